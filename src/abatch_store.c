@@ -0,0 +1,573 @@
+/*************************************************************
+ **
+ ** file: abatch_store.c
+ **
+ ** Written by B. M. Bolstad <bmb@bmbolstad.com>
+ **
+ ** Aim is to keep the intensity matrix of a batch of CEL files
+ ** on disk rather than in memory, so that batches far larger
+ ** than the available memory can be read (see read_abatch_store
+ ** in read_abatch.c) and then accessed a slice at a time.
+ **
+ ** The store is a single file:
+ **
+ ** header (ABATCH_STORE_HEADER_SIZE bytes, padded out to data_offset)
+ **   char[8]  magic "AFFYIOAB"
+ **   uint32   version
+ **   uint32   byte order mark 0x01020304 (the file is in native byte order)
+ **   uint32   dim1, dim2     cols and rows of the chip
+ **   uint64   n_cells        rows of the matrix
+ **   uint64   n_arrays       columns of the matrix
+ **   uint64   data_offset    where the first column starts
+ **   uint64   names_offset   where the names start
+ **
+ ** data (at data_offset, a multiple of the page size)
+ **   n_arrays columns of n_cells doubles, each column padded out to a
+ **   multiple of the page size so that every column starts on a page
+ **   boundary (version 1 stores have no padding between columns)
+ **
+ ** names (at names_offset, after the last column)
+ **   the CDF name then the n_arrays array names, each as a uint32
+ **   length followed by that many bytes
+ **
+ ** Keeping the names after the data means more columns can be added
+ ** to the end of the data. Before any are written the names are moved
+ ** past the space the new columns will take (reserve_abatch_store()),
+ ** and the header is rewritten last, so a store whose columns were not
+ ** all written still describes just the columns it had before.
+ **
+ ** Columns are read back by mapping the file into memory (where
+ ** the platform allows, otherwise with stdio).
+ **
+ ** History
+ ** Oct 16, 2026 - Initial version
+ ** Oct 16, 2026 - add reserve_abatch_store() so that adding columns to an existing 
+ **                store can not damage it if it fails part way
+ ** Oct 16, 2026 - version 2: pad the columns so each starts on a page boundary.
+ **                Do not replace an existing store unless asked to. Close the
+ **                store before signalling an error.
+ ** Oct 16, 2026 - use #ifdef USE_PTHREADS, as the rest of the package does
+ **
+ *************************************************************/
+
+#include <R.h>
+#include <Rdefines.h>
+#include <Rmath.h>
+#include <Rinternals.h>
+
+#include "stdlib.h"
+#include "stdio.h"
+#include <string.h>
+
+#include "mmap_functions.h"
+#include "abatch_store.h"
+
+#define ABATCH_STORE_MAGIC "AFFYIOAB"
+#define ABATCH_STORE_VERSION 2
+#define ABATCH_STORE_BYTE_ORDER 0x01020304U
+#define ABATCH_STORE_HEADER_SIZE 56
+#define ABATCH_STORE_DATA_OFFSET 4096
+#define ABATCH_STORE_PAGE_SIZE 4096
+
+/* the store is larger than 2GB for all but the smallest batches */
+
+#if defined(_WIN32)
+#define store_fseek(f, offset) _fseeki64(f, (__int64)(offset), SEEK_SET)
+#else
+#define store_fseek(f, offset) fseeko(f, (off_t)(offset), SEEK_SET)
+#endif
+
+
+/* bytes from the start of one column to the start of the next */
+
+static uint64_t store_column_stride(size_t n_cells, uint32_t version){
+
+  uint64_t stride = (uint64_t)n_cells*sizeof(double);
+
+  if (version >= 2){
+    stride = (stride + ABATCH_STORE_PAGE_SIZE - 1)/ABATCH_STORE_PAGE_SIZE*ABATCH_STORE_PAGE_SIZE;
+  }
+  return stride;
+}
+
+
+/* where column (counting the columns already stored) starts */
+
+static uint64_t store_column_offset(const abatch_store *store, size_t column){
+  return store->data_offset + (uint64_t)column*store->column_stride;
+}
+
+
+static void write_abatch_store_header(abatch_store *store){
+
+  unsigned char header[ABATCH_STORE_HEADER_SIZE];
+  uint32_t version = store->version;
+  uint32_t byte_order = ABATCH_STORE_BYTE_ORDER;
+  uint32_t dim1 = (uint32_t)store->dim1, dim2 = (uint32_t)store->dim2;
+  uint64_t n_cells = (uint64_t)store->n_cells;
+  uint64_t n_arrays = (uint64_t)store->n_arrays;
+
+  memcpy(header, ABATCH_STORE_MAGIC, 8);
+  memcpy(header + 8, &version, 4);
+  memcpy(header + 12, &byte_order, 4);
+  memcpy(header + 16, &dim1, 4);
+  memcpy(header + 20, &dim2, 4);
+  memcpy(header + 24, &n_cells, 8);
+  memcpy(header + 32, &n_arrays, 8);
+  memcpy(header + 40, &(store->data_offset), 8);
+  memcpy(header + 48, &(store->names_offset), 8);
+
+  if (store_fseek(store->file, 0) != 0 || fwrite(header, 1, ABATCH_STORE_HEADER_SIZE, store->file) != ABATCH_STORE_HEADER_SIZE){
+    close_abatch_store(store);
+    error("Unable to write the header of the intensity store");
+  }
+}
+
+
+static int write_store_string(FILE *file, const char *x){
+
+  uint32_t len = (uint32_t)strlen(x);
+
+  return (fwrite(&len, sizeof(uint32_t), 1, file) == 1 && fwrite(x, 1, len, file) == len);
+}
+
+
+static char *read_store_string(FILE *file){
+
+  uint32_t len;
+  char *x;
+
+  if (fread(&len, sizeof(uint32_t), 1, file) != 1){
+    return NULL;
+  }
+  x = Calloc(len + 1, char);
+  if (fread(x, 1, len, file) != len){
+    Free(x);
+    return NULL;
+  }
+  return x;
+}
+
+
+/* 
+   writes the CDF name and array names at names_offset, then the header pointing at them.
+   On failure the store is closed before the error is signalled 
+*/
+
+static void write_abatch_store_names(abatch_store *store){
+
+  size_t i;
+  int status;
+
+  status = (store_fseek(store->file, store->names_offset) == 0 && write_store_string(store->file, store->cdfName));
+  for (i=0; status && i < store->n_arrays; i++){
+    status = write_store_string(store->file, store->array_names[i]);
+  }
+  if (!status){
+    close_abatch_store(store);
+    error("Unable to write the names of the intensity store");
+  }
+  fflush(store->file);
+
+  write_abatch_store_header(store);
+  fflush(store->file);
+}
+
+
+static void free_store_names(abatch_store *store){
+
+  size_t i;
+
+  if (store->array_names != NULL){
+    for (i=0; i < store->n_arrays; i++){
+      if (store->array_names[i] != NULL){
+	Free(store->array_names[i]);
+      }
+    }
+    Free(store->array_names);
+  }
+  if (store->cdfName != NULL){
+    Free(store->cdfName);
+  }
+}
+
+
+static void init_abatch_store(abatch_store *store){
+
+  store->file = NULL;
+  store->dim1 = 0;
+  store->dim2 = 0;
+  store->n_cells = 0;
+  store->n_arrays = 0;
+  store->version = ABATCH_STORE_VERSION;
+  store->column_stride = 0;
+  store->write_failed = 0;
+  store->data_offset = ABATCH_STORE_DATA_OFFSET;
+  store->names_offset = ABATCH_STORE_DATA_OFFSET;
+  store->cdfName = NULL;
+  store->array_names = NULL;
+#ifdef USE_PTHREADS
+  pthread_mutex_init(&(store->lock), NULL);
+#endif
+}
+
+
+/*************************************************************
+ **
+ ** abatch_store *create_abatch_store(const char *path, const char *cdfName, int dim1, int dim2,
+ **                                   int overwrite)
+ **
+ ** creates the store at path, for arrays of the given CDF type and
+ ** dimensions. It holds no arrays until finish_abatch_store(). If
+ ** there is already a file at path it is an error unless overwrite
+ ** is set, in which case the file is replaced.
+ **
+ *************************************************************/
+
+abatch_store *create_abatch_store(const char *path, const char *cdfName, int dim1, int dim2, int overwrite){
+
+  abatch_store *store;
+  FILE *existing;
+
+  if (!overwrite && (existing = fopen(path, "rb")) != NULL){
+    fclose(existing);
+    error("The intensity store %s already exists. Use overwrite=TRUE to replace it", path);
+  }
+
+  store = Calloc(1, abatch_store);
+  init_abatch_store(store);
+  store->dim1 = dim1;
+  store->dim2 = dim2;
+  store->n_cells = (size_t)dim1*dim2;
+  store->column_stride = store_column_stride(store->n_cells, store->version);
+  store->cdfName = Calloc(strlen(cdfName) + 1, char);
+  strcpy(store->cdfName, cdfName);
+
+  if ((store->file = fopen(path, "wb+")) == NULL){
+    close_abatch_store(store);
+    error("Unable to create the intensity store %s", path);
+  }
+  write_abatch_store_names(store);
+
+  return store;
+}
+
+
+/*************************************************************
+ **
+ ** abatch_store *open_abatch_store(const char *path, int for_writing)
+ **
+ ** opens an existing store, reading its header and names. With
+ ** for_writing more columns can then be added to it.
+ **
+ *************************************************************/
+
+abatch_store *open_abatch_store(const char *path, int for_writing){
+
+  abatch_store *store = Calloc(1, abatch_store);
+  unsigned char header[ABATCH_STORE_HEADER_SIZE];
+  uint32_t version, byte_order, dim1, dim2;
+  uint64_t n_cells, n_arrays, names_offset;
+  size_t i;
+
+  init_abatch_store(store);
+
+  if ((store->file = fopen(path, for_writing ? "rb+" : "rb")) == NULL){
+    close_abatch_store(store);
+    error("Unable to open the intensity store %s", path);
+  }
+
+  if (fread(header, 1, ABATCH_STORE_HEADER_SIZE, store->file) != ABATCH_STORE_HEADER_SIZE || memcmp(header, ABATCH_STORE_MAGIC, 8) != 0){
+    close_abatch_store(store);
+    error("%s does not seem to be an intensity store", path);
+  }
+  memcpy(&version, header + 8, 4);
+  memcpy(&byte_order, header + 12, 4);
+  if (version < 1 || version > ABATCH_STORE_VERSION || byte_order != ABATCH_STORE_BYTE_ORDER){
+    close_abatch_store(store);
+    error("The intensity store %s was written by a different version or on a different platform", path);
+  }
+  memcpy(&dim1, header + 16, 4);
+  memcpy(&dim2, header + 20, 4);
+  memcpy(&n_cells, header + 24, 8);
+  memcpy(&n_arrays, header + 32, 8);
+  memcpy(&(store->data_offset), header + 40, 8);
+  memcpy(&names_offset, header + 48, 8);
+  store->names_offset = names_offset;
+
+  store->dim1 = (int)dim1;
+  store->dim2 = (int)dim2;
+  store->n_cells = (size_t)n_cells;
+  store->version = version;
+  store->column_stride = store_column_stride(store->n_cells, version);
+
+  if (store_fseek(store->file, names_offset) != 0 || (store->cdfName = read_store_string(store->file)) == NULL){
+    close_abatch_store(store);
+    error("The intensity store %s is truncated", path);
+  }
+  store->array_names = Calloc(n_arrays + 1, char *);
+  for (i=0; i < (size_t)n_arrays; i++){
+    store->n_arrays = i + 1;
+    if ((store->array_names[i] = read_store_string(store->file)) == NULL){
+      close_abatch_store(store);
+      error("The intensity store %s is truncated", path);
+    }
+  }
+  store->n_arrays = (size_t)n_arrays;
+
+  return store;
+}
+
+
+/*************************************************************
+ **
+ ** void reserve_abatch_store(abatch_store *store, int n_new)
+ **
+ ** makes room for n_new more columns by moving the names to just
+ ** after them. Call before writing any of the columns.
+ **
+ *************************************************************/
+
+void reserve_abatch_store(abatch_store *store, int n_new){
+
+  store->names_offset = store_column_offset(store, store->n_arrays + n_new);
+  write_abatch_store_names(store);
+}
+
+
+/*************************************************************
+ **
+ ** void write_abatch_store_column(abatch_store *store, size_t column, const double *values)
+ **
+ ** size_t column - of the arrays being added, 0 is the first after
+ **                 those already in the store
+ ** const double *values - n_cells intensities
+ **
+ ** may be called from several threads at once. So as not to close the
+ ** store under the other threads, a failed write is only recorded here
+ ** and reported by finish_abatch_store().
+ **
+ *************************************************************/
+
+void write_abatch_store_column(abatch_store *store, size_t column, const double *values){
+
+#ifdef USE_PTHREADS
+  pthread_mutex_lock(&(store->lock));
+#endif
+  if (!store->write_failed){
+    store->write_failed = !(store_fseek(store->file, store_column_offset(store, store->n_arrays + column)) == 0 &&
+			    fwrite(values, sizeof(double), store->n_cells, store->file) == store->n_cells);
+  }
+#ifdef USE_PTHREADS
+  pthread_mutex_unlock(&(store->lock));
+#endif
+}
+
+
+/*************************************************************
+ **
+ ** void finish_abatch_store(abatch_store *store, const char **new_names, int n_new)
+ **
+ ** once all n_new columns have been written, adds them to the store
+ ** under new_names: writes the names after the new last column and
+ ** then the header. If any of the columns could not be written the
+ ** store is closed, as it was before, and an error signalled.
+ **
+ *************************************************************/
+
+void finish_abatch_store(abatch_store *store, const char **new_names, int n_new){
+
+  size_t i;
+  char **array_names;
+
+  if (store->write_failed){
+    close_abatch_store(store);
+    error("Unable to write to the intensity store. Perhaps the disk is full.");
+  }
+
+  array_names = Calloc(store->n_arrays + n_new + 1, char *);
+  for (i=0; i < store->n_arrays; i++){
+    array_names[i] = store->array_names[i];
+  }
+  for (i=0; i < (size_t)n_new; i++){
+    array_names[store->n_arrays + i] = Calloc(strlen(new_names[i]) + 1, char);
+    strcpy(array_names[store->n_arrays + i], new_names[i]);
+  }
+  if (store->array_names != NULL){
+    Free(store->array_names);
+  }
+  store->array_names = array_names;
+  store->n_arrays += n_new;
+
+  store->names_offset = store_column_offset(store, store->n_arrays);
+  write_abatch_store_names(store);
+}
+
+
+void close_abatch_store(abatch_store *store){
+
+  if (store->file != NULL){
+    fclose(store->file);
+  }
+  free_store_names(store);
+#ifdef USE_PTHREADS
+  pthread_mutex_destroy(&(store->lock));
+#endif
+  Free(store);
+}
+
+
+/****************************************************************
+ ****************************************************************
+ **
+ ** The code that interfaces with R
+ **
+ ***************************************************************
+ ***************************************************************/
+
+/*************************************************************
+ **
+ ** SEXP R_abatch_store_info(SEXP path)
+ **
+ ** RETURNS a list with the path, CDF name, dimensions (cols, rows)
+ ** and array names of the store at path
+ **
+ *************************************************************/
+
+SEXP R_abatch_store_info(SEXP path){
+
+  abatch_store *store;
+  SEXP info, names, tmp_sexp;
+  size_t i;
+
+  store = open_abatch_store(CHAR(STRING_ELT(path,0)), 0);
+
+  PROTECT(info = allocVector(VECSXP,4));
+  SET_VECTOR_ELT(info,0,ScalarString(STRING_ELT(path,0)));
+  SET_VECTOR_ELT(info,1,mkString(store->cdfName));
+  PROTECT(tmp_sexp = allocVector(INTSXP,2));
+  INTEGER(tmp_sexp)[0] = store->dim1;
+  INTEGER(tmp_sexp)[1] = store->dim2;
+  SET_VECTOR_ELT(info,2,tmp_sexp);
+  UNPROTECT(1);
+  PROTECT(tmp_sexp = allocVector(STRSXP,store->n_arrays));
+  for (i=0; i < store->n_arrays; i++){
+    SET_STRING_ELT(tmp_sexp,i,mkChar(store->array_names[i]));
+  }
+  SET_VECTOR_ELT(info,3,tmp_sexp);
+  UNPROTECT(1);
+
+  close_abatch_store(store);
+
+  PROTECT(names = allocVector(STRSXP,4));
+  SET_STRING_ELT(names,0,mkChar("path"));
+  SET_STRING_ELT(names,1,mkChar("cdfName"));
+  SET_STRING_ELT(names,2,mkChar("dim"));
+  SET_STRING_ELT(names,3,mkChar("filenames"));
+  setAttrib(info,R_NamesSymbol,names);
+
+  UNPROTECT(2);
+  return info;
+}
+
+
+/*************************************************************
+ **
+ ** SEXP R_abatch_store_read(SEXP path, SEXP rows, SEXP columns)
+ **
+ ** SEXP rows - integer vector of the (1 based) rows wanted, NULL for all
+ ** SEXP columns - integer vector of the (1 based) columns wanted, NULL for all
+ **
+ ** RETURNS the selected part of the intensity matrix, columns named
+ ** by file.
+ **
+ *************************************************************/
+
+SEXP R_abatch_store_read(SEXP path, SEXP rows, SEXP columns){
+
+  const char *store_path = CHAR(STRING_ELT(path,0));
+  abatch_store *store;
+  mapped_file map;
+  size_t i, j, n_rows, n_cols, column;
+  int *row_index = NULL, *col_index = NULL;
+  const double *cur_column;
+  double *buffer = NULL;
+  double *intensity;
+  SEXP output, dimnames, names;
+
+  store = open_abatch_store(store_path, 0);
+
+  n_rows = isNull(rows) ? store->n_cells : (size_t)GET_LENGTH(rows);
+  n_cols = isNull(columns) ? store->n_arrays : (size_t)GET_LENGTH(columns);
+  if (!isNull(rows)){
+    row_index = INTEGER(rows);
+    for (i=0; i < n_rows; i++){
+      if (row_index[i] == NA_INTEGER || row_index[i] < 1 || (size_t)row_index[i] > store->n_cells){
+	close_abatch_store(store);
+	error("row index out of range for the intensity store");
+      }
+    }
+  }
+  if (!isNull(columns)){
+    col_index = INTEGER(columns);
+    for (j=0; j < n_cols; j++){
+      if (col_index[j] == NA_INTEGER || col_index[j] < 1 || (size_t)col_index[j] > store->n_arrays){
+	close_abatch_store(store);
+	error("column index out of range for the intensity store");
+      }
+    }
+  }
+
+  PROTECT(output = allocMatrix(REALSXP, n_rows, n_cols));
+  intensity = NUMERIC_POINTER(output);
+
+  if (map_file(store_path, &map) && map.size < store_column_offset(store, store->n_arrays)){
+    unmap_file(&map);
+    close_abatch_store(store);
+    error("The intensity store %s is truncated", store_path);
+  }
+  if (map.data == NULL && n_cols > 0){
+    buffer = Calloc(store->n_cells, double);
+  }
+
+  for (j=0; j < n_cols; j++){
+    column = (col_index != NULL) ? (size_t)col_index[j] - 1 : j;
+    if (map.data != NULL){
+      cur_column = (const double *)(map.data + store_column_offset(store, column));
+    } else {
+      if (store_fseek(store->file, store_column_offset(store, column)) != 0 ||
+	  fread(buffer, sizeof(double), store->n_cells, store->file) != store->n_cells){
+	Free(buffer);
+	close_abatch_store(store);
+	error("The intensity store %s is truncated", store_path);
+      }
+      cur_column = buffer;
+    }
+    if (row_index == NULL){
+      memcpy(intensity + j*n_rows, cur_column, n_rows*sizeof(double));
+    } else {
+      for (i=0; i < n_rows; i++){
+	intensity[j*n_rows + i] = cur_column[row_index[i] - 1];
+      }
+    }
+  }
+
+  if (buffer != NULL){
+    Free(buffer);
+  }
+  unmap_file(&map);
+
+  PROTECT(dimnames = allocVector(VECSXP,2));
+  PROTECT(names = allocVector(STRSXP,n_cols));
+  for (j=0; j < n_cols; j++){
+    column = (col_index != NULL) ? (size_t)col_index[j] - 1 : j;
+    SET_STRING_ELT(names,j,mkChar(store->array_names[column]));
+  }
+  SET_VECTOR_ELT(dimnames,1,names);
+  setAttrib(output, R_DimNamesSymbol, dimnames);
+
+  close_abatch_store(store);
+
+  UNPROTECT(3);
+  return output;
+}
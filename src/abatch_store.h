@@ -0,0 +1,48 @@
+#ifndef ABATCH_STORE_H
+#define ABATCH_STORE_H
+
+#include <stdio.h>
+
+#include <stdint.h>
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
+/****************************************************************
+ **
+ ** An intensity matrix kept on disk rather than in memory, one
+ ** column (of doubles) per array. See abatch_store.c for the layout.
+ **
+ ***************************************************************/
+
+typedef struct{
+  FILE *file;
+  int dim1;                 /* cols and rows of the chip */
+  int dim2;
+  size_t n_cells;           /* rows of the matrix, dim1*dim2 */
+  size_t n_arrays;          /* columns stored (and named) so far */
+  uint32_t version;         /* of the file layout */
+  uint64_t column_stride;   /* bytes from one column to the next */
+  int write_failed;         /* set if a column could not be written */
+  uint64_t data_offset;     /* where the first column starts */
+  uint64_t names_offset;    /* where the names start */
+  char *cdfName;
+  char **array_names;       /* n_arrays of them */
+#ifdef USE_PTHREADS
+  pthread_mutex_t lock;     /* columns may be written from several threads */
+#endif
+} abatch_store;
+
+
+abatch_store *create_abatch_store(const char *path, const char *cdfName, int dim1, int dim2, int overwrite);
+abatch_store *open_abatch_store(const char *path, int for_writing);
+void reserve_abatch_store(abatch_store *store, int n_new);
+void write_abatch_store_column(abatch_store *store, size_t column, const double *values);
+void finish_abatch_store(abatch_store *store, const char **new_names, int n_new);
+void close_abatch_store(abatch_store *store);
+
+SEXP R_abatch_store_info(SEXP path);
+SEXP R_abatch_store_read(SEXP path, SEXP rows, SEXP columns);
+
+#endif
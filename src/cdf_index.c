@@ -0,0 +1,485 @@
+/*************************************************************
+ **
+ ** file: cdf_index.c
+ **
+ ** Written by B. M. Bolstad <bmb@bmbolstad.com>
+ **
+ ** Aim is to parse a CDF file once rather than every time it is
+ ** used. The probesets of the CDF and the cells of their PM and MM
+ ** probes (what ReadCDFFile returns) are compiled into a flat index
+ ** which can be mapped straight back into memory, with nothing to
+ ** parse or allocate per probeset.
+ **
+ ** An index is compiled with R_compile_cdf_index and read with
+ ** R_read_cdf_index. If the environment variable R_AFFYIO_CDF_CACHE
+ ** names a directory, ReadCDFFile keeps an index of each CDF file it
+ ** reads there and uses it for as long as the CDF file is unchanged.
+ **
+ ** The layout of an index (native byte order):
+ **   char[8]  magic "AFFYIOCI"
+ **   uint32   version, byte order mark 0x01020304
+ **   uint64   size, int64 modification time, uint64 header hash of the CDF file
+ **            (all 0 if not made from a file, see cel_cache.c)
+ **   int32    rows, cols
+ **   uint64   n_sets, n_atoms, names_size
+ **   uint64   offsets of the set_start, pm, mm, name_start and names sections
+ ** followed by the sections themselves (see cdf_index.h), each starting
+ ** on an 8 byte boundary.
+ **
+ ** History
+ ** Oct 16, 2026 - Initial version
+ ** Oct 16, 2026 - cdf_locations_matrix() split out of cdf_index_locmap for ReadCDFProbesets
+ ** Oct 16, 2026 - open_cdf_index checks every probeset of the index, so that
+ **                cdf_index_locmap can not fail with the index still mapped
+ **
+ *************************************************************/
+
+#include <R.h>
+#include <Rdefines.h>
+#include <Rmath.h>
+#include <Rinternals.h>
+
+#include "stdlib.h"
+#include "stdio.h"
+#include <string.h>
+
+#if defined(_WIN32)
+#include <process.h>
+#define index_getpid() _getpid()
+#else
+#include <unistd.h>
+#define index_getpid() getpid()
+#endif
+
+#include "cel_cache.h"
+#include "cdf_index.h"
+
+#define CDF_INDEX_MAGIC "AFFYIOCI"
+#define CDF_INDEX_VERSION 1
+#define CDF_INDEX_BYTE_ORDER 0x01020304U
+
+
+typedef struct{
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  cache_source_key source;
+  int32_t rows;
+  int32_t cols;
+  uint64_t n_sets;
+  uint64_t n_atoms;
+  uint64_t names_size;
+  uint64_t set_start_offset;
+  uint64_t pm_offset;
+  uint64_t mm_offset;
+  uint64_t name_start_offset;
+  uint64_t names_offset;
+} cdf_index_header;
+
+
+static uint64_t index_align(uint64_t offset){
+  return (offset + 7) & ~((uint64_t)7);
+}
+
+
+/* where each section goes, given the counts in header */
+
+static void layout_cdf_index(cdf_index_header *header){
+
+  header->set_start_offset = index_align(sizeof(cdf_index_header));
+  header->pm_offset = index_align(header->set_start_offset + (header->n_sets + 1)*sizeof(uint32_t));
+  header->mm_offset = index_align(header->pm_offset + header->n_atoms*sizeof(int32_t));
+  header->name_start_offset = index_align(header->mm_offset + header->n_atoms*sizeof(int32_t));
+  header->names_offset = index_align(header->name_start_offset + (header->n_sets + 1)*sizeof(uint32_t));
+}
+
+
+/*************************************************************
+ **
+ ** void alloc_cdf_index(cdf_index *index, int rows, int cols, size_t n_sets,
+ **                      size_t n_atoms, size_t names_size)
+ **
+ ** allocates an (empty) index to be filled by one of the builders.
+ ** pm and mm start out 0 (no probe) for every atom.
+ **
+ *************************************************************/
+
+void alloc_cdf_index(cdf_index *index, int rows, int cols, size_t n_sets, size_t n_atoms, size_t names_size){
+
+  index->rows = rows;
+  index->cols = cols;
+  index->n_sets = n_sets;
+  index->n_atoms = n_atoms;
+  index->names_size = names_size;
+  index->set_start = Calloc(n_sets + 1, uint32_t);
+  index->pm = Calloc(n_atoms + 1, int32_t);
+  index->mm = Calloc(n_atoms + 1, int32_t);
+  index->name_start = Calloc(n_sets + 1, uint32_t);
+  index->names = Calloc(names_size + 1, char);
+  index->map.data = NULL;
+  index->map.size = 0;
+  index->buffer = NULL;
+}
+
+
+void free_cdf_index(cdf_index *index){
+
+  if (index->map.data != NULL){
+    unmap_file(&(index->map));
+  } else if (index->buffer != NULL){
+    Free(index->buffer);
+  } else {
+    Free(index->set_start);
+    Free(index->pm);
+    Free(index->mm);
+    Free(index->name_start);
+    Free(index->names);
+  }
+  index->buffer = NULL;
+}
+
+
+/* zeros from offset to the start of the next section */
+
+static void pad_cdf_index(FILE *outfile, uint64_t offset, uint64_t next){
+
+  static const char zeros[8] = {0,0,0,0,0,0,0,0};
+
+  if (next > offset){
+    fwrite(zeros, 1, (size_t)(next - offset), outfile);
+  }
+}
+
+
+/*************************************************************
+ **
+ ** int write_cdf_index(const char *path, const char *source, const cdf_index *index)
+ **
+ ** const char *path - where to write the index
+ ** const char *source - the CDF file it was made from (or NULL)
+ **
+ ** The index is written to a temporary file which is then renamed,
+ ** so that another process never sees it partly written. RETURNS 1
+ ** if it was written, otherwise 0.
+ **
+ *************************************************************/
+
+int write_cdf_index(const char *path, const char *source, const cdf_index *index){
+
+  cdf_index_header header;
+  char *temp_name;
+  FILE *outfile;
+  int ok = 0;
+
+  memset(&header, 0, sizeof(cdf_index_header));
+  memcpy(header.magic, CDF_INDEX_MAGIC, 8);
+  header.version = CDF_INDEX_VERSION;
+  header.byte_order = CDF_INDEX_BYTE_ORDER;
+  if (source != NULL && !cache_source_key_of(source, &(header.source))){
+    return 0;
+  }
+  header.rows = index->rows;
+  header.cols = index->cols;
+  header.n_sets = index->n_sets;
+  header.n_atoms = index->n_atoms;
+  header.names_size = index->names_size;
+  layout_cdf_index(&header);
+
+  temp_name = Calloc(strlen(path) + 48, char);
+  sprintf(temp_name, "%s.%lx.%lx.tmp", path, (unsigned long)index_getpid(), (unsigned long)(size_t)index);
+
+  if ((outfile = fopen(temp_name, "wb")) != NULL){
+    fwrite(&header, sizeof(cdf_index_header), 1, outfile);
+    pad_cdf_index(outfile, sizeof(cdf_index_header), header.set_start_offset);
+    fwrite(index->set_start, sizeof(uint32_t), index->n_sets + 1, outfile);
+    pad_cdf_index(outfile, header.set_start_offset + (index->n_sets + 1)*sizeof(uint32_t), header.pm_offset);
+    fwrite(index->pm, sizeof(int32_t), index->n_atoms, outfile);
+    pad_cdf_index(outfile, header.pm_offset + index->n_atoms*sizeof(int32_t), header.mm_offset);
+    fwrite(index->mm, sizeof(int32_t), index->n_atoms, outfile);
+    pad_cdf_index(outfile, header.mm_offset + index->n_atoms*sizeof(int32_t), header.name_start_offset);
+    fwrite(index->name_start, sizeof(uint32_t), index->n_sets + 1, outfile);
+    pad_cdf_index(outfile, header.name_start_offset + (index->n_sets + 1)*sizeof(uint32_t), header.names_offset);
+    fwrite(index->names, 1, index->names_size, outfile);
+
+    if (ferror(outfile) | fclose(outfile)){
+      remove(temp_name);
+    } else {
+      /* rename() will not replace an existing file everywhere */
+      remove(path);
+      ok = (rename(temp_name, path) == 0);
+      if (!ok){
+	remove(temp_name);
+      }
+    }
+  }
+  Free(temp_name);
+  return ok;
+}
+
+
+/* reads the whole of path into memory, for where it cannot be mapped. Free() when done */
+
+int read_whole_file(const char *path, unsigned char **buffer, size_t *size){
+
+  FILE *infile;
+  long length;
+
+  *buffer = NULL;
+  if ((infile = fopen(path, "rb")) == NULL){
+    return 0;
+  }
+  if (fseek(infile, 0, SEEK_END) != 0 || (length = ftell(infile)) <= 0){
+    fclose(infile);
+    return 0;
+  }
+  fseek(infile, 0, SEEK_SET);
+  *buffer = Calloc((size_t)length, unsigned char);
+  *size = (size_t)length;
+  if (fread(*buffer, 1, *size, infile) != *size){
+    Free(*buffer);
+    *buffer = NULL;
+  }
+  fclose(infile);
+  return (*buffer != NULL);
+}
+
+
+/*************************************************************
+ **
+ ** int open_cdf_index(const char *path, const char *source, cdf_index *index)
+ **
+ ** const char *path - a compiled index
+ ** const char *source - if not NULL, the CDF file the index must
+ **                      have been made from (as it is now)
+ ** cdf_index *index - set to point into the mapped index. Release
+ **                    with free_cdf_index()
+ **
+ ** RETURNS 1 if the index could be mapped (or read), is complete
+ ** and current, and the atoms and name of every probeset lie within
+ ** it, otherwise 0.
+ **
+ *************************************************************/
+
+int open_cdf_index(const char *path, const char *source, cdf_index *index){
+
+  const unsigned char *data;
+  size_t size, i;
+  cdf_index_header header, expected;
+  cache_source_key key;
+
+  index->buffer = NULL;
+  if (!map_file(path, &(index->map))){
+    if (!read_whole_file(path, &(index->buffer), &size)){
+      return 0;
+    }
+    data = index->buffer;
+  } else {
+    data = index->map.data;
+    size = index->map.size;
+  }
+
+  if (size < sizeof(cdf_index_header)){
+    free_cdf_index(index);
+    return 0;
+  }
+  memcpy(&header, data, sizeof(cdf_index_header));
+
+  memset(&key, 0, sizeof(cache_source_key));
+  if (memcmp(header.magic, CDF_INDEX_MAGIC, 8) != 0 || header.version != CDF_INDEX_VERSION ||
+      header.byte_order != CDF_INDEX_BYTE_ORDER || header.n_sets >= UINT32_MAX || header.n_atoms >= UINT32_MAX ||
+      (source != NULL && (!cache_source_key_of(source, &key) || memcmp(&key, &(header.source), sizeof(cache_source_key)) != 0))){
+    free_cdf_index(index);
+    return 0;
+  }
+
+  expected = header;
+  layout_cdf_index(&expected);
+  if (memcmp(&expected, &header, sizeof(cdf_index_header)) != 0 || header.names_offset + header.names_size > size){
+    free_cdf_index(index);
+    return 0;
+  }
+
+  index->rows = header.rows;
+  index->cols = header.cols;
+  index->n_sets = (size_t)header.n_sets;
+  index->n_atoms = (size_t)header.n_atoms;
+  index->names_size = (size_t)header.names_size;
+  index->set_start = (uint32_t *)(data + header.set_start_offset);
+  index->pm = (int32_t *)(data + header.pm_offset);
+  index->mm = (int32_t *)(data + header.mm_offset);
+  index->name_start = (uint32_t *)(data + header.name_start_offset);
+  index->names = (char *)(data + header.names_offset);
+
+  if (index->set_start[index->n_sets] != index->n_atoms || index->name_start[index->n_sets] != index->names_size ||
+      (index->names_size > 0 && index->names[index->names_size - 1] != '\0')){
+    free_cdf_index(index);
+    return 0;
+  }
+  for (i=0; i < index->n_sets; i++){
+    if (index->set_start[i + 1] < index->set_start[i] || index->name_start[i] >= index->names_size){
+      free_cdf_index(index);
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+/*************************************************************
+ **
+ ** SEXP cdf_locations_dimnames(void)
+ ** SEXP cdf_locations_matrix(const int32_t *pm, const int32_t *mm, size_t n_atoms, SEXP dimnames)
+ **
+ ** the matrix of PM and MM cells of a probeset (n_atoms rows, NaN 
+ ** where there is no probe) as in ReadCDFFile. The dimnames (from 
+ ** cdf_locations_dimnames()) may be shared by all the matrices.
+ **
+ *************************************************************/
+
+SEXP cdf_locations_dimnames(void){
+
+  SEXP ColNames;
+  SEXP dimnames;
+
+  PROTECT(ColNames = allocVector(STRSXP,2));
+  PROTECT(dimnames = allocVector(VECSXP,2));
+  SET_STRING_ELT(ColNames,0,mkChar("pm"));
+  SET_STRING_ELT(ColNames,1,mkChar("mm"));
+  SET_VECTOR_ELT(dimnames,1,ColNames);
+  MARK_NOT_MUTABLE(dimnames);
+  UNPROTECT(2);
+  return dimnames;
+}
+
+
+SEXP cdf_locations_matrix(const int32_t *pm, const int32_t *mm, size_t n_atoms, SEXP dimnames){
+
+  SEXP CurLocs;
+  double *curlocs;
+  size_t k;
+
+  PROTECT(CurLocs = allocMatrix(REALSXP,n_atoms,2));
+  curlocs = NUMERIC_POINTER(CurLocs);
+  for (k=0; k < n_atoms; k++){
+    curlocs[k] = (pm[k] > 0) ? (double)pm[k] : R_NaN;
+    curlocs[k + n_atoms] = (mm[k] > 0) ? (double)mm[k] : R_NaN;
+  }
+  setAttrib(CurLocs, R_DimNamesSymbol, dimnames);
+  UNPROTECT(1);
+  return CurLocs;
+}
+
+
+/*************************************************************
+ **
+ ** SEXP cdf_index_locmap(const cdf_index *index)
+ **
+ ** the list ReadCDFFile returns: the dimensions (rows, cols) and
+ ** a named list with a matrix of PM and MM cells for each probeset
+ ** (NaN where there is no probe). index must be one built here or
+ ** checked by open_cdf_index().
+ **
+ ** Although nothing is parsed, this still makes an R matrix for every
+ ** probeset, so it takes time in proportion to the number of probesets.
+ **
+ *************************************************************/
+
+SEXP cdf_index_locmap(const cdf_index *index){
+
+  SEXP CDFInfo;
+  SEXP Dimensions;
+  SEXP LocMap;
+  SEXP PSnames;
+  SEXP dimnames;
+
+  size_t i, first;
+
+  PROTECT(CDFInfo = allocVector(VECSXP,2));
+  PROTECT(Dimensions = allocVector(REALSXP,2));
+  PROTECT(LocMap = allocVector(VECSXP,index->n_sets));
+  PROTECT(PSnames = allocVector(STRSXP,index->n_sets));
+
+  NUMERIC_POINTER(Dimensions)[0] = (double)index->rows;
+  NUMERIC_POINTER(Dimensions)[1] = (double)index->cols;
+
+  /* all the matrices share the one set of dimnames */
+  PROTECT(dimnames = cdf_locations_dimnames());
+
+  for (i=0; i < index->n_sets; i++){
+    first = index->set_start[i];
+    SET_STRING_ELT(PSnames,i,mkChar(index->names + index->name_start[i]));
+    SET_VECTOR_ELT(LocMap,i,cdf_locations_matrix(index->pm + first, index->mm + first, index->set_start[i + 1] - first, dimnames));
+  }
+
+  setAttrib(LocMap,R_NamesSymbol,PSnames);
+  SET_VECTOR_ELT(CDFInfo,0,Dimensions);
+  SET_VECTOR_ELT(CDFInfo,1,LocMap);
+  UNPROTECT(5);
+  return CDFInfo;
+}
+
+
+/*************************************************************
+ **
+ ** SEXP R_compile_cdf_index(SEXP filename, SEXP index_path)
+ **
+ ** SEXP filename - a CDF file (binary or text)
+ ** SEXP index_path - where to write its compiled index
+ **
+ ** RETURNS index_path
+ **
+ *************************************************************/
+
+SEXP R_compile_cdf_index(SEXP filename, SEXP index_path){
+
+  const char *cur_file_name;
+  const char *path;
+  cdf_index index;
+
+  if (!isString(filename) || length(filename) < 1 || !isString(index_path) || length(index_path) < 1){
+    error("R_compile_cdf_index: 'filename' and 'index_path' must be character strings");
+  }
+  cur_file_name = CHAR(STRING_ELT(filename,0));
+  path = CHAR(STRING_ELT(index_path,0));
+
+  if (!build_cdf_index_xda(cur_file_name, &index) && !build_cdf_index_text(cur_file_name, &index)){
+    error("File format for %s not recognized.", cur_file_name);
+  }
+
+  if (!write_cdf_index(path, cur_file_name, &index)){
+    free_cdf_index(&index);
+    error("Unable to write the CDF index %s", path);
+  }
+  free_cdf_index(&index);
+  return index_path;
+}
+
+
+/*************************************************************
+ **
+ ** SEXP R_read_cdf_index(SEXP index_path)
+ **
+ ** RETURNS the contents of a compiled index in the same form
+ ** as ReadCDFFile.
+ **
+ *************************************************************/
+
+SEXP R_read_cdf_index(SEXP index_path){
+
+  const char *path;
+  cdf_index index;
+  SEXP CDFInfo;
+
+  if (!isString(index_path) || length(index_path) < 1){
+    error("R_read_cdf_index: 'index_path' must be a character string");
+  }
+  path = CHAR(STRING_ELT(index_path,0));
+
+  if (!open_cdf_index(path, NULL, &index)){
+    error("%s does not appear to be a CDF index (or is truncated).", path);
+  }
+  PROTECT(CDFInfo = cdf_index_locmap(&index));
+  free_cdf_index(&index);
+  UNPROTECT(1);
+  return CDFInfo;
+}
@@ -0,0 +1,61 @@
+#ifndef CDF_INDEX_H
+#define CDF_INDEX_H
+
+#include <stdint.h>
+
+#include "mmap_functions.h"
+
+/*
+   set to a directory to keep a compiled index of each CDF file
+   read by ReadCDFFile there, so that later reads need not parse it
+*/
+#define CDF_CACHE_ENV_VAR "R_AFFYIO_CDF_CACHE"
+
+
+/****************************************************************
+ **
+ ** The probesets of a CDF file and the cells of their PM and MM
+ ** probes, in a flat form that can be written out and mapped back
+ ** in (see cdf_index.c for the layout).
+ **
+ ** The atoms of probeset i are set_start[i] to set_start[i+1]-1 of
+ ** pm and mm, which hold the (1-based) index of the cell of each
+ ** atom's probe, 0 if there is none. The name of probeset i starts
+ ** at names + name_start[i].
+ **
+ ***************************************************************/
+
+typedef struct{
+  int rows;
+  int cols;
+  size_t n_sets;
+  size_t n_atoms;
+  size_t names_size;
+  uint32_t *set_start;      /* n_sets + 1 */
+  int32_t *pm;              /* n_atoms */
+  int32_t *mm;
+  uint32_t *name_start;     /* n_sets + 1 */
+  char *names;              /* names_size bytes of NUL terminated names */
+  mapped_file map;          /* the compiled index, when it is mapped */
+  unsigned char *buffer;    /* or read into memory */
+} cdf_index;
+
+
+void alloc_cdf_index(cdf_index *index, int rows, int cols, size_t n_sets, size_t n_atoms, size_t names_size);
+void free_cdf_index(cdf_index *index);
+int write_cdf_index(const char *path, const char *source, const cdf_index *index);
+int open_cdf_index(const char *path, const char *source, cdf_index *index);
+SEXP cdf_index_locmap(const cdf_index *index);
+SEXP cdf_locations_dimnames(void);
+SEXP cdf_locations_matrix(const int32_t *pm, const int32_t *mm, size_t n_atoms, SEXP dimnames);
+int read_whole_file(const char *path, unsigned char **buffer, size_t *size);
+
+int isPM(char pbase, char tbase);
+int build_cdf_index_xda(const char *filename, cdf_index *index);
+int build_cdf_index_text(const char *filename, cdf_index *index);
+
+SEXP R_compile_cdf_index(SEXP filename, SEXP index_path);
+SEXP R_read_cdf_index(SEXP index_path);
+SEXP ReadCDFProbesets(SEXP filename, SEXP probesets);
+
+#endif
@@ -0,0 +1,575 @@
+/*************************************************************
+ **
+ ** file: cel_cache.c
+ **
+ ** Written by B. M. Bolstad <bmb@bmbolstad.com>
+ **
+ ** Aim is to avoid parsing the same CEL file again and again
+ ** when it is read many times (eg while the settings of a
+ ** preprocessing method are being tuned). When the environment
+ ** variable R_AFFYIO_CEL_CACHE names a directory the parsed
+ ** contents of each CEL file read (header, intensities, optionally
+ ** stddev and npixels, masks and outliers) are written there in a
+ ** compact binary form, and used instead of the file until it changes.
+ **
+ ** Each CEL file has one entry, named by a hash of its canonical path
+ ** (absolute, with links resolved, so that the different names a file
+ ** may be given share an entry). An entry is only used if the path, size,
+ ** modification time (to the nanosecond where the platform records it)
+ ** and a hash of the first CACHE_HASH_BYTES bytes of the file all still
+ ** match.
+ **
+ ** An entry (native byte order):
+ **   char[8]  magic "AFFYIOCC"
+ **   uint32   version, byte order mark 0x01020304
+ **   uint64   size, int64 modification time (ns), uint64 header hash of the CEL file
+ **   string   canonical path of the CEL file
+ **   string   cdfName, DatHeader, Algorithm, AlgorithmParameters, ScanDate
+ **   int32    cols, rows, then the x,y of the UL, UR, LR and LL grid corners
+ **   uint32   flags (CEL_CACHE_STDDEV, CEL_CACHE_FLOAT)
+ **   uint64   n_cells
+ **   n_cells intensities then (with CEL_CACHE_STDDEV) n_cells stddev and
+ **           n_cells npixels, as float with CEL_CACHE_FLOAT otherwise double
+ **   int32    nmasks, then nmasks x and nmasks y (int16)
+ **   int32    noutliers, then noutliers x and noutliers y (int16)
+ ** where a string is a uint32 length followed by that many bytes.
+ **
+ ** Values are kept as float only when every one of them converts back
+ ** exactly (always so for binary and command console files), so a cached
+ ** read gives the same values as parsing the file.
+ **
+ ** Entries are written to a temporary file which is then renamed, so
+ ** a partly written entry is never read.
+ **
+ ** History
+ ** Oct 16, 2026 - Initial version
+ ** Oct 16, 2026 - share the entry naming and file keys with the compiled CDF index (cdf_index.c)
+ ** Oct 16, 2026 - key entries on the canonical path and the modification time in nanoseconds
+ ** Oct 16, 2026 - the caller takes the key of the CEL file before parsing it, so an entry is
+ **                never saved under the key of a file that changed while it was parsed. Lengths
+ **                read from an entry are checked against its size before anything is allocated
+ **
+ *************************************************************/
+
+#include <R.h>
+#include <Rdefines.h>
+#include <Rmath.h>
+#include <Rinternals.h>
+
+#include "stdlib.h"
+#include "stdio.h"
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#if defined(_WIN32)
+#include <process.h>
+#define cache_getpid() _getpid()
+#else
+#include <unistd.h>
+#define cache_getpid() getpid()
+#endif
+
+#include "cel_cache.h"
+
+#define CEL_CACHE_MAGIC "AFFYIOCC"
+#define CEL_CACHE_VERSION 2
+#define CEL_CACHE_BYTE_ORDER 0x01020304U
+
+#define CEL_CACHE_STDDEV 1
+#define CEL_CACHE_FLOAT 2
+
+
+/* 64 bit FNV-1a */
+
+static uint64_t cache_hash(const unsigned char *x, size_t n, uint64_t hash){
+
+  size_t i;
+
+  for (i=0; i < n; i++){
+    hash ^= (uint64_t)x[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+#define CACHE_HASH_START 0xcbf29ce484222325ULL
+
+
+int cel_cache_enabled(void){
+
+  char *dir = getenv(CEL_CACHE_ENV_VAR);
+
+  return (dir != NULL && dir[0] != '\0');
+}
+
+
+/*************************************************************
+ **
+ ** char *cache_canonical_path(const char *filename)
+ **
+ ** the absolute path of filename with any links resolved, or
+ ** filename itself if that can not be found. Free() when done.
+ **
+ *************************************************************/
+
+char *cache_canonical_path(const char *filename){
+
+  char *resolved;
+  char *path;
+
+#if defined(_WIN32)
+  resolved = _fullpath(NULL, filename, 0);
+#else
+  resolved = realpath(filename, NULL);
+#endif
+
+  if (resolved != NULL){
+    path = Calloc(strlen(resolved) + 1, char);
+    strcpy(path, resolved);
+    free(resolved);
+  } else {
+    path = Calloc(strlen(filename) + 1, char);
+    strcpy(path, filename);
+  }
+  return path;
+}
+
+
+static char *cache_entry_name_of_path(const char *dir, const char *path, const char *extension){
+
+  char *entry_name = Calloc(strlen(dir) + strlen(extension) + 24, char);
+  uint64_t hash = cache_hash((const unsigned char *)path, strlen(path), CACHE_HASH_START);
+
+  sprintf(entry_name, "%s/%08lx%08lx%s", dir, (unsigned long)(hash >> 32), (unsigned long)(hash & 0xffffffffUL), extension);
+  return entry_name;
+}
+
+
+/*************************************************************
+ **
+ ** char *cache_entry_name(const char *dir, const char *filename, const char *extension)
+ **
+ ** the name of the entry for filename in the cache directory dir,
+ ** made from a hash of its canonical path. Free() when done.
+ **
+ *************************************************************/
+
+char *cache_entry_name(const char *dir, const char *filename, const char *extension){
+
+  char *path = cache_canonical_path(filename);
+  char *entry_name = cache_entry_name_of_path(dir, path, extension);
+
+  Free(path);
+  return entry_name;
+}
+
+
+/* modification time in nanoseconds, or whole seconds where that is all the platform records */
+
+static int64_t cache_mtime(const struct stat *file_stat){
+
+#if defined(__APPLE__) && defined(st_mtime)
+  return (int64_t)file_stat->st_mtimespec.tv_sec*1000000000 + file_stat->st_mtimespec.tv_nsec;
+#elif !defined(_WIN32) && defined(st_mtime)
+  return (int64_t)file_stat->st_mtim.tv_sec*1000000000 + file_stat->st_mtim.tv_nsec;
+#else
+  return (int64_t)file_stat->st_mtime*1000000000;
+#endif
+}
+
+
+/*************************************************************
+ **
+ ** int cache_source_key_of(const char *filename, cache_source_key *key)
+ **
+ ** the size, modification time (see cache_mtime()) and a hash of the
+ ** first CACHE_HASH_BYTES bytes of filename. Returns 0 if the file
+ ** could not be read.
+ **
+ *************************************************************/
+
+int cache_source_key_of(const char *filename, cache_source_key *key){
+
+  struct stat file_stat;
+  unsigned char buffer[CACHE_HASH_BYTES];
+  size_t n_read;
+  FILE *infile;
+
+  if (stat(filename, &file_stat) != 0){
+    return 0;
+  }
+  if ((infile = fopen(filename, "rb")) == NULL){
+    return 0;
+  }
+  n_read = fread(buffer, 1, CACHE_HASH_BYTES, infile);
+  fclose(infile);
+
+  key->size = (uint64_t)file_stat.st_size;
+  key->mtime = cache_mtime(&file_stat);
+  key->header_hash = cache_hash(buffer, n_read, CACHE_HASH_START);
+  return 1;
+}
+
+
+/****************************************************************
+ **
+ ** Writing and reading the pieces of an entry. The read_ functions
+ ** return 0 if the entry ended early, or if a length in it is more
+ ** than is left of the entry (entry_size bytes in all), so that a
+ ** damaged entry is a miss rather than a huge allocation.
+ **
+ ***************************************************************/
+
+static int cache_entry_has(FILE *infile, long entry_size, uint64_t n, size_t width){
+
+  long position = ftell(infile);
+
+  if (position < 0 || position > entry_size){
+    return 0;
+  }
+  return (n <= (uint64_t)(entry_size - position)/width);
+}
+
+static void cache_write_string(FILE *outfile, const char *x){
+
+  uint32_t len;
+
+  if (x == NULL){
+    x = "";
+  }
+  len = (uint32_t)strlen(x);
+
+  fwrite(&len, sizeof(uint32_t), 1, outfile);
+  fwrite(x, 1, len, outfile);
+}
+
+
+static int cache_read_string(FILE *infile, long entry_size, char **x){
+
+  uint32_t len;
+
+  *x = NULL;
+  if (fread(&len, sizeof(uint32_t), 1, infile) != 1 || !cache_entry_has(infile, entry_size, len, 1)){
+    return 0;
+  }
+  *x = Calloc(len + 1, char);
+  return (fread(*x, 1, len, infile) == len);
+}
+
+
+static int values_fit_float(const double *x, size_t n){
+
+  size_t i;
+
+  for (i=0; i < n; i++){
+    if ((double)(float)x[i] != x[i]){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+static void cache_write_values(FILE *outfile, const double *x, size_t n, int as_float){
+
+  size_t i, j, n_block;
+  float buffer[1024];
+
+  if (!as_float){
+    fwrite(x, sizeof(double), n, outfile);
+    return;
+  }
+  for (i=0; i < n; i+= n_block){
+    n_block = (n - i < 1024) ? n - i : 1024;
+    for (j=0; j < n_block; j++){
+      buffer[j] = (float)x[i + j];
+    }
+    fwrite(buffer, sizeof(float), n_block, outfile);
+  }
+}
+
+
+static int cache_read_values(FILE *infile, double *x, size_t n, int as_float){
+
+  size_t i, j, n_block;
+  float buffer[1024];
+
+  if (!as_float){
+    return (fread(x, sizeof(double), n, infile) == n);
+  }
+  for (i=0; i < n; i+= n_block){
+    n_block = (n - i < 1024) ? n - i : 1024;
+    if (fread(buffer, sizeof(float), n_block, infile) != n_block){
+      return 0;
+    }
+    for (j=0; j < n_block; j++){
+      x[i + j] = (double)buffer[j];
+    }
+  }
+  return 1;
+}
+
+
+static void cache_write_locations(FILE *outfile, int n, const short *x, const short *y){
+
+  int32_t n_locations = n;
+
+  fwrite(&n_locations, sizeof(int32_t), 1, outfile);
+  if (n > 0){
+    fwrite(x, sizeof(short), n, outfile);
+    fwrite(y, sizeof(short), n, outfile);
+  }
+}
+
+
+static int cache_read_locations(FILE *infile, long entry_size, int *n, short **x, short **y){
+
+  int32_t n_locations;
+
+  *x = NULL;
+  *y = NULL;
+  if (fread(&n_locations, sizeof(int32_t), 1, infile) != 1 || n_locations < 0 ||
+      !cache_entry_has(infile, entry_size, (uint64_t)n_locations, 2*sizeof(short))){
+    return 0;
+  }
+  *n = n_locations;
+  *x = Calloc(n_locations + 1, short);
+  *y = Calloc(n_locations + 1, short);
+  return (fread(*x, sizeof(short), n_locations, infile) == (size_t)n_locations &&
+	  fread(*y, sizeof(short), n_locations, infile) == (size_t)n_locations);
+}
+
+
+/* frees the contents of cel, as filled by load_cached_cel() */
+
+void free_cached_cel(cached_cel *cel){
+
+  char **strings[5];
+  int i;
+
+  strings[0] = &(cel->header.cdfName);
+  strings[1] = &(cel->header.DatHeader);
+  strings[2] = &(cel->header.Algorithm);
+  strings[3] = &(cel->header.AlgorithmParameters);
+  strings[4] = &(cel->header.ScanDate);
+  for (i=0; i < 5; i++){
+    if (*strings[i] != NULL){
+      Free(*strings[i]);
+    }
+  }
+  if (cel->intensities != NULL) Free(cel->intensities);
+  if (cel->stddev != NULL) Free(cel->stddev);
+  if (cel->npixels != NULL) Free(cel->npixels);
+  if (cel->masks_x != NULL) Free(cel->masks_x);
+  if (cel->masks_y != NULL) Free(cel->masks_y);
+  if (cel->outliers_x != NULL) Free(cel->outliers_x);
+  if (cel->outliers_y != NULL) Free(cel->outliers_y);
+}
+
+
+/*************************************************************
+ **
+ ** int load_cached_cel(const char *filename, const cache_source_key *key, int need_stddev, cached_cel *cel)
+ **
+ ** const char *filename - the CEL file
+ ** const cache_source_key *key - its key, from cache_source_key_of()
+ ** int need_stddev - if true the entry must also have stddev and npixels
+ ** cached_cel *cel - filled with the cached contents, allocated with
+ **                   Calloc(), which the caller then owns
+ **
+ ** RETURNS 1 if there is an up to date entry for filename (with
+ ** stddev if needed), otherwise 0 and cel is untouched.
+ **
+ *************************************************************/
+
+int load_cached_cel(const char *filename, const cache_source_key *key, int need_stddev, cached_cel *cel){
+
+  char *entry_name;
+  char *canonical_path;
+  char *path = NULL;
+  char magic[8];
+  uint32_t version, byte_order, flags;
+  int32_t dims[10];
+  uint64_t n_cells;
+  cache_source_key entry_key;
+  cached_cel entry;
+  FILE *infile;
+  long entry_size;
+  size_t value_width;
+  int ok;
+
+  if (!cel_cache_enabled()){
+    return 0;
+  }
+
+  canonical_path = cache_canonical_path(filename);
+  entry_name = cache_entry_name_of_path(getenv(CEL_CACHE_ENV_VAR), canonical_path, ".celcache");
+  infile = fopen(entry_name, "rb");
+  Free(entry_name);
+  if (infile == NULL){
+    Free(canonical_path);
+    return 0;
+  }
+
+  memset(&entry, 0, sizeof(cached_cel));
+
+  ok = (fseek(infile, 0, SEEK_END) == 0 && (entry_size = ftell(infile)) >= 0 && fseek(infile, 0, SEEK_SET) == 0 &&
+	fread(magic, 1, 8, infile) == 8 && memcmp(magic, CEL_CACHE_MAGIC, 8) == 0 &&
+	fread(&version, sizeof(uint32_t), 1, infile) == 1 && version == CEL_CACHE_VERSION &&
+	fread(&byte_order, sizeof(uint32_t), 1, infile) == 1 && byte_order == CEL_CACHE_BYTE_ORDER &&
+	fread(&(entry_key.size), sizeof(uint64_t), 1, infile) == 1 && entry_key.size == key->size &&
+	fread(&(entry_key.mtime), sizeof(int64_t), 1, infile) == 1 && entry_key.mtime == key->mtime &&
+	fread(&(entry_key.header_hash), sizeof(uint64_t), 1, infile) == 1 && entry_key.header_hash == key->header_hash);
+
+  /* two paths may share an entry name */
+  ok = ok && cache_read_string(infile, entry_size, &path) && strcmp(path, canonical_path) == 0;
+  if (path != NULL){
+    Free(path);
+  }
+  Free(canonical_path);
+
+  ok = ok && cache_read_string(infile, entry_size, &(entry.header.cdfName))
+    && cache_read_string(infile, entry_size, &(entry.header.DatHeader))
+    && cache_read_string(infile, entry_size, &(entry.header.Algorithm))
+    && cache_read_string(infile, entry_size, &(entry.header.AlgorithmParameters))
+    && cache_read_string(infile, entry_size, &(entry.header.ScanDate))
+    && fread(dims, sizeof(int32_t), 10, infile) == 10
+    && fread(&flags, sizeof(uint32_t), 1, infile) == 1
+    && fread(&n_cells, sizeof(uint64_t), 1, infile) == 1
+    && (!need_stddev || (flags & CEL_CACHE_STDDEV))
+    && dims[0] >= 0 && dims[1] >= 0
+    && n_cells == (uint64_t)dims[0]*(uint64_t)dims[1];
+
+  /* intensities, and then stddev and npixels, must all fit in what is left */
+  value_width = (flags & CEL_CACHE_FLOAT) ? sizeof(float) : sizeof(double);
+  if (flags & CEL_CACHE_STDDEV){
+    value_width *= 3;
+  }
+  ok = ok && cache_entry_has(infile, entry_size, n_cells, value_width);
+
+  if (ok){
+    entry.header.cols = dims[0];
+    entry.header.rows = dims[1];
+    entry.header.GridCornerULx = dims[2];
+    entry.header.GridCornerULy = dims[3];
+    entry.header.GridCornerURx = dims[4];
+    entry.header.GridCornerURy = dims[5];
+    entry.header.GridCornerLRx = dims[6];
+    entry.header.GridCornerLRy = dims[7];
+    entry.header.GridCornerLLx = dims[8];
+    entry.header.GridCornerLLy = dims[9];
+    entry.n_cells = (size_t)n_cells;
+
+    entry.intensities = Calloc(entry.n_cells, double);
+    ok = cache_read_values(infile, entry.intensities, entry.n_cells, (flags & CEL_CACHE_FLOAT));
+    if (ok && (flags & CEL_CACHE_STDDEV)){
+      entry.stddev = Calloc(entry.n_cells, double);
+      entry.npixels = Calloc(entry.n_cells, double);
+      ok = cache_read_values(infile, entry.stddev, entry.n_cells, (flags & CEL_CACHE_FLOAT)) &&
+	cache_read_values(infile, entry.npixels, entry.n_cells, (flags & CEL_CACHE_FLOAT));
+    }
+    ok = ok && cache_read_locations(infile, entry_size, &(entry.nmasks), &(entry.masks_x), &(entry.masks_y))
+      && cache_read_locations(infile, entry_size, &(entry.noutliers), &(entry.outliers_x), &(entry.outliers_y));
+  }
+  fclose(infile);
+
+  if (!ok){
+    free_cached_cel(&entry);
+    return 0;
+  }
+  memcpy(cel, &entry, sizeof(cached_cel));
+  return 1;
+}
+
+
+/*************************************************************
+ **
+ ** void save_cached_cel(const char *filename, const cache_source_key *key, const cached_cel *cel)
+ **
+ ** writes (or replaces) the entry for filename, under the key it had
+ ** before it was parsed. Failing to write it is not an error, the
+ ** file is simply parsed again next time.
+ **
+ *************************************************************/
+
+void save_cached_cel(const char *filename, const cache_source_key *key, const cached_cel *cel){
+
+  char *entry_name;
+  char *temp_name;
+  char *canonical_path;
+  uint32_t version = CEL_CACHE_VERSION, byte_order = CEL_CACHE_BYTE_ORDER, flags = 0;
+  int32_t dims[10];
+  uint64_t n_cells = (uint64_t)cel->n_cells;
+  FILE *outfile;
+  int as_float;
+
+  if (!cel_cache_enabled()){
+    return;
+  }
+
+  as_float = values_fit_float(cel->intensities, cel->n_cells);
+  if (cel->stddev != NULL && cel->npixels != NULL){
+    flags |= CEL_CACHE_STDDEV;
+    as_float = as_float && values_fit_float(cel->stddev, cel->n_cells) && values_fit_float(cel->npixels, cel->n_cells);
+  }
+  if (as_float){
+    flags |= CEL_CACHE_FLOAT;
+  }
+
+  dims[0] = cel->header.cols;
+  dims[1] = cel->header.rows;
+  dims[2] = cel->header.GridCornerULx;
+  dims[3] = cel->header.GridCornerULy;
+  dims[4] = cel->header.GridCornerURx;
+  dims[5] = cel->header.GridCornerURy;
+  dims[6] = cel->header.GridCornerLRx;
+  dims[7] = cel->header.GridCornerLRy;
+  dims[8] = cel->header.GridCornerLLx;
+  dims[9] = cel->header.GridCornerLLy;
+
+  canonical_path = cache_canonical_path(filename);
+  entry_name = cache_entry_name_of_path(getenv(CEL_CACHE_ENV_VAR), canonical_path, ".celcache");
+  temp_name = Calloc(strlen(entry_name) + 48, char);
+  sprintf(temp_name, "%s.%lx.%lx.tmp", entry_name, (unsigned long)cache_getpid(), (unsigned long)(size_t)cel);
+
+  if ((outfile = fopen(temp_name, "wb")) != NULL){
+    fwrite(CEL_CACHE_MAGIC, 1, 8, outfile);
+    fwrite(&version, sizeof(uint32_t), 1, outfile);
+    fwrite(&byte_order, sizeof(uint32_t), 1, outfile);
+    fwrite(&(key->size), sizeof(uint64_t), 1, outfile);
+    fwrite(&(key->mtime), sizeof(int64_t), 1, outfile);
+    fwrite(&(key->header_hash), sizeof(uint64_t), 1, outfile);
+    cache_write_string(outfile, canonical_path);
+    cache_write_string(outfile, cel->header.cdfName);
+    cache_write_string(outfile, cel->header.DatHeader);
+    cache_write_string(outfile, cel->header.Algorithm);
+    cache_write_string(outfile, cel->header.AlgorithmParameters);
+    cache_write_string(outfile, cel->header.ScanDate);
+    fwrite(dims, sizeof(int32_t), 10, outfile);
+    fwrite(&flags, sizeof(uint32_t), 1, outfile);
+    fwrite(&n_cells, sizeof(uint64_t), 1, outfile);
+    cache_write_values(outfile, cel->intensities, cel->n_cells, as_float);
+    if (flags & CEL_CACHE_STDDEV){
+      cache_write_values(outfile, cel->stddev, cel->n_cells, as_float);
+      cache_write_values(outfile, cel->npixels, cel->n_cells, as_float);
+    }
+    cache_write_locations(outfile, cel->nmasks, cel->masks_x, cel->masks_y);
+    cache_write_locations(outfile, cel->noutliers, cel->outliers_x, cel->outliers_y);
+
+    if (ferror(outfile) | fclose(outfile)){
+      remove(temp_name);
+    } else {
+      /* rename() will not replace an existing file everywhere */
+      remove(entry_name);
+      if (rename(temp_name, entry_name) != 0){
+	remove(temp_name);
+      }
+    }
+  }
+
+  Free(temp_name);
+  Free(entry_name);
+  Free(canonical_path);
+}
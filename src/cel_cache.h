@@ -0,0 +1,60 @@
+#ifndef CEL_CACHE_H
+#define CEL_CACHE_H
+
+#include <stdint.h>
+
+#include "read_abatch.h"
+
+/*
+   set to a directory to keep the parsed contents of each CEL file
+   there, so that later reads of an unchanged file need not parse it
+*/
+#define CEL_CACHE_ENV_VAR "R_AFFYIO_CEL_CACHE"
+
+/* how much of the start of a file is hashed into its key */
+#define CACHE_HASH_BYTES 4096
+
+
+/****************************************************************
+ **
+ ** What a cache entry records about the file it was made from. An
+ ** entry is only used while all of these still match.
+ **
+ ***************************************************************/
+
+typedef struct{
+  uint64_t size;
+  int64_t mtime;            /* nanoseconds */
+  uint64_t header_hash;
+} cache_source_key;
+
+
+/****************************************************************
+ **
+ ** The parsed contents of a single channel CEL file, as kept in
+ ** the cache. Masks and outliers are given by location.
+ **
+ ***************************************************************/
+
+typedef struct{
+  detailed_header_info header;
+  size_t n_cells;
+  double *intensities;
+  double *stddev;           /* NULL if not kept */
+  double *npixels;          /* NULL if not kept */
+  int nmasks;
+  short *masks_x, *masks_y;
+  int noutliers;
+  short *outliers_x, *outliers_y;
+} cached_cel;
+
+
+int cel_cache_enabled(void);
+char *cache_canonical_path(const char *filename);
+char *cache_entry_name(const char *dir, const char *filename, const char *extension);
+int cache_source_key_of(const char *filename, cache_source_key *key);
+int load_cached_cel(const char *filename, const cache_source_key *key, int need_stddev, cached_cel *cel);
+void save_cached_cel(const char *filename, const cache_source_key *key, const cached_cel *cel);
+void free_cached_cel(cached_cel *cel);
+
+#endif
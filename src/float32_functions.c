@@ -0,0 +1,176 @@
+/*************************************************************
+ **
+ ** file: float32_functions.c
+ **
+ ** Single precision storage for intensity matrices. 
+ **
+ ** The values in CEL files are (at most) single precision: float32 
+ ** in binary and command console files, one decimal place in text
+ ** files. Keeping a batch as floats rather than doubles halves the
+ ** memory it needs. The floats are held in an R integer matrix 
+ ** (which has the same element size) with the attribute "float32" 
+ ** set to TRUE, R_float32_to_double() turns columns of it back into 
+ ** an ordinary numeric matrix.
+ **
+ ** History
+ ** Oct 16, 2026 - Initial version
+ **
+ *************************************************************/
+
+#include <R.h>
+#include <Rdefines.h>
+#include <Rinternals.h>
+
+#include "stdlib.h"
+#include "string.h"
+#include "float32_functions.h"
+
+
+/* floats are stored in the elements of an integer vector */
+typedef char float32_size_check[(sizeof(float) == sizeof(int)) ? 1 : -1];
+
+
+
+float float32_from_double(double x){
+
+  unsigned int bits = FLOAT32_NA_BITS;
+  float value;
+
+  if (ISNA(x)){
+    memcpy(&value, &bits, sizeof(float));
+    return value;
+  }
+  return (float)x;
+}
+
+
+double float32_to_double(float x){
+
+  unsigned int bits;
+
+  if (ISNAN(x)){
+    memcpy(&bits, &x, sizeof(float));
+    return (bits == FLOAT32_NA_BITS) ? NA_REAL : R_NaN;
+  }
+  return (double)x;
+}
+
+
+void float32_store(const double *values, float *destination, size_t n){
+
+  size_t i;
+
+  for (i = 0; i < n; i++){
+    destination[i] = float32_from_double(values[i]);
+  }
+}
+
+
+void float32_load(const float *values, double *destination, size_t n){
+
+  size_t i;
+
+  for (i = 0; i < n; i++){
+    destination[i] = float32_to_double(values[i]);
+  }
+}
+
+
+/*************************************************************
+ **
+ ** SEXP allocFloat32Matrix(int nrow, int ncol)
+ **
+ ** allocates (but does not PROTECT) a nrow by ncol single precision 
+ ** matrix. Fill it through FLOAT32_POINTER()
+ **
+ *************************************************************/
+
+SEXP allocFloat32Matrix(int nrow, int ncol){
+
+  SEXP x, flag;
+
+  PROTECT(x = allocMatrix(INTSXP, nrow, ncol));
+  PROTECT(flag = allocVector(LGLSXP, 1));
+  LOGICAL(flag)[0] = TRUE;
+  setAttrib(x, install("float32"), flag);
+  UNPROTECT(2);
+  return x;
+}
+
+
+int isFloat32Matrix(SEXP x){
+
+  SEXP flag = getAttrib(x, install("float32"));
+
+  return (TYPEOF(x) == INTSXP && isMatrix(x) && flag != R_NilValue && asLogical(flag) == TRUE);
+}
+
+
+/*************************************************************
+ **
+ ** SEXP R_float32_to_double(SEXP x, SEXP columns)
+ **
+ ** SEXP x       - a single precision matrix
+ ** SEXP columns - integer vector of (1 based) columns wanted, 
+ **                or NULL for all of them
+ **
+ ** RETURNS a numeric matrix of those columns, with the row names
+ ** and the names of the selected columns
+ **
+ *************************************************************/
+
+SEXP R_float32_to_double(SEXP x, SEXP columns){
+
+  SEXP values, dimnames, x_dimnames, colnames, x_colnames;
+  int nrow, ncol, n_wanted, j, col;
+  int *wanted = NULL;
+  const float *floats;
+
+  if (!isFloat32Matrix(x)){
+    error("R_float32_to_double: x is not a float32 matrix");
+  }
+
+  nrow = INTEGER(getAttrib(x, R_DimSymbol))[0];
+  ncol = INTEGER(getAttrib(x, R_DimSymbol))[1];
+
+  if (isNull(columns)){
+    n_wanted = ncol;
+  } else {
+    PROTECT(columns = coerceVector(columns, INTSXP));
+    n_wanted = length(columns);
+    wanted = INTEGER(columns);
+    for (j = 0; j < n_wanted; j++){
+      if (wanted[j] == NA_INTEGER || wanted[j] < 1 || wanted[j] > ncol){
+	error("R_float32_to_double: column %d is out of range", wanted[j]);
+      }
+    }
+  }
+
+  PROTECT(values = allocMatrix(REALSXP, nrow, n_wanted));
+  floats = FLOAT32_POINTER(x);
+  for (j = 0; j < n_wanted; j++){
+    col = (wanted == NULL) ? j : wanted[j] - 1;
+    float32_load(floats + (size_t)col*nrow, REAL(values) + (size_t)j*nrow, (size_t)nrow);
+  }
+
+  x_dimnames = getAttrib(x, R_DimNamesSymbol);
+  if (!isNull(x_dimnames)){
+    PROTECT(dimnames = allocVector(VECSXP, 2));
+    SET_VECTOR_ELT(dimnames, 0, VECTOR_ELT(x_dimnames, 0));
+    x_colnames = VECTOR_ELT(x_dimnames, 1);
+    if (!isNull(x_colnames)){
+      PROTECT(colnames = allocVector(STRSXP, n_wanted));
+      for (j = 0; j < n_wanted; j++){
+	col = (wanted == NULL) ? j : wanted[j] - 1;
+	SET_STRING_ELT(colnames, j, STRING_ELT(x_colnames, col));
+      }
+      SET_VECTOR_ELT(dimnames, 1, colnames);
+      UNPROTECT(1);
+    }
+    setAttrib(values, R_DimNamesSymbol, dimnames);
+    UNPROTECT(1);
+  }
+
+  UNPROTECT(isNull(columns) ? 1 : 2);
+  return values;
+}
@@ -0,0 +1,35 @@
+#ifndef _FLOAT32_FUNCTIONS_HEADER
+#define _FLOAT32_FUNCTIONS_HEADER
+
+#include "stdlib.h"
+
+#include <R.h>
+#include <Rinternals.h>
+
+
+/* 
+   Single precision storage of intensity matrices. R has no single
+   precision type so the floats are kept in the 4 byte elements of an 
+   integer matrix, marked by a "float32" attribute. 
+
+   NA is stored as a float NaN with its own payload so that it is 
+   distinguished from NaN when the values are widened again.
+*/
+
+#define FLOAT32_NA_BITS 0x7FC007A2U
+
+#define FLOAT32_POINTER(x) ((float *)INTEGER(x))
+
+float float32_from_double(double x);
+double float32_to_double(float x);
+
+void float32_store(const double *values, float *destination, size_t n);
+void float32_load(const float *values, double *destination, size_t n);
+
+SEXP allocFloat32Matrix(int nrow, int ncol);
+int isFloat32Matrix(SEXP x);
+
+SEXP R_float32_to_double(SEXP x, SEXP columns);
+
+
+#endif
@@ -15,6 +15,10 @@
 #include <zlib.h>
 #endif
 
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
+
 
 /*************************************************************************
  **
@@ -718,9 +722,225 @@ size_t gzread_be_double64(double *destination, int n, gzFile instream){
 
 
 
+/*************************************************************************
+ **
+ ** Reading larger stretches of gzipped files
+ **
+ ** gzopen_buffered() - as gzopen() but with a larger zlib buffer 
+ **                     (GZ_BUFFER_SIZE rather than the default 8K)
+ **
+ ** gzread_blocks()   - reads n_units records of unit_size bytes, passing
+ **                     them in large blocks to decode(). With pthreads the 
+ **                     inflating is done by a second thread into one buffer 
+ **                     while the previous block is decoded from the other. 
+ **                     Exactly n_units*unit_size bytes are read (less on a
+ **                     short file) so the stream can be read on afterwards. 
+ **                     Returns the number of units decoded, which is less 
+ **                     than n_units if the file ended early or decode() 
+ **                     returned non zero.
+ **
+ ************************************************************************/
+
+#define GZ_PIPELINE_BLOCK 1048576
+
+gzFile gzopen_buffered(const char *path, const char *mode){
+
+  gzFile file = gzopen(path, mode);
+
+#if ZLIB_VERNUM >= 0x1240
+  if (file != NULL){
+    gzbuffer(file, GZ_BUFFER_SIZE);
+  }
+#endif
+  return file;
+}
+
+
+static size_t gzread_blocks_serial(gzFile instream, size_t unit_size, size_t n_units, size_t block_units, gzread_block_decoder decode, void *arg){
+
+  size_t n_done = 0, n_block;
+  int n_read;
+  unsigned char *buffer = Calloc(block_units*unit_size, unsigned char);
+
+  while (n_done < n_units){
+    n_block = n_units - n_done;
+    if (n_block > block_units){
+      n_block = block_units;
+    }
+    n_read = gzread(instream, buffer, (unsigned)(n_block*unit_size));
+    if (n_read < 0){
+      n_read = 0;
+    }
+    if ((size_t)n_read/unit_size > 0 && decode(buffer, n_done, (size_t)n_read/unit_size, arg)){
+      break;
+    }
+    n_done += (size_t)n_read/unit_size;
+    if ((size_t)n_read < n_block*unit_size){
+      break;
+    }
+  }
+  Free(buffer);
+  return n_done;
+}
+
+
+#ifdef USE_PTHREADS
+
+typedef struct{
+  gzFile instream;
+  size_t block_size;        /* bytes in a full block, a whole number of units */
+  size_t n_bytes;           /* to be read in total */
+  unsigned char *buffers[2];
+  size_t lengths[2];        /* bytes inflated into each buffer */
+  int full[2];
+  int finished;             /* the inflate thread has stopped reading */
+  int stop;                 /* the decoding side wants no more */
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+} gz_pipeline;
+
+
+static void *gz_pipeline_inflate(void *data){
+
+  gz_pipeline *pipeline = (gz_pipeline *)data;
+  size_t n_done = 0, n_wanted;
+  int n_read, which = 0, stop;
+
+  while (n_done < pipeline->n_bytes){
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->full[which] && !pipeline->stop){
+      pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    }
+    stop = pipeline->stop;
+    pthread_mutex_unlock(&pipeline->lock);
+    if (stop){
+      break;
+    }
+
+    n_wanted = pipeline->n_bytes - n_done;
+    if (n_wanted > pipeline->block_size){
+      n_wanted = pipeline->block_size;
+    }
+    n_read = gzread(pipeline->instream, pipeline->buffers[which], (unsigned)n_wanted);
+    if (n_read < 0){
+      n_read = 0;
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->lengths[which] = (size_t)n_read;
+    pipeline->full[which] = 1;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    n_done += (size_t)n_read;
+    if ((size_t)n_read < n_wanted){
+      break;
+    }
+    which = 1 - which;
+  }
+
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->finished = 1;
+  pthread_cond_broadcast(&pipeline->changed);
+  pthread_mutex_unlock(&pipeline->lock);
+  return NULL;
+}
+
+
+/* the decoding side of the pipeline, run on the calling thread */
+
+static size_t gz_pipeline_decode(gz_pipeline *pipeline, size_t unit_size, gzread_block_decoder decode, void *arg){
+
+  size_t n_done = 0, n_block;
+  int which = 0;
 
+  while (1){
+    pthread_mutex_lock(&pipeline->lock);
+    while (!pipeline->full[which] && !pipeline->finished){
+      pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    }
+    if (!pipeline->full[which]){
+      pthread_mutex_unlock(&pipeline->lock);
+      break;
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    n_block = pipeline->lengths[which]/unit_size;
+    if (n_block > 0 && decode(pipeline->buffers[which], n_done, n_block, arg)){
+      break;
+    }
+    n_done += n_block;
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->full[which] = 0;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+    which = 1 - which;
+  }
 
+  /* let the inflate thread finish if decoding stopped early */
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->stop = 1;
+  pthread_cond_broadcast(&pipeline->changed);
+  pthread_mutex_unlock(&pipeline->lock);
 
+  return n_done;
+}
+
+
+static size_t gzread_blocks_pipelined(gzFile instream, size_t unit_size, size_t n_units, size_t block_units, gzread_block_decoder decode, void *arg){
+
+  gz_pipeline pipeline;
+  pthread_t inflate_thread;
+  size_t n_done;
+
+  pipeline.instream = instream;
+  pipeline.block_size = block_units*unit_size;
+  pipeline.n_bytes = n_units*unit_size;
+  pipeline.buffers[0] = Calloc(pipeline.block_size, unsigned char);
+  pipeline.buffers[1] = Calloc(pipeline.block_size, unsigned char);
+  pipeline.lengths[0] = pipeline.lengths[1] = 0;
+  pipeline.full[0] = pipeline.full[1] = 0;
+  pipeline.finished = 0;
+  pipeline.stop = 0;
+  pthread_mutex_init(&pipeline.lock, NULL);
+  pthread_cond_init(&pipeline.changed, NULL);
+
+  if (pthread_create(&inflate_thread, NULL, gz_pipeline_inflate, &pipeline) == 0){
+    n_done = gz_pipeline_decode(&pipeline, unit_size, decode, arg);
+    pthread_join(inflate_thread, NULL);
+  } else {
+    n_done = gzread_blocks_serial(instream, unit_size, n_units, block_units, decode, arg);
+  }
+
+  pthread_mutex_destroy(&pipeline.lock);
+  pthread_cond_destroy(&pipeline.changed);
+  Free(pipeline.buffers[0]);
+  Free(pipeline.buffers[1]);
+  return n_done;
+}
+
+#endif
+
+
+size_t gzread_blocks(gzFile instream, size_t unit_size, size_t n_units, gzread_block_decoder decode, void *arg){
+
+  size_t block_units = GZ_PIPELINE_BLOCK/unit_size;
+
+  if (unit_size == 0 || n_units == 0){
+    return n_units;
+  }
+  if (block_units == 0){
+    block_units = 1;
+  }
+#ifdef USE_PTHREADS
+  /* a second thread only pays off once there is more than one block */
+  if (n_units > block_units){
+    return gzread_blocks_pipelined(instream, unit_size, n_units, block_units, decode, arg);
+  }
+#endif
+  return gzread_blocks_serial(instream, unit_size, n_units, block_units, decode, arg);
+}
 
 #endif
 
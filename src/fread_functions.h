@@ -54,6 +54,13 @@ size_t gzread_be_char(char *destination, int n, gzFile instream);
 size_t gzread_be_uchar(unsigned char *destination, int n, gzFile instream);
 size_t gzread_be_double64(double *destination, int n, gzFile instream);
 
+#define GZ_BUFFER_SIZE 131072
+
+typedef int (*gzread_block_decoder)(const unsigned char *block, size_t first_unit, size_t n_units, void *arg);
+
+gzFile gzopen_buffered(const char *path, const char *mode);
+size_t gzread_blocks(gzFile instream, size_t unit_size, size_t n_units, gzread_block_decoder decode, void *arg);
+
 #endif
 
 
@@ -8,6 +8,15 @@
  **"
  ** History
  ** May 20, 2013 - Initial version
+ ** Oct 16, 2026 - register the single precision (float32) readers
+ ** Oct 16, 2026 - register the on disk intensity store functions
+ ** Oct 16, 2026 - register the compiled CDF index functions
+ ** Oct 16, 2026 - register ReadCDFProbesets
+ ** Oct 16, 2026 - register the PGF and CLF readers
+ ** Oct 16, 2026 - register R_clf_probe_locations
+ ** Oct 16, 2026 - register the multichannel batch readers
+ ** Oct 16, 2026 - register ReadHeaders
+ ** Oct 16, 2026 - register read_probeintensities_float32
  **
  *****************************************************/
 
@@ -16,6 +25,11 @@
 #include <Rinternals.h>
 
 #include "read_abatch.h"
+#include "float32_functions.h"
+#include "abatch_store.h"
+#include "cdf_index.h"
+#include "read_pgf.h"
+#include "read_clf.h"
 
 #if _MSC_VER >= 1000
 __declspec(dllexport)
@@ -26,6 +40,22 @@ __declspec(dllexport)
 static const R_CallMethodDef callMethods[]  = {
  {"read_abatch",(DL_FUNC)&read_abatch,7}, 
  {"read_abatch_stddev",(DL_FUNC)&read_abatch,7},
+ {"read_abatch_float32",(DL_FUNC)&read_abatch_float32,7},
+ {"read_abatch_multichannel",(DL_FUNC)&read_abatch_multichannel,7},
+ {"read_probeintensities_float32",(DL_FUNC)&read_probeintensities_float32,9},
+ {"read_probeintensities_multichannel",(DL_FUNC)&read_probeintensities_multichannel,9},
+ {"ReadHeaders",(DL_FUNC)&ReadHeaders,1},
+ {"R_float32_to_double",(DL_FUNC)&R_float32_to_double,2},
+ {"read_abatch_store",(DL_FUNC)&read_abatch_store,9},
+ {"append_abatch_store",(DL_FUNC)&append_abatch_store,6},
+ {"R_abatch_store_info",(DL_FUNC)&R_abatch_store_info,1},
+ {"R_abatch_store_read",(DL_FUNC)&R_abatch_store_read,3},
+ {"R_compile_cdf_index",(DL_FUNC)&R_compile_cdf_index,2},
+ {"R_read_cdf_index",(DL_FUNC)&R_read_cdf_index,1},
+ {"ReadCDFProbesets",(DL_FUNC)&ReadCDFProbesets,2},
+ {"R_read_pgf_file",(DL_FUNC)&R_read_pgf_file,1},
+ {"R_read_clf_file",(DL_FUNC)&R_read_clf_file,1},
+ {"R_clf_probe_locations",(DL_FUNC)&R_clf_probe_locations,3},
   {NULL, NULL, 0}
   };
 
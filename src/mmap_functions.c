@@ -0,0 +1,112 @@
+/*************************************************************
+ **
+ ** file: mmap_functions.c
+ **
+ ** Memory mapping of uncompressed files so that their contents
+ ** can be decoded directly from the page cache rather than being
+ ** copied through stdio buffers first.
+ **
+ ** Mapping is only used where the platform provides mmap(). 
+ ** Elsewhere map_file() always fails, callers then fall back on 
+ ** reading the file with stdio.
+ **
+ ** History
+ ** Oct 16, 2026 - Initial version
+ **
+ *************************************************************/
+
+#include "stdlib.h"
+#include "mmap_functions.h"
+
+#if defined(__unix__) || defined(__unix) || (defined(__APPLE__) && defined(__MACH__))
+#define USE_MMAP 1
+#endif
+
+#ifdef USE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+
+/*************************************************************
+ **
+ ** int map_file(const char *filename, mapped_file *map)
+ **
+ ** maps the whole of filename read only, advising the system that it
+ ** will be read sequentially. Returns 1 on success, otherwise 0 and
+ ** map->data is NULL.
+ **
+ *************************************************************/
+
+int map_file(const char *filename, mapped_file *map){
+
+#ifdef USE_MMAP
+  int fd;
+  struct stat file_stat;
+  void *data;
+#endif
+
+  map->data = NULL;
+  map->size = 0;
+
+#ifdef USE_MMAP
+  if ((fd = open(filename, O_RDONLY)) < 0){
+    return 0;
+  }
+  if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) || file_stat.st_size == 0){
+    close(fd);
+    return 0;
+  }
+  data = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED){
+    return 0;
+  }
+#ifdef MADV_SEQUENTIAL
+  madvise(data, (size_t)file_stat.st_size, MADV_SEQUENTIAL);
+#endif
+  map->data = (const unsigned char *)data;
+  map->size = (size_t)file_stat.st_size;
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+
+void unmap_file(mapped_file *map){
+
+#ifdef USE_MMAP
+  if (map->data != NULL){
+    munmap((void *)map->data, map->size);
+  }
+#endif
+  map->data = NULL;
+  map->size = 0;
+}
+
+
+/*************************************************************
+ **
+ ** void prefetch_file(const char *filename)
+ **
+ ** asks the system to start reading filename into the page cache,
+ ** so that it is (at least partly) in memory by the time it is 
+ ** needed. Returns immediately, failures are ignored.
+ **
+ *************************************************************/
+
+void prefetch_file(const char *filename){
+
+#if defined(USE_MMAP) && defined(MADV_WILLNEED)
+  mapped_file map;
+
+  if (map_file(filename, &map)){
+    madvise((void *)map.data, map.size, MADV_WILLNEED);
+    unmap_file(&map);
+  }
+#endif
+}
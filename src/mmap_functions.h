@@ -0,0 +1,20 @@
+#ifndef _MMAP_FUNCTIONS_HEADER
+#define _MMAP_FUNCTIONS_HEADER
+
+#include "stdlib.h"
+
+
+/* A file mapped read only into memory */
+
+typedef struct{
+  const unsigned char *data;
+  size_t size;
+} mapped_file;
+
+
+int map_file(const char *filename, mapped_file *map);
+void unmap_file(mapped_file *map);
+void prefetch_file(const char *filename);
+
+
+#endif
@@ -153,6 +153,66 @@
  ** Sept 18, 2013 -  improve 64bit support for read_abatch
  ** Jun 22, 2016 - Define PTHREAD_STACK_MIN if missing (e.g. Intel compiler) (DCT)
  ** Sept 4, 2017 - change gzFile* to gzFile
+ ** Oct 16, 2026 - read_abatch, read_abatch_stddev and read_abatch_npixels share a 
+ **                single reading engine. With pthreads files are taken from a shared
+ **                work queue (also now used by read_probeintensities) rather than
+ **                being divided into fixed ranges ahead of time
+ ** Oct 16, 2026 - CEL format is determined by opening the file once. The header
+ **                read while checking a file is kept (cel_handle) and reading then
+ **                starts directly at the cell data, with masks/outliers applied
+ **                from the same open file
+ ** Oct 16, 2026 - binary CEL cell records are read in blocks and decoded from a buffer,
+ **                intensity, stddev and npixels can be filled in a single pass
+ ** Oct 16, 2026 - command console CEL files are read through a data set index, seeking 
+ **                directly to the data set wanted. read.celfile opens them only once
+ ** Oct 16, 2026 - uncompressed binary and command console CEL files are memory mapped 
+ **                where possible, cell data is decoded from the mapping directly into
+ **                the output. The next file of a batch is prefetched while reading
+ ** Oct 16, 2026 - text CEL cell lines are parsed in place from a large block with a 
+ **                locale independent scanner rather than fgets/strtok/atof. 
+ **                read.celfile reads intensity, stddev and npixels in one pass
+ ** Oct 16, 2026 - gzipped CEL files are opened with a larger zlib buffer. Gzipped binary 
+ **                cell records are inflated and decoded in separate stages (gzread_blocks)
+ **                and masks/outliers are read with one gzread per section
+ ** Oct 16, 2026 - with R_AFFYIO_CHECK_WHILE_READING set, read_abatch and read_probeintensities
+ **                check each file against the reference CDF from the header read to read it
+ **                rather than in a separate pass over all the files first
+ ** Oct 16, 2026 - read_abatch_float32 and read_probeintensities_float32 return single 
+ **                precision matrices (see float32_functions.c)
+ ** Oct 16, 2026 - read_probeintensities flattens cdfInfo once into an int index of PM and 
+ **                MM cells (probe_gather_plan) shared by all the threads, rather than
+ **                walking cdfInfo (or a copy of it) for every file
+ ** Oct 16, 2026 - read_probeintensities no longer reads each file into a whole chip buffer.
+ **                The intensities are scattered into the PM and MM matrices as they are 
+ **                decoded using the inverse of the probe index (read_cel_handle_blocks())
+ ** Oct 16, 2026 - add read_abatch_store which reads a batch into an on disk store (abatch_store.c)
+ **                rather than a matrix in memory
+ ** Oct 16, 2026 - add append_abatch_store which adds more CEL files to an existing store
+ ** Oct 16, 2026 - when R_AFFYIO_CEL_CACHE is set the parsed contents of each CEL file are
+ **                kept in a cache (cel_cache.c) and used by read_cel_file, read_abatch and
+ **                read_probeintensities until the file changes
+ ** Oct 16, 2026 - parse_cel_file reads all the channels of a multichannel CEL file in one
+ **                pass (read_genericcel_file_channels()) rather than reopening it for each
+ ** Oct 16, 2026 - add read_abatch_multichannel and read_probeintensities_multichannel which read
+ **                batches of multichannel CEL files (threaded as for read_abatch) into a
+ **                probes by chips by channels array. ReadHeader and ReadHeaderDetailed accept
+ **                multichannel files
+ ** Oct 16, 2026 - add ReadHeaders which reads the headers of a batch of CEL files (threaded
+ **                as for read_abatch) into columns
+ ** Oct 16, 2026 - read_abatch_store no longer replaces an existing store unless overwrite is TRUE
+ ** Oct 16, 2026 - append_abatch_store rejects a CEL file given more than once
+ ** Oct 16, 2026 - a truncated or incomplete CEL file is no longer saved to the cache
+ ** Oct 16, 2026 - the threads reading a batch no longer call error() or Rprintf(). A bad file
+ **                is recorded (reader_trap), no more files are started, and the main thread
+ **                reports it once everything has been freed. A single thread is run inline
+ ** Oct 16, 2026 - read_abatch_store and append_abatch_store close the store (removing a new one)
+ **                before signalling that a CEL file could not be read
+ ** Oct 16, 2026 - the threads of ReadHeaders record a header that can not be read rather than
+ **                calling error(), which is then signalled by the main thread
+ ** Oct 16, 2026 - a command console CEL file whose mask or outlier data set is truncated is
+ **                reported as corrupted
+ ** Oct 16, 2026 - removed the whole-file binary CEL readers, which nothing called any more
+ ** Oct 16, 2026 - the key of a CEL file is taken before it is parsed and passed to the cache
  ** 
  *************************************************************/
  
@@ -162,11 +222,18 @@
 #include <Rinternals.h>
 
 #include "stdlib.h"
+#include <stddef.h>
+#include <stdarg.h>
+#include <setjmp.h>
 #include "stdio.h"
 #include "fread_functions.h"
 #include "read_multichannel_celfile_generic.h"
 #include "read_celfile_generic.h"
+#include "mmap_functions.h"
+#include "float32_functions.h"
+#include "abatch_store.h"
 #include "read_abatch.h"
+#include "cel_cache.h"
 
 #define HAVE_ZLIB 1
 
@@ -187,32 +254,155 @@
 #endif
 
 pthread_mutex_t mutex_R;
-int n_probesets;
-int *n_probes = NULL;
-double **cur_indexes = NULL;
+#endif
+
+/* 
+   files are handed out to worker threads one at a time, so that
+   a thread which finishes early (eg with a small uncompressed file)
+   simply takes the next file rather than sitting idle. Without 
+   pthreads the one "worker" is the main thread
+*/
+struct file_queue{
+#ifdef USE_PTHREADS
+  pthread_mutex_t lock;
+#endif
+  int next_file;
+  int n_files;
+  int stopped;     /* no more files are handed out once one has failed */
+};
+
+#if USE_PTHREADS
 struct thread_data{
   SEXP filenames;
-  double *CurintensityMatrix;
   double *pmMatrix;
   double *mmMatrix;
-  int i;
-  int t;
-  int chunk_size;
+  float *pmFloat32;
+  float *mmFloat32;
+  struct file_queue *queue;
   int ref_dim_1;
   int ref_dim_2;
   int n_files;
-  int num_probes;
-  SEXP cdfInfo;
+  int n_channels;
+  const struct probe_gather_plan *plan;
   const char *refCdfName;
+  int check_while_reading;
   int which_flag;
   SEXP verbose;
 };
 #define THREADS_ENV_VAR "R_THREADS"
 #endif 
 
+/* 
+   set to a non zero integer to check each CEL file against the reference 
+   CDF while it is being read, rather than checking every file first 
+*/
+#define CHECK_ENV_VAR "R_AFFYIO_CHECK_WHILE_READING"
+
 #define BUF_SIZE 1024
 
 
+/******************************************************************
+ **
+ ** Reporting problems with a CEL file
+ **
+ ** The CEL file readers report a bad file with reader_error() and 
+ ** print their warnings with reader_warning(), normally just error() 
+ ** and Rprintf(). While a reader_trap is set for the calling thread 
+ ** (set_reader_trap()) reader_error() instead puts its message in the 
+ ** trap and longjmp()s back to where the trap was set, and the warnings
+ ** are kept in the trap.
+ **
+ ** This is how the worker threads, which must not call the R API,
+ ** report a bad file: once they have all finished the main thread 
+ ** frees what it allocated for the batch, prints the warnings and 
+ ** calls error() with the message (see read_abatch_files()). As with
+ ** error() anything the reader allocated after the trap was set is lost.
+ **
+ *****************************************************************/
+
+#define READER_MESSAGE_SIZE 8192
+
+typedef struct{
+  jmp_buf env;
+  char message[READER_MESSAGE_SIZE];  /* the error, once the trap is sprung */
+  char *warnings;                     /* any warnings, or NULL. Free() them */
+} reader_trap;
+
+#ifdef USE_PTHREADS
+static pthread_key_t reader_trap_key;
+static pthread_once_t reader_trap_key_once = PTHREAD_ONCE_INIT;
+
+static void create_reader_trap_key(void){
+  pthread_key_create(&reader_trap_key, NULL);
+}
+#else
+static reader_trap *current_reader_trap = NULL;
+#endif
+
+
+static void set_reader_trap(reader_trap *trap){
+#ifdef USE_PTHREADS
+  pthread_once(&reader_trap_key_once, create_reader_trap_key);
+  pthread_setspecific(reader_trap_key, trap);
+#else
+  current_reader_trap = trap;
+#endif
+}
+
+
+static reader_trap *get_reader_trap(void){
+#ifdef USE_PTHREADS
+  pthread_once(&reader_trap_key_once, create_reader_trap_key);
+  return (reader_trap *) pthread_getspecific(reader_trap_key);
+#else
+  return current_reader_trap;
+#endif
+}
+
+
+static void reader_error(const char *format, ...){
+
+  char message[READER_MESSAGE_SIZE];
+  reader_trap *trap = get_reader_trap();
+  va_list args;
+
+  va_start(args, format);
+  if (trap != NULL){
+    vsnprintf(trap->message, READER_MESSAGE_SIZE, format, args);
+    va_end(args);
+    set_reader_trap(NULL);
+    longjmp(trap->env, 1);
+  }
+  vsnprintf(message, READER_MESSAGE_SIZE, format, args);
+  va_end(args);
+  error("%s", message);
+}
+
+
+static void reader_warning(const char *format, ...){
+
+  char message[READER_MESSAGE_SIZE];
+  reader_trap *trap = get_reader_trap();
+  size_t len = 0;
+  va_list args;
+
+  va_start(args, format);
+  if (trap == NULL){
+    Rvprintf(format, args);
+    va_end(args);
+    return;
+  }
+  vsnprintf(message, READER_MESSAGE_SIZE, format, args);
+  va_end(args);
+
+  if (trap->warnings != NULL){
+    len = strlen(trap->warnings);
+  }
+  trap->warnings = Realloc(trap->warnings, len + strlen(message) + 1, char);
+  strcpy(trap->warnings + len, message);
+}
+
+
 /******************************************************************
  **
  ** A "C" level object designed to hold information for a
@@ -248,6 +438,9 @@ typedef struct{
 
 } CEL;
 
+/* defined below, with read_cel_file() */
+static void read_cached_cel(const char *filename, int need_stddev, cached_cel *cel);
+
 
 
 
@@ -461,7 +654,7 @@ static int token_ends_with(char *token, char *ends_in){
 
 static void ReadFileLine(char *buffer, int buffersize, FILE *currentFile){
   if (fgets(buffer, buffersize, currentFile) == NULL){
-    error("End of file reached unexpectedly. Perhaps this file is truncated.\n");
+    reader_error("End of file reached unexpectedly. Perhaps this file is truncated.\n");
   }  
 }	  
 
@@ -488,14 +681,14 @@ static FILE *open_cel_file(const char *filename){
 
   currentFile = fopen(filename,mode);
   if (currentFile == NULL){
-     error("Could not open file %s", filename);
+     reader_error("Could not open file %s", filename);
   } else {
     /** check to see if first line is [CEL] so looks like a CEL file**/
     ReadFileLine(buffer, BUF_SIZE, currentFile);
     if (strncmp("[CEL]", buffer, 4) == 0) {
       rewind(currentFile);
     } else {
-      error("The file %s does not look like a CEL file",filename);
+      reader_error("The file %s does not look like a CEL file",filename);
     }
   }
   
@@ -548,9 +741,10 @@ static void AdvanceToSection(FILE *my_file,char *sectiontitle, char *buffer){
 
 /******************************************************************
  ** 
- ** int check_cel_file(const char *filename, const char *ref_cdfName, int ref_dim_1, int ref_dim_2)
+ ** int check_cel_file_stream(FILE *currentFile, const char *filename, const char *ref_cdfName, int ref_dim_1, int ref_dim_2)
  **
- ** const char *filename - the file to read
+ ** FILE *currentFile - the open CEL file, positioned before its [HEADER] section
+ ** const char *filename - the file being read
  ** const char *ref_cdfName - the reference CDF filename
  ** int ref_dim_1 - 1st dimension of reference cel file
  ** int ref_dim_2 - 2nd dimension of reference cel file
@@ -566,16 +760,14 @@ static void AdvanceToSection(FILE *my_file,char *sectiontitle, char *buffer){
  **
  ******************************************************************/
 
-static int check_cel_file(const char *filename, const char *ref_cdfName, int ref_dim_1, int ref_dim_2){
+static int check_cel_file_stream(FILE *currentFile, const char *filename, const char *ref_cdfName, int ref_dim_1, int ref_dim_2){
 
   int i;
   int dim1,dim2;
 
-  FILE *currentFile; 
   char buffer[BUF_SIZE];
   tokenset *cur_tokenset;
 
-  currentFile = open_cel_file(filename);
   
 
   AdvanceToSection(currentFile,"[HEADER]",buffer);
@@ -589,7 +781,7 @@ static int check_cel_file(const char *filename, const char *ref_cdfName, int ref
   dim2 = atoi(get_token(cur_tokenset,1));
   delete_tokens(cur_tokenset);
   if ((dim1 != ref_dim_1) || (dim2 != ref_dim_2)){
-    error("Cel file %s does not seem to have the correct dimensions",filename);
+    reader_error("Cel file %s does not seem to have the correct dimensions",filename);
   }
   
   
@@ -600,345 +792,528 @@ static int check_cel_file(const char *filename, const char *ref_cdfName, int ref
       break;
     }
     if (i == (tokenset_size(cur_tokenset) - 1)){
-      error("Cel file %s does not seem to be of %s type",filename,ref_cdfName);
+      reader_error("Cel file %s does not seem to be of %s type",filename,ref_cdfName);
     }
   }
   delete_tokens(cur_tokenset);
-  fclose(currentFile);
 
   return 0;
 }
 
-/************************************************************************
- **
- ** int read_cel_file_intensities(const char *filename, double *intensity, int chip_num, int rows, int cols)
- **
- ** const char *filename - the name of the cel file to read
- ** double *intensity  - the intensity matrix to fill
- ** int chip_num - the column of the intensity matrix that we will be filling
- ** int rows - dimension of intensity matrix
- ** int cols - dimension of intensity matrix
- **
- ** returns 0 if successful, non zero if unsuccessful
+/******************************************************************
  **
- ** This function reads from the specified file the cel intensities for that
- ** array and fills a column of the intensity matrix.
+ ** Scanning the [INTENSITY] section of a text CEL file
+ **
+ ** Each cell line is "X Y MEAN STDV NPIXELS" with the fields separated
+ ** by spaces or tabs. Rather than copying each line out with fgets() and 
+ ** splitting it with strtok()/atoi()/atof(), the lines are found in place
+ ** in a large block read from the file and the numbers converted by hand.
+ ** The conversion does not depend on the locale (the decimal point is
+ ** always '.').
+ **
+ ** text_cel_scanner             - a block of a text CEL file (or a single
+ **                                line of a gzipped one)
+ ** next_text_cel_line()         - returns the next line in the block (including
+ **                                its '\n') refilling it as needed. NULL at end of file
+ ** finish_text_cel_scanner()    - leaves the file positioned just after the last 
+ **                                line returned, so the [MASKS] and [OUTLIERS] 
+ **                                sections can be read after it as before
+ ** read_text_cel_cells()        - reads the cell lines, filling intensity, stddev 
+ **                                and npixels (any may be NULL) in one pass
  **
- ************************************************************************/
+ *****************************************************************/
 
-static int read_cel_file_intensities(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
-#if USE_PTHREADS  
-  char *tmp_pointer;
-#endif  
+#define TEXT_CEL_BLOCK 262144
 
-	/*	  int */
-  size_t i, cur_index;
-  int cur_x, cur_y;
-  double cur_mean;
-  FILE *currentFile; 
-  char buffer[BUF_SIZE];
-  /* tokenset *cur_tokenset;*/
-  char *current_token;
+typedef struct{
+  FILE *infile;
+#if defined HAVE_ZLIB
+  gzFile gzinfile;
+#endif
+  char *buffer;           /* size bytes plus a terminating '\0' */
+  size_t size;
+  size_t start;           /* first byte not yet returned */
+  size_t end;             /* one past the last byte read */
+  long block_pos;         /* file position the last block was read from */
+  size_t block_offset;    /* where in the buffer the last block was placed */
+  int eof;
+  generic_column_sink sink;  /* if not NULL intensities are passed here rather than stored */
+  void *sink_arg;
+} text_cel_scanner;
 
-  currentFile = open_cel_file(filename);
-  
-  AdvanceToSection(currentFile,"[INTENSITY]",buffer);
-  findStartsWith(currentFile,"CellHeader=",buffer);  
-  
-  for (i=0; i < rows; i++){
-    ReadFileLine(buffer, BUF_SIZE,  currentFile);
-    /* cur_tokenset = tokenize(buffer," \t");
-    cur_x = atoi(get_token(cur_tokenset,0));
-    cur_y = atoi(get_token(cur_tokenset,1));
-    cur_mean = atof(get_token(cur_tokenset,2)); */
-    
-    if (strlen(buffer) <=2){
-      Rprintf("Warning: found an empty line where not expected in %s.\nThis means that there is a cel intensity missing from the cel file.\nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, i);
-      break;
-    }
-#if USE_PTHREADS
-    current_token = strtok_r(buffer," \t",&tmp_pointer);
-#else
-    current_token = strtok(buffer," \t");
+
+static void init_text_cel_scanner(text_cel_scanner *scanner, FILE *infile){
+
+  scanner->infile = infile;
+#if defined HAVE_ZLIB
+  scanner->gzinfile = NULL;
 #endif
-    if (current_token == NULL){
-       Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
+  scanner->size = TEXT_CEL_BLOCK;
+  scanner->buffer = Calloc(scanner->size + 1, char);
+  scanner->start = 0;
+  scanner->end = 0;
+  scanner->block_pos = 0;
+  scanner->block_offset = 0;
+  scanner->eof = 0;
+  scanner->sink = NULL;
+  scanner->sink_arg = NULL;
+}
+
+
+#if defined HAVE_ZLIB
+
+/* gzseek() can not go backwards cheaply, so gzipped files are read a line at a time */
+
+static void gzinit_text_cel_scanner(text_cel_scanner *scanner, gzFile gzinfile){
+
+  scanner->infile = NULL;
+  scanner->gzinfile = gzinfile;
+  scanner->size = BUF_SIZE - 1;
+  scanner->buffer = Calloc(scanner->size + 1, char);
+  scanner->start = 0;
+  scanner->end = 0;
+  scanner->block_pos = 0;
+  scanner->block_offset = 0;
+  scanner->eof = 0;
+  scanner->sink = NULL;
+  scanner->sink_arg = NULL;
+}
 
-    cur_x = atoi(current_token);
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
 #endif
 
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
 
-    cur_y = atoi(current_token);
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
+static char *next_text_cel_line(text_cel_scanner *scanner, size_t *len){
+
+  char *line, *newline;
+  size_t n_read;
+
+#if defined HAVE_ZLIB
+  if (scanner->gzinfile != NULL){
+    if (gzgets(scanner->gzinfile, scanner->buffer, (int)(scanner->size + 1)) == NULL){
+      return NULL;
+    }
+    *len = strlen(scanner->buffer);
+    return scanner->buffer;
+  }
 #endif
- 
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
+
+  while (1){
+    line = scanner->buffer + scanner->start;
+    newline = memchr(line, '\n', scanner->end - scanner->start);
+    if (newline != NULL){
+      *len = (size_t)(newline - line) + 1;
+      scanner->start += *len;
+      return line;
+    }
+    if (scanner->eof || scanner->end - scanner->start == scanner->size){
+      /* last line without a '\n', or one longer than the whole buffer */
+      if (scanner->start == scanner->end){
+	return NULL;
+      }
+      *len = scanner->end - scanner->start;
+      scanner->start = scanner->end;
+      return line;
     }
 
-    if (cur_x < 0 || cur_x >= chip_dim_rows){    
-      error("It appears that the file %s is corrupted.",filename);
-      return 1;
+    /* keep the partial line and read the next block after it */
+    memmove(scanner->buffer, line, scanner->end - scanner->start);
+    scanner->end -= scanner->start;
+    scanner->start = 0;
+    scanner->block_pos = ftell(scanner->infile);
+    scanner->block_offset = scanner->end;
+    n_read = fread(scanner->buffer + scanner->end, 1, scanner->size - scanner->end, scanner->infile);
+    if (n_read < scanner->size - scanner->end){
+      scanner->eof = 1;
     }
-    if (cur_y < 0 || cur_y >= chip_dim_rows){
-      error("It appears that the file %s is corrupted.",filename);
-      return 1;
+    scanner->end += n_read;
+    scanner->buffer[scanner->end] = '\0';
+  }
+}
+
+
+static void finish_text_cel_scanner(text_cel_scanner *scanner){
+
+  size_t n_skip;
+
+  if (scanner->infile != NULL && scanner->start < scanner->end && scanner->start >= scanner->block_offset){
+    /* 
+       go back to where the block was read from and read the consumed part 
+       again, rather than seeking relative to the end of the block, so that 
+       text mode line ending translation can not throw the position off 
+    */
+    n_skip = scanner->start - scanner->block_offset;
+    fseek(scanner->infile, scanner->block_pos, SEEK_SET);
+    if (n_skip > 0 && fread(scanner->buffer, 1, n_skip, scanner->infile) != n_skip){
+      Free(scanner->buffer);
+      reader_error("End of file reached unexpectedly. Perhaps this file is truncated.\n");
     }
+  }
+  Free(scanner->buffer);
+}
 
-    
 
-    cur_mean = atof(current_token);
+/* as atoi(). Tokens never begin with a space or tab */
+
+static int scan_cel_int(const char *p){
 
-    cur_index = cur_x + chip_dim_rows*(cur_y);
-    intensity[chip_num*rows + cur_index] = cur_mean;
-    /* delete_tokens(cur_tokenset); */
+  long value = 0;
+  int negative = 0;
+
+  while (*p == '\n' || *p == '\r' || *p == '\v' || *p == '\f'){
+    p++;
+  }
+  if (*p == '-' || *p == '+'){
+    negative = (*p == '-');
+    p++;
   }
+  while (*p >= '0' && *p <= '9'){
+    value = 10*value + (*p - '0');
+    p++;
+  }
+  return (int)(negative ? -value : value);
+}
 
-  fclose(currentFile);
 
-  if (i != rows){
-    return 1;
+/* 
+   as atof() for plain decimal numbers. When the digits (at most 19 significant)
+   and the power of ten (at most 22) are both exactly representable a single 
+   multiplication or division gives the correctly rounded result. Anything 
+   else (very long or very large numbers, inf, nan, hex) goes to strtod() 
+*/
+
+static double scan_cel_double(const char *p){
+
+  static const double powers_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 
+					 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+  const char *token = p;
+  uint64_t mantissa = 0;
+  int n_significant = 0, n_digits = 0;
+  int exponent = 0, exponent_value = 0, exponent_negative = 0;
+  int negative = 0;
+  double value;
+
+  if (*p == '-' || *p == '+'){
+    negative = (*p == '-');
+    p++;
+  }
+  for (; *p >= '0' && *p <= '9'; p++, n_digits++){
+    if (mantissa != 0 || *p != '0'){
+      if (++n_significant > 19){
+	return strtod(token, NULL);
+      }
+      mantissa = 10*mantissa + (uint64_t)(*p - '0');
+    }
+  }
+  if (*p == '.'){
+    for (p++; *p >= '0' && *p <= '9'; p++, n_digits++){
+      if (mantissa != 0 || *p != '0'){
+	if (++n_significant > 19){
+	  return strtod(token, NULL);
+	}
+	mantissa = 10*mantissa + (uint64_t)(*p - '0');
+      }
+      exponent--;
+    }
+  }
+  if (n_digits == 0 || *p == 'x' || *p == 'X'){
+    return strtod(token, NULL);
+  }
+  if ((*p == 'e' || *p == 'E') && 
+      ((p[1] >= '0' && p[1] <= '9') || ((p[1] == '-' || p[1] == '+') && p[2] >= '0' && p[2] <= '9'))){
+    p++;
+    if (*p == '-' || *p == '+'){
+      exponent_negative = (*p == '-');
+      p++;
+    }
+    for (; *p >= '0' && *p <= '9'; p++){
+      if (exponent_value < 10000){
+	exponent_value = 10*exponent_value + (*p - '0');
+      }
+    }
+    exponent += (exponent_negative ? -exponent_value : exponent_value);
+  }
+
+  if (mantissa == 0){
+    return (negative ? -0.0 : 0.0);
+  }
+  if (mantissa > ((uint64_t)1 << 53) || exponent < -22 || exponent > 22){
+    return strtod(token, NULL);
+  }
+  value = (double)mantissa;
+  if (exponent < 0){
+    value /= powers_of_ten[-exponent];
+  } else {
+    value *= powers_of_ten[exponent];
   }
+  return (negative ? -value : value);
+}
 
 
-  return 0;
+/* finds up to n_wanted tokens (separated by spaces or tabs) on a line, returns how many were found */
+
+static int find_cel_tokens(const char *line, size_t len, const char **tokens, int n_wanted){
+
+  const char *end = line + len;
+  int n_tokens = 0;
+
+  while (n_tokens < n_wanted){
+    while (line < end && (*line == ' ' || *line == '\t')){
+      line++;
+    }
+    if (line == end || *line == '\0'){
+      break;
+    }
+    tokens[n_tokens++] = line;
+    while (line < end && *line != ' ' && *line != '\t' && *line != '\0'){
+      line++;
+    }
+  }
+  return n_tokens;
 }
 
 
 /************************************************************************
  **
- ** int read_cel_file_stddev(const char *filename, double *intensity, int chip_num, int rows, int cols)
+ ** static int read_text_cel_cells(text_cel_scanner *scanner, const char *filename, size_t chip_num, size_t rows, 
+ **                                size_t chip_dim_rows, double *intensity, double *stddev, double *npixels)
  **
- ** const char *filename - the name of the cel file to read
- ** double *intensity  - the intensity matrix to fill
- ** int chip_num - the column of the intensity matrix that we will be filling
- ** int rows - dimension of intensity matrix
- ** int cols - dimension of intensity matrix
+ ** text_cel_scanner *scanner - positioned just after the CellHeader= line
+ ** double *intensity, *stddev, *npixels - the matrices to fill, any may be NULL
  **
- ** returns 0 if successful, non zero if unsuccessful
+ ** returns 0 if successful, 1 if fewer than rows cells were read (after a 
+ ** warning). An error() is flagged if a cell location is out of range.
  **
- ** This function reads from the specified file the cel stddev for that
- ** array and fills a column of the intensity matrix.
+ ** As when each was read in its own pass, a line missing only the STDV or 
+ ** NPIXELS field stops just stddev or npixels from being filled.
+ **
+ ** If the scanner has a sink the intensity of each cell is passed to it
+ ** (with its cell index) instead of being stored in intensity.
  **
  ************************************************************************/
 
-static int read_cel_file_stddev(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
-#if USE_PTHREADS  
-  char *tmp_pointer;
-#endif  
+static int read_text_cel_cells(text_cel_scanner *scanner, const char *filename, size_t chip_num, size_t rows, size_t chip_dim_rows, double *intensity, double *stddev, double *npixels){
 
-  size_t i, cur_x,cur_y,cur_index;
-  double cur_stddev;
-  FILE *currentFile; 
-  char buffer[BUF_SIZE];
-  /* tokenset *cur_tokenset;*/
-  char *current_token;
+  size_t i, len, cur_index;
+  int cur_x, cur_y;
+  int n_tokens, n_wanted;
+  int status = 0;
+  const char *tokens[5];
+  char *line;
+  double cur_intensity;
 
-  currentFile = open_cel_file(filename);
-  
-  AdvanceToSection(currentFile,"[INTENSITY]",buffer);
-  findStartsWith(currentFile,"CellHeader=",buffer);  
-  
   for (i=0; i < rows; i++){
-    ReadFileLine(buffer, BUF_SIZE,  currentFile);
-    /* cur_tokenset = tokenize(buffer," \t");
-    cur_x = atoi(get_token(cur_tokenset,0));
-    cur_y = atoi(get_token(cur_tokenset,1));
-    cur_mean = atof(get_token(cur_tokenset,2)); */
+    n_wanted = (npixels != NULL ? 5 : (stddev != NULL ? 4 : 3));
+
+    line = next_text_cel_line(scanner, &len);
+    if (line == NULL){
+      Free(scanner->buffer);
+      if (scanner->infile != NULL){
+	reader_error("End of file reached unexpectedly. Perhaps this file is truncated.\n");
+      }
+      reader_error("End of gz file reached unexpectedly. Perhaps this file is truncated.\n");
+    }
     
-    if (strlen(buffer) <=2){
-      Rprintf("Warning: found an empty line where not expected in %s.\n This means that there is a cel intensity missing from the cel file.\n Sucessfully read to cel intensity %d of %d expected\n", filename, i-1, i);
+    if (len <= 2){
+      reader_warning("Warning: found an empty line where not expected in %s.\nThis means that there is a cel intensity missing from the cel file.\nSucessfully read to cel intensity %d of %d expected\n", filename, (int)i-1, (int)i);
+      status = 1;
       break;
     }
-#if USE_PTHREADS
-    current_token = strtok_r(buffer," \t",&tmp_pointer);
-#else
-    current_token = strtok(buffer," \t");
-#endif
-
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
+    n_tokens = find_cel_tokens(line, len, tokens, n_wanted);
+    if (n_tokens < n_wanted){
+      reader_warning("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, (int)i-1, (int)rows);
+      status = 1;
+      if (n_tokens < 3){
+	break;
+      }
+      if (n_tokens < 5){
+	npixels = NULL;
+      }
+      if (n_tokens < 4){
+	stddev = NULL;
+      }
+      if (intensity == NULL && stddev == NULL && npixels == NULL){
+	break;
+      }
     }
-    cur_x = atoi(current_token);
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif
-
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
+    
+    cur_x = scan_cel_int(tokens[0]);
+    cur_y = scan_cel_int(tokens[1]);
+    if (cur_x < 0 || (size_t)cur_x >= chip_dim_rows || cur_y < 0 || (size_t)cur_y >= chip_dim_rows){
+      Free(scanner->buffer);
+      reader_error("It appears that the file %s is corrupted.",filename);
+      return 1;
     }
-    cur_y = atoi(current_token);
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
+    
+    cur_index = chip_num*rows + cur_x + chip_dim_rows*(cur_y);
+    if (scanner->sink != NULL){
+      cur_intensity = scan_cel_double(tokens[2]);
+      scanner->sink(&cur_intensity, cur_index, 1, scanner->sink_arg);
     }
-   
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
+    if (intensity != NULL){
+      intensity[cur_index] = scan_cel_double(tokens[2]);
+    }
+    if (stddev != NULL){
+      stddev[cur_index] = scan_cel_double(tokens[3]);
+    }
+    if (npixels != NULL){
+      npixels[cur_index] = (double)scan_cel_int(tokens[4]);
     }
-    cur_stddev = atof(current_token);
-
-
-    cur_index = cur_x + chip_dim_rows*(cur_y);
-    intensity[chip_num*rows + cur_index] = cur_stddev;
-    /* delete_tokens(cur_tokenset); */
-  }
-
-  fclose(currentFile);
-
-  if (i != rows){
-    return 1;
   }
 
-  return 0;
+  return status;
 }
 
 
-
-
 /************************************************************************
  **
- ** int read_cel_file_npixels(const char *filename, double *intensity, int chip_num, int rows, int cols)
- **
- ** const char *filename - the name of the cel file to read
- ** double *intensity  - the intensity matrix to fill
- ** int chip_num - the column of the intensity matrix that we will be filling
- ** int rows - dimension of intensity matrix
- ** int cols - dimension of intensity matrix
+ ** static int read_cel_file_cells_stream(FILE *currentFile, const char *filename, size_t chip_num, size_t rows, 
+ **                                       size_t chip_dim_rows, double *intensity, double *stddev, double *npixels)
  **
- ** returns 0 if successful, non zero if unsuccessful
+ ** FILE *currentFile - an open text CEL file (see open_cel_file)
  **
- ** This function reads from the specified file the cel stddev for that
- ** array and fills a column of the intensity matrix.
+ ** advances to the [INTENSITY] section and reads it with read_text_cel_cells(). 
+ ** On return the file is positioned just after the last cell line read.
  **
  ************************************************************************/
 
-static int read_cel_file_npixels(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
-#if USE_PTHREADS  
-  char *tmp_pointer;
-#endif  
-
-  size_t i, cur_x,cur_y,cur_index,cur_npixels;
+static int read_cel_file_cells_stream(FILE *currentFile, const char *filename, size_t chip_num, size_t rows, size_t chip_dim_rows, double *intensity, double *stddev, double *npixels){
 
-  FILE *currentFile; 
   char buffer[BUF_SIZE];
-  /* tokenset *cur_tokenset;*/
-  char *current_token;
+  text_cel_scanner scanner;
+  int status;
 
-  currentFile = open_cel_file(filename);
-  
   AdvanceToSection(currentFile,"[INTENSITY]",buffer);
   findStartsWith(currentFile,"CellHeader=",buffer);  
-  
-  for (i=0; i < rows; i++){
-    ReadFileLine(buffer, BUF_SIZE,  currentFile);
-    /* cur_tokenset = tokenize(buffer," \t");
-    cur_x = atoi(get_token(cur_tokenset,0));
-    cur_y = atoi(get_token(cur_tokenset,1));
-    cur_mean = atof(get_token(cur_tokenset,2)); */
-    
-    if (strlen(buffer) <=2){
-      Rprintf("Warning: found an empty line where not expected in %s.\n This means that there is a cel intensity missing from the cel file.\n Sucessfully read to cel intensity %d of %d expected\n", filename, i-1, i);
-      break;
-    }
-#if USE_PTHREADS
-    current_token = strtok_r(buffer," \t",&tmp_pointer);
-#else
-    current_token = strtok(buffer," \t");
-#endif
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
-    cur_x = atoi(current_token);
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif
 
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
-    
-    cur_y = atoi(current_token); 
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
-    
+  init_text_cel_scanner(&scanner, currentFile);
+  status = read_text_cel_cells(&scanner, filename, chip_num, rows, chip_dim_rows, intensity, stddev, npixels);
+  finish_text_cel_scanner(&scanner);
 
+  return status;
+}
 
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif  
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
 
-   
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif  
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
-    
-    cur_npixels = atoi(current_token);
-    
-    cur_index = cur_x + chip_dim_rows*(cur_y);
-    intensity[chip_num*rows + cur_index] = (double)cur_npixels;
-    /* delete_tokens(cur_tokenset); */
-  }
+/************************************************************************
+ **
+ ** static int read_cel_file_intensity_blocks(FILE *currentFile, const char *filename, size_t rows, 
+ **                                           size_t chip_dim_rows, generic_column_sink sink, void *arg)
+ **
+ ** as read_cel_file_intensities_stream() but each intensity is handed to 
+ ** sink rather than stored (see read_cel_handle_blocks())
+ **
+ ************************************************************************/
+
+static int read_cel_file_intensity_blocks(FILE *currentFile, const char *filename, size_t rows, size_t chip_dim_rows, generic_column_sink sink, void *arg){
+
+  char buffer[BUF_SIZE];
+  text_cel_scanner scanner;
+  int status;
+
+  AdvanceToSection(currentFile,"[INTENSITY]",buffer);
+  findStartsWith(currentFile,"CellHeader=",buffer);  
+
+  init_text_cel_scanner(&scanner, currentFile);
+  scanner.sink = sink;
+  scanner.sink_arg = arg;
+  status = read_text_cel_cells(&scanner, filename, 0, rows, chip_dim_rows, NULL, NULL, NULL);
+  finish_text_cel_scanner(&scanner);
+
+  return status;
+}
+
+
+/************************************************************************
+ **
+ ** int read_cel_file_intensities_stream(FILE *currentFile, const char *filename, double *intensity, int chip_num, int rows, int cols)
+ **
+ ** FILE *currentFile - an open text CEL file (see open_cel_file)
+ ** const char *filename - the name of the cel file to read
+ ** double *intensity  - the intensity matrix to fill
+ ** int chip_num - the column of the intensity matrix that we will be filling
+ ** int rows - dimension of intensity matrix
+ ** int cols - dimension of intensity matrix
+ **
+ ** returns 0 if successful, non zero if unsuccessful
+ **
+ ** This function reads from the specified file the cel intensities for that
+ ** array and fills a column of the intensity matrix.
+ **
+ ************************************************************************/
+
+static int read_cel_file_intensities_stream(FILE *currentFile, const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+
+  return read_cel_file_cells_stream(currentFile, filename, chip_num, rows, chip_dim_rows, intensity, NULL, NULL);
+}
+
+
+/************************************************************************
+ **
+ ** int read_cel_file_stddev_stream(FILE *currentFile, const char *filename, double *intensity, int chip_num, int rows, int cols)
+ **
+ ** FILE *currentFile - an open text CEL file (see open_cel_file)
+ ** const char *filename - the name of the cel file to read
+ ** double *intensity  - the intensity matrix to fill
+ ** int chip_num - the column of the intensity matrix that we will be filling
+ ** int rows - dimension of intensity matrix
+ ** int cols - dimension of intensity matrix
+ **
+ ** returns 0 if successful, non zero if unsuccessful
+ **
+ ** This function reads from the specified file the cel stddev for that
+ ** array and fills a column of the intensity matrix.
+ **
+ ************************************************************************/
+
+static int read_cel_file_stddev_stream(FILE *currentFile, const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+
+  return read_cel_file_cells_stream(currentFile, filename, chip_num, rows, chip_dim_rows, NULL, intensity, NULL);
+}
+
+
+/************************************************************************
+ **
+ ** int read_cel_file_npixels_stream(FILE *currentFile, const char *filename, double *intensity, int chip_num, int rows, int cols)
+ **
+ ** FILE *currentFile - an open text CEL file (see open_cel_file)
+ ** const char *filename - the name of the cel file to read
+ ** double *intensity  - the intensity matrix to fill
+ ** int chip_num - the column of the intensity matrix that we will be filling
+ ** int rows - dimension of intensity matrix
+ ** int cols - dimension of intensity matrix
+ **
+ ** returns 0 if successful, non zero if unsuccessful
+ **
+ ** This function reads from the specified file the cel stddev for that
+ ** array and fills a column of the intensity matrix.
+ **
+ ************************************************************************/
+
+static int read_cel_file_npixels_stream(FILE *currentFile, const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+
+  return read_cel_file_cells_stream(currentFile, filename, chip_num, rows, chip_dim_rows, NULL, NULL, intensity);
+}
+
+
+/***************************************************************
+ **
+ ** static int read_cel_file_all(const char *filename, double *intensity, double *stddev, double *npixels, 
+ **                              size_t n_cells, size_t chip_dim_rows)
+ **
+ ** reads intensity, stddev and npixels (any may be NULL) of a single text 
+ ** cel file in one pass. returns non zero if fewer than n_cells were read.
+ **
+ **************************************************************/
+
+static int read_cel_file_all(const char *filename, double *intensity, double *stddev, double *npixels, size_t n_cells, size_t chip_dim_rows){
 
+  FILE *currentFile;
+  int status;
+
+  currentFile = open_cel_file(filename);
+  status = read_cel_file_cells_stream(currentFile, filename, 0, n_cells, chip_dim_rows, intensity, stddev, npixels);
   fclose(currentFile);
-  
-  if (i != rows){
-    return 1;
-  }
 
-  return 0;
+  return status;
 }
 
 
@@ -956,11 +1331,11 @@ static int read_cel_file_npixels(const char *filename, double *intensity, size_t
 
 /****************************************************************
  **
- ** void apply_masks(const char *filename, double *intensity, int chip_num, 
+ ** void apply_masks_stream(FILE *currentFile, double *intensity, int chip_num, 
  **                   int rows, int cols,int chip_dim_rows, 
  **                   int rm_mask, int rm_outliers)
  **
- ** const char *filename    - name of file to open
+ ** FILE *currentFile - the open CEL file, anywhere before its [MASKS] section
  ** double *intensity - matrix of probe intensities
  ** int chip_num - the index 0 ...n-1 of the chip we are dealing with
  ** int rows - dimension of the intensity matrix
@@ -974,11 +1349,10 @@ static int read_cel_file_npixels(const char *filename, double *intensity, size_t
  **
  ****************************************************************/
 
-static void apply_masks(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
+static void apply_masks_stream(FILE *currentFile, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
   
   size_t i;
   size_t numcells, cur_x, cur_y, cur_index;
-  FILE *currentFile;
   char buffer[BUF_SIZE];
   tokenset *cur_tokenset;
 
@@ -987,7 +1361,6 @@ static void apply_masks(const char *filename, double *intensity, size_t chip_num
     return;
   }
   
-  currentFile = open_cel_file(filename);
   /* read masks section */
   if (rm_mask){
 
@@ -1035,7 +1408,6 @@ static void apply_masks(const char *filename, double *intensity, size_t chip_num
     }
   }
   
-  fclose(currentFile);
 
 }
 
@@ -1176,7 +1548,7 @@ static char *get_header_info(const char *filename, int *dim1, int *dim2){
       break;
     }
     if (i == (tokenset_size(cur_tokenset) - 1)){
-      error("Cel file %s does not seem to be have cdf information",filename);
+      reader_error("Cel file %s does not seem to be have cdf information",filename);
     }
   }
   delete_tokens(cur_tokenset);
@@ -1271,7 +1643,7 @@ static void get_detailed_header_info(const char *filename, detailed_header_info
       break;
     }
     if (i == (tokenset_size(cur_tokenset) - 1)){
-      error("Cel file %s does not seem to be have cdf information",filename);
+      reader_error("Cel file %s does not seem to be have cdf information",filename);
     }
   }
   delete_tokens(cur_tokenset);
@@ -1322,7 +1694,7 @@ static int isTextCelFile(const char *filename){
 
   currentFile = fopen(filename,mode);
   if (currentFile == NULL){
-    error("Could not open file %s", filename);
+    reader_error("Could not open file %s", filename);
   } else {
     /** check to see if first line is [CEL] so looks like a CEL file**/
     ReadFileLine(buffer, BUF_SIZE, currentFile);
@@ -1363,7 +1735,7 @@ static int isTextCelFile(const char *filename){
 
 static void ReadgzFileLine(char *buffer, int buffersize, gzFile currentFile){
   if (gzgets( currentFile,buffer, buffersize) == NULL){
-    error("End of gz file reached unexpectedly. Perhaps this file is truncated.\n");
+    reader_error("End of gz file reached unexpectedly. Perhaps this file is truncated.\n");
   }  
 }
 
@@ -1389,16 +1761,16 @@ static gzFile open_gz_cel_file(const char *filename){
   gzFile currentFile= NULL; 
   char buffer[BUF_SIZE];
 
-  currentFile = gzopen(filename,mode);
+  currentFile = gzopen_buffered(filename,mode);
   if (currentFile == NULL){
-     error("Could not open file %s", filename);
+     reader_error("Could not open file %s", filename);
   } else {
     /** check to see if first line is [CEL] so looks like a CEL file**/
     ReadgzFileLine(buffer, BUF_SIZE, currentFile);
     if (strncmp("[CEL]", buffer, 4) == 0) {
       gzrewind(currentFile);
     } else {
-      error("The file %s does not look like a CEL file",filename);
+      reader_error("The file %s does not look like a CEL file",filename);
     }
   }
   
@@ -1454,9 +1826,10 @@ static void gzAdvanceToSection(gzFile my_file,char *sectiontitle, char *buffer){
 
 /******************************************************************
  ** 
- ** int check_gzcel_file(const char *filename, char *ref_cdfName, int ref_dim_1, int ref_dim_2)
+ ** int check_gzcel_file_stream(gzFile currentFile, const char *filename, char *ref_cdfName, int ref_dim_1, int ref_dim_2)
  **
- ** const char *filename - the file to read
+ ** gzFile currentFile - the open CEL file, positioned before its [HEADER] section
+ ** const char *filename - the file being read
  ** char *ref_cdfName - the reference CDF filename
  ** int ref_dim_1 - 1st dimension of reference cel file
  ** int ref_dim_2 - 2nd dimension of reference cel file
@@ -1472,16 +1845,14 @@ static void gzAdvanceToSection(gzFile my_file,char *sectiontitle, char *buffer){
  **
  ******************************************************************/
 
-static int check_gzcel_file(const char *filename, const char *ref_cdfName, int ref_dim_1, int ref_dim_2){
+static int check_gzcel_file_stream(gzFile currentFile, const char *filename, const char *ref_cdfName, int ref_dim_1, int ref_dim_2){
 
   int i;
   int dim1,dim2;
 
-  gzFile currentFile; 
   char buffer[BUF_SIZE];
   tokenset *cur_tokenset;
 
-  currentFile = open_gz_cel_file(filename);
   
 
   gzAdvanceToSection(currentFile,"[HEADER]",buffer);
@@ -1495,7 +1866,7 @@ static int check_gzcel_file(const char *filename, const char *ref_cdfName, int r
   dim2 = atoi(get_token(cur_tokenset,1));
   delete_tokens(cur_tokenset);
   if ((dim1 != ref_dim_1) || (dim2 != ref_dim_2)){
-    error("Cel file %s does not seem to have the correct dimensions",filename);
+    reader_error("Cel file %s does not seem to have the correct dimensions",filename);
   }
   
   
@@ -1506,11 +1877,10 @@ static int check_gzcel_file(const char *filename, const char *ref_cdfName, int r
       break;
     }
     if (i == (tokenset_size(cur_tokenset) - 1)){
-      error("Cel file %s does not seem to be of %s type",filename,ref_cdfName);
+      reader_error("Cel file %s does not seem to be of %s type",filename,ref_cdfName);
     }
   }
   delete_tokens(cur_tokenset);
-  gzclose(currentFile);
 
   return 0;
 }
@@ -1519,106 +1889,58 @@ static int check_gzcel_file(const char *filename, const char *ref_cdfName, int r
 
 /************************************************************************
  **
- ** int read_gzcel_file_intensities(const char *filename, double *intensity, int chip_num, int rows, int cols)
- **
- ** const char *filename - the name of the cel file to read
- ** double *intensity  - the intensity matrix to fill
- ** int chip_num - the column of the intensity matrix that we will be filling
- ** int rows - dimension of intensity matrix
- ** int cols - dimension of intensity matrix
+ ** static int read_gzcel_file_cells_stream(gzFile currentFile, const char *filename, size_t chip_num, size_t rows, 
+ **                                         size_t chip_dim_rows, double *intensity, double *stddev, double *npixels)
  **
- ** returns 0 if successful, non zero if unsuccessful
+ ** gzFile currentFile - an open gzipped text CEL file (see open_gz_cel_file)
  **
- ** This function reads from the specified file the cel intensities for that
- ** array and fills a column of the intensity matrix.
+ ** as read_cel_file_cells_stream() but for gzipped text CEL files
  **
  ************************************************************************/
 
-static int read_gzcel_file_intensities(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
-#if USE_PTHREADS  
-  char *tmp_pointer;
-#endif  
-  
-  size_t i, cur_index;
-  int cur_x, cur_y;
-  double cur_mean;
-  gzFile currentFile; 
+static int read_gzcel_file_cells_stream(gzFile currentFile, const char *filename, size_t chip_num, size_t rows, size_t chip_dim_rows, double *intensity, double *stddev, double *npixels){
+
   char buffer[BUF_SIZE];
-  /* tokenset *cur_tokenset;*/
-  char *current_token;
+  text_cel_scanner scanner;
+  int status;
 
-  currentFile = open_gz_cel_file(filename);
-  
   gzAdvanceToSection(currentFile,"[INTENSITY]",buffer);
   gzfindStartsWith(currentFile,"CellHeader=",buffer);  
-  
-  for (i=0; i < rows; i++){
-    ReadgzFileLine(buffer, BUF_SIZE,  currentFile);
-    /* cur_tokenset = tokenize(buffer," \t");
-    cur_x = atoi(get_token(cur_tokenset,0));
-    cur_y = atoi(get_token(cur_tokenset,1));
-    cur_mean = atof(get_token(cur_tokenset,2)); */
-#if USE_PTHREADS
-    current_token = strtok_r(buffer," \t",&tmp_pointer);
-#else
-    current_token = strtok(buffer," \t");
-#endif
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
 
-    cur_x = atoi(current_token);
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
+  gzinit_text_cel_scanner(&scanner, currentFile);
+  status = read_text_cel_cells(&scanner, filename, chip_num, rows, chip_dim_rows, intensity, stddev, npixels);
+  finish_text_cel_scanner(&scanner);
 
-    cur_y = atoi(current_token);
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
- 
-    if (cur_x < 0 || cur_x >= chip_dim_rows){
-      error("It appears that the file %s is corrupted.",filename);
-      return 1;
-    }
-    if (cur_y < 0 || cur_y >= chip_dim_rows){
-      error("It appears that the file %s is corrupted.",filename);
-      return 1;
-    }
+  return status;
+}
 
-    cur_mean = atof(current_token);
 
-    cur_index = cur_x + chip_dim_rows*(cur_y);
-    intensity[chip_num*rows + cur_index] = cur_mean;
-    /* delete_tokens(cur_tokenset); */
-  }
+/* as read_cel_file_intensity_blocks() but for gzipped text CEL files */
 
-  gzclose(currentFile);
-  
-  if (i != rows){
-    return 1;
-  }
+static int read_gzcel_file_intensity_blocks(gzFile currentFile, const char *filename, size_t rows, size_t chip_dim_rows, generic_column_sink sink, void *arg){
 
-  return 0;
+  char buffer[BUF_SIZE];
+  text_cel_scanner scanner;
+  int status;
+
+  gzAdvanceToSection(currentFile,"[INTENSITY]",buffer);
+  gzfindStartsWith(currentFile,"CellHeader=",buffer);  
+
+  gzinit_text_cel_scanner(&scanner, currentFile);
+  scanner.sink = sink;
+  scanner.sink_arg = arg;
+  status = read_text_cel_cells(&scanner, filename, 0, rows, chip_dim_rows, NULL, NULL, NULL);
+  finish_text_cel_scanner(&scanner);
+
+  return status;
 }
 
+
 /************************************************************************
  **
- ** int read_gzcel_file_stddev(const char *filename, double *intensity, int chip_num, int rows, int cols)
+ ** int read_gzcel_file_intensities_stream(gzFile currentFile, const char *filename, double *intensity, int chip_num, int rows, int cols)
  **
+ ** gzFile currentFile - an open gzipped text CEL file (see open_gz_cel_file)
  ** const char *filename - the name of the cel file to read
  ** double *intensity  - the intensity matrix to fill
  ** int chip_num - the column of the intensity matrix that we will be filling
@@ -1632,98 +1954,41 @@ static int read_gzcel_file_intensities(const char *filename, double *intensity,
  **
  ************************************************************************/
 
-static int read_gzcel_file_stddev(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
-#if USE_PTHREADS  
-  char *tmp_pointer;
-#endif  
-  
-  size_t i, cur_x,cur_y,cur_index;
-  double cur_stddev;
-  gzFile currentFile; 
-  char buffer[BUF_SIZE];
-  /* tokenset *cur_tokenset;*/
-  char *current_token;
-
-  currentFile = open_gz_cel_file(filename);
-  
-  gzAdvanceToSection(currentFile,"[INTENSITY]",buffer);
-  gzfindStartsWith(currentFile,"CellHeader=",buffer);  
-  
-  for (i=0; i < rows; i++){
-    ReadgzFileLine(buffer, BUF_SIZE,  currentFile);
-    /* cur_tokenset = tokenize(buffer," \t");
-    cur_x = atoi(get_token(cur_tokenset,0));
-    cur_y = atoi(get_token(cur_tokenset,1));
-    cur_mean = atof(get_token(cur_tokenset,2)); */
-#if USE_PTHREADS
-    current_token = strtok_r(buffer," \t",&tmp_pointer);
-#else
-    current_token = strtok(buffer," \t");
-#endif
-    
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
-
-    cur_x = atoi(current_token);
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif
- 
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
-
-    cur_y = atoi(current_token);
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif
-
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
+static int read_gzcel_file_intensities_stream(gzFile currentFile, const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
 
+  return read_gzcel_file_cells_stream(currentFile, filename, chip_num, rows, chip_dim_rows, intensity, NULL, NULL);
+}
 
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif
-    
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
-
-    cur_stddev = atof(current_token);
-    
-    cur_index = cur_x + chip_dim_rows*(cur_y);
-    intensity[chip_num*rows + cur_index] = cur_stddev;
-    /* delete_tokens(cur_tokenset); */
-  }
 
-  gzclose(currentFile);
-  
-  if (i != rows){
-    return 1;
-  }
+/************************************************************************
+ **
+ ** int read_gzcel_file_stddev_stream(gzFile currentFile, const char *filename, double *intensity, int chip_num, int rows, int cols)
+ **
+ ** gzFile currentFile - an open gzipped text CEL file (see open_gz_cel_file)
+ ** const char *filename - the name of the cel file to read
+ ** double *intensity  - the intensity matrix to fill
+ ** int chip_num - the column of the intensity matrix that we will be filling
+ ** int rows - dimension of intensity matrix
+ ** int cols - dimension of intensity matrix
+ **
+ ** returns 0 if successful, non zero if unsuccessful
+ **
+ ** This function reads from the specified file the cel stddev for that
+ ** array and fills a column of the intensity matrix.
+ **
+ ************************************************************************/
 
+static int read_gzcel_file_stddev_stream(gzFile currentFile, const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
 
-  return 0;
+  return read_gzcel_file_cells_stream(currentFile, filename, chip_num, rows, chip_dim_rows, NULL, intensity, NULL);
 }
 
 
 /************************************************************************
  **
- ** int read_gzcel_file_npixels(const char *filename, double *intensity, int chip_num, int rows, int cols)
+ ** int read_gzcel_file_npixels_stream(gzFile currentFile, const char *filename, double *intensity, int chip_num, int rows, int cols)
  **
+ ** gzFile currentFile - an open gzipped text CEL file (see open_gz_cel_file)
  ** const char *filename - the name of the cel file to read
  ** double *intensity  - the intensity matrix to fill
  ** int chip_num - the column of the intensity matrix that we will be filling
@@ -1737,105 +2002,42 @@ static int read_gzcel_file_stddev(const char *filename, double *intensity, size_
  **
  ************************************************************************/
 
-static int read_gzcel_file_npixels(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
-#if USE_PTHREADS  
-  char *tmp_pointer;
-#endif  
+static int read_gzcel_file_npixels_stream(gzFile currentFile, const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
 
-  size_t i, cur_x,cur_y,cur_index,cur_npixels;
+  return read_gzcel_file_cells_stream(currentFile, filename, chip_num, rows, chip_dim_rows, NULL, NULL, intensity);
+}
 
-  gzFile currentFile; 
-  char buffer[BUF_SIZE];
-  /* tokenset *cur_tokenset;*/
-  char *current_token;
-
-  currentFile = open_gz_cel_file(filename);
-  
-  gzAdvanceToSection(currentFile,"[INTENSITY]",buffer);
-  gzfindStartsWith(currentFile,"CellHeader=",buffer);  
-  
-  for (i=0; i < rows; i++){
-    ReadgzFileLine(buffer, BUF_SIZE,  currentFile);
-    /* cur_tokenset = tokenize(buffer," \t");
-    cur_x = atoi(get_token(cur_tokenset,0));
-    cur_y = atoi(get_token(cur_tokenset,1));
-    cur_mean = atof(get_token(cur_tokenset,2)); */
-#if USE_PTHREADS
-    current_token = strtok_r(buffer," \t",&tmp_pointer);
-#else
-    current_token = strtok(buffer," \t");
-#endif
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
-    cur_x = atoi(current_token);
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif
-
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
-    cur_y = atoi(current_token);
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif
-
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
 
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
+/***************************************************************
+ **
+ ** static int read_gzcel_file_all(const char *filename, double *intensity, double *stddev, double *npixels, 
+ **                                size_t n_cells, size_t chip_dim_rows)
+ **
+ ** as read_cel_file_all() but for gzipped text CEL files
+ **
+ **************************************************************/
 
-#if USE_PTHREADS
-    current_token = strtok_r(NULL," \t",&tmp_pointer);
-#else
-    current_token = strtok(NULL," \t");
-#endif
-    if (current_token == NULL){
-      Rprintf("Warning: found an incomplete line where not expected in %s.\nThe CEL file may be truncated. \nSucessfully read to cel intensity %d of %d expected\n", filename, i-1, rows);
-      break;
-    }
-    cur_npixels = atoi(current_token);
+static int read_gzcel_file_all(const char *filename, double *intensity, double *stddev, double *npixels, size_t n_cells, size_t chip_dim_rows){
 
-    cur_index = cur_x + chip_dim_rows*(cur_y);
-    intensity[chip_num*rows + cur_index] = (double)cur_npixels;
-    /* delete_tokens(cur_tokenset); */
-  }
+  gzFile currentFile;
+  int status;
 
+  currentFile = open_gz_cel_file(filename);
+  status = read_gzcel_file_cells_stream(currentFile, filename, 0, n_cells, chip_dim_rows, intensity, stddev, npixels);
   gzclose(currentFile);
-  
-  if (i != rows){
-    return 1;
-  }
 
-  return 0;
+  return status;
 }
 
 
 
 /****************************************************************
  **
- ** void gz_apply_masks(const char *filename, double *intensity, int chip_num, 
+ ** void gz_apply_masks_stream(gzFile currentFile, double *intensity, int chip_num, 
  **                   int rows, int cols,int chip_dim_rows, 
  **                   int rm_mask, int rm_outliers)
  **
- ** const char *filename    - name of file to open
+ ** gzFile currentFile - the open CEL file, anywhere before its [MASKS] section
  ** double *intensity - matrix of probe intensities
  ** int chip_num - the index 0 ...n-1 of the chip we are dealing with
  ** int rows - dimension of the intensity matrix
@@ -1849,11 +2051,10 @@ static int read_gzcel_file_npixels(const char *filename, double *intensity, size
  **
  ****************************************************************/
 
-static void gz_apply_masks(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
+static void gz_apply_masks_stream(gzFile currentFile, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
   
   size_t i;
   size_t numcells, cur_x, cur_y, cur_index;
-  gzFile currentFile;
   char buffer[BUF_SIZE];
   tokenset *cur_tokenset;
 
@@ -1862,7 +2063,6 @@ static void gz_apply_masks(const char *filename, double *intensity, size_t chip_
     return;
   }
   
-  currentFile = open_gz_cel_file(filename);
   /* read masks section */
   if (rm_mask){
 
@@ -1910,7 +2110,6 @@ static void gz_apply_masks(const char *filename, double *intensity, size_t chip_
     }
   }
   
-  gzclose(currentFile);
 
 }
 
@@ -1965,7 +2164,7 @@ static char *gz_get_header_info(const char *filename, int *dim1, int *dim2){
       break;
     }
     if (i == (tokenset_size(cur_tokenset) - 1)){
-      error("Cel file %s does not seem to be have cdf information",filename);
+      reader_error("Cel file %s does not seem to be have cdf information",filename);
     }
   }
   delete_tokens(cur_tokenset);
@@ -2062,7 +2261,7 @@ static void gz_get_detailed_header_info(const char *filename, detailed_header_in
       break;
     }
     if (i == (tokenset_size(cur_tokenset) - 1)){
-      error("Cel file %s does not seem to be have cdf information",filename);
+      reader_error("Cel file %s does not seem to be have cdf information",filename);
     }
   }
   delete_tokens(cur_tokenset);
@@ -2201,7 +2400,7 @@ static int isgzTextCelFile(const char *filename){
  char buffer[BUF_SIZE];
  currentFile = gzopen(filename,mode);
  if (currentFile == NULL){
-   error("Could not open file %s", filename);
+   reader_error("Could not open file %s", filename);
  } else {
    /** check to see if first line is [CEL] so looks like a CEL file**/
    ReadgzFileLine(buffer, BUF_SIZE, currentFile);
@@ -2255,52 +2454,184 @@ static int CountCDFProbes(SEXP cdfInfo){
 
 /*************************************************************************
  **
- ** static void  storeIntensities(double *CurintensityMatrix,double *pmMatrix,
- **                               double *mmMatrix, int curcol ,int rows,int cols,
- **                               int chip_dim_rows,SEXP cdfInfo)
+ ** A probe_gather_plan is cdfInfo flattened, once per call, into the 0 based
+ ** cell index of each PM and MM probe in output row order. Building it uses 
+ ** the R API so it is done on the main thread; after that the threads only
+ ** need the plan. A missing (NA) index is stored as -1 and gives NA.
  **
- ** double *CurintensityMatrix 
+ ** The plan also holds the inverse of this, for each cell of the chip the 
+ ** output rows it goes to, so that a CEL file can be scattered straight into
+ ** the PM and MM matrices as it is decoded rather than first being read 
+ ** into a whole chip buffer. The rows of cell c are cell_rows[cell_start[c]] 
+ ** to cell_rows[cell_start[c+1] - 1], each stored as 2*row for a PM probe 
+ ** and 2*row + 1 for an MM probe. Only the probes wanted (which) are included.
  **
+ ** build_gather_plan() - flatten cdfInfo (a list of matrices, PM indices in
+ **                       the first column, MM in the second)
+ ** free_gather_plan()  - free the index arrays
  **
  *************************************************************************/
 
-static void storeIntensities(double *CurintensityMatrix, double *pmMatrix, double *mmMatrix, size_t curcol, size_t rows, size_t cols, size_t tot_n_probes, SEXP cdfInfo, int which){
-  
-  size_t i = 0,j=0, currow=0;
-#ifndef USE_PTHREADS
-  int n_probes=0;
+typedef struct probe_gather_plan{
+  size_t n_probes;
+  int *pm_index;
+  int *mm_index;
+  size_t n_cells;
+  int *cell_start;
+  int *cell_rows;
+} probe_gather_plan;
+
+
+static int gather_plan_index(double index, size_t n_cells){
+
+  if (ISNAN(index) || index < 1 || index > (double)n_cells){
+    return -1;
+  }
+  return (int)index - 1;
+}
+
+
+/* the inverse of pm_index and mm_index, built with a counting sort on cell */
+
+static void build_scatter_index(probe_gather_plan *plan, int which){
+
+  size_t c, k;
+  int *next;
+
+  plan->cell_start = Calloc(plan->n_cells + 1, int);
+  for (k=0; k < plan->n_probes; k++){
+    if (which >= 0 && plan->pm_index[k] >= 0){
+      plan->cell_start[plan->pm_index[k] + 1]++;
+    }
+    if (which <= 0 && plan->mm_index[k] >= 0){
+      plan->cell_start[plan->mm_index[k] + 1]++;
+    }
+  }
+  for (c=0; c < plan->n_cells; c++){
+    plan->cell_start[c + 1] += plan->cell_start[c];
+  }
+
+  plan->cell_rows = Calloc(plan->cell_start[plan->n_cells] + 1, int);
+  next = Calloc(plan->n_cells + 1, int);
+  memcpy(next, plan->cell_start, (plan->n_cells + 1)*sizeof(int));
+  for (k=0; k < plan->n_probes; k++){
+    if (which >= 0 && plan->pm_index[k] >= 0){
+      plan->cell_rows[next[plan->pm_index[k]]++] = 2*(int)k;
+    }
+    if (which <= 0 && plan->mm_index[k] >= 0){
+      plan->cell_rows[next[plan->mm_index[k]]++] = 2*(int)k + 1;
+    }
+  }
+  Free(next);
+}
+
+
+static void build_gather_plan(SEXP cdfInfo, size_t n_cells, int which, probe_gather_plan *plan){
+
+  int i, j, n_probes, n_cols;
   int n_probesets = GET_LENGTH(cdfInfo);
+  size_t currow = 0;
   double *cur_index;
-
   SEXP curIndices;
-#endif
 
-  for (i=0; i < n_probesets; i++){    
-#ifdef USE_PTHREADS
-    for (j=0; j < n_probes[i]; j++){
-      if (which >= 0){
-	pmMatrix[curcol*tot_n_probes + currow] =  CurintensityMatrix[(int)cur_indexes[i][j] - 1]; 
-      }
-      if (which <= 0){
-	mmMatrix[curcol*tot_n_probes + currow] =  CurintensityMatrix[(int)cur_indexes[i][j+n_probes[i]] - 1];
-      }
+  plan->n_probes = (size_t)CountCDFProbes(cdfInfo);
+  plan->pm_index = Calloc(plan->n_probes + 1, int);
+  plan->mm_index = Calloc(plan->n_probes + 1, int);
+  plan->n_cells = n_cells;
+
+  for (i=0; i < n_probesets; i++){
+    PROTECT(curIndices = AS_NUMERIC(VECTOR_ELT(cdfInfo,i)));
+    n_probes = INTEGER(getAttrib(VECTOR_ELT(cdfInfo,i),R_DimSymbol))[0];
+    n_cols = INTEGER(getAttrib(VECTOR_ELT(cdfInfo,i),R_DimSymbol))[1];
+    cur_index = NUMERIC_POINTER(curIndices);
+    for (j=0; j < n_probes; j++){
+      plan->pm_index[currow] = gather_plan_index(cur_index[j], n_cells);
+      plan->mm_index[currow] = (n_cols > 1) ? gather_plan_index(cur_index[j + n_probes], n_cells) : -1;
       currow++;
     }
-#else
-    curIndices = VECTOR_ELT(cdfInfo,i);
-    n_probes = INTEGER(getAttrib(curIndices,R_DimSymbol))[0];
-    cur_index = NUMERIC_POINTER(AS_NUMERIC(curIndices));
+    UNPROTECT(1);
+  }
 
-    for (j=0; j < n_probes; j++){
-      if (which >= 0){
-	pmMatrix[curcol*tot_n_probes + currow] =  CurintensityMatrix[(int)cur_index[j] - 1]; 
+  build_scatter_index(plan, which);
+}
+
+
+static void free_gather_plan(probe_gather_plan *plan){
+  Free(plan->pm_index);
+  Free(plan->mm_index);
+  Free(plan->cell_start);
+  Free(plan->cell_rows);
+  plan->n_probes = 0;
+  plan->n_cells = 0;
+}
+
+
+/*************************************************************************
+ **
+ ** A probe_scatter is where the probes of one CEL file go: a column of 
+ ** each of the PM and MM matrices (index 0 PM, 1 MM), either double or
+ ** single precision. A matrix that is not wanted is NULL.
+ **
+ ** init_probe_scatter() - point at column curcol and set all its rows
+ **                        to NA. Rows of missing probes, and of any cells
+ **                        a short file never delivers, stay NA
+ ** scatter_probes()     - a generic_column_sink, stores each cell in the
+ **                        rows the plan gives for it
+ **
+ *************************************************************************/
+
+typedef struct{
+  const probe_gather_plan *plan;
+  double *output[2];
+  float *output32[2];
+} probe_scatter;
+
+
+static void init_probe_scatter(probe_scatter *scatter, double *pmMatrix, double *mmMatrix, float *pmFloat32, float *mmFloat32, size_t curcol, const probe_gather_plan *plan, int which){
+
+  size_t k;
+  size_t n_probes = plan->n_probes;
+  int j;
+
+  scatter->plan = plan;
+  scatter->output[0] = (which >= 0 && pmMatrix != NULL) ? pmMatrix + curcol*n_probes : NULL;
+  scatter->output[1] = (which <= 0 && mmMatrix != NULL) ? mmMatrix + curcol*n_probes : NULL;
+  scatter->output32[0] = (which >= 0 && pmFloat32 != NULL) ? pmFloat32 + curcol*n_probes : NULL;
+  scatter->output32[1] = (which <= 0 && mmFloat32 != NULL) ? mmFloat32 + curcol*n_probes : NULL;
+
+  for (j=0; j < 2; j++){
+    for (k=0; k < n_probes; k++){
+      if (scatter->output[j] != NULL){
+	scatter->output[j][k] = NA_REAL;
       }
-      if (which <= 0){
-	mmMatrix[curcol*tot_n_probes + currow] =  CurintensityMatrix[(int)cur_index[j+n_probes] - 1];	
+      if (scatter->output32[j] != NULL){
+	scatter->output32[j][k] = float32_from_double(NA_REAL);
+      }
+    }
+  }
+}
+
+
+static void scatter_probes(const double *values, size_t first_cell, size_t n_cells, void *arg){
+
+  probe_scatter *scatter = (probe_scatter *)arg;
+  const probe_gather_plan *plan = scatter->plan;
+  size_t k, cell;
+  int j, target;
+
+  for (k=0; k < n_cells; k++){
+    cell = first_cell + k;
+    if (cell >= plan->n_cells){
+      break;
+    }
+    for (j = plan->cell_start[cell]; j < plan->cell_start[cell + 1]; j++){
+      target = plan->cell_rows[j];
+      if (scatter->output32[target & 1] != NULL){
+	scatter->output32[target & 1][target >> 1] = float32_from_double(values[k]);
+      } else {
+	scatter->output[target & 1][target >> 1] = values[k];
       }
-      currow++;
     }
-#endif
   }
 }
 
@@ -2377,7 +2708,7 @@ static int isBinaryCelFile(const char *filename){
   
   if ((infile = fopen(filename, "rb")) == NULL)
     {
-      error("Unable to open the file %s",filename);
+      reader_error("Unable to open the file %s",filename);
       return 0;
     }
   
@@ -2429,48 +2760,40 @@ static void delete_binary_header(binary_header *my_header){
 
 /*************************************************************
  **
- ** static binary_header *read_binary_header(const char *filename, int return_stream, FILE *infile)
+ ** static binary_header *read_binary_header_stream(FILE *infile, const char *filename)
  **
- ** const char *filename - name of binary cel file
- ** int return_stream - if 1 return the stream as part of the header, otherwise close the
- **              file at end of function.
+ ** FILE *infile - the open binary cel file, positioned at its start
+ ** const char *filename - name of binary cel file (for error messages)
+ **
+ ** reads the header. On return the stream (also stored in the header)
+ ** is positioned at the start of the cell records.
  **
  *************************************************************/
 
-static binary_header *read_binary_header(const char *filename, int return_stream){  /* , FILE *infile){ */
+static binary_header *read_binary_header_stream(FILE *infile, const char *filename){
   
-  FILE *infile;
 
   binary_header *this_header = Calloc(1,binary_header);
   
   /* Pass through all the header information */
   
-  if ((infile = fopen(filename, "rb")) == NULL)
-    {
-      error("Unable to open the file %s\n",filename);
-      return 0;
-    }
   
   if (!fread_int32(&(this_header->magic_number),1,infile)){
-    error("The binary file %s does not have the appropriate magic number\n",filename);
-    fclose(infile);
+    reader_error("The binary file %s does not have the appropriate magic number\n",filename);
     return 0;
   }
   
   if (this_header->magic_number != 64){
-    error("The binary file %s does not have the appropriate magic number\n",filename);
-    fclose(infile);
+    reader_error("The binary file %s does not have the appropriate magic number\n",filename);
     return 0;
   }
   
   if (!fread_int32(&(this_header->version_number),1,infile)){
-    fclose(infile);
     return 0;
   }
 
   if (this_header->version_number != 4){
-    error("The binary file %s is not version 4. Cannot read\n",filename);
-    fclose(infile);
+    reader_error("The binary file %s is not version 4. Cannot read\n",filename);
     return 0;
   }
 
@@ -2481,77 +2804,73 @@ static binary_header *read_binary_header(const char *filename, int return_stream
   /** We follow FUSION here (in the past we followed the DOCS **/
 
   if (!fread_int32(&(this_header->rows),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
   
   
   if (!fread_int32(&(this_header->cols),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
     return 0;
   }
   
 
   if (!fread_int32(&(this_header->n_cells),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
   
   if (this_header->n_cells != (this_header->cols)*(this_header->rows)){
-    error("The number of cells does not seem to be equal to cols*rows in %s.\n",filename);
+    reader_error("The number of cells does not seem to be equal to cols*rows in %s.\n",filename);
   }
 
   
   if (!fread_int32(&(this_header->header_len),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
 
   this_header->header = Calloc(this_header->header_len+1,char);
   
   if (!fread(this_header->header,sizeof(char),this_header->header_len,infile)){
-    error("binary file corrupted? Could not read any further.\n");
+    reader_error("binary file corrupted? Could not read any further.\n");
   }
   
   if (!fread_int32(&(this_header->alg_len),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
   
   this_header->algorithm = Calloc(this_header->alg_len+1,char);
   
   if (!fread_char(this_header->algorithm,this_header->alg_len,infile)){
-    error("binary file corrupted? Could not read any further.\n");
+    reader_error("binary file corrupted? Could not read any further.\n");
   }
   
   if (!fread_int32(&(this_header->alg_param_len),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
   
   this_header->alg_param = Calloc(this_header->alg_param_len+1,char);
   
   if (!fread_char(this_header->alg_param,this_header->alg_param_len,infile)){
-    error("binary file corrupted? Could not read any further.\n");
+    reader_error("binary file corrupted? Could not read any further.\n");
   }
     
   if (!fread_int32(&(this_header->celmargin),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
   
   if (!fread_uint32(&(this_header->n_outliers),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
   
   if (!fread_uint32(&(this_header->n_masks),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
 
   if (!fread_int32(&(this_header->n_subgrids),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   } 
 
 
-  if (!return_stream){
-    fclose(infile);
-  } else {
-    this_header->infile = infile;
-  }
+  this_header->infile = infile;
   
   
   return this_header;
@@ -2561,6 +2880,38 @@ static binary_header *read_binary_header(const char *filename, int return_stream
 
 }
 
+
+/*************************************************************
+ **
+ ** static binary_header *read_binary_header(const char *filename, int return_stream)
+ **
+ ** const char *filename - name of binary cel file
+ ** int return_stream - if 1 return the stream as part of the header, otherwise close the
+ **              file at end of function.
+ **
+ *************************************************************/
+
+static binary_header *read_binary_header(const char *filename, int return_stream){
+  
+  FILE *infile;
+
+  binary_header *this_header;
+  
+  if ((infile = fopen(filename, "rb")) == NULL)
+    {
+      reader_error("Unable to open the file %s\n",filename);
+      return 0;
+    }
+
+  this_header = read_binary_header_stream(infile, filename);
+
+  if (!return_stream || this_header == NULL){
+    fclose(infile);
+  }
+
+  return this_header;
+}
+
 /*************************************************************
  **
  ** static char *binary_get_header_info(const char *filename, int *dim1, int *dim2)
@@ -2600,7 +2951,7 @@ static char *binary_get_header_info(const char *filename, int *dim1, int *dim2){
       break;
     }
     if (i == (tokenset_size(my_tokenset) - 1)){
-      error("Cel file %s does not seem to be have cdf information",filename);
+      reader_error("Cel file %s does not seem to be have cdf information",filename);
     }
   }
   
@@ -2741,7 +3092,7 @@ static void binary_get_detailed_header_info(const char *filename, detailed_heade
       break;
     }
     if (i == (tokenset_size(my_tokenset) - 1)){
-      error("Cel file %s does not seem to be have cdf information",filename);
+      reader_error("Cel file %s does not seem to be have cdf information",filename);
     }
   }
    
@@ -2769,14 +3120,14 @@ static void binary_get_detailed_header_info(const char *filename, detailed_heade
 
 /***************************************************************
  **
- ** static int check_binary_cel_file(const char *filename, char *ref_cdfName, int ref_dim_1, int ref_dim_2)
+ ** static int check_binary_cel_header(binary_header *my_header, const char *filename, const char *ref_cdfName, int ref_dim_1, int ref_dim_2)
  ** 
- ** This function checks a binary cel file to see if it has the 
+ ** This function checks the header of a binary cel file to see if it has the 
  ** expected rows, cols and cdfname
  **
  **************************************************************/
 
-static int check_binary_cel_file(const char *filename, const char *ref_cdfName, int ref_dim_1, int ref_dim_2){
+static int check_binary_cel_header(binary_header *my_header, const char *filename, const char *ref_cdfName, int ref_dim_1, int ref_dim_2){
 
 
 
@@ -2785,13 +3136,9 @@ static int check_binary_cel_file(const char *filename, const char *ref_cdfName,
 
   int i = 0,endpos;
   
-  binary_header *my_header;
-
-
-  my_header = read_binary_header(filename,0);  
 
   if ((my_header->cols != ref_dim_1) || (my_header->rows != ref_dim_2)){
-    error("Cel file %s does not seem to have the correct dimensions",filename);
+    reader_error("Cel file %s does not seem to have the correct dimensions",filename);
   }
   
   my_tokenset = tokenize(my_header->header," ");
@@ -2811,16 +3158,15 @@ static int check_binary_cel_file(const char *filename, const char *ref_cdfName,
       break;
     }
     if (i == (tokenset_size(my_tokenset) - 1)){
-      error("Cel file %s does not seem to be have cdf information",filename);
+      reader_error("Cel file %s does not seem to be have cdf information",filename);
     }
   }
 
   if (strncasecmp(cdfName,ref_cdfName,strlen(ref_cdfName)) != 0){
-    error("Cel file %s does not seem to be of %s type",filename,ref_cdfName);
+    reader_error("Cel file %s does not seem to be of %s type",filename,ref_cdfName);
   }
 
   
-  delete_binary_header(my_header);
   delete_tokens(my_tokenset);
   Free(cdfName);
 
@@ -2833,188 +3179,271 @@ static int check_binary_cel_file(const char *filename, const char *ref_cdfName,
 
 /***************************************************************
  **
- ** static int read_binarycel_file_intensities(const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows)
+ ** Bulk decoding of the cell records of a binary CEL file.
  **
- ** 
- ** This function reads binary cel file intensities into the data matrix
+ ** Each cell is stored as a packed little endian 10 byte record
+ ** (float intensity, float stddev, short npixels), rows then cols,
+ ** so record k belongs at position k of the chip's column. Rather
+ ** than three fread calls per cell the records are read a block at
+ ** a time and decoded from the buffer.
  **
  **************************************************************/
 
-static int read_binarycel_file_intensities(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+#define BINARY_CEL_RECORD_SIZE 10
+#define BINARY_CEL_RECORD_BLOCK 16384
 
-  size_t i=0, j=0;
-  size_t cur_index;
-  
-  int fread_err=0;
 
+static float binary_cel_float32(const unsigned char *bytes){
 
-  celintens_record *cur_intensity = Calloc(1,celintens_record);
-  binary_header *my_header;
+  unsigned int bits;
+  float value;
 
-  my_header = read_binary_header(filename,1);
-  
-  for (i = 0; i < my_header->rows; i++){
-    for (j =0; j < my_header->cols; j++){
-      cur_index = j + my_header->cols*i; /* i + my_header->rows*j; */
-      fread_err = fread_float32(&(cur_intensity->cur_intens),1,my_header->infile);
-      fread_err+= fread_float32(&(cur_intensity->cur_sd),1,my_header->infile);
-      fread_err+=fread_int16(&(cur_intensity->npixels),1,my_header->infile);
-      if (fread_err < 3){
-	fclose(my_header->infile);
-	delete_binary_header(my_header);
-	Free(cur_intensity);
-	return 1;
-      }
-      if (cur_intensity->cur_intens < 0 || cur_intensity->cur_intens > 65536 || isnan(cur_intensity->cur_intens)){
-	fclose(my_header->infile);
-	delete_binary_header(my_header);
-	Free(cur_intensity);
-	return 1;
-      }
-      fread_err=0;
-      intensity[chip_num*my_header->n_cells + cur_index] = (double )cur_intensity->cur_intens;
-    }
-  }
-  
-  fclose(my_header->infile);
-  delete_binary_header(my_header);
-  Free(cur_intensity);
-  return(0);
+  bits = (unsigned int)bytes[0] | ((unsigned int)bytes[1] << 8) | ((unsigned int)bytes[2] << 16) | ((unsigned int)bytes[3] << 24);
+  memcpy(&value, &bits, sizeof(float));
+  return value;
 }
 
 
-
-
 /***************************************************************
  **
- ** static int read_binarycel_file_stdev(const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows)
+ ** static int decode_binarycel_records(const unsigned char *buffer, size_t n_records, size_t first,
+ **                                     double *intensity, double *stddev, double *npixels)
  **
- ** 
- ** This function reads binary cel file stddev values into the data matrix
+ ** const unsigned char *buffer - n_records packed cell records
+ ** size_t first - where in the output arrays the first record goes
+ ** double *intensity, *stddev, *npixels - where to store each quantity. 
+ **                     Any of these may be NULL in which case it is skipped
+ **
+ ** returns 1 if an intensity is negative, greater than 65536 or NaN 
+ ** (the file is then most likely corrupted), otherwise 0. Intensities 
+ ** are only checked when they are being stored.
  **
  **************************************************************/
 
-static int read_binarycel_file_stddev(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
-
-  size_t i=0, j=0;
-  size_t cur_index;
-
-  int fread_err=0;
-  
-  celintens_record *cur_intensity = Calloc(1,celintens_record);
-  binary_header *my_header;
+static int decode_binarycel_records(const unsigned char *buffer, size_t n_records, size_t first, double *intensity, double *stddev, double *npixels){
 
-  my_header = read_binary_header(filename,1);
+  size_t k;
+  float cur_intens;
+  const unsigned char *record;
   
-  for (i = 0; i < my_header->rows; i++){
-    for (j =0; j < my_header->cols; j++){
-      cur_index = j + my_header->cols*i; /* i + my_header->rows*j; */
-      fread_err = fread_float32(&(cur_intensity->cur_intens),1,my_header->infile);
-      fread_err+= fread_float32(&(cur_intensity->cur_sd),1,my_header->infile);
-      fread_err+= fread_int16(&(cur_intensity->npixels),1,my_header->infile);
-      if (fread_err < 3){
-	fclose(my_header->infile);
-	delete_binary_header(my_header);
-	Free(cur_intensity);
+  if (intensity != NULL){
+    for (k = 0, record = buffer; k < n_records; k++, record += BINARY_CEL_RECORD_SIZE){
+      cur_intens = binary_cel_float32(record);
+      if (cur_intens < 0 || cur_intens > 65536 || isnan(cur_intens)){
 	return 1;
       }
-      fread_err=0;
-      intensity[chip_num*my_header->n_cells + cur_index] = (double )cur_intensity->cur_sd;
+      intensity[first + k] = (double)cur_intens;
     }
   }
-  
-  fclose(my_header->infile);
-  delete_binary_header(my_header);
-  Free(cur_intensity);
-  return(0);
+  if (stddev != NULL){
+    for (k = 0, record = buffer + 4; k < n_records; k++, record += BINARY_CEL_RECORD_SIZE){
+      stddev[first + k] = (double)binary_cel_float32(record);
+    }
+  }
+  if (npixels != NULL){
+    for (k = 0, record = buffer + 8; k < n_records; k++, record += BINARY_CEL_RECORD_SIZE){
+      npixels[first + k] = (double)(short)(record[0] | (record[1] << 8));
+    }
+  }
+  return 0;
 }
 
 
-
-
 /***************************************************************
  **
- ** static int read_binarycel_file_npixels(const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows)
+ ** static int read_binarycel_records_stream(binary_header *my_header, size_t chip_num, 
+ **                                          double *intensity, double *stddev, double *npixels)
  **
- ** 
- ** This function reads binary cel file npixels values into the data matrix
+ ** binary_header *my_header - header of an open binary CEL file, positioned at the start of the cell records
+ ** size_t chip_num - the column of the matrices to fill
+ ** double *intensity, *stddev, *npixels - matrices to fill (any may be NULL)
+ **
+ ** reads all the cell records in a single pass. returns 1 if the file 
+ ** is truncated or corrupted, 0 otherwise.
  **
  **************************************************************/
 
-static int read_binarycel_file_npixels(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+static int read_binarycel_records_stream(binary_header *my_header, size_t chip_num, double *intensity, double *stddev, double *npixels){
 
-  size_t i=0, j=0;
-  size_t cur_index;
+  size_t n_cells = (size_t)my_header->n_cells;
+  size_t first = chip_num*n_cells;
+  size_t done, n_block;
+  int status = 0;
 
-  int fread_err=0;
- 
-  celintens_record *cur_intensity = Calloc(1,celintens_record);
-  binary_header *my_header;
+  unsigned char *buffer = Calloc(BINARY_CEL_RECORD_BLOCK*BINARY_CEL_RECORD_SIZE, unsigned char);
 
-  my_header = read_binary_header(filename,1);
-  
-  for (i = 0; i < my_header->rows; i++){
-    for (j =0; j < my_header->cols; j++){
-      cur_index = j + my_header->cols*i; /* i + my_header->rows*j; */
-      fread_err = fread_float32(&(cur_intensity->cur_intens),1,my_header->infile);
-      fread_err+= fread_float32(&(cur_intensity->cur_sd),1,my_header->infile);
-      fread_err+= fread_int16(&(cur_intensity->npixels),1,my_header->infile);  
-      if (fread_err < 3){
-	fclose(my_header->infile);
-	delete_binary_header(my_header);
-	Free(cur_intensity);
-	return 1;
-      }
-      fread_err=0;
-      intensity[chip_num*my_header->n_cells + cur_index] = (double )cur_intensity->npixels;
+  for (done = 0; done < n_cells; done += n_block){
+    n_block = n_cells - done;
+    if (n_block > BINARY_CEL_RECORD_BLOCK){
+      n_block = BINARY_CEL_RECORD_BLOCK;
+    }
+    if (fread(buffer, BINARY_CEL_RECORD_SIZE, n_block, my_header->infile) != n_block){
+      status = 1;
+      break;
+    }
+    if (decode_binarycel_records(buffer, n_block, first + done, intensity, stddev, npixels)){
+      status = 1;
+      break;
     }
   }
-  
-  fclose(my_header->infile);
-  delete_binary_header(my_header);
-  Free(cur_intensity);
-  return(0);
-}
-
-
 
+  Free(buffer);
+  return status;
+}
 
 
+/***************************************************************
+ **
+ ** static int decode_binarycel_mapped(const mapped_file *map, long offset, size_t n_cells, size_t chip_num, 
+ **                                    double *intensity, double *stddev, double *npixels)
+ **
+ ** const mapped_file *map - a binary CEL file mapped into memory
+ ** long offset - where in the file the cell records start
+ **
+ ** as read_binarycel_records_stream() but decoding the cell records 
+ ** directly from the mapped file.
+ **
+ **************************************************************/
 
+static int decode_binarycel_mapped(const mapped_file *map, long offset, size_t n_cells, size_t chip_num, double *intensity, double *stddev, double *npixels){
 
+  size_t n_available = 0;
 
+  if (offset >= 0 && (size_t)offset < map->size){
+    n_available = (map->size - (size_t)offset)/BINARY_CEL_RECORD_SIZE;
+  }
+  if (n_available < n_cells){
+    return 1;
+  }
+  return decode_binarycel_records(map->data + offset, n_cells, chip_num*n_cells, intensity, stddev, npixels);
+}
 
 
+/***************************************************************
+ **
+ ** static int read_binarycel_file_all(const char *filename, double *intensity, double *stddev, double *npixels)
+ **
+ ** reads intensity, stddev and npixels (any may be NULL) of a single binary 
+ ** cel file in one pass. returns 1 if the file is corrupted, 0 otherwise.
+ **
+ **************************************************************/
 
+static int read_binarycel_file_all(const char *filename, double *intensity, double *stddev, double *npixels){
 
+  binary_header *my_header;
+  mapped_file map;
+  int status;
 
+  my_header = read_binary_header(filename,1);
+  if (map_file(filename, &map)){
+    status = decode_binarycel_mapped(&map, ftell(my_header->infile), (size_t)my_header->n_cells, 0, intensity, stddev, npixels);
+    unmap_file(&map);
+  } else {
+    status = read_binarycel_records_stream(my_header, 0, intensity, stddev, npixels);
+  }
+  fclose(my_header->infile);
+  delete_binary_header(my_header);
 
+  return status;
+}
 
 
 /***************************************************************
  **
- ** static void binary_apply_masks(const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows, int rm_mask, int rm_outliers)
+ ** static int read_binarycel_file_intensities_stream(binary_header *my_header, const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows)
+ **
+ ** binary_header *my_header - header of an open binary CEL file, positioned at the start of the cell records
  **
  ** 
+ ** This function reads binary cel file intensities into the data matrix
  **
  **************************************************************/
 
-static void binary_apply_masks(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
-  
-  size_t i=0;
+static int read_binarycel_file_intensities_stream(binary_header *my_header, const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
 
-  size_t cur_index;
+  return read_binarycel_records_stream(my_header, chip_num, intensity, NULL, NULL);
+}
 
-  int sizeofrecords;
 
-  outliermask_loc *cur_loc= Calloc(1,outliermask_loc);
-  binary_header *my_header;
 
-  my_header = read_binary_header(filename,1);
+
+/***************************************************************
+ **
+ ** static int read_binarycel_file_stddev_stream(binary_header *my_header, const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows)
+ **
+ ** binary_header *my_header - header of an open binary CEL file, positioned at the start of the cell records
+ **
+ ** 
+ ** This function reads binary cel file stddev values into the data matrix
+ **
+ **************************************************************/
+
+static int read_binarycel_file_stddev_stream(binary_header *my_header, const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+
+  return read_binarycel_records_stream(my_header, chip_num, NULL, intensity, NULL);
+}
+
+
+
+
+/***************************************************************
+ **
+ ** static int read_binarycel_file_npixels_stream(binary_header *my_header, const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows)
+ **
+ ** binary_header *my_header - header of an open binary CEL file, positioned at the start of the cell records
+ **
+ ** 
+ ** This function reads binary cel file npixels values into the data matrix
+ **
+ **************************************************************/
+
+static int read_binarycel_file_npixels_stream(binary_header *my_header, const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+
+  return read_binarycel_records_stream(my_header, chip_num, NULL, NULL, intensity);
+}
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+/***************************************************************
+ **
+ ** static void binary_apply_masks_stream(binary_header *my_header, int skip_records, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows, int rm_mask, int rm_outliers)
+ **
+ ** binary_header *my_header - header of the open binary CEL file
+ ** int skip_records - if true the stream is at the start of the cell records, 
+ **                    which are skipped. Otherwise it is already past them.
+ **
+ ** sets the MASKS and OUTLIERS to NA
+ **
+ **************************************************************/
+
+static void binary_apply_masks_stream(binary_header *my_header, int skip_records, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
+  
+  size_t i=0;
+
+  size_t cur_index;
+
+  int sizeofrecords;
+
+  outliermask_loc *cur_loc= Calloc(1,outliermask_loc);
   
   sizeofrecords = 2*sizeof(float) + sizeof(short); /* sizeof(celintens_record) */
   
-  fseek(my_header->infile,my_header->n_cells*sizeofrecords,SEEK_CUR);
+  if (skip_records){
+    fseek(my_header->infile,my_header->n_cells*sizeofrecords,SEEK_CUR);
+  }
 
   if (rm_mask){
     for (i =0; i < my_header->n_masks; i++){
@@ -3044,8 +3473,6 @@ static void binary_apply_masks(const char *filename, double *intensity, size_t c
     fseek(my_header->infile,my_header->n_outliers*sizeof(cur_loc),SEEK_CUR);
   }
   
-  fclose(my_header->infile);
-  delete_binary_header(my_header);
  
   Free(cur_loc);
 
@@ -3151,7 +3578,7 @@ static int isgzBinaryCelFile(const char *filename){
   
   if ((infile = gzopen(filename, "rb")) == NULL)
     {
-      error("Unable to open the file %s",filename);
+      reader_error("Unable to open the file %s",filename);
       return 0;
     }
   
@@ -3184,35 +3611,31 @@ static int isgzBinaryCelFile(const char *filename){
 
 /*************************************************************
  **
- ** static binary_header *gzread_binary_header(const char *filename, int return_stream, FILE *infile)
+ ** static binary_header *gzread_binary_header_stream(gzFile infile, const char *filename)
  **
- ** const char *filename - name of binary cel file
- ** int return_stream - if 1 return the stream as part of the header, otherwise close the
- **              file at end of function.
+ ** gzFile infile - the open binary cel file, positioned at its start
+ ** const char *filename - name of binary cel file (for error messages)
+ **
+ ** reads the header. On return the stream (also stored in the header)
+ ** is positioned at the start of the cell records.
  **
  *************************************************************/
 
-static binary_header *gzread_binary_header(const char *filename, int return_stream){  /* , FILE *infile){ */
+static binary_header *gzread_binary_header_stream(gzFile infile, const char *filename){
   
-  gzFile infile;
 
   binary_header *this_header = Calloc(1,binary_header);
   
   /* Pass through all the header information */
   
-  if ((infile = gzopen(filename, "rb")) == NULL)
-    {
-      error("Unable to open the file %s\n",filename);
-      return 0;
-    }
   
   if (!gzread_int32(&(this_header->magic_number),1,infile)){
-    error("The binary file %s does not have the appropriate magic number\n",filename);
+    reader_error("The binary file %s does not have the appropriate magic number\n",filename);
     return 0;
   }
   
   if (this_header->magic_number != 64){
-    error("The binary file %s does not have the appropriate magic number\n",filename);
+    reader_error("The binary file %s does not have the appropriate magic number\n",filename);
     return 0;
   }
   
@@ -3221,7 +3644,7 @@ static binary_header *gzread_binary_header(const char *filename, int return_stre
   }
 
   if (this_header->version_number != 4){
-    error("The binary file %s is not version 4. Cannot read\n",filename);
+    reader_error("The binary file %s is not version 4. Cannot read\n",filename);
     return 0;
   }
     
@@ -3232,75 +3655,71 @@ static binary_header *gzread_binary_header(const char *filename, int return_stre
   /** We follow FUSION here (in the past we followed the DOCS **/
   
   if (!gzread_int32(&(this_header->rows),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
   
   if (!gzread_int32(&(this_header->cols),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
     return 0;
   }
 
   if (!gzread_int32(&(this_header->n_cells),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
   
   if (this_header->n_cells != (this_header->cols)*(this_header->rows)){
-    error("The number of cells does not seem to be equal to cols*rows in %s.\n",filename);
+    reader_error("The number of cells does not seem to be equal to cols*rows in %s.\n",filename);
   }
 
   
   if (!gzread_int32(&(this_header->header_len),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
 
   this_header->header = Calloc(this_header->header_len+1,char);
   
   if (!gzread(infile,this_header->header,sizeof(char)*this_header->header_len)){
-    error("binary file corrupted? Could not read any further.\n");
+    reader_error("binary file corrupted? Could not read any further.\n");
   }
   
   if (!gzread_int32(&(this_header->alg_len),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
   
   this_header->algorithm = Calloc(this_header->alg_len+1,char);
   
   if (!gzread_char(this_header->algorithm,this_header->alg_len,infile)){
-    error("binary file corrupted? Could not read any further.\n");
+    reader_error("binary file corrupted? Could not read any further.\n");
   }
   
   if (!gzread_int32(&(this_header->alg_param_len),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
   
   this_header->alg_param = Calloc(this_header->alg_param_len+1,char);
   
   if (!gzread_char(this_header->alg_param,this_header->alg_param_len,infile)){
-    error("binary file corrupted? Could not read any further.\n");
+    reader_error("binary file corrupted? Could not read any further.\n");
   }
     
   if (!gzread_int32(&(this_header->celmargin),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
   
   if (!gzread_uint32(&(this_header->n_outliers),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
   
   if (!gzread_uint32(&(this_header->n_masks),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   }
 
   if (!gzread_int32(&(this_header->n_subgrids),1,infile)){
-    error("Binary file corrupted? Could not read any further\n");
+    reader_error("Binary file corrupted? Could not read any further\n");
   } 
 
 
-  if (!return_stream){
-    gzclose(infile);
-  } else {
-    this_header->gzinfile = infile;
-  }
+  this_header->gzinfile = infile;
   
   
   return this_header;
@@ -3311,6 +3730,38 @@ static binary_header *gzread_binary_header(const char *filename, int return_stre
 }
 
 
+/*************************************************************
+ **
+ ** static binary_header *gzread_binary_header(const char *filename, int return_stream)
+ **
+ ** const char *filename - name of binary cel file
+ ** int return_stream - if 1 return the stream as part of the header, otherwise close the
+ **              file at end of function.
+ **
+ *************************************************************/
+
+static binary_header *gzread_binary_header(const char *filename, int return_stream){
+  
+  gzFile infile;
+
+  binary_header *this_header;
+  
+  if ((infile = gzopen_buffered(filename, "rb")) == NULL)
+    {
+      reader_error("Unable to open the file %s\n",filename);
+      return 0;
+    }
+
+  this_header = gzread_binary_header_stream(infile, filename);
+
+  if (!return_stream || this_header == NULL){
+    gzclose(infile);
+  }
+
+  return this_header;
+}
+
+
 
 /*************************************************************
  **
@@ -3351,7 +3802,7 @@ static char *gzbinary_get_header_info(const char *filename, int *dim1, int *dim2
       break;
     }
     if (i == (tokenset_size(my_tokenset) - 1)){
-      error("Cel file %s does not seem to be have cdf information",filename);
+      reader_error("Cel file %s does not seem to be have cdf information",filename);
     }
   }
   
@@ -3490,7 +3941,7 @@ static void gzbinary_get_detailed_header_info(const char *filename, detailed_hea
       break;
     }
     if (i == (tokenset_size(my_tokenset) - 1)){
-      error("Cel file %s does not seem to be have cdf information",filename);
+      reader_error("Cel file %s does not seem to be have cdf information",filename);
     }
   }
   
@@ -3510,12 +3961,12 @@ static void gzbinary_get_detailed_header_info(const char *filename, detailed_hea
  **
  ** static int check_binary_cel_file(const char *filename, char *ref_cdfName, int ref_dim_1, int ref_dim_2)
  ** 
- ** This function checks a binary cel file to see if it has the 
+ ** This function checks the header of a binary cel file to see if it has the 
  ** expected rows, cols and cdfname
  **
  **************************************************************/
 
-static int check_gzbinary_cel_file(const char *filename, const char *ref_cdfName, int ref_dim_1, int ref_dim_2){
+static int check_gzbinary_cel_header(binary_header *my_header, const char *filename, const char *ref_cdfName, int ref_dim_1, int ref_dim_2){
 
 
 
@@ -3524,13 +3975,9 @@ static int check_gzbinary_cel_file(const char *filename, const char *ref_cdfName
 
   int i = 0,endpos;
   
-  binary_header *my_header;
-
-
-  my_header = gzread_binary_header(filename,0);  
 
   if ((my_header->cols != ref_dim_1) || (my_header->rows != ref_dim_2)){
-    error("Cel file %s does not seem to have the correct dimensions",filename);
+    reader_error("Cel file %s does not seem to have the correct dimensions",filename);
   }
   
   my_tokenset = tokenize(my_header->header," ");
@@ -3550,16 +3997,15 @@ static int check_gzbinary_cel_file(const char *filename, const char *ref_cdfName
       break;
     }
     if (i == (tokenset_size(my_tokenset) - 1)){
-      error("Cel file %s does not seem to be have cdf information",filename);
+      reader_error("Cel file %s does not seem to be have cdf information",filename);
     }
   }
 
   if (strncasecmp(cdfName,ref_cdfName,strlen(ref_cdfName)) != 0){
-    error("Cel file %s does not seem to be of %s type",filename,ref_cdfName);
+    reader_error("Cel file %s does not seem to be of %s type",filename,ref_cdfName);
   }
 
   
-  delete_binary_header(my_header);
   delete_tokens(my_tokenset);
   Free(cdfName);
 
@@ -3570,150 +4016,231 @@ static int check_gzbinary_cel_file(const char *filename, const char *ref_cdfName
 
 
 
+/* where gzread_blocks() should put the decoded cell records */
+
+typedef struct{
+  size_t first;
+  double *intensity;
+  double *stddev;
+  double *npixels;
+} binarycel_outputs;
+
+
+static int gzdecode_binarycel_block(const unsigned char *block, size_t first_unit, size_t n_units, void *arg){
+
+  binarycel_outputs *outputs = (binarycel_outputs *)arg;
+
+  return decode_binarycel_records(block, n_units, outputs->first + first_unit, outputs->intensity, outputs->stddev, outputs->npixels);
+}
+
+
 /***************************************************************
  **
- ** static int gzread_binarycel_file_intensities(const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows)
+ ** static int gzread_binarycel_records_stream(binary_header *my_header, size_t chip_num, 
+ **                                            double *intensity, double *stddev, double *npixels)
  **
- ** 
- ** This function reads gzipped binary cel file intensities into the data matrix
+ ** as read_binarycel_records_stream() but for a gzipped binary CEL file. 
+ ** The records are inflated and decoded in large blocks by gzread_blocks()
  **
  **************************************************************/
 
-static int gzread_binarycel_file_intensities(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+static int gzread_binarycel_records_stream(binary_header *my_header, size_t chip_num, double *intensity, double *stddev, double *npixels){
 
-  size_t i=0, j=0;
-  size_t cur_index;
-  
-  int fread_err=0;
+  size_t n_cells = (size_t)my_header->n_cells;
+  binarycel_outputs outputs;
 
+  outputs.first = chip_num*n_cells;
+  outputs.intensity = intensity;
+  outputs.stddev = stddev;
+  outputs.npixels = npixels;
 
-  celintens_record *cur_intensity = Calloc(1,celintens_record);
-  binary_header *my_header;
+  if (gzread_blocks(my_header->gzinfile, BINARY_CEL_RECORD_SIZE, n_cells, gzdecode_binarycel_block, &outputs) != n_cells){
+    return 1;
+  }
+  return 0;
+}
 
-  my_header = gzread_binary_header(filename,1);
-  
-  for (i = 0; i < my_header->rows; i++){
-    for (j =0; j < my_header->cols; j++){
-      cur_index = j + my_header->cols*i; /* i + my_header->rows*j; */
-      fread_err = gzread_float32(&(cur_intensity->cur_intens),1,my_header->gzinfile);
-      fread_err+= gzread_float32(&(cur_intensity->cur_sd),1,my_header->gzinfile);
-      fread_err+= gzread_int16(&(cur_intensity->npixels),1,my_header->gzinfile);
-      if (fread_err < 3){
-	gzclose(my_header->gzinfile);
-	delete_binary_header(my_header);
-	Free(cur_intensity);
-	return 1;
-      }     
-      if (cur_intensity->cur_intens < 0 || cur_intensity->cur_intens > 65536 || isnan(cur_intensity->cur_intens)){
-	gzclose(my_header->gzinfile);
-	delete_binary_header(my_header);
-	Free(cur_intensity);
-	return 1;
-      }
-      fread_err=0;
-      intensity[chip_num*my_header->n_cells + cur_index] = (double )cur_intensity->cur_intens;
+
+/***************************************************************
+ **
+ ** Reading binary CEL intensities a block at a time
+ **
+ ** Rather than into a column of a matrix, the intensities are decoded 
+ ** BINARY_CEL_RECORD_BLOCK cells at a time into a small buffer which is 
+ ** passed to a sink along with the index of its first cell. Used by 
+ ** read_cel_handle_blocks(). Each returns 1 if the file is truncated 
+ ** or corrupted, 0 otherwise.
+ **
+ ** sink_binarycel_records()          - decode and pass on records already in memory
+ ** read_binarycel_intensity_blocks() - an open binary CEL file (or its mapping)
+ ** gzread_binarycel_intensity_blocks() - an open gzipped binary CEL file
+ **
+ **************************************************************/
+
+static int sink_binarycel_records(const unsigned char *records, size_t n_records, size_t first, double *values, generic_column_sink sink, void *arg){
+
+  size_t done, n_block;
+
+  for (done = 0; done < n_records; done += n_block){
+    n_block = n_records - done;
+    if (n_block > BINARY_CEL_RECORD_BLOCK){
+      n_block = BINARY_CEL_RECORD_BLOCK;
     }
+    if (decode_binarycel_records(records + done*BINARY_CEL_RECORD_SIZE, n_block, 0, values, NULL, NULL)){
+      return 1;
+    }
+    sink(values, first + done, n_block, arg);
   }
-  
-  gzclose(my_header->gzinfile);
-  delete_binary_header(my_header);
-  Free(cur_intensity);
-  return(0);
+  return 0;
+}
+
+
+static int read_binarycel_intensity_blocks(binary_header *my_header, const mapped_file *map, long offset, generic_column_sink sink, void *arg){
+
+  size_t n_cells = (size_t)my_header->n_cells;
+  size_t done, n_block;
+  int status = 0;
+  unsigned char *buffer;
+  double *values = Calloc(BINARY_CEL_RECORD_BLOCK, double);
+
+  if (map != NULL && map->data != NULL){
+    if (offset < 0 || (size_t)offset >= map->size || (map->size - (size_t)offset)/BINARY_CEL_RECORD_SIZE < n_cells){
+      status = 1;
+    } else {
+      status = sink_binarycel_records(map->data + offset, n_cells, 0, values, sink, arg);
+    }
+    Free(values);
+    return status;
+  }
+
+  buffer = Calloc(BINARY_CEL_RECORD_BLOCK*BINARY_CEL_RECORD_SIZE, unsigned char);
+  for (done = 0; done < n_cells; done += n_block){
+    n_block = n_cells - done;
+    if (n_block > BINARY_CEL_RECORD_BLOCK){
+      n_block = BINARY_CEL_RECORD_BLOCK;
+    }
+    if (fread(buffer, BINARY_CEL_RECORD_SIZE, n_block, my_header->infile) != n_block || 
+	sink_binarycel_records(buffer, n_block, done, values, sink, arg)){
+      status = 1;
+      break;
+    }
+  }
+  Free(buffer);
+  Free(values);
+  return status;
+}
+
+
+/* what gzsink_binarycel_block() needs, values is BINARY_CEL_RECORD_BLOCK long */
+
+typedef struct{
+  double *values;
+  generic_column_sink sink;
+  void *arg;
+} binarycel_sink;
+
+
+static int gzsink_binarycel_block(const unsigned char *block, size_t first_unit, size_t n_units, void *arg){
+
+  binarycel_sink *dest = (binarycel_sink *)arg;
+
+  return sink_binarycel_records(block, n_units, first_unit, dest->values, dest->sink, dest->arg);
 }
 
 
+static int gzread_binarycel_intensity_blocks(binary_header *my_header, generic_column_sink sink, void *arg){
+
+  size_t n_cells = (size_t)my_header->n_cells;
+  binarycel_sink dest;
+  int status = 0;
+
+  dest.values = Calloc(BINARY_CEL_RECORD_BLOCK, double);
+  dest.sink = sink;
+  dest.arg = arg;
+  if (gzread_blocks(my_header->gzinfile, BINARY_CEL_RECORD_SIZE, n_cells, gzsink_binarycel_block, &dest) != n_cells){
+    status = 1;
+  }
+  Free(dest.values);
+  return status;
+}
 
 
 /***************************************************************
  **
- ** static int gzread_binarycel_file_stdev(const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows)
+ ** static int gzread_binarycel_file_all(const char *filename, double *intensity, double *stddev, double *npixels)
  **
- ** 
- ** This function reads binary cel file stddev values into the data matrix
+ ** reads intensity, stddev and npixels (any may be NULL) of a single gzipped 
+ ** binary cel file in one pass. returns 1 if the file is corrupted, 0 otherwise.
  **
  **************************************************************/
 
-static int gzread_binarycel_file_stddev(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
-
-  size_t i=0, j=0;
-  size_t cur_index;
+static int gzread_binarycel_file_all(const char *filename, double *intensity, double *stddev, double *npixels){
 
-  int fread_err=0;
-  
-  celintens_record *cur_intensity = Calloc(1,celintens_record);
   binary_header *my_header;
+  int status;
 
   my_header = gzread_binary_header(filename,1);
-  
-  for (i = 0; i < my_header->rows; i++){
-    for (j =0; j < my_header->cols; j++){
-      cur_index = j + my_header->cols*i; /* i + my_header->rows*j; */
-      fread_err = gzread_float32(&(cur_intensity->cur_intens),1,my_header->gzinfile);
-      fread_err+= gzread_float32(&(cur_intensity->cur_sd),1,my_header->gzinfile);
-      fread_err+= gzread_int16(&(cur_intensity->npixels),1,my_header->gzinfile);
-      if (fread_err < 3){
-	gzclose(my_header->gzinfile);
-	delete_binary_header(my_header);
-	Free(cur_intensity);
-	return 1;
-      }
-      fread_err=0;
-      intensity[chip_num*my_header->n_cells + cur_index] = (double )cur_intensity->cur_sd;
-    }
-  }
-  
+  status = gzread_binarycel_records_stream(my_header, 0, intensity, stddev, npixels);
   gzclose(my_header->gzinfile);
   delete_binary_header(my_header);
-  Free(cur_intensity);
-  return(0);
+
+  return status;
 }
 
 
+/***************************************************************
+ **
+ ** static int gzread_binarycel_file_intensities_stream(binary_header *my_header, const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows)
+ **
+ ** binary_header *my_header - header of an open gzipped binary CEL file, positioned at the start of the cell records
+ **
+ ** 
+ ** This function reads gzipped binary cel file intensities into the data matrix
+ **
+ **************************************************************/
+
+static int gzread_binarycel_file_intensities_stream(binary_header *my_header, const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+
+  return gzread_binarycel_records_stream(my_header, chip_num, intensity, NULL, NULL);
+}
+
 
 
 
 /***************************************************************
  **
- ** static int read_binarycel_file_npixels(const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows)
+ ** static int gzread_binarycel_file_stddev_stream(binary_header *my_header, const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows)
+ **
+ ** binary_header *my_header - header of an open gzipped binary CEL file, positioned at the start of the cell records
  **
  ** 
- ** This function reads binary cel file npixels values into the data matrix
+ ** This function reads binary cel file stddev values into the data matrix
  **
  **************************************************************/
 
-static int gzread_binarycel_file_npixels(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+static int gzread_binarycel_file_stddev_stream(binary_header *my_header, const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
 
-  size_t i=0, j=0;
-  size_t cur_index;
+  return gzread_binarycel_records_stream(my_header, chip_num, NULL, intensity, NULL);
+}
 
-  int fread_err=0;
- 
-  celintens_record *cur_intensity = Calloc(1,celintens_record);
-  binary_header *my_header;
 
-  my_header = gzread_binary_header(filename,1);
-  
-  for (i = 0; i < my_header->rows; i++){
-    for (j =0; j < my_header->cols; j++){
-      cur_index = j + my_header->cols*i; /* i + my_header->rows*j; */
-      fread_err = gzread_float32(&(cur_intensity->cur_intens),1,my_header->gzinfile);
-      fread_err+= gzread_float32(&(cur_intensity->cur_sd),1,my_header->gzinfile);
-      fread_err+= gzread_int16(&(cur_intensity->npixels),1,my_header->gzinfile);  
-      if (fread_err < 3){
-	gzclose(my_header->gzinfile);
-	delete_binary_header(my_header);
-	Free(cur_intensity);
-	return 1;
-      }
-      fread_err=0;
-      intensity[chip_num*my_header->n_cells + cur_index] = (double )cur_intensity->npixels;
-    }
-  }
-  
-  gzclose(my_header->gzinfile);
-  delete_binary_header(my_header);
-  Free(cur_intensity);
-  return(0);
+
+
+
+/***************************************************************
+ **
+ ** static int gzread_binarycel_file_npixels_stream(binary_header *my_header, const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows)
+ **
+ ** binary_header *my_header - header of an open gzipped binary CEL file, positioned at the start of the cell records
+ **
+ ** 
+ ** This function reads binary cel file npixels values into the data matrix
+ **
+ **************************************************************/
+
+static int gzread_binarycel_file_npixels_stream(binary_header *my_header, const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+
+  return gzread_binarycel_records_stream(my_header, chip_num, NULL, NULL, intensity);
 }
 
 
@@ -3721,59 +4248,82 @@ static int gzread_binarycel_file_npixels(const char *filename, double *intensity
 
 /***************************************************************
  **
- ** static void gz_binary_apply_masks(const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows, int rm_mask, int rm_outliers)
+ ** static void gz_binary_apply_masks_stream(binary_header *my_header, int skip_records, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows, int rm_mask, int rm_outliers)
  **
- ** 
+ ** binary_header *my_header - header of the open binary CEL file
+ ** int skip_records - if true the stream is at the start of the cell records, 
+ **                    which are skipped. Otherwise it is already past them.
+ **
+ ** sets the MASKS and OUTLIERS to NA
  **
  **************************************************************/
 
-static void gz_binary_apply_masks(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
+static void gz_binary_apply_masks_stream(binary_header *my_header, int skip_records, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
   
   size_t i=0;
+  size_t n_read;
+  short *locs;
 
   size_t cur_index;
 
   int sizeofrecords;
 
   outliermask_loc *cur_loc= Calloc(1,outliermask_loc);
-  binary_header *my_header;
-
-  my_header = gzread_binary_header(filename,1);
   
   sizeofrecords = 2*sizeof(float) + sizeof(short); /* sizeof(celintens_record) */
   
   //fseek(my_header->infile,my_header->n_cells*sizeofrecords,SEEK_CUR);
-  gzseek(my_header->gzinfile,my_header->n_cells*sizeofrecords,SEEK_CUR);
+  if (skip_records){
+    gzseek(my_header->gzinfile,my_header->n_cells*sizeofrecords,SEEK_CUR);
+  }
+  /* each section is read with a single gzread() rather than two per location */
   if (rm_mask){
+    locs = Calloc(2*(size_t)my_header->n_masks + 1, short);
+    n_read = gzread_int16(locs, 2*my_header->n_masks, my_header->gzinfile)/sizeof(short);
+    if (n_read > 2*(size_t)my_header->n_masks){
+      n_read = 0;
+    }
     for (i =0; i < my_header->n_masks; i++){
-      gzread_int16(&(cur_loc->x),1,my_header->gzinfile);
-      gzread_int16(&(cur_loc->y),1,my_header->gzinfile);
+      /* as before, a location cut short by the end of the file keeps the last values read */
+      if (2*i < n_read){
+	cur_loc->x = locs[2*i];
+      }
+      if (2*i + 1 < n_read){
+	cur_loc->y = locs[2*i + 1];
+      }
       cur_index = (int)cur_loc->x + my_header->rows*(int)cur_loc->y; 
       /* cur_index = (int)cur_loc->y + my_header->rows*(int)cur_loc->x; */
       /*   intensity[chip_num*my_header->rows + cur_index] = R_NaN; */
       intensity[chip_num*rows + cur_index] =  R_NaN;
-      
-
     }
+    Free(locs);
   } else {
     gzseek(my_header->gzinfile,my_header->n_masks*sizeof(cur_loc),SEEK_CUR);
 
   }
 
   if (rm_outliers){
+    locs = Calloc(2*(size_t)my_header->n_outliers + 1, short);
+    n_read = gzread_int16(locs, 2*my_header->n_outliers, my_header->gzinfile)/sizeof(short);
+    if (n_read > 2*(size_t)my_header->n_outliers){
+      n_read = 0;
+    }
     for (i =0; i < my_header->n_outliers; i++){
-      gzread_int16(&(cur_loc->x),1,my_header->gzinfile);
-      gzread_int16(&(cur_loc->y),1,my_header->gzinfile);
+      if (2*i < n_read){
+	cur_loc->x = locs[2*i];
+      }
+      if (2*i + 1 < n_read){
+	cur_loc->y = locs[2*i + 1];
+      }
       cur_index = (int)cur_loc->x + my_header->rows*(int)cur_loc->y; 
       /* intensity[chip_num*my_header->n_cells + cur_index] = R_NaN; */
       intensity[chip_num*rows + cur_index] =  R_NaN;
     }
+    Free(locs);
   } else {
     gzseek(my_header->gzinfile,my_header->n_outliers*sizeof(cur_loc),SEEK_CUR);
   }
   
-  gzclose(my_header->gzinfile);
-  delete_binary_header(my_header);
  
   Free(cur_loc);
 
@@ -3847,25 +4397,1272 @@ static void gzbinary_get_masks_outliers(const char *filename, int *nmasks, short
 /****************************************************************
  ****************************************************************
  **
- ** This is the code that interfaces with R
+ ** Code for reading a batch of CEL files into a matrix with one
+ ** column per chip. This is shared by read_abatch, read_abatch_stddev
+ ** and read_abatch_npixels.
  **
  ***************************************************************
  ***************************************************************/
 
-/************************************************************************
+/* which quantity from each CEL file should be placed in the matrix */
+#define ABATCH_INTENSITY 0
+#define ABATCH_STDDEV 1
+#define ABATCH_NPIXELS 2
+
+/* the CEL file formats */
+#define CEL_FORMAT_UNKNOWN -1
+#define CEL_FORMAT_TEXT 0
+#define CEL_FORMAT_GZTEXT 1
+#define CEL_FORMAT_BINARY 2
+#define CEL_FORMAT_GZBINARY 3
+#define CEL_FORMAT_GENERIC 4
+#define CEL_FORMAT_GZGENERIC 5
+#define CEL_FORMAT_MULTICHANNEL 6
+#define CEL_FORMAT_GZMULTICHANNEL 7
+
+/* enough of the start of a file to tell the formats apart */
+#define CEL_SNIFF_SIZE 64
+
+
+/*************************************************************************
  **
- **  SEXP read_abatch(SEXP filenames, SEXP compress,  
- **                   SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, 
- **                   SEXP ref_cdfName)
+ ** static int determine_cel_format(const char *filename)
  **
- ** SEXP filenames - an R character vector of filenames to read
- ** SEXP compress  - logical flag TRUE means files are *.gz
- ** SEXP rm_mask   - if true set MASKS  to NA
- ** SEXP rm_outliers - if true set OUTLIERS to NA
- ** SEXP rm_extra    - if true  overrides rm_mask and rm_outliers settings
- ** SEXP ref_cdfName - the reference CDF name to check each CEL file against 
- ** SEXP ref_dim     - cols/rows of reference chip
- ** SEXP verbose     - if verbose print out more information to the screen
+ ** const char *filename - name of the CEL file
+ **
+ ** RETURNS one of the CEL_FORMAT_ values. CEL_FORMAT_UNKNOWN if the
+ ** file is not recognised as a CEL file.
+ **
+ ** The file is opened once and the format decided from its first few 
+ ** (decompressed) bytes:
+ **
+ **   text      - starts "[CEL"
+ **   binary    - a little endian magic number of 64 followed by version 4
+ **   generic   - magic number 59, version 1 with data type 
+ **               "affymetrix-calvin-intensity" (the first string of the
+ **               data header, which begins at byte 10)
+ **   multichannel - as generic but with data type 
+ **               "affymetrix-calvin-multi-intensity"
+ **
+ ** gzopen() reads uncompressed files as they are, gzdirect() then 
+ ** tells us whether the file was gzipped.
+ **
+ *************************************************************************/
+
+static int determine_cel_format(const char *filename){
+
+  const char *generic_type = "affymetrix-calvin-intensity";
+  const char *multichannel_type = "affymetrix-calvin-multi-intensity";
+  unsigned char buffer[CEL_SNIFF_SIZE];
+  int n_read, compressed, format;
+  unsigned int magic_number, version_number, type_len;
+  gzFile infile;
+
+  if ((infile = gzopen(filename, "rb")) == NULL){
+    reader_error("Could not open file %s", filename);
+  }
+  n_read = gzread(infile, buffer, CEL_SNIFF_SIZE);
+  compressed = !gzdirect(infile);
+  gzclose(infile);
+
+  format = CEL_FORMAT_UNKNOWN;
+
+  if (n_read >= 4 && strncmp("[CEL]", (char *)buffer, 4) == 0){
+    format = CEL_FORMAT_TEXT;
+  } else if (n_read >= 8){
+    magic_number = buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((unsigned int)buffer[3] << 24);
+    version_number = buffer[4] | (buffer[5] << 8) | (buffer[6] << 16) | ((unsigned int)buffer[7] << 24);
+    if (magic_number == 64 && version_number == 4){
+      format = CEL_FORMAT_BINARY;
+    } else if (n_read >= 14 && buffer[0] == 59 && buffer[1] == 1){
+      type_len = ((unsigned int)buffer[10] << 24) | (buffer[11] << 16) | (buffer[12] << 8) | buffer[13];
+      if (type_len == strlen(generic_type) && n_read >= 14 + (int)type_len && 
+	  strncmp(generic_type, (char *)&buffer[14], type_len) == 0){
+	format = CEL_FORMAT_GENERIC;
+      } else if (type_len == strlen(multichannel_type) && n_read >= 14 + (int)type_len && 
+		 strncmp(multichannel_type, (char *)&buffer[14], type_len) == 0){
+	format = CEL_FORMAT_MULTICHANNEL;
+      }
+    }
+  }
+
+  if (compressed && format != CEL_FORMAT_UNKNOWN){
+#if defined HAVE_ZLIB
+    format++;   /* the gzipped version of each format follows it */
+#else
+    if (format == CEL_FORMAT_TEXT){
+      format = CEL_FORMAT_UNKNOWN;
+    } else {
+      format++;
+    }
+#endif
+  }
+  return format;
+}
+
+
+static void unknown_cel_format_error(const char *filename){
+#if defined HAVE_ZLIB
+  reader_error("Is %s really a CEL file? tried reading as text, gzipped text, binary, gzipped binary, command console and gzipped command console formats.\n",filename);
+#else
+  reader_error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",filename);
+#endif
+}
+
+
+/*************************************************************************
+ **
+ ** A cel_handle is a CEL file that has had its format determined and 
+ ** its header read (and checked) once. It remembers where the cell data 
+ ** begins so that the file can later be reopened straight at the data, 
+ ** then read and have its masks applied without starting again from
+ ** the top of the file.
+ **
+ ** open_cel_handle()        - work out the format, read the header and 
+ **                            if ref_cdfName is not NULL check it against 
+ **                            the reference CDF name and dimensions. 
+ **                            Leaves the file open at the cell data.
+ ** close_cel_handle()       - close the file, keeping what we know about it
+ ** reopen_cel_handle()      - open the file again at the cell data
+ ** read_cel_handle()        - read intensities, stddev or npixels (which) 
+ ** apply_masks_cel_handle() - set MASKS/OUTLIERS to NA. Must directly follow
+ **                            read_cel_handle(). Returns non zero if the
+ **                            masks could not be read
+ ** free_cel_handle()        - close the file and free the handle contents
+ **
+ ** For the command console formats the handle also keeps an index of the
+ ** data sets in the file so that each can be read by seeking straight to it.
+ ** For multichannel files read_cel_handle(), read_cel_handle_blocks() and 
+ ** apply_masks_cel_handle() work on handle->channel. Reading the channels 
+ ** in order goes through the file only once.
+ **
+ *************************************************************************/
+
+typedef struct{
+  const char *filename;
+  int format;
+  long data_offset;       /* where the cell data begins */
+  int nrows;              /* rows on the chip, command console formats */
+  binary_header *header;  /* binary formats (holds the open stream) */
+  FILE *infile;           /* text and command console formats */
+  gzFile gzinfile;        /* gzipped text and command console formats */
+  generic_data_set_index *index;  /* data sets of the command console formats */
+  mapped_file map;        /* uncompressed binary and command console formats, while reading */
+  int channel;            /* which channel of a multichannel file to read */
+} cel_handle;
+
+
+
+static void check_generic_cel_header(const char *filename, const char *cdfName, int dim1, int dim2, const char *ref_cdfName, int ref_dim_1, int ref_dim_2){
+
+  if ((dim1 != ref_dim_1) || (dim2 != ref_dim_2)){
+    reader_error("Cel file %s does not seem to have the correct dimensions",filename);
+  }
+  
+  if (strncasecmp(cdfName,ref_cdfName,strlen(ref_cdfName)) != 0){
+    reader_error("Cel file %s does not seem to be of %s type",filename,ref_cdfName);
+  }
+}
+
+
+static void open_cel_handle(cel_handle *handle, const char *filename, const char *ref_cdfName, int ref_dim_1, int ref_dim_2){
+
+  char *cdfName;
+  int dim1, dim2;
+
+  handle->filename = filename;
+  handle->format = CEL_FORMAT_UNKNOWN;
+  handle->data_offset = 0;
+  handle->nrows = 0;
+  handle->header = NULL;
+  handle->infile = NULL;
+  handle->gzinfile = NULL;
+  handle->index = NULL;
+  handle->map.data = NULL;
+  handle->map.size = 0;
+  handle->channel = 0;
+  handle->format = determine_cel_format(filename);
+
+  switch (handle->format){
+  case CEL_FORMAT_TEXT:
+    handle->infile = open_cel_file(filename);
+    if (ref_cdfName != NULL){
+      check_cel_file_stream(handle->infile, filename, ref_cdfName, ref_dim_1, ref_dim_2);
+    }
+    handle->data_offset = ftell(handle->infile);
+    break;
+#if defined HAVE_ZLIB
+  case CEL_FORMAT_GZTEXT:
+    handle->gzinfile = open_gz_cel_file(filename);
+    if (ref_cdfName != NULL){
+      check_gzcel_file_stream(handle->gzinfile, filename, ref_cdfName, ref_dim_1, ref_dim_2);
+    }
+    handle->data_offset = (long)gztell(handle->gzinfile);
+    break;
+#endif
+  case CEL_FORMAT_BINARY:
+    handle->header = read_binary_header(filename, 1);
+    if (ref_cdfName != NULL){
+      check_binary_cel_header(handle->header, filename, ref_cdfName, ref_dim_1, ref_dim_2);
+    }
+    handle->data_offset = ftell(handle->header->infile);
+    break;
+  case CEL_FORMAT_GZBINARY:
+    handle->header = gzread_binary_header(filename, 1);
+    if (ref_cdfName != NULL){
+      check_gzbinary_cel_header(handle->header, filename, ref_cdfName, ref_dim_1, ref_dim_2);
+    }
+    handle->data_offset = (long)gztell(handle->header->gzinfile);
+    break;
+  case CEL_FORMAT_GENERIC:
+  case CEL_FORMAT_MULTICHANNEL:
+    if ((handle->infile = fopen(filename, "rb")) == NULL){
+      reader_error("Unable to open the file %s",filename);
+    }
+    cdfName = generic_get_header_info_stream(handle->infile, &dim1, &dim2);
+    if (ref_cdfName != NULL){
+      check_generic_cel_header(filename, cdfName, dim1, dim2, ref_cdfName, ref_dim_1, ref_dim_2);
+    }
+    Free(cdfName);
+    handle->nrows = dim2;
+    handle->data_offset = ftell(handle->infile);
+    handle->index = Calloc(1, generic_data_set_index);
+    init_generic_data_set_index(handle->index, handle->infile);
+    break;
+  case CEL_FORMAT_GZGENERIC:
+  case CEL_FORMAT_GZMULTICHANNEL:
+    if ((handle->gzinfile = gzopen_buffered(filename, "rb")) == NULL){
+      reader_error("Unable to open the file %s",filename);
+    }
+    cdfName = gzgeneric_get_header_info_stream(handle->gzinfile, &dim1, &dim2);
+    if (ref_cdfName != NULL){
+      check_generic_cel_header(filename, cdfName, dim1, dim2, ref_cdfName, ref_dim_1, ref_dim_2);
+    }
+    Free(cdfName);
+    handle->nrows = dim2;
+    handle->data_offset = (long)gztell(handle->gzinfile);
+    handle->index = Calloc(1, generic_data_set_index);
+    gzinit_generic_data_set_index(handle->index, handle->gzinfile);
+    break;
+  default:
+    unknown_cel_format_error(filename);
+  }
+}
+
+
+static void close_cel_handle(cel_handle *handle){
+
+  if (handle->map.data != NULL){
+    unmap_file(&(handle->map));
+    if (handle->index != NULL){
+      handle->index->mapped = NULL;
+      handle->index->mapped_size = 0;
+    }
+  }
+  if (handle->header != NULL){
+    if (handle->header->infile != NULL){
+      fclose(handle->header->infile);
+      handle->header->infile = NULL;
+    }
+    if (handle->header->gzinfile != NULL){
+      gzclose(handle->header->gzinfile);
+      handle->header->gzinfile = NULL;
+    }
+  }
+  if (handle->infile != NULL){
+    fclose(handle->infile);
+    handle->infile = NULL;
+  }
+  if (handle->gzinfile != NULL){
+    gzclose(handle->gzinfile);
+    handle->gzinfile = NULL;
+  }
+}
+
+
+static void reopen_cel_handle(cel_handle *handle){
+
+  FILE *infile = NULL;
+  gzFile gzinfile = NULL;
+
+  switch (handle->format){
+  case CEL_FORMAT_TEXT:
+    /* same mode as open_cel_file() so that the offset is meaningful */
+    infile = fopen(handle->filename, "r");
+    break;
+  case CEL_FORMAT_BINARY:
+  case CEL_FORMAT_GENERIC:
+  case CEL_FORMAT_MULTICHANNEL:
+    infile = fopen(handle->filename, "rb");
+    break;
+  default:
+    gzinfile = gzopen_buffered(handle->filename, "rb");
+    break;
+  }
+
+  if (infile == NULL && gzinfile == NULL){
+    reader_error("Unable to open the file %s\n",handle->filename);
+  }
+
+  if (infile != NULL){
+    fseek(infile, handle->data_offset, SEEK_SET);
+  } else {
+    gzseek(gzinfile, (z_off_t)handle->data_offset, SEEK_SET);
+  }
+
+  if (handle->header != NULL){
+    handle->header->infile = infile;
+    handle->header->gzinfile = gzinfile;
+  } else {
+    handle->infile = infile;
+    handle->gzinfile = gzinfile;
+  }
+}
+
+
+/* map an uncompressed binary or command console file so its cell data can be decoded in place */
+
+static void map_cel_handle(cel_handle *handle){
+
+  if (handle->map.data != NULL || (handle->format != CEL_FORMAT_BINARY && handle->format != CEL_FORMAT_GENERIC && handle->format != CEL_FORMAT_MULTICHANNEL)){
+    return;
+  }
+  if (map_file(handle->filename, &(handle->map)) && handle->index != NULL){
+    handle->index->mapped = handle->map.data;
+    handle->index->mapped_size = handle->map.size;
+  }
+}
+
+
+static int read_cel_handle(cel_handle *handle, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int which){
+
+  const char *filename = handle->filename;
+
+  map_cel_handle(handle);
+
+  switch (handle->format){
+  case CEL_FORMAT_TEXT:
+    if (which == ABATCH_STDDEV){
+      return read_cel_file_stddev_stream(handle->infile, filename, intensity, chip_num, rows, cols, chip_dim_rows);
+    } else if (which == ABATCH_NPIXELS){
+      return read_cel_file_npixels_stream(handle->infile, filename, intensity, chip_num, rows, cols, chip_dim_rows);
+    }
+    return read_cel_file_intensities_stream(handle->infile, filename, intensity, chip_num, rows, cols, chip_dim_rows);
+#if defined HAVE_ZLIB
+  case CEL_FORMAT_GZTEXT:
+    if (which == ABATCH_STDDEV){
+      return read_gzcel_file_stddev_stream(handle->gzinfile, filename, intensity, chip_num, rows, cols, chip_dim_rows);
+    } else if (which == ABATCH_NPIXELS){
+      return read_gzcel_file_npixels_stream(handle->gzinfile, filename, intensity, chip_num, rows, cols, chip_dim_rows);
+    }
+    return read_gzcel_file_intensities_stream(handle->gzinfile, filename, intensity, chip_num, rows, cols, chip_dim_rows);
+#endif
+  case CEL_FORMAT_BINARY:
+    if (handle->map.data != NULL){
+      return decode_binarycel_mapped(&(handle->map), handle->data_offset, (size_t)handle->header->n_cells, chip_num, 
+				     (which == ABATCH_INTENSITY ? intensity : NULL), 
+				     (which == ABATCH_STDDEV ? intensity : NULL), 
+				     (which == ABATCH_NPIXELS ? intensity : NULL));
+    }
+    if (which == ABATCH_STDDEV){
+      return read_binarycel_file_stddev_stream(handle->header, filename, intensity, chip_num, rows, cols, chip_dim_rows);
+    } else if (which == ABATCH_NPIXELS){
+      return read_binarycel_file_npixels_stream(handle->header, filename, intensity, chip_num, rows, cols, chip_dim_rows);
+    }
+    return read_binarycel_file_intensities_stream(handle->header, filename, intensity, chip_num, rows, cols, chip_dim_rows);
+  case CEL_FORMAT_GZBINARY:
+    if (which == ABATCH_STDDEV){
+      return gzread_binarycel_file_stddev_stream(handle->header, filename, intensity, chip_num, rows, cols, chip_dim_rows);
+    } else if (which == ABATCH_NPIXELS){
+      return gzread_binarycel_file_npixels_stream(handle->header, filename, intensity, chip_num, rows, cols, chip_dim_rows);
+    }
+    return gzread_binarycel_file_intensities_stream(handle->header, filename, intensity, chip_num, rows, cols, chip_dim_rows);
+  case CEL_FORMAT_GENERIC:
+    if (which == ABATCH_STDDEV){
+      return read_genericcel_file_stddev_stream(handle->infile, handle->index, intensity, chip_num, rows, cols, chip_dim_rows);
+    } else if (which == ABATCH_NPIXELS){
+      return read_genericcel_file_npixels_stream(handle->infile, handle->index, intensity, chip_num, rows, cols, chip_dim_rows);
+    }
+    return read_genericcel_file_intensities_stream(handle->infile, handle->index, intensity, chip_num, rows, cols, chip_dim_rows);
+  case CEL_FORMAT_GZGENERIC:
+    if (which == ABATCH_STDDEV){
+      return gzread_genericcel_file_stddev_stream(handle->gzinfile, handle->index, intensity, chip_num, rows, cols, chip_dim_rows);
+    } else if (which == ABATCH_NPIXELS){
+      return gzread_genericcel_file_npixels_stream(handle->gzinfile, handle->index, intensity, chip_num, rows, cols, chip_dim_rows);
+    }
+    return gzread_genericcel_file_intensities_stream(handle->gzinfile, handle->index, intensity, chip_num, rows, cols, chip_dim_rows);
+  case CEL_FORMAT_MULTICHANNEL:
+    /* the ABATCH_ values are the same as the MULTICHANNEL_ ones */
+    return read_genericcel_channel_stream(handle->infile, handle->index, handle->channel, which, intensity, chip_num);
+  case CEL_FORMAT_GZMULTICHANNEL:
+    return gzread_genericcel_channel_stream(handle->gzinfile, handle->index, handle->channel, which, intensity, chip_num);
+  default:
+    unknown_cel_format_error(filename);
+  }
+  return 1;
+}
+
+
+/*************************************************************************
+ **
+ ** static int read_cel_handle_blocks(cel_handle *handle, size_t rows, size_t chip_dim_rows, 
+ **                                   generic_column_sink sink, void *arg)
+ **
+ ** size_t rows - number of cells on the chip
+ ** size_t chip_dim_rows - cells in each row of the chip
+ **
+ ** reads the intensities of an open handle, passing them to sink a block
+ ** of cells at a time (a single cell for the text formats) rather than
+ ** storing them. Returns non zero if the file was corrupted.
+ **
+ *************************************************************************/
+
+static int read_cel_handle_blocks(cel_handle *handle, size_t rows, size_t chip_dim_rows, generic_column_sink sink, void *arg){
+
+  map_cel_handle(handle);
+
+  switch (handle->format){
+  case CEL_FORMAT_TEXT:
+    return read_cel_file_intensity_blocks(handle->infile, handle->filename, rows, chip_dim_rows, sink, arg);
+#if defined HAVE_ZLIB
+  case CEL_FORMAT_GZTEXT:
+    return read_gzcel_file_intensity_blocks(handle->gzinfile, handle->filename, rows, chip_dim_rows, sink, arg);
+#endif
+  case CEL_FORMAT_BINARY:
+    return read_binarycel_intensity_blocks(handle->header, &(handle->map), handle->data_offset, sink, arg);
+  case CEL_FORMAT_GZBINARY:
+    return gzread_binarycel_intensity_blocks(handle->header, sink, arg);
+  case CEL_FORMAT_GENERIC:
+    return read_genericcel_file_intensities_blocks(handle->infile, handle->index, sink, arg);
+  case CEL_FORMAT_GZGENERIC:
+    return gzread_genericcel_file_intensities_blocks(handle->gzinfile, handle->index, sink, arg);
+  case CEL_FORMAT_MULTICHANNEL:
+    return read_genericcel_channel_blocks(handle->infile, handle->index, handle->channel, sink, arg);
+  case CEL_FORMAT_GZMULTICHANNEL:
+    return gzread_genericcel_channel_blocks(handle->gzinfile, handle->index, handle->channel, sink, arg);
+  default:
+    unknown_cel_format_error(handle->filename);
+  }
+  return 1;
+}
+
+
+static int apply_masks_cel_handle(cel_handle *handle, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
+
+  /* read_cel_handle() leaves the stream just past the data set it read, unless 
+     the cell records were decoded from a mapping. The command console formats 
+     find the mask data sets through the index */
+
+  switch (handle->format){
+  case CEL_FORMAT_TEXT:
+    apply_masks_stream(handle->infile, intensity, chip_num, rows, cols, chip_dim_rows, rm_mask, rm_outliers);
+    break;
+#if defined HAVE_ZLIB
+  case CEL_FORMAT_GZTEXT:
+    gz_apply_masks_stream(handle->gzinfile, intensity, chip_num, rows, cols, chip_dim_rows, rm_mask, rm_outliers);
+    break;
+#endif
+  case CEL_FORMAT_BINARY:
+    binary_apply_masks_stream(handle->header, (handle->map.data != NULL), intensity, chip_num, rows, cols, chip_dim_rows, rm_mask, rm_outliers);
+    break;
+  case CEL_FORMAT_GZBINARY:
+    gz_binary_apply_masks_stream(handle->header, 0, intensity, chip_num, rows, cols, chip_dim_rows, rm_mask, rm_outliers);
+    break;
+  case CEL_FORMAT_GENERIC:
+    return generic_apply_masks_stream(handle->infile, handle->index, handle->nrows, intensity, chip_num, rows, cols, chip_dim_rows, rm_mask, rm_outliers);
+  case CEL_FORMAT_GZGENERIC:
+    return gzgeneric_apply_masks_stream(handle->gzinfile, handle->index, handle->nrows, intensity, chip_num, rows, cols, chip_dim_rows, rm_mask, rm_outliers);
+  case CEL_FORMAT_MULTICHANNEL:
+    genericcel_channel_apply_masks_stream(handle->infile, handle->index, handle->channel, handle->nrows, intensity, chip_num, rows, rm_mask, rm_outliers);
+    break;
+  case CEL_FORMAT_GZMULTICHANNEL:
+    gzgenericcel_channel_apply_masks_stream(handle->gzinfile, handle->index, handle->channel, handle->nrows, intensity, chip_num, rows, rm_mask, rm_outliers);
+    break;
+  default:
+    unknown_cel_format_error(handle->filename);
+  }
+  return 0;
+}
+
+
+static void free_cel_handle(cel_handle *handle){
+
+  close_cel_handle(handle);
+  if (handle->header != NULL){
+    delete_binary_header(handle->header);
+    handle->header = NULL;
+  }
+  if (handle->index != NULL){
+    Free_generic_data_set_index(handle->index);
+    Free(handle->index);
+    handle->index = NULL;
+  }
+}
+
+
+/* is the file of a handle still open (as it is straight after open_cel_handle()) */
+
+static int cel_handle_is_open(cel_handle *handle){
+
+  if (handle->header != NULL){
+    return (handle->header->infile != NULL || handle->header->gzinfile != NULL);
+  }
+  return (handle->infile != NULL || handle->gzinfile != NULL);
+}
+
+
+/* 
+   n_channels is 0 when single channel files are being read, otherwise the
+   number of channels each (multichannel) file should have 
+*/
+
+static void check_cel_handle_channels(cel_handle *handle, int n_channels){
+
+  int multichannel = (handle->format == CEL_FORMAT_MULTICHANNEL || handle->format == CEL_FORMAT_GZMULTICHANNEL);
+
+  if (n_channels == 0 && multichannel){
+    reader_error("The file %s is a multichannel CEL file",handle->filename);
+  }
+  if (n_channels > 0 && !multichannel){
+    reader_error("The file %s is not a multichannel CEL file",handle->filename);
+  }
+}
+
+
+/*************************************************************************
+ **
+ ** static int check_while_reading(void)
+ **
+ ** RETURNS non zero if the CHECK_ENV_VAR environment variable asks for
+ ** each CEL file to be checked against the reference CDF name and 
+ ** dimensions as it is read (from the header parsed to read it), rather 
+ ** than all the files being checked before any are read. 
+ **
+ ** Either way a file of the wrong type is an error() and nothing is 
+ ** returned, but checking while reading avoids opening and parsing the 
+ ** header of every file a second time. The price is that a bad file near
+ ** the end of a batch is only found after the files before it are read.
+ **
+ *************************************************************************/
+
+static int check_while_reading(void){
+
+  char *check = getenv(CHECK_ENV_VAR);
+
+  return (check != NULL && atoi(check) != 0);
+}
+
+
+/*************************************************************************
+ **
+ ** static void check_cel_file_cdf(const char *cur_file_name, const char *cdfName, int ref_dim_1, int ref_dim_2)
+ **
+ ** const char *cur_file_name - name of the CEL file
+ ** const char *cdfName - the reference CDF name
+ ** int ref_dim_1, ref_dim_2 - reference dimensions
+ **
+ ** Calls error() if the file is not of the reference chip type
+ **
+ *************************************************************************/
+
+static void check_cel_file_cdf(const char *cur_file_name, const char *cdfName, int ref_dim_1, int ref_dim_2){
+
+  cel_handle handle;
+
+  open_cel_handle(&handle, cur_file_name, cdfName, ref_dim_1, ref_dim_2);
+  free_cel_handle(&handle);
+}
+
+
+/*************************************************************************
+ **
+ ** static void abatch_read_cached_file(cel_handle *handle, double *column, size_t n_cells, 
+ **                                     int chip_dim_rows, int which, int rm_mask, int rm_outliers)
+ **
+ ** abatch_read_file() when the CEL file cache is enabled (see cel_cache.c).
+ ** Fills column (n_cells long) from the cached contents of the (already
+ ** checked) file, then sets MASKS/OUTLIERS to NA if requested.
+ **
+ *************************************************************************/
+
+static void abatch_read_cached_file(cel_handle *handle, double *column, size_t n_cells, int chip_dim_rows, int which, int rm_mask, int rm_outliers){
+
+  cached_cel cel;
+  const double *values;
+  int i;
+
+  read_cached_cel(handle->filename, (which != ABATCH_INTENSITY), &cel);
+  if (cel.n_cells != n_cells){
+    reader_error("Cel file %s does not seem to have the correct dimensions",handle->filename);
+  }
+
+  if (which == ABATCH_STDDEV){
+    values = cel.stddev;
+  } else if (which == ABATCH_NPIXELS){
+    values = cel.npixels;
+  } else {
+    values = cel.intensities;
+  }
+  memcpy(column, values, n_cells*sizeof(double));
+
+  if (rm_mask){
+    for (i=0; i < cel.nmasks; i++){
+      column[cel.masks_x[i] + chip_dim_rows*cel.masks_y[i]] = R_NaN;
+    }
+  }
+  if (rm_outliers){
+    for (i=0; i < cel.noutliers; i++){
+      column[cel.outliers_x[i] + chip_dim_rows*cel.outliers_y[i]] = R_NaN;
+    }
+  }
+
+  free_cached_cel(&cel);
+}
+
+
+/*************************************************************************
+ **
+ ** static void abatch_read_channels(cel_handle *handle, double *intensityMatrix, size_t chip_num, 
+ **                                  int ref_dim_1, int ref_dim_2, int n_files, int n_channels, 
+ **                                  int which, int rm_mask, int rm_outliers)
+ **
+ ** abatch_read_file() for a multichannel CEL file. intensityMatrix holds
+ ** a probes by chips matrix for each channel, one after the other (ie it 
+ ** is a probes by chips by channels array). Each channel of the file is 
+ ** read into column chip_num of its matrix, then has its masks applied.
+ **
+ *************************************************************************/
+
+static void abatch_read_channels(cel_handle *handle, double *intensityMatrix, size_t chip_num, int ref_dim_1, int ref_dim_2, int n_files, int n_channels, int which, int rm_mask, int rm_outliers){
+
+  int c;
+  size_t n_cells = (size_t)ref_dim_1*ref_dim_2;
+  double *channelMatrix;
+
+  if (!cel_handle_is_open(handle)){
+    reopen_cel_handle(handle);
+  }
+
+  for (c=0; c < n_channels; c++){
+    channelMatrix = intensityMatrix + (size_t)c*n_cells*n_files;
+    handle->channel = c;
+    if (read_cel_handle(handle, channelMatrix, chip_num, n_cells, n_files, ref_dim_1, which)){
+      reader_error("Could not read channel %d of the file %s. Do all the files have the same channels?\n", c + 1, handle->filename);
+    }
+    if (rm_mask || rm_outliers){
+      apply_masks_cel_handle(handle, channelMatrix, chip_num, n_cells, n_files, ref_dim_1, rm_mask, rm_outliers);
+    }
+  }
+}
+
+
+/*************************************************************************
+ **
+ ** static void abatch_read_file(cel_handle *handle, double *intensityMatrix, float *float32Matrix, 
+ **                              abatch_store *store, double *scratch, size_t chip_num, int ref_dim_1, int ref_dim_2, 
+ **                              int n_files, int n_channels, int which, int rm_mask, int rm_outliers, int verbose, 
+ **                              const char *prefetch_name)
+ **
+ ** cel_handle *handle - the (already checked) CEL file. Either closed, or still
+ **                      open at the cell data from open_cel_handle()
+ ** double *intensityMatrix - matrix to fill (probes by chips)
+ ** float *float32Matrix - if not NULL, the single precision matrix to fill instead. 
+ **                        The file is read into scratch (ref_dim_1*ref_dim_2 long) 
+ **                        and then narrowed into its column
+ ** abatch_store *store - if not NULL, the on disk store to fill instead, again
+ **                       through scratch (see abatch_store.c)
+ ** size_t chip_num - which column to fill
+ ** int n_channels - 0 for single channel CEL files, otherwise the number of channels
+ **                  of the multichannel files being read (see abatch_read_channels(),
+ **                  float32Matrix and store must then be NULL)
+ ** int which - one of ABATCH_INTENSITY, ABATCH_STDDEV, ABATCH_NPIXELS
+ ** int rm_mask, rm_outliers - if true set MASKS/OUTLIERS to NA
+ ** const char *prefetch_name - the file likely to be read next (or NULL), which
+ **                             is paged in while this one is being decoded
+ **
+ ** reads a single CEL file into its column of the matrix and then
+ ** applies masks/outliers to that column if requested
+ **
+ *************************************************************************/
+
+static void abatch_read_file(cel_handle *handle, double *intensityMatrix, float *float32Matrix, abatch_store *store, double *scratch, size_t chip_num, int ref_dim_1, int ref_dim_2, int n_files, int n_channels, int which, int rm_mask, int rm_outliers, int verbose, const char *prefetch_name){
+
+  int status;
+  size_t n_cells = (size_t)ref_dim_1*ref_dim_2;
+  size_t column = chip_num;
+
+  if (float32Matrix != NULL || store != NULL){
+    intensityMatrix = scratch;
+    chip_num = 0;
+    n_files = 1;
+  }
+
+  if (verbose){
+    Rprintf("Reading in : %s\n",handle->filename);
+  }
+
+  if (prefetch_name != NULL){
+    prefetch_file(prefetch_name);
+  }
+
+  check_cel_handle_channels(handle, n_channels);
+
+  if (n_channels > 0){
+    abatch_read_channels(handle, intensityMatrix, chip_num, ref_dim_1, ref_dim_2, n_files, n_channels, which, rm_mask, rm_outliers);
+  } else if (cel_cache_enabled()){
+    abatch_read_cached_file(handle, intensityMatrix + chip_num*n_cells, n_cells, ref_dim_1, which, rm_mask, rm_outliers);
+  } else {
+    /* still open if it was only just checked */
+    if (!cel_handle_is_open(handle)){
+      reopen_cel_handle(handle);
+    }
+    
+    status = read_cel_handle(handle, intensityMatrix, chip_num, ref_dim_1*ref_dim_2, n_files, ref_dim_1, which);
+    
+    /* the text parsers warn about truncated files themselves and the partial data is kept */
+    if (status && handle->format != CEL_FORMAT_TEXT && handle->format != CEL_FORMAT_GZTEXT){
+      reader_error("It appears that the file %s is corrupted.\n",handle->filename);
+    }
+    
+    if ((rm_mask || rm_outliers) && apply_masks_cel_handle(handle, intensityMatrix, chip_num, ref_dim_1*ref_dim_2, n_files, ref_dim_1, rm_mask, rm_outliers)){
+      reader_error("It appears that the file %s is corrupted.\n",handle->filename);
+    }
+  }
+
+  close_cel_handle(handle);
+
+  if (float32Matrix != NULL){
+    float32_store(scratch, float32Matrix + column*n_cells, n_cells);
+  }
+  if (store != NULL){
+    write_abatch_store_column(store, column, scratch);
+  }
+}
+
+
+/*************************************************************************
+ **
+ ** Helpers for the threaded readers
+ **
+ ** num_threads_to_use() - how many threads to use (from the R_THREADS 
+ **                        environment variable) but never more than there 
+ **                        are files
+ ** next_queued_file()   - take the next unclaimed file from a queue. 
+ **                        returns -1 once all the files have been handed out,
+ **                        or once the queue has been stopped
+ ** stop_file_queue()    - hand out no more files (one has failed)
+ ** run_threads()        - start num_threads threads and wait for them all to 
+ **                        finish. Thread t is passed args + t*arg_size, so
+ **                        arg_size = 0 gives each thread the same arguments.
+ **                        A single "thread", or one that could not be 
+ **                        started, is run on the calling thread instead
+ **
+ *************************************************************************/
+
+static void init_file_queue(struct file_queue *queue, int n_files){
+#ifdef USE_PTHREADS
+  pthread_mutex_init(&(queue->lock), NULL);
+#endif
+  queue->next_file = 0;
+  queue->n_files = n_files;
+  queue->stopped = 0;
+}
+
+
+static void destroy_file_queue(struct file_queue *queue){
+#ifdef USE_PTHREADS
+  pthread_mutex_destroy(&(queue->lock));
+#endif
+}
+
+
+static int next_queued_file(struct file_queue *queue){
+  int num = -1;
+
+#ifdef USE_PTHREADS
+  pthread_mutex_lock(&(queue->lock));
+#endif
+  if (queue->next_file < queue->n_files && !queue->stopped){
+    num = queue->next_file;
+    queue->next_file++;
+  }
+#ifdef USE_PTHREADS
+  pthread_mutex_unlock(&(queue->lock));
+#endif
+  return num;
+}
+
+
+#ifdef USE_PTHREADS
+
+static int num_threads_to_use(int n_files){
+
+  char *nthreads;
+  int num_threads = 1;
+
+  nthreads = getenv(THREADS_ENV_VAR);
+  if(nthreads != NULL){
+    num_threads = atoi(nthreads);
+    if(num_threads <= 0){
+      error("The number of threads (enviroment variable %s) must be a positive integer, but the specified value was %s", THREADS_ENV_VAR, nthreads);
+    }
+  }
+  if (num_threads > n_files){
+    num_threads = n_files;
+  }
+  if (num_threads < 1){
+    num_threads = 1;
+  }
+  return num_threads;
+}
+
+
+static void run_threads(void *(*start_routine)(void *), void *args, size_t arg_size, int num_threads){
+
+  pthread_t *threads;
+  pthread_attr_t attr;
+  int *started;
+  int i;
+  size_t stacksize = PTHREAD_STACK_MIN + 0x40000;
+
+  if (num_threads <= 1){
+    start_routine(args);
+    return;
+  }
+
+  threads = (pthread_t *) Calloc(num_threads, pthread_t);
+  started = Calloc(num_threads, int);
+
+  /* Initialize and set thread detached attribute */
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+  pthread_attr_setstacksize (&attr, stacksize);
+
+  for (i =0; i < num_threads; i++){
+    started[i] = (pthread_create(&threads[i], &attr, start_routine, (void *) ((char *) args + i*arg_size)) == 0);
+    if (!started[i]){
+      /* do this share here instead */
+      start_routine((void *) ((char *) args + i*arg_size));
+    }
+  }
+  /* Wait for the other threads */
+  for(i = 0; i < num_threads; i++){
+    if (started[i]){
+      pthread_join(threads[i], NULL);
+    }
+  }
+  pthread_attr_destroy(&attr);
+  Free(started);
+  Free(threads);
+}
+#endif
+
+
+/*************************************************************************
+ **
+ ** A batch of CEL files being read by read_abatch_files(), shared by
+ ** all the threads. Each file is a job (abatch_file_job()): open and 
+ ** check it, read it, or both.
+ **
+ *************************************************************************/
+
+struct abatch_thread_data{
+  const char **filenames;
+  cel_handle *handles;
+  double *intensityMatrix;
+  float *float32Matrix;
+  abatch_store *store;
+  const char *cdfName;
+  int n_files;
+  int n_channels;
+  int ref_dim_1;
+  int ref_dim_2;
+  int which;
+  int rm_mask;
+  int rm_outliers;
+  int verbose;        /* only when the files are read on the main thread */
+  int num_threads;
+  int open;           /* what is done with each file */
+  int read;
+  int failed_file;    /* the first file that could not be checked or read, or -1 */
+  char message[READER_MESSAGE_SIZE];  /* and why */
+  char **warnings;    /* any warnings for each file */
+  struct file_queue *queue;
+};
+
+
+/* 
+   file num of a queue has failed with message: stop the queue and keep the message
+   in failed_message (READER_MESSAGE_SIZE long) if it is the first file to fail
+*/
+
+static void record_file_failure(struct file_queue *queue, int *failed_file, char *failed_message, int num, const char *message){
+
+#ifdef USE_PTHREADS
+  pthread_mutex_lock(&(queue->lock));
+#endif
+  queue->stopped = 1;
+  if (*failed_file < 0 || num < *failed_file){
+    *failed_file = num;
+    strcpy(failed_message, message);
+  }
+#ifdef USE_PTHREADS
+  pthread_mutex_unlock(&(queue->lock));
+#endif
+}
+
+
+/*************************************************************************
+ **
+ ** static int abatch_file_job(struct abatch_thread_data *args, reader_trap *trap, int num, double *scratch)
+ **
+ ** opens (and checks) file num of the batch if args->open, then reads it 
+ ** into its column if args->read, otherwise closes it again. A problem 
+ ** with the file is caught in trap and recorded in args, which stops any 
+ ** more files being handed out.
+ **
+ ** RETURNS 0 if all went well, otherwise 1
+ **
+ *************************************************************************/
+
+static int abatch_file_job(struct abatch_thread_data *args, reader_trap *trap, int num, double *scratch){
+
+  trap->warnings = NULL;
+  set_reader_trap(trap);
+  if (setjmp(trap->env) != 0){
+    /* reader_error() has already unset the trap */
+    args->warnings[num] = trap->warnings;
+    record_file_failure(args->queue, &(args->failed_file), args->message, num, trap->message);
+    return 1;
+  }
+
+  if (args->open){
+    open_cel_handle(&(args->handles[num]), args->filenames[num], args->cdfName, args->ref_dim_1, args->ref_dim_2);
+  }
+  if (args->read){
+    /* the other threads are busy with the files in between */
+    abatch_read_file(&(args->handles[num]), args->intensityMatrix, args->float32Matrix, args->store, scratch, num, args->ref_dim_1, args->ref_dim_2, args->n_files, args->n_channels,
+		     args->which, args->rm_mask, args->rm_outliers, args->verbose,
+		     (num + args->num_threads < args->n_files ? args->filenames[num + args->num_threads] : NULL));
+  } else {
+    close_cel_handle(&(args->handles[num]));
+  }
+
+  set_reader_trap(NULL);
+  args->warnings[num] = trap->warnings;
+  return 0;
+}
+
+
+static void *abatch_group(void *data){
+  int num;
+  struct abatch_thread_data *args = (struct abatch_thread_data *) data;
+  reader_trap trap;
+  double *scratch = NULL;
+
+  if (args->read && (args->float32Matrix != NULL || args->store != NULL)){
+    scratch = Calloc((size_t)args->ref_dim_1*args->ref_dim_2, double);
+  }
+  while ((num = next_queued_file(args->queue)) >= 0){
+    abatch_file_job(args, &trap, num, scratch);
+  }
+  if (scratch != NULL){
+    Free(scratch);
+  }
+  return NULL;
+}
+
+
+/* one pass over the files of the batch (with R_THREADS threads) */
+
+static void run_abatch_pass(struct abatch_thread_data *args, int open, int read){
+
+  struct file_queue queue;
+
+  args->open = open;
+  args->read = read;
+  args->queue = &queue;
+  init_file_queue(&queue, args->n_files);
+#ifdef USE_PTHREADS
+  run_threads(abatch_group, args, 0, args->num_threads);
+#else
+  abatch_group(args);
+#endif
+  destroy_file_queue(&queue);
+  args->queue = NULL;
+}
+
+
+/*************************************************************************
+ **
+ ** static int read_abatch_files(const char **file_names, int n_files, int n_channels, const char *cdfName, 
+ **                              int ref_dim_1, int ref_dim_2, int which, int mask_flag, 
+ **                              int outlier_flag, int verbose_flag, double *intensityMatrix, 
+ **                              float *float32Matrix, abatch_store *store, char *message)
+ **
+ ** const char **file_names - the CEL files to read
+ ** int n_channels - 0, or the number of channels of multichannel files (see abatch_read_file())
+ ** double *intensityMatrix, float *float32Matrix, abatch_store *store - where
+ **          to put them, one column per file. Only one is not NULL.
+ ** char *message - READER_MESSAGE_SIZE long, set to the problem if one of 
+ **                 the files could not be read
+ **
+ ** First all the files are checked against the reference CDF name and
+ ** dimensions, then each file is read (and masks applied). The format,
+ ** header and start of the cell data of each file are found during the 
+ ** check and kept (in a cel_handle) for the read. With pthreads
+ ** both steps are carried out by R_THREADS threads, each taking the next
+ ** file from a shared queue. If check_while_reading() each file is instead 
+ ** checked as it is opened for reading and there is no separate check step.
+ **
+ ** Once a file fails no more are started. The threads make no R API 
+ ** calls: any warnings are printed once they have finished, and the 
+ ** caller, after freeing what it allocated, calls error() with message.
+ **
+ ** RETURNS 0 if all the files were read, otherwise 1
+ **
+ *************************************************************************/
+
+static int read_abatch_files(const char **file_names, int n_files, int n_channels, const char *cdfName, int ref_dim_1, int ref_dim_2, int which, int mask_flag, int outlier_flag, int verbose_flag, double *intensityMatrix, float *float32Matrix, abatch_store *store, char *message){
+
+  int i; 
+  int check_first = !check_while_reading();
+  int num_threads = 1;
+  struct abatch_thread_data args;
+
+#ifdef USE_PTHREADS
+  num_threads = num_threads_to_use(n_files);
+#endif
+
+  args.filenames = file_names;
+  args.handles = Calloc(n_files, cel_handle);
+  args.intensityMatrix = intensityMatrix;
+  args.float32Matrix = float32Matrix;
+  args.store = store;
+  args.cdfName = cdfName;
+  args.n_files = n_files;
+  args.n_channels = n_channels;
+  args.ref_dim_1 = ref_dim_1;
+  args.ref_dim_2 = ref_dim_2;
+  args.which = which;
+  args.rm_mask = mask_flag;
+  args.rm_outliers = outlier_flag;
+  args.verbose = (num_threads == 1 ? verbose_flag : 0);
+  args.num_threads = num_threads;
+  args.failed_file = -1;
+  args.warnings = Calloc(n_files, char *);
+  args.queue = NULL;
+
+  if (check_first){
+    /* before we do any real reading check that all the files are of the same cdf type */
+    run_abatch_pass(&args, 1, 0);
+  }
+
+  if (args.failed_file < 0){
+    if (verbose_flag && num_threads > 1){
+      /* the threads can't print, so list the files now */
+      for (i =0; i < n_files; i++){
+	Rprintf("Reading in : %s\n",file_names[i]);
+      }
+    }
+    /* now read in each of the cel files filling out the columns of the matrix */
+    run_abatch_pass(&args, !check_first, 1);
+  }
+
+  for (i =0; i < n_files; i++){
+    free_cel_handle(&(args.handles[i]));
+    if (args.warnings[i] != NULL){
+      Rprintf("%s", args.warnings[i]);
+      Free(args.warnings[i]);
+    }
+  }
+  Free(args.warnings);
+  Free(args.handles);
+
+  if (args.failed_file >= 0){
+    strcpy(message, args.message);
+    return 1;
+  }
+  return 0;
+}
+
+
+/* the mask and outlier flags of read_abatch, rm_extra overriding the other two */
+
+static void abatch_mask_flags(SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, int *mask_flag, int *outlier_flag){
+
+  if (asInteger(rm_extra)){
+    *mask_flag = 1;
+    *outlier_flag = 1;
+  } else {
+    *mask_flag = asInteger(rm_mask);
+    *outlier_flag = asInteger(rm_outliers);
+  }
+}
+
+
+/*************************************************************************
+ **
+ ** static SEXP multichannel_channel_names(SEXP filenames)
+ **
+ ** RETURNS (unprotected) the names of the channels of the first of the
+ ** files, which must be a multichannel CEL file. The other files are 
+ ** expected to have the same channels.
+ **
+ *************************************************************************/
+
+static SEXP multichannel_channel_names(SEXP filenames){
+
+  int k, n_channels, format;
+  const char *filename;
+  char *name;
+
+  SEXP names;
+
+  if (GET_LENGTH(filenames) == 0){
+    error("No CEL files to read");
+  }
+  filename = CHAR(STRING_ELT(filenames, 0));
+  format = determine_cel_format(filename);
+
+  if (format == CEL_FORMAT_MULTICHANNEL){
+    n_channels = multichannel_determine_number_channels(filename);
+  } else if (format == CEL_FORMAT_GZMULTICHANNEL){
+    n_channels = gzmultichannel_determine_number_channels(filename);
+  } else {
+    error("The file %s is not a multichannel CEL file",filename);
+  }
+
+  PROTECT(names = allocVector(STRSXP, n_channels));
+  for (k=0; k < n_channels; k++){
+    if (format == CEL_FORMAT_MULTICHANNEL){
+      name = multichannel_determine_channel_name(filename, k);
+    } else {
+      name = gzmultichannel_determine_channel_name(filename, k);
+    }
+    SET_STRING_ELT(names, k, mkChar(name != NULL ? name : ""));
+    if (name != NULL){
+      Free(name);
+    }
+  }
+  UNPROTECT(1);
+  return names;
+}
+
+
+/*************************************************************************
+ **
+ ** static SEXP read_abatch_matrix(SEXP filenames, SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, 
+ **                                SEXP ref_cdfName, SEXP ref_dim, SEXP verbose, int which, int float32,
+ **                                int multichannel)
+ **
+ ** arguments as for read_abatch, plus
+ ** int which - one of ABATCH_INTENSITY, ABATCH_STDDEV, ABATCH_NPIXELS
+ ** int float32 - if true the matrix is single precision (see float32_functions.c)
+ ** int multichannel - if true the files are multichannel CEL files
+ **
+ ** RETURNS a matrix with one column per CEL file, columns named by file.
+ ** For multichannel files a probes by files by channels array, the
+ ** third dimension named by channel. The files are read by read_abatch_files().
+ **
+ *************************************************************************/
+
+static SEXP read_abatch_matrix(SEXP filenames, SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose, int which, int float32, int multichannel){
+
+  int i; 
+  
+  int n_files;
+  int n_channels = 0;
+  int ref_dim_1, ref_dim_2;
+  int mask_flag, outlier_flag;
+  int failed;
+
+  const char *cur_file_name;
+  const char *cdfName;
+  const char **file_names;
+  char message[READER_MESSAGE_SIZE];
+  double *intensityMatrix = NULL;
+  float *float32Matrix = NULL;
+
+  SEXP intensity,names,dimnames,channel_names = R_NilValue;
+
+  ref_dim_1 = INTEGER(ref_dim)[0];
+  ref_dim_2 = INTEGER(ref_dim)[1];
+  
+  n_files = GET_LENGTH(filenames);
+  
+  if (multichannel){
+    PROTECT(channel_names = multichannel_channel_names(filenames));
+    n_channels = GET_LENGTH(channel_names);
+    PROTECT(intensity = alloc3DArray(REALSXP, ref_dim_1*ref_dim_2, n_files, n_channels));
+    intensityMatrix = NUMERIC_POINTER(intensity);
+  } else if (float32){
+    PROTECT(intensity = allocFloat32Matrix(ref_dim_1*ref_dim_2, n_files));
+    float32Matrix = FLOAT32_POINTER(intensity);
+  } else {
+    PROTECT(intensity = allocMatrix(REALSXP, ref_dim_1*ref_dim_2, n_files));
+    intensityMatrix = NUMERIC_POINTER(AS_NUMERIC(intensity));
+  }
+  
+  cdfName = CHAR(STRING_ELT(ref_cdfName,0));
+
+  abatch_mask_flags(rm_mask, rm_outliers, rm_extra, &mask_flag, &outlier_flag);
+
+  /* get the filenames now, so no R API calls are needed while reading */
+  file_names = Calloc(n_files, const char *);
+  for (i =0; i < n_files; i++){
+    file_names[i] = CHAR(STRING_ELT(filenames, i));
+  }
+
+  failed = read_abatch_files(file_names, n_files, n_channels, cdfName, ref_dim_1, ref_dim_2, which, mask_flag, outlier_flag, asInteger(verbose),
+			     intensityMatrix, float32Matrix, NULL, message);
+
+  Free(file_names);
+  if (failed){
+    error("%s", message);
+  }
+
+  PROTECT(dimnames = allocVector(VECSXP,(multichannel ? 3 : 2)));
+  PROTECT(names = allocVector(STRSXP,n_files));
+  for ( i =0; i < n_files; i++){
+    cur_file_name = CHAR(STRING_ELT(filenames, i));
+    SET_STRING_ELT(names,i,mkChar(cur_file_name));
+  }
+  SET_VECTOR_ELT(dimnames,1,names);
+  if (multichannel){
+    SET_VECTOR_ELT(dimnames,2,channel_names);
+  }
+  setAttrib(intensity, R_DimNamesSymbol, dimnames);
+  
+
+  UNPROTECT(multichannel ? 4 : 3);
+  
+  return intensity;  
+}
+
+
+/****************************************************************
+ ****************************************************************
+ **
+ ** This is the code that interfaces with R
+ **
+ ***************************************************************
+ ***************************************************************/
+
+/************************************************************************
+ **
+ **  SEXP read_abatch(SEXP filenames, SEXP compress,  
+ **                   SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, 
+ **                   SEXP ref_cdfName)
+ **
+ ** SEXP filenames - an R character vector of filenames to read
+ ** SEXP compress  - logical flag TRUE means files are *.gz
+ ** SEXP rm_mask   - if true set MASKS  to NA
+ ** SEXP rm_outliers - if true set OUTLIERS to NA
+ ** SEXP rm_extra    - if true  overrides rm_mask and rm_outliers settings
+ ** SEXP ref_cdfName - the reference CDF name to check each CEL file against 
+ ** SEXP ref_dim     - cols/rows of reference chip
+ ** SEXP verbose     - if verbose print out more information to the screen
  **
  ** RETURNS an intensity matrix with cel file intensities from
  ** each chip in columns
@@ -3880,194 +5677,189 @@ static void gzbinary_get_masks_outliers(const char *filename, int *nmasks, short
  *************************************************************************/
 
 SEXP read_abatch(SEXP filenames, SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose){
-  
-  int i; 
-  
-  int n_files;
-  int ref_dim_1, ref_dim_2;
 
-  const char *cur_file_name;
-  const char *cdfName;
-  double *intensityMatrix;
+  if (!isString(filenames))
+    error("read_abatch: filenames argument must be a character vector");
 
-  SEXP intensity,names,dimnames;
+  return read_abatch_matrix(filenames, rm_mask, rm_outliers, rm_extra, ref_cdfName, ref_dim, verbose, ABATCH_INTENSITY, 0, 0);
+}
+
+
+/************************************************************************
+ **
+ **  SEXP read_abatch_float32(SEXP filenames, SEXP rm_mask, SEXP rm_outliers, 
+ **                           SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose)
+ **
+ ** arguments as for read_abatch
+ **
+ ** RETURNS the intensity matrix as read_abatch, but stored in single 
+ ** precision (an integer matrix with attribute float32, see 
+ ** float32_functions.c) so taking half the memory. 
+ **
+ *************************************************************************/
+
+SEXP read_abatch_float32(SEXP filenames, SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose){
 
   if (!isString(filenames))
-    error("read_abatch: filenames argument must be a character vector");
+    error("read_abatch_float32: filenames argument must be a character vector");
 
-  ref_dim_1 = INTEGER(ref_dim)[0];
-  ref_dim_2 = INTEGER(ref_dim)[1];
-  
-  n_files = GET_LENGTH(filenames);
-  
-  PROTECT(intensity = allocMatrix(REALSXP, ref_dim_1*ref_dim_2, n_files));
-  
-  cdfName = CHAR(STRING_ELT(ref_cdfName,0));
-  intensityMatrix = NUMERIC_POINTER(AS_NUMERIC(intensity));
+  return read_abatch_matrix(filenames, rm_mask, rm_outliers, rm_extra, ref_cdfName, ref_dim, verbose, ABATCH_INTENSITY, 1, 0);
+}
+
+
+/************************************************************************
+ **
+ **  SEXP read_abatch_multichannel(SEXP filenames, SEXP rm_mask, SEXP rm_outliers, 
+ **                                SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose)
+ **
+ ** arguments as for read_abatch, but the files are multichannel CEL files
+ ** all with the channels of the first
+ **
+ ** RETURNS a probes by chips by channels array of intensities, the 
+ ** third dimension named by channel. So [, , k] is the matrix read_abatch
+ ** would give for channel k. 
+ **
+ ** The files are read (threaded as for read_abatch) with a single pass
+ ** through each, the channels being read in the order they are in the file.
+ **
+ *************************************************************************/
 
+SEXP read_abatch_multichannel(SEXP filenames, SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose){
 
+  if (!isString(filenames))
+    error("read_abatch_multichannel: filenames argument must be a character vector");
+
+  return read_abatch_matrix(filenames, rm_mask, rm_outliers, rm_extra, ref_cdfName, ref_dim, verbose, ABATCH_INTENSITY, 0, 1);
+}
 
-  /* before we do any real reading check that all the files are of the same cdf type */
 
+/************************************************************************
+ **
+ **  SEXP read_abatch_store(SEXP filenames, SEXP rm_mask, SEXP rm_outliers, 
+ **                         SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, 
+ **                         SEXP verbose, SEXP store_path, SEXP overwrite)
+ **
+ ** arguments as for read_abatch, plus
+ ** SEXP store_path - the file to create
+ ** SEXP overwrite - if TRUE an existing file at store_path is replaced,
+ **                  otherwise it is an error for there to be one
+ **
+ ** RETURNS a description of the store (see R_abatch_store_info)
+ **
+ ** rather than into a matrix in memory the intensities are read into 
+ ** an on disk store (see abatch_store.c), one file at a time per thread.
+ ** So only a single chip per thread need be held in memory however 
+ ** large the batch. 
+ **
+ *************************************************************************/
+
+SEXP read_abatch_store(SEXP filenames, SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose, SEXP store_path, SEXP overwrite){
+
+  int i, n_files;
+  int mask_flag, outlier_flag;
+  const char **file_names;
+  char message[READER_MESSAGE_SIZE];
+  abatch_store *store;
+
+  if (!isString(filenames))
+    error("read_abatch_store: filenames argument must be a character vector");
+
+  n_files = GET_LENGTH(filenames);
+  abatch_mask_flags(rm_mask, rm_outliers, rm_extra, &mask_flag, &outlier_flag);
+
+  store = create_abatch_store(CHAR(STRING_ELT(store_path,0)), CHAR(STRING_ELT(ref_cdfName,0)), INTEGER(ref_dim)[0], INTEGER(ref_dim)[1], asLogical(overwrite) == TRUE);
+
+  file_names = Calloc(n_files, const char *);
   for (i =0; i < n_files; i++){
-    cur_file_name = CHAR(STRING_ELT(filenames, i));
-    if (isTextCelFile(cur_file_name)){
-      if (check_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-      }
-    } else if (isgzTextCelFile(cur_file_name)){
-#if defined HAVE_ZLIB
-      if (check_gzcel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-      }
-      
-#else
-       error("Compress option not supported on your platform\n");
-#endif
-     } else if (isBinaryCelFile(cur_file_name)){
-      
-       if (check_binary_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-     } else if (isgzBinaryCelFile(cur_file_name)){
-      
-       if (check_gzbinary_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-    } else if(isGenericCelFile(cur_file_name)){
-      if (check_generic_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-    } else if(isgzGenericCelFile(cur_file_name)){
-      if (check_gzgeneric_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-    } else {
-#if defined HAVE_ZLIB
-       error("Is %s really a CEL file? tried reading as text, gzipped text, binary, gzipped binary, command console and gzipped command console formats..\n",cur_file_name);
-#else
-       error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",cur_file_name);
-#endif
-     }
+    file_names[i] = CHAR(STRING_ELT(filenames, i));
   }
 
-  /* 
-     Now read in each of the cel files, one by one, filling out the columns of the intensity matrix.
-  */
-  
-  for (i=0; i < n_files; i++){ 
-      cur_file_name = CHAR(STRING_ELT(filenames, i));
-      if (asInteger(verbose)){
-	Rprintf("Reading in : %s\n",cur_file_name);
-      }
-      if (isTextCelFile(cur_file_name)){
-	read_cel_file_intensities(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1);
-      } else if (isgzTextCelFile(cur_file_name)){
-#if defined HAVE_ZLIB
-	read_gzcel_file_intensities(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1);
-#else
-	error("Compress option not supported on your platform\n");
-#endif
-      } else if (isBinaryCelFile(cur_file_name)){
-	if (read_binarycel_file_intensities(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1)){
-	  error("It appears that the file %s is corrupted.\n",cur_file_name);
-	}
-      } else if (isgzBinaryCelFile(cur_file_name)){
-	if (gzread_binarycel_file_intensities(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1)){
-	  error("It appears that the file %s is corrupted.\n",cur_file_name);
-	}
-      } else if (isGenericCelFile(cur_file_name)){ 
-	if (read_genericcel_file_intensities(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1)){
-	  error("It appears that the file %s is corrupted.\n",cur_file_name);
-	}
-      }  else if (isgzGenericCelFile(cur_file_name)){ 
-	if (gzread_genericcel_file_intensities(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1)){
-	  error("It appears that the file %s is corrupted.\n",cur_file_name);
-	}
-      } else {
-#if defined HAVE_ZLIB
-       error("Is %s really a CEL file? tried reading as text, gzipped text, binary, gzipped binary, command console and gzipped command console formats.\n",cur_file_name);
-#else
-       error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",cur_file_name);
-#endif
-    }
-
+  reserve_abatch_store(store, n_files);
+  if (read_abatch_files(file_names, n_files, 0, store->cdfName, store->dim1, store->dim2, ABATCH_INTENSITY, mask_flag, outlier_flag, asInteger(verbose),
+			NULL, NULL, store, message)){
+    /* an unfinished new store holds nothing worth keeping */
+    close_abatch_store(store);
+    remove(CHAR(STRING_ELT(store_path,0)));
+    Free(file_names);
+    error("%s", message);
   }
-  
+  finish_abatch_store(store, file_names, n_files);
+  close_abatch_store(store);
 
-  /* Now lets go through all the files  filling in masks etc */
+  Free(file_names);
 
+  return R_abatch_store_info(store_path);
+}
 
-  if (asInteger(rm_mask) || asInteger(rm_outliers) || asInteger(rm_extra)){
-    for (i=0; i < n_files; i++){ 
-      cur_file_name = CHAR(STRING_ELT(filenames,i));
-      if (isTextCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      } else if (isgzTextCelFile(cur_file_name)){
-#if defined HAVE_ZLIB	
-	if (asInteger(rm_extra)){
-	  gz_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  gz_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-#else
-	error("Compress option not supported on your platform\n");
-#endif
-      } else if (isBinaryCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  binary_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  binary_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      } else if (isgzBinaryCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  gz_binary_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  gz_binary_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      } else if (isGenericCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  generic_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  generic_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      } else if (isgzGenericCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  gzgeneric_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  gzgeneric_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      } else {
-#if defined HAVE_ZLIB
-       error("Is %s really a CEL file? tried reading as text, gzipped text, binary and gzipped binary.\n",cur_file_name);
-#else
-       error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",cur_file_name);
-#endif
-      }
-      
 
+/************************************************************************
+ **
+ **  SEXP append_abatch_store(SEXP filenames, SEXP rm_mask, SEXP rm_outliers, 
+ **                           SEXP rm_extra, SEXP verbose, SEXP store_path)
+ **
+ ** arguments as for read_abatch_store
+ **
+ ** RETURNS a description of the store (see R_abatch_store_info)
+ **
+ ** adds the CEL files in filenames to the end of an existing store
+ ** without touching the arrays already in it. The new files are checked
+ ** against the CDF name and dimensions recorded in the store, exactly as
+ ** read_abatch checks them, and must not already be in the store nor be
+ ** given more than once. The
+ ** store only grows to include them once they have all been read.
+ **
+ *************************************************************************/
+
+SEXP append_abatch_store(SEXP filenames, SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP verbose, SEXP store_path){
+
+  int i, n_files;
+  size_t j;
+  int mask_flag, outlier_flag;
+  const char **file_names;
+  char message[READER_MESSAGE_SIZE];
+  abatch_store *store;
+
+  if (!isString(filenames))
+    error("append_abatch_store: filenames argument must be a character vector");
+
+  n_files = GET_LENGTH(filenames);
+  abatch_mask_flags(rm_mask, rm_outliers, rm_extra, &mask_flag, &outlier_flag);
 
+  store = open_abatch_store(CHAR(STRING_ELT(store_path,0)), 1);
 
+  file_names = Calloc(n_files, const char *);
+  for (i =0; i < n_files; i++){
+    file_names[i] = CHAR(STRING_ELT(filenames, i));
+    for (j=0; j < store->n_arrays; j++){
+      if (strcmp(file_names[i], store->array_names[j]) == 0){
+	Free(file_names);
+	close_abatch_store(store);
+	error("The CEL file %s is already in the intensity store",CHAR(STRING_ELT(filenames, i)));
+      }
+    }
+    for (j=0; j < (size_t)i; j++){
+      if (strcmp(file_names[i], file_names[j]) == 0){
+	Free(file_names);
+	close_abatch_store(store);
+	error("The CEL file %s is given more than once",CHAR(STRING_ELT(filenames, i)));
+      }
     }
   }
-  
-  PROTECT(dimnames = allocVector(VECSXP,2));
-  PROTECT(names = allocVector(STRSXP,n_files));
-  for ( i =0; i < n_files; i++){
-    cur_file_name = CHAR(STRING_ELT(filenames, i));
-    SET_STRING_ELT(names,i,mkChar(cur_file_name));
+
+  reserve_abatch_store(store, n_files);
+  if (read_abatch_files(file_names, n_files, 0, store->cdfName, store->dim1, store->dim2, ABATCH_INTENSITY, mask_flag, outlier_flag, asInteger(verbose),
+			NULL, NULL, store, message)){
+    /* the header was not rewritten, so the store still describes just the arrays it had */
+    close_abatch_store(store);
+    Free(file_names);
+    error("%s", message);
   }
-  SET_VECTOR_ELT(dimnames,1,names);
-  setAttrib(intensity, R_DimNamesSymbol, dimnames);
-  
+  finish_abatch_store(store, file_names, n_files);
+  close_abatch_store(store);
 
-  UNPROTECT(3);
-  
-  return intensity;  
+  Free(file_names);
+
+  return R_abatch_store_info(store_path);
 }
 
 /*************************************************************************
@@ -4102,30 +5894,33 @@ SEXP ReadHeader(SEXP filename){
   
 
 
-  /* check for type text, gzipped text or binary then ReadHeader */
+  /* check for type text, gzipped text, binary or command console then ReadHeader */
 
-  if (isTextCelFile(cur_file_name)){
+  switch (determine_cel_format(cur_file_name)){
+  case CEL_FORMAT_TEXT:
     cdfName = get_header_info(cur_file_name, &ref_dim_1,&ref_dim_2);
-  } else if (isgzTextCelFile(cur_file_name)){
+    break;
 #if defined HAVE_ZLIB
+  case CEL_FORMAT_GZTEXT:
     cdfName = gz_get_header_info(cur_file_name, &ref_dim_1,&ref_dim_2);
-#else
-    error("Compress option not supported on your platform\n");
+    break;
 #endif
-  } else if (isBinaryCelFile(cur_file_name)){
+  case CEL_FORMAT_BINARY:
     cdfName = binary_get_header_info(cur_file_name, &ref_dim_1,&ref_dim_2);
-  } else if (isgzBinaryCelFile(cur_file_name)){
+    break;
+  case CEL_FORMAT_GZBINARY:
     cdfName = gzbinary_get_header_info(cur_file_name, &ref_dim_1,&ref_dim_2);
-  } else if (isGenericCelFile(cur_file_name)){
+    break;
+  case CEL_FORMAT_GENERIC:
+  case CEL_FORMAT_MULTICHANNEL:
     cdfName = generic_get_header_info(cur_file_name, &ref_dim_1,&ref_dim_2);
-  } else if (isgzGenericCelFile(cur_file_name)){
+    break;
+  case CEL_FORMAT_GZGENERIC:
+  case CEL_FORMAT_GZMULTICHANNEL:
     cdfName = gzgeneric_get_header_info(cur_file_name, &ref_dim_1,&ref_dim_2);
-  } else {
-#if defined HAVE_ZLIB
-       error("Is %s really a CEL file? tried reading as text, gzipped text, binary, gzipped binary, command console and gzipped command console formats\n",cur_file_name);
-#else
-       error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",cur_file_name);
-#endif
+    break;
+  default:
+    unknown_cel_format_error(cur_file_name);
   }
   
   PROTECT(name = allocVector(STRSXP,1));
@@ -4146,6 +5941,55 @@ SEXP ReadHeader(SEXP filename){
 
 
 
+/*************************************************************************
+ **
+ ** static void read_detailed_header(const char *filename, detailed_header_info *header_info)
+ **
+ ** reads the detailed header of a CEL file of any format into header_info.
+ ** free_detailed_header() frees the strings this allocates.
+ **
+ *************************************************************************/
+
+static void read_detailed_header(const char *filename, detailed_header_info *header_info){
+
+  switch (determine_cel_format(filename)){
+  case CEL_FORMAT_TEXT:
+    get_detailed_header_info(filename,header_info);
+    break;
+#if defined HAVE_ZLIB
+  case CEL_FORMAT_GZTEXT:
+    gz_get_detailed_header_info(filename,header_info);
+    break;
+#endif
+  case CEL_FORMAT_BINARY:
+    binary_get_detailed_header_info(filename,header_info);
+    break;
+  case CEL_FORMAT_GZBINARY:
+    gzbinary_get_detailed_header_info(filename,header_info);
+    break;
+  case CEL_FORMAT_GENERIC:
+  case CEL_FORMAT_MULTICHANNEL:
+    generic_get_detailed_header_info(filename,header_info);
+    break;
+  case CEL_FORMAT_GZGENERIC:
+  case CEL_FORMAT_GZMULTICHANNEL:
+    gzgeneric_get_detailed_header_info(filename,header_info);
+    break;
+  default:
+    unknown_cel_format_error(filename);
+  }
+}
+
+
+static void free_detailed_header(detailed_header_info *header_info){
+  Free(header_info->Algorithm);
+  Free(header_info->AlgorithmParameters);
+  Free(header_info->DatHeader);
+  Free(header_info->cdfName);
+  Free(header_info->ScanDate);
+}
+
+
 /*************************************************************************
  **
  ** SEXP ReadHeaderDetailed(SEXP filename)
@@ -4174,30 +6018,7 @@ SEXP ReadHeaderDetailed(SEXP filename){
 
   cur_file_name = CHAR(STRING_ELT(filename,0));
  
-
-  if (isTextCelFile(cur_file_name)){
-    get_detailed_header_info(cur_file_name,&header_info);
-  } else if (isgzTextCelFile(cur_file_name)){
-#if defined HAVE_ZLIB
-    gz_get_detailed_header_info(cur_file_name,&header_info);
-#else
-    error("Compress option not supported on your platform\n");
-#endif
-  } else if (isBinaryCelFile(cur_file_name)){
-    binary_get_detailed_header_info(cur_file_name,&header_info);
-  } else if (isgzBinaryCelFile(cur_file_name)){
-    gzbinary_get_detailed_header_info(cur_file_name,&header_info);
-  }  else if (isGenericCelFile(cur_file_name)){
-    generic_get_detailed_header_info(cur_file_name,&header_info);
-  }  else if (isgzGenericCelFile(cur_file_name)){
-    gzgeneric_get_detailed_header_info(cur_file_name,&header_info);
-  } else {
-#if defined HAVE_ZLIB
-    error("Is %s really a CEL file? tried reading as text, gzipped text, binary, gzipped binary, command console and gzipped command console formats.\n",cur_file_name);
-#else
-    error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",cur_file_name);
-#endif
-  }
+  read_detailed_header(cur_file_name,&header_info);
 
   /* Rprintf("%s\n",header_info.cdfName); */
 
@@ -4242,34 +6063,204 @@ SEXP ReadHeaderDetailed(SEXP filename){
   SET_VECTOR_ELT(HEADER,6,tmp_sexp);
   UNPROTECT(1);
 
-  PROTECT(tmp_sexp = allocVector(STRSXP,1));
-  SET_STRING_ELT(tmp_sexp,0,mkChar(header_info.Algorithm));
-  SET_VECTOR_ELT(HEADER,7,tmp_sexp);
-  UNPROTECT(1);
+  PROTECT(tmp_sexp = allocVector(STRSXP,1));
+  SET_STRING_ELT(tmp_sexp,0,mkChar(header_info.Algorithm));
+  SET_VECTOR_ELT(HEADER,7,tmp_sexp);
+  UNPROTECT(1);
+
+  PROTECT(tmp_sexp = allocVector(STRSXP,1));
+  SET_STRING_ELT(tmp_sexp,0,mkChar(header_info.AlgorithmParameters));
+  SET_VECTOR_ELT(HEADER,8,tmp_sexp);
+  UNPROTECT(1);
+  
+  PROTECT(tmp_sexp = allocVector(STRSXP,1));
+  SET_STRING_ELT(tmp_sexp,0,mkChar(header_info.ScanDate));
+  SET_VECTOR_ELT(HEADER,9,tmp_sexp);
+  UNPROTECT(1);
+  
+  free_detailed_header(&header_info);
+
+  UNPROTECT(1);
+  return HEADER;
+}
+
+
+struct header_thread_data{
+  const char **filenames;
+  detailed_header_info *headers;
+  int failed_file;    /* the first file whose header could not be read, or -1 */
+  char message[READER_MESSAGE_SIZE];  /* and why */
+  struct file_queue *queue;
+};
+
+
+/* as abatch_file_job(), but reads the header of file num */
+
+static int read_header_job(struct header_thread_data *args, reader_trap *trap, int num){
+
+  trap->warnings = NULL;
+  set_reader_trap(trap);
+  if (setjmp(trap->env) != 0){
+    if (trap->warnings != NULL){
+      Free(trap->warnings);
+    }
+    record_file_failure(args->queue, &(args->failed_file), args->message, num, trap->message);
+    return 1;
+  }
+  read_detailed_header(args->filenames[num], &(args->headers[num]));
+  set_reader_trap(NULL);
+  if (trap->warnings != NULL){
+    Free(trap->warnings);
+  }
+  return 0;
+}
+
+
+static void *read_headers_group(void *data){
+  int num;
+  struct header_thread_data *args = (struct header_thread_data *) data;
+  reader_trap trap;
+
+  while ((num = next_queued_file(args->queue)) >= 0){
+    read_header_job(args, &trap, num);
+  }
+  return NULL;
+}
+
+
+static SEXP header_string_column(const detailed_header_info *headers, int n_files, size_t offset){
+  SEXP column;
+  int i;
+
+  PROTECT(column = allocVector(STRSXP, n_files));
+  for (i = 0; i < n_files; i++){
+    SET_STRING_ELT(column, i, mkChar(*(char **)((const char *)&headers[i] + offset)));
+  }
+  UNPROTECT(1);
+  return column;
+}
+
+
+/*************************************************************************
+ **
+ ** SEXP ReadHeaders(SEXP filenames)
+ **
+ ** SEXP filenames - the CEL files whose headers are to be read
+ **
+ ** RETURNS a list of columns, one element per file: cdfName, Cols, Rows,
+ ** ScanDate, DatHeader, Algorithm and AlgorithmParameters. These are
+ ** the fields of ReadHeaderDetailed, read in the same way, so only the
+ ** header of each file is read.
+ **
+ ** With pthreads the headers are read by R_THREADS threads, each taking
+ ** the next file from a shared queue. The columns are filled in once
+ ** all the headers have been read. If a header can not be read no more
+ ** are started, and once the threads have finished and everything is 
+ ** freed the problem is signalled.
+ **
+ *************************************************************************/
+
+SEXP ReadHeaders(SEXP filenames){
+
+  SEXP headers_list, names, tmp_sexp;
+  const char **file_names;
+  detailed_header_info *headers;
+  int i, n_files;
+  struct file_queue queue;
+  struct header_thread_data args;
+#ifdef USE_PTHREADS
+  int num_threads = 1;
+#endif
+
+  if (!isString(filenames))
+    error("ReadHeaders: filenames argument must be a character vector");
+
+  n_files = length(filenames);
+#ifdef USE_PTHREADS
+  if (n_files > 0){
+    num_threads = num_threads_to_use(n_files);
+  }
+#endif
+  file_names = Calloc(n_files, const char *);
+  for (i = 0; i < n_files; i++){
+    file_names[i] = CHAR(STRING_ELT(filenames, i));
+  }
+  headers = Calloc(n_files, detailed_header_info);
+
+  args.filenames = file_names;
+  args.headers = headers;
+  args.failed_file = -1;
+  args.queue = &queue;
+  init_file_queue(&queue, n_files);
+#ifdef USE_PTHREADS
+  if (n_files > 0){
+    run_threads(read_headers_group, &args, 0, num_threads);
+  }
+#else
+  read_headers_group(&args);
+#endif
+  destroy_file_queue(&queue);
+
+  if (args.failed_file >= 0){
+    for (i = 0; i < n_files; i++){
+      free_detailed_header(&headers[i]);
+    }
+    Free(headers);
+    Free(file_names);
+    error("%s", args.message);
+  }
 
-  PROTECT(tmp_sexp = allocVector(STRSXP,1));
-  SET_STRING_ELT(tmp_sexp,0,mkChar(header_info.AlgorithmParameters));
-  SET_VECTOR_ELT(HEADER,8,tmp_sexp);
+  PROTECT(headers_list = allocVector(VECSXP, 7));
+  SET_VECTOR_ELT(headers_list, 0, header_string_column(headers, n_files, offsetof(detailed_header_info, cdfName)));
+  PROTECT(tmp_sexp = allocVector(INTSXP, n_files));
+  for (i = 0; i < n_files; i++){
+    INTEGER(tmp_sexp)[i] = headers[i].cols;
+  }
+  SET_VECTOR_ELT(headers_list, 1, tmp_sexp);
   UNPROTECT(1);
-  
-  PROTECT(tmp_sexp = allocVector(STRSXP,1));
-  SET_STRING_ELT(tmp_sexp,0,mkChar(header_info.ScanDate));
-  SET_VECTOR_ELT(HEADER,9,tmp_sexp);
+  PROTECT(tmp_sexp = allocVector(INTSXP, n_files));
+  for (i = 0; i < n_files; i++){
+    INTEGER(tmp_sexp)[i] = headers[i].rows;
+  }
+  SET_VECTOR_ELT(headers_list, 2, tmp_sexp);
   UNPROTECT(1);
-  
-  Free(header_info.Algorithm);
-  Free(header_info.AlgorithmParameters);
-  Free(header_info.DatHeader);
-  Free(header_info.cdfName);
+  SET_VECTOR_ELT(headers_list, 3, header_string_column(headers, n_files, offsetof(detailed_header_info, ScanDate)));
+  SET_VECTOR_ELT(headers_list, 4, header_string_column(headers, n_files, offsetof(detailed_header_info, DatHeader)));
+  SET_VECTOR_ELT(headers_list, 5, header_string_column(headers, n_files, offsetof(detailed_header_info, Algorithm)));
+  SET_VECTOR_ELT(headers_list, 6, header_string_column(headers, n_files, offsetof(detailed_header_info, AlgorithmParameters)));
+
+  PROTECT(names = allocVector(STRSXP, 7));
+  SET_STRING_ELT(names, 0, mkChar("cdfName"));
+  SET_STRING_ELT(names, 1, mkChar("Cols"));
+  SET_STRING_ELT(names, 2, mkChar("Rows"));
+  SET_STRING_ELT(names, 3, mkChar("ScanDate"));
+  SET_STRING_ELT(names, 4, mkChar("DatHeader"));
+  SET_STRING_ELT(names, 5, mkChar("Algorithm"));
+  SET_STRING_ELT(names, 6, mkChar("AlgorithmParameters"));
+  setAttrib(headers_list, R_NamesSymbol, names);
+
+  for (i = 0; i < n_files; i++){
+    free_detailed_header(&headers[i]);
+  }
+  Free(headers);
+  Free(file_names);
 
-  UNPROTECT(1);
-  return HEADER;
+  UNPROTECT(2);
+  return headers_list;
 }
 
 /* Refactored from read_probeintensities so both threaded and non-threaded versions can use the same code */
-void readfile(SEXP filenames, double *CurintensityMatrix, double *pmMatrix, double *mmMatrix,
-              int i, int ref_dim_1, int ref_dim_2, int n_files, int num_probes, SEXP cdfInfo, int which_flag, SEXP verbose){
+/* cdfName is NULL if the file has already been checked, otherwise it is checked from the header read here */
+/* the intensities are scattered into column i of the PM/MM matrices as they are decoded (see probe_scatter) */
+/* n_channels is 0 for single channel files. Otherwise each matrix holds one probes by files matrix per channel */
+void readfile(SEXP filenames, double *pmMatrix, double *mmMatrix, float *pmFloat32, float *mmFloat32,
+              int i, int ref_dim_1, int ref_dim_2, int n_files, int n_channels, const probe_gather_plan *plan, int which_flag, SEXP verbose, const char *cdfName){
     const char *cur_file_name;
+    cel_handle handle;
+    cached_cel cel;
+    probe_scatter scatter;
+    size_t offset;
+    int c;
 #ifdef USE_PTHREADS
     pthread_mutex_lock (&mutex_R);
     cur_file_name = CHAR(STRING_ELT(filenames,i));
@@ -4281,47 +6272,34 @@ void readfile(SEXP filenames, double *CurintensityMatrix, double *pmMatrix, doub
     if (asInteger(verbose)){
       Rprintf("Reading in : %s\n",cur_file_name);
     }
-    if (isTextCelFile(cur_file_name)){
-      if(read_cel_file_intensities(cur_file_name,CurintensityMatrix, 0, ref_dim_1*ref_dim_2, n_files,ref_dim_1) !=0){
-	error("The CEL file %s was corrupted. Data not read.\n",cur_file_name);
-      }
-      storeIntensities(CurintensityMatrix,pmMatrix,mmMatrix,i,ref_dim_1*ref_dim_2, n_files,num_probes,cdfInfo,which_flag);
-    } else if (isgzTextCelFile(cur_file_name)){
-#if defined HAVE_ZLIB
-      if(read_gzcel_file_intensities(cur_file_name,CurintensityMatrix, 0, ref_dim_1*ref_dim_2, n_files,ref_dim_1)!=0){
-	error("The CEL file %s was corrupted. Data not read.\n",cur_file_name);
+    if (cel_cache_enabled() && n_channels == 0){
+      init_probe_scatter(&scatter, pmMatrix, mmMatrix, pmFloat32, mmFloat32, i, plan, which_flag);
+      read_cached_cel(cur_file_name, 0, &cel);
+      if (cdfName != NULL){
+	check_generic_cel_header(cur_file_name, cel.header.cdfName, cel.header.cols, cel.header.rows, cdfName, ref_dim_1, ref_dim_2);
+      } else if (cel.n_cells != (size_t)ref_dim_1*ref_dim_2){
+	error("Cel file %s does not seem to have the correct dimensions",cur_file_name);
       }
-      storeIntensities(CurintensityMatrix,pmMatrix,mmMatrix,i,ref_dim_1*ref_dim_2, n_files,num_probes,cdfInfo,which_flag);
-#else
-      error("Compress option not supported on your platform\n");
-#endif
-    } else if (isBinaryCelFile(cur_file_name)){
-       if(read_binarycel_file_intensities(cur_file_name,CurintensityMatrix, 0, ref_dim_1*ref_dim_2, n_files,ref_dim_1) !=0){
-	error("The CEL file %s was corrupted. Data not read.\n",cur_file_name);
-       }
-      storeIntensities(CurintensityMatrix,pmMatrix,mmMatrix,i,ref_dim_1*ref_dim_2, n_files,num_probes,cdfInfo,which_flag);
-    } else if (isgzBinaryCelFile(cur_file_name)){
-      if(gzread_binarycel_file_intensities(cur_file_name,CurintensityMatrix, 0, ref_dim_1*ref_dim_2, n_files,ref_dim_1) !=0){
-	error("The CEL file %s was corrupted. Data not read.\n",cur_file_name);
-      }
-      storeIntensities(CurintensityMatrix,pmMatrix,mmMatrix,i,ref_dim_1*ref_dim_2, n_files,num_probes,cdfInfo,which_flag);
-    } else if (isGenericCelFile(cur_file_name)){
-      if(read_genericcel_file_intensities(cur_file_name,CurintensityMatrix, 0, ref_dim_1*ref_dim_2, n_files,ref_dim_1) !=0){
-	error("The CEL file %s was corrupted. Data not read.\n",cur_file_name);
-      }
-      storeIntensities(CurintensityMatrix,pmMatrix,mmMatrix,i,ref_dim_1*ref_dim_2, n_files,num_probes,cdfInfo,which_flag);
-    }  else if (isgzGenericCelFile(cur_file_name)){
-      if(gzread_genericcel_file_intensities(cur_file_name,CurintensityMatrix, 0, ref_dim_1*ref_dim_2, n_files,ref_dim_1)!=0){
+      scatter_probes(cel.intensities, 0, cel.n_cells, &scatter);
+      free_cached_cel(&cel);
+      return;
+    }
+    open_cel_handle(&handle, cur_file_name, cdfName, ref_dim_1, ref_dim_2);
+    check_cel_handle_channels(&handle, n_channels);
+    /* the channels follow each other in the file, so this is still one pass through it */
+    for (c=0; c < (n_channels > 0 ? n_channels : 1); c++){
+      offset = (size_t)c*plan->n_probes*n_files;
+      init_probe_scatter(&scatter, (pmMatrix != NULL ? pmMatrix + offset : NULL), (mmMatrix != NULL ? mmMatrix + offset : NULL), 
+			 (pmFloat32 != NULL ? pmFloat32 + offset : NULL), (mmFloat32 != NULL ? mmFloat32 + offset : NULL), i, plan, which_flag);
+      handle.channel = c;
+      if (read_cel_handle_blocks(&handle, (size_t)ref_dim_1*ref_dim_2, ref_dim_1, scatter_probes, &scatter) != 0){
+	if (n_channels > 0){
+	  error("Could not read channel %d of the file %s. Do all the files have the same channels?\n", c + 1, cur_file_name);
+	}
 	error("The CEL file %s was corrupted. Data not read.\n",cur_file_name);
       }
-      storeIntensities(CurintensityMatrix,pmMatrix,mmMatrix,i,ref_dim_1*ref_dim_2, n_files,num_probes,cdfInfo,which_flag);
-    } else {
-#if defined HAVE_ZLIB
-       error("Is %s really a CEL file? tried reading as text, gzipped text, binary, gzipped binary, command console and gzipped command console formats.\n",cur_file_name);
-#else
-       error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",cur_file_name);
-#endif
     }
+    free_cel_handle(&handle);
 }
 
 void checkFileCDF(SEXP filenames, int i, const char *cdfName, int ref_dim_1, int ref_dim_2){
@@ -4332,44 +6310,7 @@ void checkFileCDF(SEXP filenames, int i, const char *cdfName, int ref_dim_1, int
 #else
     const char *cur_file_name = CHAR(STRING_ELT(filenames,i));
 #endif
-    if (isTextCelFile(cur_file_name)){
-      if (check_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-      }
-    } else if (isgzTextCelFile(cur_file_name)){
-#if defined HAVE_ZLIB
-      if (check_gzcel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-      }
-      
-#else
-       error("Compress option not supported on your platform\n");
-#endif
-    } else if (isBinaryCelFile(cur_file_name)){
-      
-      if (check_binary_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-    }  else if (isgzBinaryCelFile(cur_file_name)){
-      
-       if (check_gzbinary_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-    }  else if (isGenericCelFile(cur_file_name)){
-       if (check_generic_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-    }  else if (isgzGenericCelFile(cur_file_name)){
-       if (check_gzgeneric_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-    } else {  
-#if defined HAVE_ZLIB
-       error("Is %s really a CEL file? tried reading as text, gzipped text, binary, gzipped binary, command console and gzipped command console formats.\n",cur_file_name);
-#else
-       error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",cur_file_name);
-#endif
-     }
+    check_cel_file_cdf(cur_file_name, cdfName, ref_dim_1, ref_dim_2);
 }
 
 #ifdef USE_PTHREADS
@@ -4377,15 +6318,12 @@ void checkFileCDF(SEXP filenames, int i, const char *cdfName, int ref_dim_1, int
 void *readfile_group(void *data){
    int num;
    struct thread_data *args = (struct thread_data *) data;
-   
 
-   args->CurintensityMatrix = Calloc(args->ref_dim_1*args->ref_dim_2, double);
-
-   for(num = args->i; num < args->i+args->chunk_size; num++){
-     readfile(args->filenames, args->CurintensityMatrix, args->pmMatrix, args->mmMatrix, num,
-              args->ref_dim_1, args->ref_dim_2, args->n_files, args->num_probes, args->cdfInfo, args->which_flag, args->verbose);
+   while ((num = next_queued_file(args->queue)) >= 0){
+     readfile(args->filenames, args->pmMatrix, args->mmMatrix, args->pmFloat32, args->mmFloat32, num,
+              args->ref_dim_1, args->ref_dim_2, args->n_files, args->n_channels, args->plan, args->which_flag, args->verbose,
+              (args->check_while_reading ? args->refCdfName : NULL));
    }
-   Free(args->CurintensityMatrix);
    return NULL;
 }
 
@@ -4393,7 +6331,7 @@ void *checkFileCDF_group(void *data){
   int num;
   struct thread_data *args = (struct thread_data *) data;
 
-  for(num = args->i; num < args->i+args->chunk_size; num++){
+  while ((num = next_queued_file(args->queue)) >= 0){
     checkFileCDF(args->filenames, num, args->refCdfName, args->ref_dim_1, args->ref_dim_2);
   }
   return NULL;
@@ -4429,43 +6367,41 @@ void *checkFileCDF_group(void *data){
  ** of matrices, each matricies has two columns. The first is assumed to
  ** be PM indices, the second column is assumed to be MM indices.
  **
+ ** read_probeintensities_float32() is the same but returns single precision 
+ ** matrices (see float32_functions.c). read_probeintensities_multichannel()
+ ** reads multichannel CEL files, all with the channels of the first, each 
+ ** element then being a probes by files by channels array. All three use 
+ ** read_probeintensity_matrices()
  **
  *************************************************************************/
  
 
-SEXP read_probeintensities(SEXP filenames,  SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose, SEXP cdfInfo,SEXP which){
+static SEXP read_probeintensity_matrices(SEXP filenames,  SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose, SEXP cdfInfo,SEXP which, int float32, int multichannel){
 
     
   int i; 
   
   int n_files;
+  int n_channels = 0;
   int ref_dim_1, ref_dim_2;
   int which_flag;  /* 0 means both, 1 means PM only, -1 means MM only */
 
   int num_probes;
+  int check_first = !check_while_reading();
 
   const char *cur_file_name;
   const char *cdfName;
   double *pmMatrix=0, *mmMatrix=0;
+  float *pmFloat32=NULL, *mmFloat32=NULL;
+  probe_gather_plan plan;
 
-#ifndef USE_PTHREADS
-  double *CurintensityMatrix;
-#endif
-
-  SEXP PM_intensity= R_NilValue, MM_intensity= R_NilValue, Current_intensity, names, dimnames;
-  SEXP output_list,pmmmnames;
+  SEXP PM_intensity= R_NilValue, MM_intensity= R_NilValue, names, dimnames;
+  SEXP output_list,pmmmnames,channel_names = R_NilValue;
   
 #ifdef USE_PTHREADS
-  SEXP curIndices;
-
-  pthread_t *threads;
-  char *nthreads;
-  int returnCode, t, chunk_size, num_threads = 1;
-  double chunk_size_d, chunk_tot_d;
-  pthread_attr_t attr;
+  int num_threads;
+  struct file_queue queue;
   struct thread_data *args;
-  void *status;
-  size_t stacksize = PTHREAD_STACK_MIN + 0x40000;
 
 #endif
 
@@ -4487,27 +6423,42 @@ SEXP read_probeintensities(SEXP filenames,  SEXP rm_mask, SEXP rm_outliers, SEXP
 
   n_files = GET_LENGTH(filenames);
   
-  /* We will read in chip at a time */
-  PROTECT(Current_intensity = allocMatrix(REALSXP, ref_dim_1*ref_dim_2, 1));
- 
   cdfName = CHAR(STRING_ELT(ref_cdfName,0));
-
-#ifndef USE_PTHREADS
-  CurintensityMatrix = NUMERIC_POINTER(AS_NUMERIC(Current_intensity));
-#endif
   
-  /* Lets count how many probes we have */
+  /* Lets flatten the probe locations into an index (and its inverse), this also counts how many probes we have */
   
-  num_probes = CountCDFProbes(cdfInfo);
+  if (multichannel){
+    PROTECT(channel_names = multichannel_channel_names(filenames));
+    n_channels = GET_LENGTH(channel_names);
+  }
+
+  build_gather_plan(cdfInfo, (size_t)ref_dim_1*ref_dim_2, which_flag, &plan);
+  num_probes = (int)plan.n_probes;
 
   if (which_flag >= 0){
-    PROTECT(PM_intensity = allocMatrix(REALSXP,num_probes,n_files));
-    pmMatrix = NUMERIC_POINTER(AS_NUMERIC(PM_intensity));
+    if (multichannel){
+      PROTECT(PM_intensity = alloc3DArray(REALSXP,num_probes,n_files,n_channels));
+      pmMatrix = NUMERIC_POINTER(PM_intensity);
+    } else if (float32){
+      PROTECT(PM_intensity = allocFloat32Matrix(num_probes,n_files));
+      pmFloat32 = FLOAT32_POINTER(PM_intensity);
+    } else {
+      PROTECT(PM_intensity = allocMatrix(REALSXP,num_probes,n_files));
+      pmMatrix = NUMERIC_POINTER(AS_NUMERIC(PM_intensity));
+    }
   }
 
   if (which_flag <= 0){
-    PROTECT(MM_intensity = allocMatrix(REALSXP,num_probes,n_files));
-    mmMatrix = NUMERIC_POINTER(AS_NUMERIC(MM_intensity));
+    if (multichannel){
+      PROTECT(MM_intensity = alloc3DArray(REALSXP,num_probes,n_files,n_channels));
+      mmMatrix = NUMERIC_POINTER(MM_intensity);
+    } else if (float32){
+      PROTECT(MM_intensity = allocFloat32Matrix(num_probes,n_files));
+      mmFloat32 = FLOAT32_POINTER(MM_intensity);
+    } else {
+      PROTECT(MM_intensity = allocMatrix(REALSXP,num_probes,n_files));
+      mmMatrix = NUMERIC_POINTER(AS_NUMERIC(MM_intensity));
+    }
   }
 
   if (which_flag < 0){
@@ -4520,105 +6471,44 @@ SEXP read_probeintensities(SEXP filenames,  SEXP rm_mask, SEXP rm_outliers, SEXP
 
   /* Setup the data required for threading */
 #ifdef USE_PTHREADS
-  nthreads = getenv(THREADS_ENV_VAR);
-  if(nthreads != NULL){
-    num_threads = atoi(nthreads);
-    if(num_threads <= 0){
-      error("The number of threads (enviroment variable %s) must be a positive integer, but the specified value was %s", THREADS_ENV_VAR, nthreads);
-    }
-  }
-  threads = (pthread_t *) Calloc(num_threads, pthread_t);
-
-  /* Initialize and set thread detached attribute */
-  pthread_attr_init(&attr);
-  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-  pthread_attr_setstacksize (&attr, stacksize);
-
-  /* this code works out how many threads to use and allocates ranges of files to each thread */
-  /* The aim is to try to be as fair as possible in dividing up the matrix */
-  /* A special cases to be aware of: 
-    1) Number of files is less than the number of threads
-  */
-  if (num_threads < n_files){
-    chunk_size = n_files/num_threads;
-    chunk_size_d = ((double) n_files)/((double) num_threads);
-  } else {
-    chunk_size = 1;
-    chunk_size_d = 1;
-  }
-
-  if(chunk_size == 0){
-    chunk_size = 1;
-  }
-
-  n_probesets = GET_LENGTH(cdfInfo);
-  n_probes = (int *) Calloc(n_probesets, int);
-  cur_indexes = (double **) Calloc(n_probesets, double *);
+  num_threads = num_threads_to_use(n_files);
 
   /* Create the data structures required for each thread to independently
      run the checkFileCDF and readfile functions */
-  for(i=0; i < n_probesets; i++){
-    curIndices = VECTOR_ELT(cdfInfo,i);
-    n_probes[i] = INTEGER(getAttrib(curIndices,R_DimSymbol))[0];
-    cur_indexes[i] = (double *) Calloc(n_probes[i]*2, double);
-    memcpy(cur_indexes[i], NUMERIC_POINTER(AS_NUMERIC(curIndices)), sizeof(double)*n_probes[i]*2);
-  }
-  args = (struct thread_data *) Calloc((n_files < num_threads ? n_files : num_threads), struct thread_data);
+  args = (struct thread_data *) Calloc(num_threads, struct thread_data);
 
   args[0].filenames = filenames;
   args[0].pmMatrix = pmMatrix;
   args[0].mmMatrix = mmMatrix;
+  args[0].pmFloat32 = pmFloat32;
+  args[0].mmFloat32 = mmFloat32;
+  args[0].queue = &queue;
   args[0].ref_dim_1 = ref_dim_1;
   args[0].ref_dim_2 = ref_dim_2,
   args[0].n_files = n_files;
-  args[0].num_probes = num_probes;
-  args[0].cdfInfo = cdfInfo;
+  args[0].n_channels = n_channels;
+  args[0].plan = &plan;
   args[0].refCdfName = cdfName;
+  args[0].check_while_reading = !check_first;
   args[0].which_flag = which_flag;
   args[0].verbose = verbose;
+  for (i=1; i < num_threads; i++){
+    memcpy(&(args[i]), &(args[0]), sizeof(struct thread_data));
+  }
 
   pthread_mutex_init(&mutex_R, NULL);
-  t = 0; /* t = number of actual threads doing work */
-  chunk_tot_d = 0;
-  for (i=0; floor(chunk_tot_d+0.00001) < n_files; i+=chunk_size){
-     if(t != 0){
-       memcpy(&(args[t]), &(args[0]), sizeof(struct thread_data));
-     }
-
-     args[t].i = i;
-     /* take care of distribution of the remainder (when #chips%#threads != 0) */
-     chunk_tot_d += chunk_size_d;
-     // Add 0.00001 in case there was a rounding issue with the division
-     if(i+chunk_size < floor(chunk_tot_d+0.00001)){
-       args[t].chunk_size = chunk_size+1;
-       i++;
-     }
-     else{
-       args[t].chunk_size = chunk_size;
-     }
-     t++;
-  }
 
   /* First check headers of cel files */
   /* before we do any real reading check that all the files are of the same cdf type */
-  for (i =0; i < t; i++){
-     returnCode = pthread_create(&threads[i], &attr, checkFileCDF_group, (void *) &(args[i]));
-     if (returnCode){
-         error("ERROR; return code from pthread_create() is %d\n", returnCode);
-     }
-  }
-  /* Wait for the other threads */
-  for(i = 0; i < t; i++){
-      returnCode = pthread_join(threads[i], &status);
-      if (returnCode){
-         error("ERROR; return code from pthread_join(thread #%d) is %d, exit status for thread was %d\n", 
-	       i, returnCode, *((int *) status));
-      }
+  if (check_first){
+    init_file_queue(&queue, n_files);
+    run_threads(checkFileCDF_group, args, sizeof(struct thread_data), num_threads);
+    destroy_file_queue(&queue);
   }
 #else
   /* First check headers of cel files */
   /* before we do any real reading check that all the files are of the same cdf type */
-  for (i =0; i < n_files; i++){
+  for (i =0; i < n_files && check_first; i++){
     checkFileCDF(filenames, i, cdfName, ref_dim_1, ref_dim_2);
   }
 #endif
@@ -4626,313 +6516,90 @@ SEXP read_probeintensities(SEXP filenames,  SEXP rm_mask, SEXP rm_outliers, SEXP
   /* now lets read them in and store them in the PM and MM matrices */
 
 #ifdef USE_PTHREADS
-  for(int i = 0; i < t; i++){
-     returnCode = pthread_create(&threads[i], &attr, readfile_group, (void *) &(args[i]));
-     if (returnCode){
-         error("ERROR; return code from pthread_create() is %d\n", returnCode);
-     }
-  }
-  /* Free attribute and wait for the other threads */
-  for(i = 0; i < t; i++){
-      returnCode = pthread_join(threads[i], &status);
-      if (returnCode){
-         error("ERROR; return code from pthread_join(thread #%d) is %d, exit status for thread was %d\n", 
-	       i, returnCode, *((int *) status));
-      }
-  }
+  init_file_queue(&queue, n_files);
+  run_threads(readfile_group, args, sizeof(struct thread_data), num_threads);
+  destroy_file_queue(&queue);
+
   Free(args);
-  Free(threads);
-  pthread_attr_destroy(&attr);
   pthread_mutex_destroy(&mutex_R);
-
-  /* clear the old index data */
-  Free(n_probes);
-  for(i = 0; i < n_probesets; i++){
-    Free(cur_indexes[i]);
-  }
-  Free(cur_indexes);
-#else
-  for (i=0; i < n_files; i++){ 
-    readfile(filenames, CurintensityMatrix, pmMatrix, mmMatrix, i, ref_dim_1, ref_dim_2, 
-	     n_files, num_probes, cdfInfo, which_flag, verbose);
-  }
-#endif
-
-  PROTECT(dimnames = allocVector(VECSXP,2));
-  PROTECT(names = allocVector(STRSXP,n_files));
-  for ( i =0; i < n_files; i++){
-    cur_file_name = CHAR(STRING_ELT(filenames, i));
-    SET_STRING_ELT(names,i,mkChar(cur_file_name));
-  }
-  SET_VECTOR_ELT(dimnames,1,names);
-  if (which_flag >=0){
-    setAttrib(PM_intensity, R_DimNamesSymbol, dimnames);
-  } 
-  
-  if (which_flag <=0){
-    setAttrib(MM_intensity, R_DimNamesSymbol, dimnames);
-  }
-  
-  if (which_flag == 0){
-    PROTECT(output_list = allocVector(VECSXP,2));
-    SET_VECTOR_ELT(output_list,0,PM_intensity);
-    SET_VECTOR_ELT(output_list,1,MM_intensity);
-    PROTECT(pmmmnames = allocVector(STRSXP,2));
-    SET_STRING_ELT(pmmmnames,0,mkChar("pm"));
-    SET_STRING_ELT(pmmmnames,1,mkChar("mm"));
-  } else if (which_flag > 0){
-    PROTECT(output_list = allocVector(VECSXP,1));
-    SET_VECTOR_ELT(output_list,0,PM_intensity);
-    PROTECT(pmmmnames = allocVector(STRSXP,1));
-    SET_STRING_ELT(pmmmnames,0,mkChar("pm"));
-  } else {
-    PROTECT(output_list = allocVector(VECSXP,1));
-    SET_VECTOR_ELT(output_list,0,MM_intensity);
-    PROTECT(pmmmnames = allocVector(STRSXP,1));
-    SET_STRING_ELT(pmmmnames,0,mkChar("mm"));
-  }
-
-  setAttrib(output_list,R_NamesSymbol,pmmmnames);
-  
-  if (which_flag != 0){
-    UNPROTECT(6);
-  } else {
-    UNPROTECT(7);
-  }
-  return(output_list);
-
-}
-
-/************************************************************************
- **
- **  SEXP read_abatch_stddev(SEXP filenames, SEXP compress,  
- **                   SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, 
- **                   SEXP ref_cdfName)
- **
- ** SEXP filenames - an R character vector of filenames to read
- ** 
- ** SEXP rm_mask   - if true set MASKS  to NA
- ** SEXP rm_outliers - if true set OUTLIERS to NA
- ** SEXP rm_extra    - if true  overrides rm_mask and rm_outliers settings
- ** SEXP ref_cdfName - the reference CDF name to check each CEL file against 
- ** SEXP ref_dim     - cols/rows of reference chip
- ** SEXP verbose     - if verbose print out more information to the screen
- **
- ** RETURNS an intensity matrix with cel file stddev from
- ** each chip in columns
- **
- ** this function will read in all the cel files in a affybatch.
- ** this function will stop on possible errors with an error() call.
- **
- ** The intensity matrix will be allocated here. It will be given
- ** column names here. the column names that it will be given here are the 
- ** filenames.
- **
- *************************************************************************/
-
-SEXP read_abatch_stddev(SEXP filenames,  SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose){
-  
-  int i; 
-  
-  int n_files;
-  int ref_dim_1, ref_dim_2;
-
-  const char *cur_file_name;
-  const char *cdfName;
-  double *intensityMatrix;
-
-  SEXP intensity,names,dimnames;
-
-  ref_dim_1 = INTEGER(ref_dim)[0];
-  ref_dim_2 = INTEGER(ref_dim)[1];
-
-  if (!isString(filenames))
-    error("read_abatch_stddev: argument 'filenames' must be a character vector");
-  
-  n_files = GET_LENGTH(filenames);
-  
-  PROTECT(intensity = allocMatrix(REALSXP, ref_dim_1*ref_dim_2, n_files));
-  
-  cdfName = CHAR(STRING_ELT(ref_cdfName,0));
-  intensityMatrix = NUMERIC_POINTER(AS_NUMERIC(intensity));
-
-
-
-  /* before we do any real reading check that all the files are of the same cdf type */
-
-  for (i =0; i < n_files; i++){
-    cur_file_name = CHAR(STRING_ELT(filenames, i));
-    if (isTextCelFile(cur_file_name)){
-      if (check_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-      }
-    } else if (isgzTextCelFile(cur_file_name)){
-#if defined HAVE_ZLIB
-      if (check_gzcel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-      }
-      
 #else
-       error("Compress option not supported on your platform\n");
-#endif
-     } else if (isBinaryCelFile(cur_file_name)){
-      
-       if (check_binary_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-     } else if (isgzBinaryCelFile(cur_file_name)){
-      
-       if (check_gzbinary_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-     }  else if (isGenericCelFile(cur_file_name)){
-      if (check_generic_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-    }  else if (isgzGenericCelFile(cur_file_name)){
-      if (check_gzgeneric_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-     } else {
-#if defined HAVE_ZLIB
-       error("Is %s really a CEL file? tried reading as text, gzipped text, binary, gzipped binary, command console and gzipped command console formats.\n",cur_file_name);
-#else
-       error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",cur_file_name);
-#endif
-     }
-  }
-
-  /* 
-     Now read in each of the cel files, one by one, filling out the columns of the intensity matrix.
-  */
-  
   for (i=0; i < n_files; i++){ 
-      cur_file_name = CHAR(STRING_ELT(filenames, i));
-      if (asInteger(verbose)){
-	Rprintf("Reading in : %s\n",cur_file_name);
-      }
-      if (isTextCelFile(cur_file_name)){
-	read_cel_file_stddev(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1);
-      } else if (isgzTextCelFile(cur_file_name)){
-#if defined HAVE_ZLIB
-      read_gzcel_file_stddev(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1);
-#else
-      error("Compress option not supported on your platform\n");
-#endif
-      } else if (isBinaryCelFile(cur_file_name)){
-      	if (read_binarycel_file_stddev(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1)){
-	  error("It appears that the file %s is corrupted.\n",cur_file_name);
-	}
-    } else if (isgzBinaryCelFile(cur_file_name)){
-      	if (gzread_binarycel_file_stddev(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1)){
-	  error("It appears that the file %s is corrupted.\n",cur_file_name);
-	}
-      } else if (isGenericCelFile(cur_file_name)){
-	if (read_genericcel_file_stddev(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1)){
-	  error("It appears that the file %s is corrupted.\n",cur_file_name);
-	}
-      }  else if (isgzGenericCelFile(cur_file_name)){
-	if (gzread_genericcel_file_stddev(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1)){
-	  error("It appears that the file %s is corrupted.\n",cur_file_name);
-	}
-      }else {
-#if defined HAVE_ZLIB
-       error("Is %s really a CEL file? tried reading as text, gzipped text, binary and gzipped binary\n",cur_file_name);
-#else
-       error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",cur_file_name);
-#endif
-    }
-
+    readfile(filenames, pmMatrix, mmMatrix, pmFloat32, mmFloat32, i, ref_dim_1, ref_dim_2, 
+	     n_files, n_channels, &plan, which_flag, verbose, (check_first ? NULL : cdfName));
   }
-  
-
-  /* Now lets go through all the files  filling in masks etc */
-
-
-  if (asInteger(rm_mask) || asInteger(rm_outliers) || asInteger(rm_extra)){
-    for (i=0; i < n_files; i++){ 
-      cur_file_name = CHAR(STRING_ELT(filenames, i));
-      if (isTextCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      } else if (isgzTextCelFile(cur_file_name)){
-#if defined HAVE_ZLIB	
-	if (asInteger(rm_extra)){
-	  gz_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  gz_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-#else
-	error("Compress option not supported on your platform\n");
-#endif
-      } else if (isBinaryCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  binary_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  binary_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      } else if (isgzBinaryCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  gz_binary_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  gz_binary_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      } else if (isGenericCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  generic_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  generic_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      }  else if (isgzGenericCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  gzgeneric_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  gzgeneric_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      }else {
-#if defined HAVE_ZLIB
-       error("Is %s really a CEL file? tried reading as text, gzipped text, binary, gzipped binary, command console and gzipped command console formats.\n",cur_file_name);
-#else
-       error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",cur_file_name);
 #endif
-      }
-      
-
 
+  free_gather_plan(&plan);
 
-    }
-  }
-  
-  PROTECT(dimnames = allocVector(VECSXP,2));
+  PROTECT(dimnames = allocVector(VECSXP,(multichannel ? 3 : 2)));
   PROTECT(names = allocVector(STRSXP,n_files));
   for ( i =0; i < n_files; i++){
     cur_file_name = CHAR(STRING_ELT(filenames, i));
     SET_STRING_ELT(names,i,mkChar(cur_file_name));
   }
   SET_VECTOR_ELT(dimnames,1,names);
-  setAttrib(intensity, R_DimNamesSymbol, dimnames);
+  if (multichannel){
+    SET_VECTOR_ELT(dimnames,2,channel_names);
+  }
+  if (which_flag >=0){
+    setAttrib(PM_intensity, R_DimNamesSymbol, dimnames);
+  } 
   
+  if (which_flag <=0){
+    setAttrib(MM_intensity, R_DimNamesSymbol, dimnames);
+  }
+  
+  if (which_flag == 0){
+    PROTECT(output_list = allocVector(VECSXP,2));
+    SET_VECTOR_ELT(output_list,0,PM_intensity);
+    SET_VECTOR_ELT(output_list,1,MM_intensity);
+    PROTECT(pmmmnames = allocVector(STRSXP,2));
+    SET_STRING_ELT(pmmmnames,0,mkChar("pm"));
+    SET_STRING_ELT(pmmmnames,1,mkChar("mm"));
+  } else if (which_flag > 0){
+    PROTECT(output_list = allocVector(VECSXP,1));
+    SET_VECTOR_ELT(output_list,0,PM_intensity);
+    PROTECT(pmmmnames = allocVector(STRSXP,1));
+    SET_STRING_ELT(pmmmnames,0,mkChar("pm"));
+  } else {
+    PROTECT(output_list = allocVector(VECSXP,1));
+    SET_VECTOR_ELT(output_list,0,MM_intensity);
+    PROTECT(pmmmnames = allocVector(STRSXP,1));
+    SET_STRING_ELT(pmmmnames,0,mkChar("mm"));
+  }
 
-  UNPROTECT(3);
+  setAttrib(output_list,R_NamesSymbol,pmmmnames);
   
-  return intensity;  
+  if (which_flag != 0){
+    UNPROTECT(5 + multichannel);
+  } else {
+    UNPROTECT(6 + multichannel);
+  }
+  return(output_list);
+
 }
 
 
+SEXP read_probeintensities(SEXP filenames,  SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose, SEXP cdfInfo,SEXP which){
 
+  return read_probeintensity_matrices(filenames, rm_mask, rm_outliers, rm_extra, ref_cdfName, ref_dim, verbose, cdfInfo, which, 0, 0);
+}
 
 
+SEXP read_probeintensities_float32(SEXP filenames,  SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose, SEXP cdfInfo,SEXP which){
 
+  return read_probeintensity_matrices(filenames, rm_mask, rm_outliers, rm_extra, ref_cdfName, ref_dim, verbose, cdfInfo, which, 1, 0);
+}
 
 
+SEXP read_probeintensities_multichannel(SEXP filenames,  SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose, SEXP cdfInfo,SEXP which){
 
+  return read_probeintensity_matrices(filenames, rm_mask, rm_outliers, rm_extra, ref_cdfName, ref_dim, verbose, cdfInfo, which, 0, 1);
+}
 
 /************************************************************************
  **
- **  SEXP read_abatch_npixels(SEXP filenames, SEXP compress,  
+ **  SEXP read_abatch_stddev(SEXP filenames, SEXP compress,  
  **                   SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, 
  **                   SEXP ref_cdfName)
  **
@@ -4957,197 +6624,56 @@ SEXP read_abatch_stddev(SEXP filenames,  SEXP rm_mask, SEXP rm_outliers, SEXP rm
  **
  *************************************************************************/
 
-SEXP read_abatch_npixels(SEXP filenames,  SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose){
-  
-  int i; 
-  
-  int n_files;
-  int ref_dim_1, ref_dim_2;
-
-  const char *cur_file_name;
-  const char *cdfName;
-  double *intensityMatrix;
-
-  SEXP intensity,names,dimnames;
+SEXP read_abatch_stddev(SEXP filenames,  SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose){
 
-  ref_dim_1 = INTEGER(ref_dim)[0];
-  ref_dim_2 = INTEGER(ref_dim)[1];
-  
   if (!isString(filenames))
-    error("read_abatch_npixels: argument 'filenames' must be a character vector");
-
-  n_files = GET_LENGTH(filenames);
-  
-  PROTECT(intensity = allocMatrix(REALSXP, ref_dim_1*ref_dim_2, n_files));
-  
-  cdfName = CHAR(STRING_ELT(ref_cdfName,0));
-  intensityMatrix = NUMERIC_POINTER(AS_NUMERIC(intensity));
-
+    error("read_abatch_stddev: argument 'filenames' must be a character vector");
 
+  return read_abatch_matrix(filenames, rm_mask, rm_outliers, rm_extra, ref_cdfName, ref_dim, verbose, ABATCH_STDDEV, 0, 0);
+}
 
-  /* before we do any real reading check that all the files are of the same cdf type */
 
-  for (i =0; i < n_files; i++){
-    cur_file_name = CHAR(STRING_ELT(filenames, i));
-    if (isTextCelFile(cur_file_name)){
-      if (check_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-      }
-    } else if (isgzTextCelFile(cur_file_name)){
-#if defined HAVE_ZLIB
-      if (check_gzcel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-      }
-      
-#else
-       error("Compress option not supported on your platform\n");
-#endif
-     } else if (isBinaryCelFile(cur_file_name)){
-      
-       if (check_binary_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-     } else if (isgzBinaryCelFile(cur_file_name)){
-      
-       if (check_gzbinary_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-     } else if (isGenericCelFile(cur_file_name)){
-       if (check_generic_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-    }  else if (isgzGenericCelFile(cur_file_name)){
-       if (check_gzgeneric_cel_file(cur_file_name,cdfName, ref_dim_1, ref_dim_2)){
-	 error("File %s does not seem to have correct dimension or is not of %s chip type.", cur_file_name, cdfName);
-       }
-    } else {
-#if defined HAVE_ZLIB
-       error("Is %s really a CEL file? tried reading as text, gzipped text, binary, gzipped binary, command console and gzipped command console formats.\n",cur_file_name);
-#else
-       error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",cur_file_name);
-#endif
-     }
-  }
 
-  /* 
-     Now read in each of the cel files, one by one, filling out the columns of the intensity matrix.
-  */
-  
-  for (i=0; i < n_files; i++){ 
-      cur_file_name = CHAR(STRING_ELT(filenames, i));
-      if (asInteger(verbose)){
-	Rprintf("Reading in : %s\n",cur_file_name);
-      }
-      if (isTextCelFile(cur_file_name)){
-	read_cel_file_npixels(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1);
-      } else if (isgzTextCelFile(cur_file_name)){
-#if defined HAVE_ZLIB
-      read_gzcel_file_npixels(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1);
-#else
-      error("Compress option not supported on your platform\n");
-#endif
-      } else if (isBinaryCelFile(cur_file_name)){
-	if (read_binarycel_file_npixels(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1)){
-	  error("It appears that the file %s is corrupted.\n",cur_file_name);
-	}
-      } else if (isgzBinaryCelFile(cur_file_name)){
-	if (gzread_binarycel_file_npixels(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1)){
-	  error("It appears that the file %s is corrupted.\n",cur_file_name);
-	}
-      } else if (isGenericCelFile(cur_file_name)){
-	if (read_genericcel_file_npixels(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1)){
-	  error("It appears that the file %s is corrupted.\n",cur_file_name);
-	}
 
-      } else if (isgzGenericCelFile(cur_file_name)){
-	if (gzread_genericcel_file_npixels(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1)){
-	  error("It appears that the file %s is corrupted.\n",cur_file_name);
-	}
 
-      } else {
-#if defined HAVE_ZLIB
-       error("Is %s really a CEL file? tried reading as text, gzipped text, binary and gzipped binary\n",cur_file_name);
-#else
-       error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",cur_file_name);
-#endif
-    }
 
-  }
-  
 
-  /* Now lets go through all the files  filling in masks etc */
 
 
-  if (asInteger(rm_mask) || asInteger(rm_outliers) || asInteger(rm_extra)){
-    for (i=0; i < n_files; i++){ 
-      cur_file_name = CHAR(STRING_ELT(filenames, i));
-      if (isTextCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      } else if (isgzTextCelFile(cur_file_name)){
-#if defined HAVE_ZLIB	
-	if (asInteger(rm_extra)){
-	  gz_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  gz_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-#else
-	error("Compress option not supported on your platform\n");
-#endif
-      } else if (isBinaryCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  binary_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  binary_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      } else if (isgzBinaryCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  gz_binary_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  gz_binary_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      } else if (isGenericCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  generic_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  generic_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      }  else if (isgzGenericCelFile(cur_file_name)){
-	if (asInteger(rm_extra)){
-	  gzgeneric_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,1,1);
-	} else {
-	  gzgeneric_apply_masks(cur_file_name,intensityMatrix, i, ref_dim_1*ref_dim_2, n_files,ref_dim_1,asInteger(rm_mask),asInteger(rm_outliers));
-	}
-      } else {
-#if defined HAVE_ZLIB
-       error("Is %s really a CEL file? tried reading as text, gzipped text, binary, gzipped binary, command console and gzipped command console formats.\n",cur_file_name);
-#else
-       error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",cur_file_name);
-#endif
-      }
-      
 
+/************************************************************************
+ **
+ **  SEXP read_abatch_npixels(SEXP filenames, SEXP compress,  
+ **                   SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, 
+ **                   SEXP ref_cdfName)
+ **
+ ** SEXP filenames - an R character vector of filenames to read
+ ** 
+ ** SEXP rm_mask   - if true set MASKS  to NA
+ ** SEXP rm_outliers - if true set OUTLIERS to NA
+ ** SEXP rm_extra    - if true  overrides rm_mask and rm_outliers settings
+ ** SEXP ref_cdfName - the reference CDF name to check each CEL file against 
+ ** SEXP ref_dim     - cols/rows of reference chip
+ ** SEXP verbose     - if verbose print out more information to the screen
+ **
+ ** RETURNS an intensity matrix with cel file stddev from
+ ** each chip in columns
+ **
+ ** this function will read in all the cel files in a affybatch.
+ ** this function will stop on possible errors with an error() call.
+ **
+ ** The intensity matrix will be allocated here. It will be given
+ ** column names here. the column names that it will be given here are the 
+ ** filenames.
+ **
+ *************************************************************************/
 
+SEXP read_abatch_npixels(SEXP filenames,  SEXP rm_mask, SEXP rm_outliers, SEXP rm_extra, SEXP ref_cdfName, SEXP ref_dim, SEXP verbose){
 
-    }
-  }
-  
-  PROTECT(dimnames = allocVector(VECSXP,2));
-  PROTECT(names = allocVector(STRSXP,n_files));
-  for ( i =0; i < n_files; i++){
-    cur_file_name = CHAR(STRING_ELT(filenames, i));
-    SET_STRING_ELT(names,i,mkChar(cur_file_name));
-  }
-  SET_VECTOR_ELT(dimnames,1,names);
-  setAttrib(intensity, R_DimNamesSymbol, dimnames);
-  
+  if (!isString(filenames))
+    error("read_abatch_npixels: argument 'filenames' must be a character vector");
 
-  UNPROTECT(3);
-  
-  return intensity;  
+  return read_abatch_matrix(filenames, rm_mask, rm_outliers, rm_extra, ref_cdfName, ref_dim, verbose, ABATCH_NPIXELS, 0, 0);
 }
 
 
@@ -5165,20 +6691,45 @@ SEXP read_abatch_npixels(SEXP filenames,  SEXP rm_mask, SEXP rm_outliers, SEXP r
 
 /************************************************************************
  **
- ** CEL *read_cel_file(const char *filename)
+ ** static CEL *parse_cel_file(const char *filename, int read_intensities_only, int *incomplete)
  **  
  ** Reads the contents of the CEL file into a "CEL" structure.
  ** Currently slightly inefficient (should be reimplemented more
- ** cleanly later)
+ ** cleanly later). All channels of a multichannel file are read
+ ** in a single pass through it.
+ **
+ ** *incomplete is set non zero if the file was truncated (text files,
+ ** which are still returned with what could be read) or one of its
+ ** data sets was missing (command console files), so that what was
+ ** returned should not be kept in the cache.
  **
  **
  ************************************************************************/
 
-CEL *read_cel_file(const char *filename, int read_intensities_only){
+/* hands the channels read from a multichannel file over to my_CEL */
+
+static void take_multichannel_cel(CEL *my_CEL, multichannel_cel *channels){
+
+  my_CEL->multichannel = channels->n_channels;
+  my_CEL->channelnames = channels->channelnames;
+  my_CEL->intensities = channels->intensities;
+  my_CEL->stddev = channels->stddev;
+  my_CEL->npixels = channels->npixels;
+  my_CEL->nmasks = channels->nmasks;
+  my_CEL->masks_x = channels->masks_x;
+  my_CEL->masks_y = channels->masks_y;
+  my_CEL->noutliers = channels->noutliers;
+  my_CEL->outliers_x = channels->outliers_x;
+  my_CEL->outliers_y = channels->outliers_y;
+}
+
+
+static CEL *parse_cel_file(const char *filename, int read_intensities_only, int *incomplete){
   
   CEL *my_CEL;
-  int i,k;
+  multichannel_cel channels;
 
+  *incomplete = 0;
   my_CEL = Calloc(1, CEL);
   my_CEL->multichannel = 0;
   my_CEL->channelnames = NULL;
@@ -5192,7 +6743,7 @@ CEL *read_cel_file(const char *filename, int read_intensities_only){
 #if defined HAVE_ZLIB
     gz_get_detailed_header_info(filename,&my_CEL->header);
 #else
-    error("Compress option not supported on your platform\n");
+    reader_error("Compress option not supported on your platform\n");
 #endif
   } else if (isBinaryCelFile(filename)){
     binary_get_detailed_header_info(filename,&my_CEL->header);
@@ -5204,147 +6755,92 @@ CEL *read_cel_file(const char *filename, int read_intensities_only){
     gzgeneric_get_detailed_header_info(filename,&my_CEL->header);
   } else if (isGenericMultiChannelCelFile(filename)){
     generic_get_detailed_header_info(filename,&my_CEL->header);
-    my_CEL->multichannel = multichannel_determine_number_channels(filename);
-    my_CEL->channelnames = Calloc(my_CEL->multichannel,char*);
-    for (k = 0; k <  my_CEL->multichannel; k++){
-      my_CEL->channelnames[k] =multichannel_determine_channel_name(filename, k);
+    if (read_genericcel_file_channels(filename, (size_t)(my_CEL->header.cols)*(my_CEL->header.rows), read_intensities_only, &channels)){
+      reader_error("It appears that the file %s is corrupted.",filename);
     }
+    take_multichannel_cel(my_CEL, &channels);
+    return my_CEL;
   }  else if (isgzGenericMultiChannelCelFile(filename)){
     gzgeneric_get_detailed_header_info(filename,&my_CEL->header);
-    my_CEL->multichannel = gzmultichannel_determine_number_channels(filename);
-    my_CEL->channelnames = Calloc(my_CEL->multichannel,char*);
-    for (k = 0; k <  my_CEL->multichannel; k++){
-      my_CEL->channelnames[k] =gzmultichannel_determine_channel_name(filename, k);
+    if (gzread_genericcel_file_channels(filename, (size_t)(my_CEL->header.cols)*(my_CEL->header.rows), read_intensities_only, &channels)){
+      reader_error("It appears that the file %s is corrupted.",filename);
     }
+    take_multichannel_cel(my_CEL, &channels);
+    return my_CEL;
   } else {
 #if defined HAVE_ZLIB
-    error("Is %s really a CEL file? tried reading as text, gzipped text, binary and gzipped binary\n",filename);
+    reader_error("Is %s really a CEL file? tried reading as text, gzipped text, binary and gzipped binary\n",filename);
 #else
-    error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",filename);
+    reader_error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",filename);
 #endif
   }
 
 
   /*** Now lets allocate the space for intensities, stdev, npixels ****/
-  if (!my_CEL->multichannel){
-    my_CEL->intensities = Calloc(1,double *);
-    my_CEL->intensities[0] = Calloc((my_CEL->header.cols)*(my_CEL->header.rows),double);
-    if (!read_intensities_only){
-      my_CEL->stddev = Calloc(1,double *);
-      my_CEL->npixels = Calloc(1,double *);
-      my_CEL->stddev[0] = Calloc((my_CEL->header.cols)*(my_CEL->header.rows),double);
-      my_CEL->npixels[0] = Calloc((my_CEL->header.cols)*(my_CEL->header.rows),double);
-    } else {
-      my_CEL->stddev = NULL;
-      my_CEL->npixels = NULL;
-    }
+  my_CEL->intensities = Calloc(1,double *);
+  my_CEL->intensities[0] = Calloc((my_CEL->header.cols)*(my_CEL->header.rows),double);
+  if (!read_intensities_only){
+    my_CEL->stddev = Calloc(1,double *);
+    my_CEL->npixels = Calloc(1,double *);
+    my_CEL->stddev[0] = Calloc((my_CEL->header.cols)*(my_CEL->header.rows),double);
+    my_CEL->npixels[0] = Calloc((my_CEL->header.cols)*(my_CEL->header.rows),double);
   } else {
-    my_CEL->intensities = Calloc(my_CEL->multichannel,double *);
-    for (i=0; i < my_CEL->multichannel; i++){
-      my_CEL->intensities[i] = Calloc((my_CEL->header.cols)*(my_CEL->header.rows),double);
-    }
-    if (!read_intensities_only){
-      my_CEL->stddev = Calloc(my_CEL->multichannel,double *);
-      my_CEL->npixels = Calloc(my_CEL->multichannel,double *);
-      for (i=0; i < my_CEL->multichannel; i++){
-	my_CEL->stddev[i] = Calloc((my_CEL->header.cols)*(my_CEL->header.rows),double);
-	my_CEL->npixels[i] = Calloc((my_CEL->header.cols)*(my_CEL->header.rows),double);
-      }
-    } else {
-      my_CEL->stddev = NULL;
-      my_CEL->npixels = NULL;
-    }
-
-
+    my_CEL->stddev = NULL;
+    my_CEL->npixels = NULL;
   }
 
 
   if (isTextCelFile(filename)){
-    read_cel_file_intensities(filename,my_CEL->intensities[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);	
-    if (!read_intensities_only){
-      read_cel_file_stddev(filename,my_CEL->stddev[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);
-      read_cel_file_npixels(filename,my_CEL->npixels[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);
-    }
+    *incomplete = read_cel_file_all(filename, my_CEL->intensities[0], 
+		      (read_intensities_only ? NULL : my_CEL->stddev[0]), 
+		      (read_intensities_only ? NULL : my_CEL->npixels[0]), 
+		      (my_CEL->header.cols)*(my_CEL->header.rows), my_CEL->header.cols);
   }  else if (isgzTextCelFile(filename)){
 #if defined HAVE_ZLIB
-    read_gzcel_file_intensities(filename,my_CEL->intensities[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);  
-    if (!read_intensities_only){	
-      read_gzcel_file_stddev(filename,my_CEL->stddev[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);
-      read_gzcel_file_npixels(filename,my_CEL->npixels[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);
-    }
+    *incomplete = read_gzcel_file_all(filename, my_CEL->intensities[0], 
+			(read_intensities_only ? NULL : my_CEL->stddev[0]), 
+			(read_intensities_only ? NULL : my_CEL->npixels[0]), 
+			(my_CEL->header.cols)*(my_CEL->header.rows), my_CEL->header.cols);
 #else
-    error("Compress option not supported on your platform\n");
+    reader_error("Compress option not supported on your platform\n");
 #endif
   } else if (isBinaryCelFile(filename)){
-    if (read_binarycel_file_intensities(filename,my_CEL->intensities[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols)){
-      error("It appears that the file %s is corrupted.",filename);
-    }
-    if (!read_intensities_only){
-      read_binarycel_file_stddev(filename,my_CEL->stddev[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);
-      read_binarycel_file_npixels(filename,my_CEL->npixels[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);
+    if (read_binarycel_file_all(filename, my_CEL->intensities[0], 
+				(read_intensities_only ? NULL : my_CEL->stddev[0]), 
+				(read_intensities_only ? NULL : my_CEL->npixels[0]))){
+      reader_error("It appears that the file %s is corrupted.",filename);
     }
   } else if (isgzBinaryCelFile(filename)){
-    if (gzread_binarycel_file_intensities(filename,my_CEL->intensities[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols)){
-      error("It appears that the file %s is corrupted.",filename);
+    if (gzread_binarycel_file_all(filename, my_CEL->intensities[0], 
+				  (read_intensities_only ? NULL : my_CEL->stddev[0]), 
+				  (read_intensities_only ? NULL : my_CEL->npixels[0]))){
+      reader_error("It appears that the file %s is corrupted.",filename);
     }  
-    if (!read_intensities_only){	
-      gzread_binarycel_file_stddev(filename,my_CEL->stddev[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);
-      gzread_binarycel_file_npixels(filename,my_CEL->npixels[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);
-    }
   } else if (isGenericCelFile(filename)){
-    read_genericcel_file_intensities(filename,my_CEL->intensities[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);  
-    if (!read_intensities_only){	
-      read_genericcel_file_stddev(filename,my_CEL->stddev[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);
-      read_genericcel_file_npixels(filename,my_CEL->npixels[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);
-    }
+    *incomplete = read_genericcel_file_all(filename, my_CEL->intensities[0], 
+			     (read_intensities_only ? NULL : my_CEL->stddev[0]), 
+			     (read_intensities_only ? NULL : my_CEL->npixels[0]));
   } else if (isgzGenericCelFile(filename)){
-    gzread_genericcel_file_intensities(filename,my_CEL->intensities[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);  
-    if (!read_intensities_only){	
-      gzread_genericcel_file_stddev(filename,my_CEL->stddev[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);
-      gzread_genericcel_file_npixels(filename,my_CEL->npixels[0], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols);
-    }
-  } else if (isGenericMultiChannelCelFile(filename)){
-    for (i=0; i < my_CEL->multichannel; i++){
-      read_genericcel_file_intensities_multichannel(filename,my_CEL->intensities[i], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols, i);  
-      if (!read_intensities_only){	
-	read_genericcel_file_stddev_multichannel(filename,my_CEL->stddev[i], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols, i);
-	read_genericcel_file_npixels_multichannel(filename,my_CEL->npixels[i], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols, i);
-      }
-    }
-  } else if (isgzGenericMultiChannelCelFile(filename)){
-    for (i=0; i < my_CEL->multichannel; i++){
-      gzread_genericcel_file_intensities_multichannel(filename,my_CEL->intensities[i], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols, i);  
-      if (!read_intensities_only){	
-	gzread_genericcel_file_stddev_multichannel(filename,my_CEL->stddev[i], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols, i);
-	gzread_genericcel_file_npixels_multichannel(filename,my_CEL->npixels[i], 0, (my_CEL->header.cols)*(my_CEL->header.rows), 1,my_CEL->header.cols, i);
-      }
-    }
+    *incomplete = gzread_genericcel_file_all(filename, my_CEL->intensities[0], 
+  			     (read_intensities_only ? NULL : my_CEL->stddev[0]), 
+  			     (read_intensities_only ? NULL : my_CEL->npixels[0]));
   }else {
 #if defined HAVE_ZLIB
-    error("Is %s really a CEL file? tried reading as text, gzipped text, binary and gzipped binary\n",filename);
+    reader_error("Is %s really a CEL file? tried reading as text, gzipped text, binary and gzipped binary\n",filename);
 #else
-    error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",filename);
+    reader_error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",filename);
 #endif
   }
 
   /*** Now add masks and outliers ***/
 
 
-  if (!my_CEL->multichannel){
-    my_CEL->nmasks = Calloc(1, int);
-    my_CEL->noutliers = Calloc(1, int);
-    my_CEL->masks_x = Calloc(1, short *);
-    my_CEL->masks_y = Calloc(1, short *);
-    my_CEL->outliers_x = Calloc(1, short *);
-    my_CEL->outliers_y = Calloc(1, short *);
-  } else {
-    my_CEL->nmasks = Calloc(my_CEL->multichannel, int);
-    my_CEL->noutliers = Calloc(my_CEL->multichannel, int);
-    my_CEL->masks_x = Calloc(my_CEL->multichannel, short *);
-    my_CEL->masks_y = Calloc(my_CEL->multichannel, short *);
-    my_CEL->outliers_x = Calloc(my_CEL->multichannel, short *);
-    my_CEL->outliers_y = Calloc(my_CEL->multichannel, short *);
-  }
+  my_CEL->nmasks = Calloc(1, int);
+  my_CEL->noutliers = Calloc(1, int);
+  my_CEL->masks_x = Calloc(1, short *);
+  my_CEL->masks_y = Calloc(1, short *);
+  my_CEL->outliers_x = Calloc(1, short *);
+  my_CEL->outliers_y = Calloc(1, short *);
 
   if (isTextCelFile(filename)){
     get_masks_outliers(filename, &(my_CEL->nmasks[0]), &my_CEL->masks_x[0], &my_CEL->masks_y[0], &(my_CEL->noutliers[0]), &my_CEL->outliers_x[0], &my_CEL->outliers_y[0]);
@@ -5352,7 +6848,7 @@ CEL *read_cel_file(const char *filename, int read_intensities_only){
 #if defined HAVE_ZLIB
     gz_get_masks_outliers(filename, &(my_CEL->nmasks[0]), &my_CEL->masks_x[0], &my_CEL->masks_y[0], &(my_CEL->noutliers[0]), &my_CEL->outliers_x[0], &my_CEL->outliers_y[0]);
 #else
-    error("Compress option not supported on your platform\n");
+    reader_error("Compress option not supported on your platform\n");
 #endif 
   } else if (isBinaryCelFile(filename)){
     binary_get_masks_outliers(filename, &(my_CEL->nmasks[0]), &my_CEL->masks_x[0], &my_CEL->masks_y[0], &(my_CEL->noutliers[0]), &my_CEL->outliers_x[0], &my_CEL->outliers_y[0]);
@@ -5362,19 +6858,11 @@ CEL *read_cel_file(const char *filename, int read_intensities_only){
     generic_get_masks_outliers(filename, &(my_CEL->nmasks[0]), &my_CEL->masks_x[0], &my_CEL->masks_y[0], &(my_CEL->noutliers[0]), &my_CEL->outliers_x[0], &my_CEL->outliers_y[0]);
   } else if (isgzGenericCelFile(filename)){
     gzgeneric_get_masks_outliers(filename, &(my_CEL->nmasks[0]), &my_CEL->masks_x[0], &my_CEL->masks_y[0], &(my_CEL->noutliers[0]), &my_CEL->outliers_x[0], &my_CEL->outliers_y[0]);
-  }  else if (isGenericMultiChannelCelFile(filename)){
-    for (i=0; i < my_CEL->multichannel; i++){
-      generic_get_masks_outliers_multichannel(filename, &(my_CEL->nmasks[i]), &my_CEL->masks_x[i], &my_CEL->masks_y[i], &(my_CEL->noutliers[i]), &my_CEL->outliers_x[i], &my_CEL->outliers_y[i], i);
-    }
-  } else if (isgzGenericMultiChannelCelFile(filename)){
-    for (i=0; i < my_CEL->multichannel; i++){
-      gzgeneric_get_masks_outliers_multichannel(filename, &(my_CEL->nmasks[i]), &my_CEL->masks_x[i], &my_CEL->masks_y[i], &(my_CEL->noutliers[i]), &my_CEL->outliers_x[i], &my_CEL->outliers_y[i], i);
-    }
   } else {
 #if defined HAVE_ZLIB
-    error("Is %s really a CEL file? tried reading as text, gzipped text, binary, gzipped binary, command console and gzipped command console formats.\n",filename);
+    reader_error("Is %s really a CEL file? tried reading as text, gzipped text, binary, gzipped binary, command console and gzipped command console formats.\n",filename);
 #else
-    error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",filename);
+    reader_error("Is %s really a CEL file? tried reading as text and binary. The gzipped text and binary formats are not supported on your platform.\n",filename);
 #endif
   }
 
@@ -5385,6 +6873,159 @@ CEL *read_cel_file(const char *filename, int read_intensities_only){
 }
 
 
+/************************************************************************
+ **
+ ** Moving the contents of a single channel CEL file between a "CEL"
+ ** structure and the cache (cel_cache.c). Neither copies the data.
+ **
+ ** view_cel_as_cached() - cel points into my_CEL
+ ** cel_from_cached()    - a CEL holding the contents of cel, which is
+ **                        left empty. stddev and npixels are dropped
+ **                        if read_intensities_only
+ **
+ ************************************************************************/
+
+static void view_cel_as_cached(CEL *my_CEL, cached_cel *cel){
+
+  cel->header = my_CEL->header;
+  cel->n_cells = (size_t)(my_CEL->header.cols)*(my_CEL->header.rows);
+  cel->intensities = my_CEL->intensities[0];
+  cel->stddev = (my_CEL->stddev != NULL) ? my_CEL->stddev[0] : NULL;
+  cel->npixels = (my_CEL->npixels != NULL) ? my_CEL->npixels[0] : NULL;
+  cel->nmasks = my_CEL->nmasks[0];
+  cel->masks_x = my_CEL->masks_x[0];
+  cel->masks_y = my_CEL->masks_y[0];
+  cel->noutliers = my_CEL->noutliers[0];
+  cel->outliers_x = my_CEL->outliers_x[0];
+  cel->outliers_y = my_CEL->outliers_y[0];
+}
+
+
+static CEL *cel_from_cached(cached_cel *cel, int read_intensities_only){
+
+  CEL *my_CEL;
+
+  my_CEL = Calloc(1, CEL);
+  my_CEL->multichannel = 0;
+  my_CEL->channelnames = NULL;
+  my_CEL->header = cel->header;
+
+  my_CEL->intensities = Calloc(1,double *);
+  my_CEL->intensities[0] = cel->intensities;
+  if (!read_intensities_only){
+    my_CEL->stddev = Calloc(1,double *);
+    my_CEL->npixels = Calloc(1,double *);
+    my_CEL->stddev[0] = cel->stddev;
+    my_CEL->npixels[0] = cel->npixels;
+  } else {
+    my_CEL->stddev = NULL;
+    my_CEL->npixels = NULL;
+    if (cel->stddev != NULL){
+      Free(cel->stddev);
+      Free(cel->npixels);
+    }
+  }
+
+  my_CEL->nmasks = Calloc(1, int);
+  my_CEL->noutliers = Calloc(1, int);
+  my_CEL->masks_x = Calloc(1, short *);
+  my_CEL->masks_y = Calloc(1, short *);
+  my_CEL->outliers_x = Calloc(1, short *);
+  my_CEL->outliers_y = Calloc(1, short *);
+  my_CEL->nmasks[0] = cel->nmasks;
+  my_CEL->masks_x[0] = cel->masks_x;
+  my_CEL->masks_y[0] = cel->masks_y;
+  my_CEL->noutliers[0] = cel->noutliers;
+  my_CEL->outliers_x[0] = cel->outliers_x;
+  my_CEL->outliers_y[0] = cel->outliers_y;
+
+  memset(cel, 0, sizeof(cached_cel));
+  return my_CEL;
+}
+
+
+/************************************************************************
+ **
+ ** CEL *read_cel_file(const char *filename, int read_intensities_only)
+ **  
+ ** Reads the contents of the CEL file into a "CEL" structure, from
+ ** the cache if it is enabled and has the file. Otherwise the file is
+ ** parsed and (if it is single channel and was read completely) added 
+ ** to the cache, keyed as it was before it was parsed.
+ **
+ ************************************************************************/
+
+CEL *read_cel_file(const char *filename, int read_intensities_only){
+
+  CEL *my_CEL;
+  cached_cel cel;
+  cache_source_key key;
+  int incomplete;
+
+  if (!cel_cache_enabled() || !cache_source_key_of(filename, &key)){
+    return parse_cel_file(filename, read_intensities_only, &incomplete);
+  }
+
+  if (load_cached_cel(filename, &key, !read_intensities_only, &cel)){
+    return cel_from_cached(&cel, read_intensities_only);
+  }
+
+  my_CEL = parse_cel_file(filename, read_intensities_only, &incomplete);
+  if (!my_CEL->multichannel && !incomplete){
+    view_cel_as_cached(my_CEL, &cel);
+    save_cached_cel(filename, &key, &cel);
+  }
+  return my_CEL;
+}
+
+
+/************************************************************************
+ **
+ ** static void read_cached_cel(const char *filename, int need_stddev, cached_cel *cel)
+ **  
+ ** fills cel with the contents of a single channel CEL file, from the
+ ** cache if it has them, otherwise by parsing the file (which is then
+ ** added to the cache, unless it was truncated). Release with free_cached_cel().
+ **
+ ************************************************************************/
+
+static void read_cached_cel(const char *filename, int need_stddev, cached_cel *cel){
+
+  CEL *my_CEL;
+  cache_source_key key;
+  int keyed, incomplete;
+
+  /* the key is taken first, so a file that changes while it is parsed is not cached as the old one */
+  keyed = cel_cache_enabled() && cache_source_key_of(filename, &key);
+  if (keyed && load_cached_cel(filename, &key, need_stddev, cel)){
+    return;
+  }
+
+  my_CEL = parse_cel_file(filename, !need_stddev, &incomplete);
+  if (my_CEL->multichannel){
+    reader_error("The file %s is a multichannel CEL file",filename);
+  }
+  view_cel_as_cached(my_CEL, cel);
+  if (keyed && !incomplete){
+    save_cached_cel(filename, &key, cel);
+  }
+
+  /* cel now owns the contents */
+  Free(my_CEL->intensities);
+  if (my_CEL->stddev != NULL){
+    Free(my_CEL->stddev);
+    Free(my_CEL->npixels);
+  }
+  Free(my_CEL->nmasks);
+  Free(my_CEL->noutliers);
+  Free(my_CEL->masks_x);
+  Free(my_CEL->masks_y);
+  Free(my_CEL->outliers_x);
+  Free(my_CEL->outliers_y);
+  Free(my_CEL);
+}
+
+
 /**************************************************************************
  **
  **
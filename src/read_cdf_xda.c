@@ -26,6 +26,15 @@
  ** Oct 27, 2007 - When building a cdfenv set NON identified values to NA (mostly affects MM for PM only arrays)
  ** Nov 12, 2008 - Fix crash 
  ** Jan 15, 2008 - Fix VECTOR_ELT/STRING_ELT issues
+ ** Oct 16, 2026 - ReadCDFFile builds a cdf_index (cdf_index.c) by decoding the units straight
+ **                from the mapped file, split across R_THREADS threads, and can keep the
+ **                compiled index in a cache directory (R_AFFYIO_CDF_CACHE)
+ ** Oct 16, 2026 - ReadCDFProbesets reads only the named probesets, finding their
+ **                units through the units_start table
+ ** Oct 16, 2026 - ReadCDFProbesets matches probesets by the name of the last block of each
+ **                unit, as ReadCDFFile names them. read_cdf_unit checks every read and that
+ **                its blocks and cells fit in the file
+ ** Oct 16, 2026 - build_cdf_index_xda checks the number of units before allocating by it
  **
  ****************************************************************/
 
@@ -36,7 +45,15 @@
 #include "stdlib.h"
 #include "stdio.h"
 #include "fread_functions.h"
+#include "mmap_functions.h"
+#include "cel_cache.h"
+#include "cdf_index.h"
 #include <ctype.h>
+#include <string.h>
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif
 
 /* #define READ_CDF_DEBUG */
 						  /* #define READ_CDF_DEBUG_SNP */
@@ -255,62 +272,106 @@ int read_cdf_qcunit(cdf_qc_unit *my_unit,int filelocation,FILE *instream){
   return 1;
 }
 
+/* 
+   the sizes (in the file) of a unit header, a block header and a cell, 
+   and where the name is in a block header 
+*/
+
+#define XDA_UNIT_HEADER_SIZE 20
+#define XDA_BLOCK_HEADER_SIZE 82
+#define XDA_BLOCK_NAME_OFFSET 18
+#define XDA_CELL_SIZE 14
+
+
 /*************************************************************************
  **
- ** int read_cdf_unit(cdf_unit *my_unit,int filelocation,FILE *instream)
+ ** int read_cdf_unit(cdf_unit *my_unit,int filelocation,FILE *instream,long filesize)
  **
  ** cdf_qc_unit *my_unit - preallocated space to store unit (aka probeset) information
  ** int filelocation - indexing/location information used to read information
  **                    from file
  ** FILE *instream - a pre-opened file to read from
+ ** long filesize - the size of the file, which the blocks and cells of 
+ **                 the unit must fit within
  **
  ** reads a specified probeset into the my_unit, including all blocks and all probes
  ** it is assumed that the unit itself is preallocated. Blocks and probes within
  ** the blocks are allocated by this function.
+ **
+ ** Returns 1 if the unit was read, otherwise 0 (with nothing left allocated
+ ** and my_unit->nblocks set to 0).
  ** 
  *************************************************************************/
 
-int read_cdf_unit(cdf_unit *my_unit,int filelocation,FILE *instream){
+int read_cdf_unit(cdf_unit *my_unit,int filelocation,FILE *instream,long filesize){
 
   int i,j;
+  int ok;
+  long offset;
 
-  fseek(instream,filelocation,SEEK_SET);
+  my_unit->nblocks = 0;
+  my_unit->unit_block = NULL;
 
-  fread_uint16(&(my_unit->unittype),1,instream);
-  fread_uchar(&(my_unit->direction),1,instream);
-  
+  if (filelocation < 0 || filelocation > filesize - XDA_UNIT_HEADER_SIZE || fseek(instream,filelocation,SEEK_SET) != 0){
+    return 0;
+  }
+
+  ok = fread_uint16(&(my_unit->unittype),1,instream) &&
+    fread_uchar(&(my_unit->direction),1,instream) &&
+    fread_int32(&(my_unit->natoms),1,instream) &&
+    fread_int32(&(my_unit->nblocks),1,instream) &&
+    fread_int32(&(my_unit->ncells),1,instream) &&
+    fread_int32(&(my_unit->unitnumber),1,instream) &&
+    fread_uchar(&(my_unit->ncellperatom),1,instream);
+  offset = (long)filelocation + XDA_UNIT_HEADER_SIZE;
+
+  if (!ok || my_unit->nblocks < 0 || my_unit->nblocks > (filesize - offset)/XDA_BLOCK_HEADER_SIZE){
+    my_unit->nblocks = 0;
+    return 0;
+  }
 
-  fread_int32(&(my_unit->natoms),1,instream);
-  fread_int32(&(my_unit->nblocks),1,instream);
-  fread_int32(&(my_unit->ncells),1,instream);
-  fread_int32(&(my_unit->unitnumber),1,instream);
-  fread_uchar(&(my_unit->ncellperatom),1,instream);
-
-  my_unit->unit_block = Calloc(my_unit->nblocks,cdf_unit_block);
-
-  for (i=0; i < my_unit->nblocks; i++){
-    fread_int32(&(my_unit->unit_block[i].natoms),1,instream);
-    fread_int32(&(my_unit->unit_block[i].ncells),1,instream);
-    fread_uchar(&(my_unit->unit_block[i].ncellperatom),1,instream);
-    fread_uchar(&(my_unit->unit_block[i].direction),1,instream);
-    fread_int32(&(my_unit->unit_block[i].firstatom),1,instream);
-    fread_int32(&(my_unit->unit_block[i].unused),1,instream);
-    fread_char(my_unit->unit_block[i].blockname,64,instream); 
-
-    my_unit->unit_block[i].unit_cells = Calloc(my_unit->unit_block[i].ncells,cdf_unit_cell);
-
-    for (j=0; j < my_unit->unit_block[i].ncells; j++){
-      fread_int32(&(my_unit->unit_block[i].unit_cells[j].atomnumber),1,instream);
-      fread_uint16(&(my_unit->unit_block[i].unit_cells[j].x),1,instream);
-      fread_uint16(&(my_unit->unit_block[i].unit_cells[j].y),1,instream);
-      fread_int32(&(my_unit->unit_block[i].unit_cells[j].indexpos),1,instream);
-      fread_char(&(my_unit->unit_block[i].unit_cells[j].pbase),1,instream);
-      fread_char(&(my_unit->unit_block[i].unit_cells[j].tbase),1,instream);
+  my_unit->unit_block = Calloc(my_unit->nblocks + 1,cdf_unit_block);
+
+  for (i=0; ok && i < my_unit->nblocks; i++){
+    ok = (filesize - offset >= XDA_BLOCK_HEADER_SIZE) &&
+      fread_int32(&(my_unit->unit_block[i].natoms),1,instream) &&
+      fread_int32(&(my_unit->unit_block[i].ncells),1,instream) &&
+      fread_uchar(&(my_unit->unit_block[i].ncellperatom),1,instream) &&
+      fread_uchar(&(my_unit->unit_block[i].direction),1,instream) &&
+      fread_int32(&(my_unit->unit_block[i].firstatom),1,instream) &&
+      fread_int32(&(my_unit->unit_block[i].unused),1,instream) &&
+      fread_char(my_unit->unit_block[i].blockname,64,instream); 
+    offset += XDA_BLOCK_HEADER_SIZE;
+
+    if (!ok || my_unit->unit_block[i].ncells < 0 || my_unit->unit_block[i].ncells > (filesize - offset)/XDA_CELL_SIZE){
+      ok = 0;
+      break;
     }
 
+    my_unit->unit_block[i].unit_cells = Calloc(my_unit->unit_block[i].ncells + 1,cdf_unit_cell);
 
+    for (j=0; ok && j < my_unit->unit_block[i].ncells; j++){
+      ok = fread_int32(&(my_unit->unit_block[i].unit_cells[j].atomnumber),1,instream) &&
+	fread_uint16(&(my_unit->unit_block[i].unit_cells[j].x),1,instream) &&
+	fread_uint16(&(my_unit->unit_block[i].unit_cells[j].y),1,instream) &&
+	fread_int32(&(my_unit->unit_block[i].unit_cells[j].indexpos),1,instream) &&
+	fread_char(&(my_unit->unit_block[i].unit_cells[j].pbase),1,instream) &&
+	fread_char(&(my_unit->unit_block[i].unit_cells[j].tbase),1,instream);
+    }
+    offset += (long)my_unit->unit_block[i].ncells*XDA_CELL_SIZE;
   }
 
+  if (!ok){
+    for (i=0; i < my_unit->nblocks; i++){
+      if (my_unit->unit_block[i].unit_cells != NULL){
+	Free(my_unit->unit_block[i].unit_cells);
+      }
+    }
+    Free(my_unit->unit_block);
+    my_unit->unit_block = NULL;
+    my_unit->nblocks = 0;
+    return 0;
+  }
 
   return 1;
 
@@ -370,6 +431,7 @@ static void dealloc_cdf_xda(cdf_xda *my_cdf){
 static int read_cdf_xda(const char *filename,cdf_xda *my_cdf){
 
   FILE *infile;
+  long filesize;
 
   int i;
 
@@ -379,6 +441,10 @@ static int read_cdf_xda(const char *filename,cdf_xda *my_cdf){
       return 0;
     }
 
+  fseek(infile,0,SEEK_END);
+  filesize = ftell(infile);
+  fseek(infile,0,SEEK_SET);
+
   if (!fread_int32(&my_cdf->header.magicnumber,1,infile)){
     return 0;
   }
@@ -469,7 +535,7 @@ static int read_cdf_xda(const char *filename,cdf_xda *my_cdf){
 
 
   for (i=0; i < my_cdf->header.n_units; i++){
-    if (!read_cdf_unit(&my_cdf->units[i],my_cdf->units_start[i],infile)){
+    if (!read_cdf_unit(&my_cdf->units[i],my_cdf->units_start[i],infile,filesize)){
       return 0;
     }
   }
@@ -588,7 +654,7 @@ static int check_cdf_xda(const char *filename){
 
 /*************************************************************
  **
- ** static int isPM(char pbase,char tbase)
+ ** int isPM(char pbase,char tbase)
  **
  ** char pbase - probe base at substitution position
  ** char tbase - target base at substitution position
@@ -599,7 +665,7 @@ static int check_cdf_xda(const char *filename){
  *************************************************************/
 
 
-static int isPM(char pbase,char tbase){
+int isPM(char pbase,char tbase){
   /*
   if (Pbase.Cmp(Tbase) == 0){
     *isPM = false;
@@ -664,301 +730,815 @@ SEXP CheckCDFXDA(SEXP filename){
 
 
 
-SEXP ReadCDFFile(SEXP filename){
-  
-  SEXP CDFInfo;
-  SEXP Dimensions;
-  SEXP LocMap= R_NilValue,tempLocMap;
-  SEXP CurLocs;
-  SEXP PSnames = R_NilValue,tempPSnames;
-  SEXP ColNames;
-  SEXP dimnames;
+/*************************************************************
+ **
+ ** Compiling a binary CDF file into a cdf_index (see cdf_index.c)
+ **
+ ** Rather than read every unit, block and cell into its own
+ ** structure (read_cdf_xda()), the file is mapped (or read whole)
+ ** and the units are decoded straight from it into the index. This
+ ** is done in two passes, the first counting the atoms and name of
+ ** each unit, the second filling in the cells. Each pass is shared
+ ** between R_THREADS threads when those are available.
+ **
+ ** As with ReadCDFFile only expression units are handled. As there,
+ ** the probeset takes the name and atoms of the (last) block of
+ ** the unit.
+ **
+ *************************************************************/
 
-  cdf_xda my_cdf;
-  const char *cur_file_name;
-  /* char *tmp_name; */
+#define XDA_UNIT_OK 0
+#define XDA_UNIT_CORRUPT 1
+#define XDA_UNIT_GENOTYPING 2
+#define XDA_UNIT_OTHER 3
 
-  int i,j,k;
-  int cur_blocks,cur_cells, cur_atoms;
-  /* int which_probetype; */
-  int which_psname=0;
+#define THREADS_ENV_VAR "R_THREADS"
 
-  cdf_unit_cell *current_cell;
 
-  double *curlocs;
-  
-  /* int nrows, ncols; */
+static int xda_int32(const unsigned char *x){
+  return (int)((unsigned int)x[0] | ((unsigned int)x[1] << 8) | ((unsigned int)x[2] << 16) | ((unsigned int)x[3] << 24));
+}
+
+static unsigned short xda_uint16(const unsigned char *x){
+  return (unsigned short)(x[0] | (x[1] << 8));
+}
+
+
+typedef struct{
+  const unsigned char *data;
+  size_t size;
+  size_t units_start_offset;  /* where the units_start table is in data */
+  int cols;
+  int first_unit;             /* this job's units */
+  int last_unit;
+  int pass;
+  uint32_t *unit_atoms;       /* pass 1: atoms in each unit */
+  uint32_t *unit_name_size;   /* pass 1: bytes for each name */
+  cdf_index *index;           /* pass 2: filled in */
+  int status;
+} xda_index_job;
+
+
+/*************************************************************
+ **
+ ** static int locate_xda_block(const unsigned char *data, size_t size, size_t unit_offset, size_t *block_offset)
+ **
+ ** checks the unit at unit_offset fits in the file and is an 
+ ** expression unit. block_offset is set to its last block (0 if
+ ** it has none). RETURNS one of the XDA_UNIT_ codes.
+ **
+ *************************************************************/
+
+static int locate_xda_block(const unsigned char *data, size_t size, size_t unit_offset, size_t *block_offset){
+
+  unsigned short unittype;
+  int i, nblocks, ncells;
+  size_t offset;
+
+  *block_offset = 0;
+  if (unit_offset > size || size - unit_offset < XDA_UNIT_HEADER_SIZE){
+    return XDA_UNIT_CORRUPT;
+  }
+  unittype = xda_uint16(data + unit_offset);
+  if (unittype == 2){
+    return XDA_UNIT_GENOTYPING;
+  } else if (unittype != 1){
+    return XDA_UNIT_OTHER;
+  }
+  nblocks = xda_int32(data + unit_offset + 7);
+
+  offset = unit_offset + XDA_UNIT_HEADER_SIZE;
+  for (i=0; i < nblocks; i++){
+    if (size - offset < XDA_BLOCK_HEADER_SIZE){
+      return XDA_UNIT_CORRUPT;
+    }
+    ncells = xda_int32(data + offset + 4);
+    if (ncells < 0 || (size - offset - XDA_BLOCK_HEADER_SIZE)/XDA_CELL_SIZE < (size_t)ncells){
+      return XDA_UNIT_CORRUPT;
+    }
+    *block_offset = offset;
+    offset += XDA_BLOCK_HEADER_SIZE + (size_t)ncells*XDA_CELL_SIZE;
+  }
+  return XDA_UNIT_OK;
+}
+
+
+static int decode_xda_units(xda_index_job *job){
+
+  int i, k, natoms, ncells, atom;
+  size_t block_offset, first, name_size;
+  const unsigned char *block, *cell, *name_end;
+  int32_t *target;
+  char *name;
+  int status;
+
+  for (i = job->first_unit; i < job->last_unit; i++){
+    status = locate_xda_block(job->data, job->size, (size_t)xda_int32(job->data + job->units_start_offset + 4*(size_t)i), &block_offset);
+    if (status != XDA_UNIT_OK){
+      return status;
+    }
+    block = (block_offset != 0) ? job->data + block_offset : NULL;
+    natoms = (block != NULL) ? xda_int32(block) : 0;
+    if (natoms < 0){
+      return XDA_UNIT_CORRUPT;
+    }
+
+    if (job->pass == 1){
+      job->unit_atoms[i] = (uint32_t)natoms;
+      job->unit_name_size[i] = 1;
+      if (block != NULL){
+	name_end = memchr(block + XDA_BLOCK_NAME_OFFSET, '\0', 63);
+	job->unit_name_size[i] += (name_end != NULL) ? (uint32_t)(name_end - (block + XDA_BLOCK_NAME_OFFSET)) : 63;
+      }
+      continue;
+    }
+
+    first = job->index->set_start[i];
+    if (block != NULL){
+      name = job->index->names + job->index->name_start[i];
+      name_size = job->index->name_start[i + 1] - job->index->name_start[i];
+      memcpy(name, block + XDA_BLOCK_NAME_OFFSET, name_size - 1);
+      name[name_size - 1] = '\0';
+
+      ncells = xda_int32(block + 4);
+      for (k=0, cell = block + XDA_BLOCK_HEADER_SIZE; k < ncells; k++, cell += XDA_CELL_SIZE){
+	atom = xda_int32(cell);
+	if (atom < 0 || atom >= natoms){
+	  return XDA_UNIT_CORRUPT;
+	}
+	target = isPM((char)cell[12], (char)cell[13]) ? job->index->pm : job->index->mm;
+	target[first + atom] = xda_uint16(cell + 4) + xda_uint16(cell + 6)*job->cols + 1;
+      }
+    }
+  }
+  return XDA_UNIT_OK;
+}
+
+
+#ifdef USE_PTHREADS
+static void *decode_xda_units_thread(void *data){
+  xda_index_job *job = (xda_index_job *)data;
+  job->status = decode_xda_units(job);
+  return NULL;
+}
+#endif
+
+
+/* runs one pass over all the units, split across threads if possible. returns an XDA_UNIT_ code */
+
+static int run_xda_pass(xda_index_job *jobs, int num_threads){
+
+  int t, status = XDA_UNIT_OK;
+#ifdef USE_PTHREADS
+  pthread_t *threads;
+  pthread_attr_t attr;
+  int *started;
+
+  if (num_threads > 1){
+    threads = Calloc(num_threads, pthread_t);
+    started = Calloc(num_threads, int);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    for (t=0; t < num_threads; t++){
+      started[t] = (pthread_create(&threads[t], &attr, decode_xda_units_thread, (void *)&jobs[t]) == 0);
+      if (!started[t]){
+	/* do this share here instead */
+	jobs[t].status = decode_xda_units(&jobs[t]);
+      }
+    }
+    for (t=0; t < num_threads; t++){
+      if (started[t]){
+	pthread_join(threads[t], NULL);
+      }
+    }
+    pthread_attr_destroy(&attr);
+    Free(started);
+    Free(threads);
+  } else {
+    jobs[0].status = decode_xda_units(&jobs[0]);
+  }
+#else
+  for (t=0; t < num_threads; t++){
+    jobs[t].status = decode_xda_units(&jobs[t]);
+  }
+#endif
+
+  for (t=0; t < num_threads; t++){
+    if (jobs[t].status != XDA_UNIT_OK && status == XDA_UNIT_OK){
+      status = jobs[t].status;
+    }
+  }
+  return status;
+}
+
+
+/*************************************************************
+ **
+ ** int build_cdf_index_xda(const char *filename, cdf_index *index)
+ **
+ ** const char *filename - a binary CDF file
+ ** cdf_index *index - filled with its probesets. Release with 
+ **                    free_cdf_index()
+ **
+ ** RETURNS 0 if filename is not a binary CDF file, 1 once the index
+ ** is built. Other problems with the file are errors.
+ **
+ *************************************************************/
+
+int build_cdf_index_xda(const char *filename, cdf_index *index){
+
+  mapped_file map;
+  unsigned char *buffer = NULL;
+  const unsigned char *data;
+  size_t size, offset, n_atoms, names_size;
+  int i, n_units, n_qc_units, len_ref_seq, rows, cols;
+  int num_threads = 1;
+  int status;
+  char *nthreads;
+  uint32_t *unit_atoms, *unit_name_size;
+  xda_index_job *jobs;
+
+  if (!map_file(filename, &map)){
+    if (!read_whole_file(filename, &buffer, &size)){
+      error("Unable to open the file %s",filename);
+    }
+    data = buffer;
+  } else {
+    data = map.data;
+    size = map.size;
+  }
+
+  if (size < 24 || xda_int32(data) != 67 || xda_int32(data + 4) != 1){
+    if (buffer != NULL){
+      Free(buffer);
+    } else {
+      unmap_file(&map);
+    }
+    return 0;
+  }
+
+  cols = xda_uint16(data + 8);
+  rows = xda_uint16(data + 10);
+  n_units = xda_int32(data + 12);
+  n_qc_units = xda_int32(data + 16);
+  len_ref_seq = xda_int32(data + 20);
+
+  /* reference sequence and probeset names, then the qc unit and unit offsets */
+  offset = 24 + (size_t)len_ref_seq + 64*(size_t)n_units + 4*(size_t)n_qc_units;
+  if (n_units < 0 || n_qc_units < 0 || len_ref_seq < 0 || offset > size || (size - offset)/4 < (size_t)n_units){
+    /* n_units can not be trusted to size anything */
+    if (buffer != NULL){
+      Free(buffer);
+    } else {
+      unmap_file(&map);
+    }
+    error("Problem reading binary cdf file %s. Possibly corrupted or truncated?\n",filename);
+  }
+  status = XDA_UNIT_OK;
+
+  nthreads = getenv(THREADS_ENV_VAR);
+  if (nthreads != NULL && atoi(nthreads) > 0){
+    num_threads = atoi(nthreads);
+  }
+#ifndef USE_PTHREADS
+  num_threads = 1;
+#endif
+  if (num_threads > n_units/1024 + 1){
+    num_threads = n_units/1024 + 1;
+  }
+
+  unit_atoms = Calloc(n_units + 1, uint32_t);
+  unit_name_size = Calloc(n_units + 1, uint32_t);
+  jobs = Calloc(num_threads, xda_index_job);
+  for (i=0; i < num_threads; i++){
+    jobs[i].data = data;
+    jobs[i].size = size;
+    jobs[i].units_start_offset = offset;
+    jobs[i].cols = cols;
+    jobs[i].first_unit = (int)(((double)n_units*i)/num_threads);
+    jobs[i].last_unit = (int)(((double)n_units*(i+1))/num_threads);
+    jobs[i].pass = 1;
+    jobs[i].unit_atoms = unit_atoms;
+    jobs[i].unit_name_size = unit_name_size;
+    jobs[i].index = index;
+    jobs[i].status = XDA_UNIT_OK;
+  }
+
+  status = run_xda_pass(jobs, num_threads);
+
+  if (status == XDA_UNIT_OK){
+    n_atoms = 0;
+    names_size = 0;
+    for (i=0; i < n_units; i++){
+      n_atoms += unit_atoms[i];
+      names_size += unit_name_size[i];
+    }
+    if (n_atoms >= UINT32_MAX || names_size >= UINT32_MAX){
+      status = XDA_UNIT_CORRUPT;
+    }
+  }
+
+  if (status == XDA_UNIT_OK){
+    alloc_cdf_index(index, rows, cols, (size_t)n_units, n_atoms, names_size);
+    for (i=0; i < n_units; i++){
+      index->set_start[i + 1] = index->set_start[i] + unit_atoms[i];
+      index->name_start[i + 1] = index->name_start[i] + unit_name_size[i];
+    }
+    for (i=0; i < num_threads; i++){
+      jobs[i].pass = 2;
+    }
+    status = run_xda_pass(jobs, num_threads);
+    if (status != XDA_UNIT_OK){
+      free_cdf_index(index);
+    }
+  }
+
+  Free(jobs);
+  Free(unit_atoms);
+  Free(unit_name_size);
+  if (buffer != NULL){
+    Free(buffer);
+  } else {
+    unmap_file(&map);
+  }
+
+  if (status == XDA_UNIT_GENOTYPING){
+    error("makecdfenv does not currently know how to handle cdf files of this type (genotyping).");
+  } else if (status == XDA_UNIT_OTHER){
+    error("makecdfenv does not currently know how to handle cdf files of this type (ie not expression or genotyping)");
+  } else if (status != XDA_UNIT_OK){
+    error("Problem reading binary cdf file %s. Possibly corrupted or truncated?\n",filename);
+  }
+  return 1;
+}
+
+
+
+/*************************************************************
+ **
+ ** SEXP ReadCDFFile(SEXP filename)
+ **
+ ** SEXP filename - a binary CDF file
+ **
+ ** RETURNS the dimensions of the chip (rows, cols) and a list of
+ ** probesets with the PM MM locations of each (in the BioC style).
+ ** If R_AFFYIO_CDF_CACHE names a directory these come from a
+ ** compiled index of the file kept there (see cdf_index.c), which
+ ** is made the first time the file is read.
+ **
+ *************************************************************/
 
+SEXP ReadCDFFile(SEXP filename){
+  
+  SEXP CDFInfo;
+  cdf_index index;
+  const char *cur_file_name;
+  char *cache_dir;
+  char *entry_name = NULL;
  
   cur_file_name = CHAR(STRING_ELT(filename,0));
 
-  if (!read_cdf_xda(cur_file_name,&my_cdf)){
+  cache_dir = getenv(CDF_CACHE_ENV_VAR);
+  if (cache_dir != NULL && cache_dir[0] != '\0'){
+    entry_name = cache_entry_name(cache_dir, cur_file_name, ".cdfindex");
+    if (open_cdf_index(entry_name, cur_file_name, &index)){
+      Free(entry_name);
+      entry_name = NULL;
+      PROTECT(CDFInfo = cdf_index_locmap(&index));
+      free_cdf_index(&index);
+      UNPROTECT(1);
+      return CDFInfo;
+    }
+  }
+
+  if (!build_cdf_index_xda(cur_file_name, &index)){
+    if (entry_name != NULL){
+      Free(entry_name);
+    }
     error("Problem reading binary cdf file %s. Possibly corrupted or truncated?\n",cur_file_name);
   }
   
+  if (entry_name != NULL){
+    write_cdf_index(entry_name, cur_file_name, &index);
+    Free(entry_name);
+  }
 
-  /* We output:
-     nrows, ncols in an integer vector, plus a list of probesets PM MM locations (in the BioC style) */
-  PROTECT(CDFInfo = allocVector(VECSXP,2));
-  PROTECT(Dimensions = allocVector(REALSXP,2));
+  PROTECT(CDFInfo = cdf_index_locmap(&index));
+  free_cdf_index(&index);
+  UNPROTECT(1);
+  return CDFInfo;
+}
 
-  if (my_cdf.units[0].unittype ==1){ 
-    PROTECT(LocMap = allocVector(VECSXP,my_cdf.header.n_units));
-    PROTECT(PSnames = allocVector(STRSXP,my_cdf.header.n_units));
-  } else {
-    PROTECT(tempLocMap = allocVector(VECSXP,2*my_cdf.header.n_units));
-    PROTECT(tempPSnames = allocVector(STRSXP,2*my_cdf.header.n_units));
+
+
+
+/*************************************************************
+ **
+ ** Random access to the units of a binary CDF file.
+ **
+ ** Opening a cdf_xda_handle reads just the header and the
+ ** qc_start/units_start tables of the file. Units are then found
+ ** by name and read one at a time with read_cdf_unit(), so that
+ ** asking for a few probesets does not cost a parse of the whole
+ ** file. As ReadCDFFile names each probeset after the last block
+ ** of its unit (which need not match the probeset name table) 
+ ** finding them means reading the block headers of the units, but
+ ** none of their cells.
+ **
+ *************************************************************/
+
+#define XDA_NAME_SIZE 64
+
+typedef struct{
+  cdf_xda_header header;
+  long file_size;
+  int *qc_start;
+  int *units_start;
+  FILE *infile;
+} cdf_xda_handle;
+
+
+typedef struct{
+  const char *name;
+  int which;              /* position in the request */
+} cdf_name_request;
+
+
+/*************************************************************
+ **
+ ** static int open_cdf_xda_handle(const char *filename, cdf_xda_handle *handle)
+ **
+ ** RETURNS 1 if filename is a binary CDF file and its header and
+ ** offset tables were read, otherwise 0 (with nothing left open).
+ **
+ *************************************************************/
+
+static int open_cdf_xda_handle(const char *filename, cdf_xda_handle *handle){
+
+  memset(handle, 0, sizeof(cdf_xda_handle));
+
+  if ((handle->infile = fopen(filename, "rb")) == NULL){
+    return 0;
   }
 
-  NUMERIC_POINTER(Dimensions)[0] = (double)my_cdf.header.rows;
-  NUMERIC_POINTER(Dimensions)[1] = (double)my_cdf.header.cols;
-  
+  if (!fread_int32(&handle->header.magicnumber,1,handle->infile) || handle->header.magicnumber != 67 ||
+      !fread_int32(&handle->header.version_number,1,handle->infile) || handle->header.version_number != 1 ||
+      !fread_uint16(&handle->header.cols,1,handle->infile) ||
+      !fread_uint16(&handle->header.rows,1,handle->infile) ||
+      !fread_int32(&handle->header.n_units,1,handle->infile) ||
+      !fread_int32(&handle->header.n_qc_units,1,handle->infile) ||
+      !fread_int32(&handle->header.len_ref_seq,1,handle->infile) ||
+      handle->header.n_units < 0 || handle->header.n_qc_units < 0 || handle->header.len_ref_seq < 0 ||
+      fseek(handle->infile,handle->header.len_ref_seq,SEEK_CUR) != 0){
+    fclose(handle->infile);
+    return 0;
+  }
 
-  for (i=0; i < my_cdf.header.n_units; i++){
-#ifdef READ_CDF_DEBUG
-    printf("%d\n",i);
-#endif
-    cur_blocks = my_cdf.units[i].nblocks;
+  if (fseek(handle->infile,XDA_NAME_SIZE*(long)handle->header.n_units,SEEK_CUR) != 0){
+    fclose(handle->infile);
+    return 0;
+  }
 
-#ifdef READ_CDF_DEBUG
-    Rprintf("New Block: ");
-#endif
-    if (my_cdf.units[i].unittype ==1){
-      /* Expression analysis */
-      for (j=0; j < cur_blocks; j++){
-	
-#ifdef READ_CDF_DEBUG
-	Rprintf("%s ",my_cdf.units[i].unit_block[j].blockname);
-#endif
+  handle->qc_start = Calloc(handle->header.n_qc_units,int);
+  handle->units_start = Calloc(handle->header.n_units,int);
 
-	cur_cells = my_cdf.units[i].unit_block[j].ncells;
-	cur_atoms = my_cdf.units[i].unit_block[j].natoms; 
-	
-	SET_STRING_ELT(PSnames,i,mkChar(my_cdf.units[i].unit_block[j].blockname));
-	
-	PROTECT(CurLocs = allocMatrix(REALSXP,cur_atoms,2));
-	PROTECT(ColNames = allocVector(STRSXP,2));
-	PROTECT(dimnames = allocVector(VECSXP,2));
-	SET_STRING_ELT(ColNames,0,mkChar("pm"));
-	SET_STRING_ELT(ColNames,1,mkChar("mm"));
-	
-	curlocs = NUMERIC_POINTER(AS_NUMERIC(CurLocs));
-	
-        for (k=0; k < cur_atoms*2; k++){
-	  curlocs[k] = R_NaN;
-	}
+  if ((handle->header.n_qc_units != 0 && !fread_int32(handle->qc_start,handle->header.n_qc_units,handle->infile)) ||
+      (handle->header.n_units != 0 && !fread_int32(handle->units_start,handle->header.n_units,handle->infile))){
+    Free(handle->qc_start);
+    Free(handle->units_start);
+    fclose(handle->infile);
+    return 0;
+  }
 
-	for (k=0; k < cur_cells; k++){
-	  current_cell = &(my_cdf.units[i].unit_block[j].unit_cells[k]);
-	  
-	  if(isPM(current_cell->pbase,current_cell->tbase)){
-	    curlocs[current_cell->atomnumber] =  current_cell->x + current_cell->y*(my_cdf.header.cols) + 1;   /*  current_cell->x + current_cell->y*(my_cdf.header.rows) + 1; */          /* "y*", sizex, "+x+1"; */
-	  } else {
-	    curlocs[current_cell->atomnumber+ cur_atoms] =   current_cell->x + current_cell->y*(my_cdf.header.cols) + 1;                /* current_cell->x + current_cell->y*(my_cdf.header.rows) + 1; */
-	  }
-	}
-	
+  if (fseek(handle->infile,0,SEEK_END) != 0 || (handle->file_size = ftell(handle->infile)) < 0){
+    Free(handle->qc_start);
+    Free(handle->units_start);
+    fclose(handle->infile);
+    return 0;
+  }
+  return 1;
+}
 
-      
-	SET_VECTOR_ELT(dimnames,1,ColNames);
-	setAttrib(CurLocs, R_DimNamesSymbol, dimnames);
-	SET_VECTOR_ELT(LocMap,i,CurLocs);
-	UNPROTECT(3);
-      }
-    } else if (my_cdf.units[i].unittype == 2){
-      /* Genotyping array */
 
-#ifndef READ_CDF_NOSNP
-      if (cur_blocks == 1){
-	
-	cur_cells = my_cdf.units[i].unit_block[0].ncells;
-	cur_atoms = my_cdf.units[i].unit_block[0].natoms; 
-	
-	SET_STRING_ELT(tempPSnames,which_psname,mkChar(my_cdf.units[i].unit_block[0].blockname));
-	
-	PROTECT(CurLocs = allocMatrix(REALSXP,cur_atoms,2));
-	PROTECT(ColNames = allocVector(STRSXP,2));
-	PROTECT(dimnames = allocVector(VECSXP,2));
-	SET_STRING_ELT(ColNames,0,mkChar("pm"));
-	SET_STRING_ELT(ColNames,1,mkChar("mm"));
-	
-	curlocs = NUMERIC_POINTER(AS_NUMERIC(CurLocs));
-	
-	for (k=0; k < cur_cells; k++){
-	  current_cell = &(my_cdf.units[i].unit_block[0].unit_cells[k]);
-	  
-	  if(isPM(current_cell->pbase,current_cell->tbase)){
-	    curlocs[current_cell->atomnumber] =   current_cell->x + current_cell->y*(my_cdf.header.cols) + 1;   /* current_cell->x + current_cell->y*(my_cdf.header.rows) + 1;    */       /* "y*", sizex, "+x+1"; */
-	  } else {
-	    curlocs[current_cell->atomnumber+ cur_atoms] =   current_cell->x + current_cell->y*(my_cdf.header.cols) + 1;                /* current_cell->x + current_cell->y*(my_cdf.header.rows) + 1; */
-	  }
-	}
-	
+static void close_cdf_xda_handle(cdf_xda_handle *handle){
 
-      
-	SET_VECTOR_ELT(dimnames,1,ColNames);
-	setAttrib(CurLocs, R_DimNamesSymbol, dimnames);
-	SET_VECTOR_ELT(tempLocMap,which_psname,CurLocs);
-	UNPROTECT(3);
-	which_psname++;
-
-      } else if (cur_blocks == 4){
-	for (j=0; j < cur_blocks; j++){
-#ifdef READ_CDF_DEBUG_SNP
-	  Rprintf("%s %s\n",my_cdf.probesetnames[i],my_cdf.units[i].unit_block[j].blockname);
-#endif
-	}
-	
-	j = 0;
-	cur_cells = my_cdf.units[i].unit_block[0].ncells;
-	cur_atoms = my_cdf.units[i].unit_block[0].natoms; 
-	if (strlen(my_cdf.units[i].unit_block[j].blockname) == 1){
-	  tmp_name = Calloc(strlen(my_cdf.probesetnames[i])+2,char);
-	  tmp_name = strcpy(tmp_name,my_cdf.probesetnames[i]);
-	  tmp_name = strcat(tmp_name,my_cdf.units[i].unit_block[j].blockname);
-	  SET_STRING_ELT(tempPSnames,which_psname,mkChar(tmp_name));
-	  Free(tmp_name);
-	} else {
-	  SET_STRING_ELT(tempPSnames,which_psname,mkChar(my_cdf.units[i].unit_block[0].blockname));
-	}
+  Free(handle->qc_start);
+  Free(handle->units_start);
+  fclose(handle->infile);
+}
 
-	PROTECT(CurLocs = allocMatrix(REALSXP,2*cur_atoms,2));
-	PROTECT(ColNames = allocVector(STRSXP,2));
-	PROTECT(dimnames = allocVector(VECSXP,2));
-	SET_STRING_ELT(ColNames,0,mkChar("pm"));
-	SET_STRING_ELT(ColNames,1,mkChar("mm"));
-	
-	curlocs = NUMERIC_POINTER(AS_NUMERIC(CurLocs));
-
-
-	for (k=0; k < cur_cells; k++){
-	  current_cell = &(my_cdf.units[i].unit_block[0].unit_cells[k]);
-	  /*	  Rprintf("%d %d  %u %u \n",cur_cells, current_cell->atomnumber,current_cell->x,current_cell->y); */
-	  if(isPM(current_cell->pbase,current_cell->tbase)){
-	    curlocs[current_cell->atomnumber] = current_cell->x + current_cell->y*(my_cdf.header.rows) + 1;           /* "y*", sizex, "+x+1"; */
-	  } else {
-	    curlocs[current_cell->atomnumber+ 2*cur_atoms] = current_cell->x + current_cell->y*(my_cdf.header.rows) + 1; 
-	  }
-	  if (current_cell->x + current_cell->y*(my_cdf.header.rows) + 1 == 370737){
-	    Rprintf("%d %c %c",isPM(current_cell->pbase,current_cell->tbase),current_cell->pbase,current_cell->tbase);
-	  }
-	}
 
-	j=2;
-	cur_cells = my_cdf.units[i].unit_block[2].ncells;
-	cur_atoms = my_cdf.units[i].unit_block[2].natoms; 
-	for (k=0; k < cur_cells; k++){
-	  current_cell = &(my_cdf.units[i].unit_block[2].unit_cells[k]);
-	  /* Rprintf("half : %d %d  %u %u \n",cur_cells, current_cell->atomnumber,current_cell->x,current_cell->y); */
-	  if(isPM(current_cell->pbase,current_cell->tbase)){
-	    curlocs[current_cell->atomnumber - (cur_atoms)] = current_cell->x + current_cell->y*(my_cdf.header.rows) + 1;           /* "y*", sizex, "+x+1"; */
-	  } else {
-	    curlocs[current_cell->atomnumber - (cur_atoms)+ 2*cur_atoms] = current_cell->x + current_cell->y*(my_cdf.header.rows) + 1; 
-	  }
-	}
-	
-	SET_VECTOR_ELT(dimnames,1,ColNames);
-	setAttrib(CurLocs, R_DimNamesSymbol, dimnames);
-	SET_VECTOR_ELT(tempLocMap,which_psname,CurLocs);	
-	UNPROTECT(3);
-	which_psname++;
+static int compare_name_request(const void *a, const void *b){
+  return strcmp(((const cdf_name_request *)a)->name, ((const cdf_name_request *)b)->name);
+}
+
+
+/*************************************************************
+ **
+ ** static int read_xda_block_name(cdf_xda_handle *handle, int which, char *name)
+ **
+ ** sets name (XDA_NAME_SIZE bytes) to the name of the last block
+ ** of unit which, as ReadCDFFile would name the probeset, or "" if
+ ** it has no blocks. Only the block headers are read, bounded by
+ ** the size of the file as in locate_xda_block().
+ **
+ ** RETURNS one of the XDA_UNIT_ codes
+ **
+ *************************************************************/
 
+static int read_xda_block_name(cdf_xda_handle *handle, int which, char *name){
 
+  unsigned char header[XDA_BLOCK_HEADER_SIZE];
+  int i, nblocks, ncells;
+  unsigned short unittype;
+  long offset = handle->units_start[which];
 
+  name[0] = '\0';
+  if (offset < 0 || offset > handle->file_size - XDA_UNIT_HEADER_SIZE || fseek(handle->infile, offset, SEEK_SET) != 0 ||
+      !fread_uchar(header, XDA_UNIT_HEADER_SIZE, handle->infile)){
+    return XDA_UNIT_CORRUPT;
+  }
+  unittype = xda_uint16(header);
+  if (unittype == 2){
+    return XDA_UNIT_GENOTYPING;
+  } else if (unittype != 1){
+    return XDA_UNIT_OTHER;
+  }
+  nblocks = xda_int32(header + 7);
 
+  offset += XDA_UNIT_HEADER_SIZE;
+  for (i=0; i < nblocks; i++){
+    if (handle->file_size - offset < XDA_BLOCK_HEADER_SIZE || fseek(handle->infile, offset, SEEK_SET) != 0 ||
+	!fread_uchar(header, XDA_BLOCK_HEADER_SIZE, handle->infile)){
+      return XDA_UNIT_CORRUPT;
+    }
+    ncells = xda_int32(header + 4);
+    if (ncells < 0 || (handle->file_size - offset - XDA_BLOCK_HEADER_SIZE)/XDA_CELL_SIZE < ncells){
+      return XDA_UNIT_CORRUPT;
+    }
+    /* as decode_xda_units(), at most 63 characters of it */
+    memcpy(name, header + XDA_BLOCK_NAME_OFFSET, XDA_NAME_SIZE - 1);
+    name[XDA_NAME_SIZE - 1] = '\0';
+    offset += XDA_BLOCK_HEADER_SIZE + (long)ncells*XDA_CELL_SIZE;
+  }
+  return XDA_UNIT_OK;
+}
 
-	j = 1;	
-	cur_cells = my_cdf.units[i].unit_block[1].ncells;
-	cur_atoms = my_cdf.units[i].unit_block[1].natoms; 
-	if (strlen(my_cdf.units[i].unit_block[j].blockname) == 1){
-	  tmp_name = Calloc(strlen(my_cdf.probesetnames[i])+2,char);
-	  tmp_name = strcpy(tmp_name,my_cdf.probesetnames[i]);
-	  tmp_name = strcat(tmp_name,my_cdf.units[i].unit_block[j].blockname);
-	  SET_STRING_ELT(tempPSnames,which_psname,mkChar(tmp_name));
-	  Free(tmp_name);
-	} else {
-	  SET_STRING_ELT(tempPSnames,which_psname,mkChar(my_cdf.units[i].unit_block[1].blockname));
-	}
-	PROTECT(CurLocs = allocMatrix(REALSXP,2*cur_atoms,2));
-	PROTECT(ColNames = allocVector(STRSXP,2));
-	PROTECT(dimnames = allocVector(VECSXP,2));
-	SET_STRING_ELT(ColNames,0,mkChar("pm"));
-	SET_STRING_ELT(ColNames,1,mkChar("mm"));
-	curlocs = NUMERIC_POINTER(AS_NUMERIC(CurLocs));
-	
-	for (k=0; k < cur_cells; k++){
-	  current_cell = &(my_cdf.units[i].unit_block[1].unit_cells[k]);
-	  /* Rprintf("Dual : %d %d  %u %u \n",cur_cells, current_cell->atomnumber,current_cell->x,current_cell->y); */
-	  if(isPM(current_cell->pbase,current_cell->tbase)){
-	    curlocs[current_cell->atomnumber - (cur_atoms)] = current_cell->x + current_cell->y*(my_cdf.header.rows) + 1;           /* "y*", sizex, "+x+1"; */
-	  } else {
-	    curlocs[current_cell->atomnumber - (cur_atoms)+ 2*cur_atoms] = current_cell->x + current_cell->y*(my_cdf.header.rows) + 1; 
-	  }
-	}
-		
-	j=3;
-	cur_cells = my_cdf.units[i].unit_block[3].ncells;
-	cur_atoms = my_cdf.units[i].unit_block[3].natoms; 
-	for (k=0; k < cur_cells; k++){
-	  current_cell = &(my_cdf.units[i].unit_block[3].unit_cells[k]);
-	  /* Rprintf("half deux : %d %d  %d %u %u \n",cur_cells, current_cell->atomnumber, cur_atoms,current_cell->x,current_cell->y); */
-	  if(isPM(current_cell->pbase,current_cell->tbase)){
-	    curlocs[current_cell->atomnumber - (2*cur_atoms)] = current_cell->x + current_cell->y*(my_cdf.header.rows) + 1;           /* "y*", sizex, "+x+1"; */
-	  } else {
-	    curlocs[current_cell->atomnumber] = current_cell->x + current_cell->y*(my_cdf.header.rows) + 1; 
-	  }
-	}
-	
-	SET_VECTOR_ELT(dimnames,1,ColNames);
-	setAttrib(CurLocs, R_DimNamesSymbol, dimnames);
-	SET_VECTOR_ELT(tempLocMap,which_psname,CurLocs);	
-	UNPROTECT(3);
-	which_psname++;
-
-      } else {
-	error("makecdfenv does not currently know how to handle cdf files of this type (genotyping with blocks != 1 or 4.)"); 	
+
+/*************************************************************
+ **
+ ** static int find_cdf_xda_units(cdf_xda_handle *handle, const char **names, int n, int *unit)
+ **
+ ** sets unit[k] to the (first) unit whose probeset, named by its
+ ** last block as in ReadCDFFile, is names[k], -1 if there is none.
+ ** The units stop being read once every name has been found.
+ **
+ ** RETURNS one of the XDA_UNIT_ codes
+ **
+ *************************************************************/
+
+static int find_cdf_xda_units(cdf_xda_handle *handle, const char **names, int n, int *unit){
+
+  cdf_name_request *requests;
+  cdf_name_request key, *found;
+  char name[XDA_NAME_SIZE];
+  int i, k, remaining;
+  int status = XDA_UNIT_OK;
+
+  requests = Calloc(n > 0 ? n : 1, cdf_name_request);
+  for (k=0; k < n; k++){
+    requests[k].name = names[k];
+    requests[k].which = k;
+    unit[k] = -1;
+  }
+  qsort(requests, n, sizeof(cdf_name_request), compare_name_request);
+
+  remaining = n;
+  key.name = name;
+  for (i=0; i < handle->header.n_units && remaining > 0; i++){
+    if ((status = read_xda_block_name(handle, i, name)) != XDA_UNIT_OK){
+      break;
+    }
+    found = bsearch(&key, requests, n, sizeof(cdf_name_request), compare_name_request);
+    if (found == NULL){
+      continue;
+    }
+    /* the same name may have been asked for more than once */
+    while (found > requests && strcmp((found - 1)->name, name) == 0){
+      found--;
+    }
+    for (; found < requests + n && strcmp(found->name, name) == 0; found++){
+      if (unit[found->which] == -1){
+	unit[found->which] = i;
+	remaining--;
       }
-#else
-      error("makecdfenv does not currently know how to handle cdf files of this type (genotyping).");
-#endif
+    }
+  }
+
+  Free(requests);
+  return status;
+}
+
+
+/*************************************************************
+ **
+ ** static int read_cdf_xda_probeset(cdf_xda_handle *handle, int which, int32_t **pm, int32_t **mm, int *n_atoms)
+ **
+ ** reads unit which and gives the cells of the PM and MM probes
+ ** of each atom of its (last) block, as ReadCDFFile would. pm and
+ ** mm are allocated here.
+ **
+ ** RETURNS one of the XDA_UNIT_ codes
+ **
+ *************************************************************/
+
+static int read_cdf_xda_probeset(cdf_xda_handle *handle, int which, int32_t **pm, int32_t **mm, int *n_atoms){
 
+  cdf_unit unit;
+  cdf_unit_block *block;
+  cdf_unit_cell *cell;
+  int i, j, status = XDA_UNIT_OK;
 
+  *pm = NULL;
+  *mm = NULL;
+  *n_atoms = 0;
 
+  memset(&unit, 0, sizeof(cdf_unit));
+  if (!read_cdf_unit(&unit, handle->units_start[which], handle->infile, handle->file_size)){
+    return XDA_UNIT_CORRUPT;
+  }
 
-    } else { 
-      error("makecdfenv does not currently know how to handle cdf files of this type (ie not expression or genotyping)"); 
+  if (unit.unittype == 2){
+    status = XDA_UNIT_GENOTYPING;
+  } else if (unit.unittype != 1){
+    status = XDA_UNIT_OTHER;
+  } else if (unit.nblocks > 0){
+    block = &unit.unit_block[unit.nblocks - 1];
+    if (block->natoms < 0){
+      status = XDA_UNIT_CORRUPT;
+    } else {
+      *n_atoms = block->natoms;
+      *pm = Calloc(block->natoms > 0 ? block->natoms : 1, int32_t);
+      *mm = Calloc(block->natoms > 0 ? block->natoms : 1, int32_t);
+      for (j=0; j < block->ncells; j++){
+	cell = &block->unit_cells[j];
+	if (cell->atomnumber < 0 || cell->atomnumber >= block->natoms){
+	  status = XDA_UNIT_CORRUPT;
+	  break;
+	}
+	(isPM(cell->pbase, cell->tbase) ? *pm : *mm)[cell->atomnumber] = cell->x + cell->y*handle->header.cols + 1;
+      }
     }
+  }
 
-    
-#ifdef READ_CDF_DEBUG
-    Rprintf("\n");    
-#endif
+  for (i=0; i < unit.nblocks; i++){
+    Free(unit.unit_block[i].unit_cells);
+  }
+  Free(unit.unit_block);
+
+  if (status != XDA_UNIT_OK && *pm != NULL){
+    Free(*pm);
+    Free(*mm);
+  }
+  return status;
+}
+
+
+/*************************************************************
+ **
+ ** static SEXP cdf_index_probesets(const cdf_index *index, SEXP probesets)
+ **
+ ** the probesets asked for out of a complete index (for text CDF
+ ** files, which can not be randomly accessed)
+ **
+ *************************************************************/
+
+static SEXP cdf_index_probesets(const cdf_index *index, SEXP probesets){
+
+  SEXP LocMap;
+  SEXP dimnames;
+  cdf_name_request *requests;
+  cdf_name_request key, *found;
+  int n = length(probesets);
+  size_t i, first;
+  int k;
+
+  requests = (cdf_name_request *)R_alloc(n > 0 ? n : 1, sizeof(cdf_name_request));
+  for (k=0; k < n; k++){
+    requests[k].name = CHAR(STRING_ELT(probesets,k));
+    requests[k].which = k;
   }
+  qsort(requests, n, sizeof(cdf_name_request), compare_name_request);
+
+  PROTECT(LocMap = allocVector(VECSXP,n));
+  PROTECT(dimnames = cdf_locations_dimnames());
 
-  if (my_cdf.units[0].unittype ==2){
-    PROTECT(PSnames = allocVector(STRSXP,which_psname));
-    PROTECT(LocMap = allocVector(VECSXP,which_psname));
-    for (i =0; i < which_psname; i++){
-      SET_STRING_ELT(PSnames,i,mkChar(CHAR(STRING_ELT(tempPSnames,i))));
-      SET_VECTOR_ELT(LocMap,i,VECTOR_ELT(tempLocMap,i));
+  for (i=0; i < index->n_sets; i++){
+    key.name = index->names + index->name_start[i];
+    found = bsearch(&key, requests, n, sizeof(cdf_name_request), compare_name_request);
+    if (found == NULL){
+      continue;
+    }
+    while (found > requests && strcmp((found - 1)->name, key.name) == 0){
+      found--;
+    }
+    first = index->set_start[i];
+    for (; found < requests + n && strcmp(found->name, key.name) == 0; found++){
+      if (VECTOR_ELT(LocMap,found->which) == R_NilValue){
+	SET_VECTOR_ELT(LocMap,found->which,cdf_locations_matrix(index->pm + first, index->mm + first, index->set_start[i + 1] - first, dimnames));
+      }
     }
-    
   }
-#ifdef READ_CDF_DEBUG
-  Rprintf("%d \n",which_psname);
-#endif
-  setAttrib(LocMap,R_NamesSymbol,PSnames);
+  UNPROTECT(2);
+  return LocMap;
+}
+
+
+/*************************************************************
+ **
+ ** SEXP ReadCDFProbesets(SEXP filename, SEXP probesets)
+ **
+ ** SEXP filename - a CDF file
+ ** SEXP probesets - names of probesets
+ **
+ ** RETURNS the dimensions of the chip (rows, cols) and a list 
+ ** with the PM MM locations of each of the named probesets (as 
+ ** for ReadCDFFile), NULL for those not in the file. For a binary
+ ** CDF file only the units asked for are read.
+ **
+ *************************************************************/
+
+SEXP ReadCDFProbesets(SEXP filename, SEXP probesets){
+
+  SEXP CDFInfo;
+  SEXP Dimensions;
+  SEXP LocMap;
+  SEXP dimnames;
+  cdf_xda_handle handle;
+  cdf_index index;
+  const char *cur_file_name;
+  const char **names;
+  int *unit;
+  int32_t *pm, *mm;
+  int k, n, n_atoms, status = XDA_UNIT_OK;
+
+  cur_file_name = CHAR(STRING_ELT(filename,0));
+  n = length(probesets);
+
+  PROTECT(CDFInfo = allocVector(VECSXP,2));
+  PROTECT(Dimensions = allocVector(REALSXP,2));
   SET_VECTOR_ELT(CDFInfo,0,Dimensions);
-  SET_VECTOR_ELT(CDFInfo,1,LocMap);
-  if (my_cdf.units[0].unittype ==2){
-    UNPROTECT(6);
+
+  if (!open_cdf_xda_handle(cur_file_name, &handle)){
+    if (!build_cdf_index_text(cur_file_name, &index)){
+      error("File format for %s not recognized.",cur_file_name);
+    }
+    NUMERIC_POINTER(Dimensions)[0] = (double)index.rows;
+    NUMERIC_POINTER(Dimensions)[1] = (double)index.cols;
+    LocMap = cdf_index_probesets(&index, probesets);
+    free_cdf_index(&index);
   } else {
-    UNPROTECT(4);
+    NUMERIC_POINTER(Dimensions)[0] = (double)handle.header.rows;
+    NUMERIC_POINTER(Dimensions)[1] = (double)handle.header.cols;
+
+    names = (const char **)R_alloc(n > 0 ? n : 1, sizeof(char *));
+    unit = (int *)R_alloc(n > 0 ? n : 1, sizeof(int));
+    for (k=0; k < n; k++){
+      names[k] = CHAR(STRING_ELT(probesets,k));
+    }
+
+    status = find_cdf_xda_units(&handle, names, n, unit);
+
+    PROTECT(LocMap = allocVector(VECSXP,n));
+    PROTECT(dimnames = cdf_locations_dimnames());
+    for (k=0; k < n && status == XDA_UNIT_OK; k++){
+      if (unit[k] < 0){
+	continue;
+      }
+      status = read_cdf_xda_probeset(&handle, unit[k], &pm, &mm, &n_atoms);
+      if (status == XDA_UNIT_OK && pm != NULL){
+	SET_VECTOR_ELT(LocMap,k,cdf_locations_matrix(pm, mm, n_atoms, dimnames));
+	Free(pm);
+	Free(mm);
+      }
+    }
+    close_cdf_xda_handle(&handle);
+    UNPROTECT(2);
+
+    if (status == XDA_UNIT_GENOTYPING){
+      error("makecdfenv does not currently know how to handle cdf files of this type (genotyping).");
+    } else if (status == XDA_UNIT_OTHER){
+      error("makecdfenv does not currently know how to handle cdf files of this type (ie not expression or genotyping)");
+    } else if (status != XDA_UNIT_OK){
+      error("Problem reading binary cdf file %s. Possibly corrupted or truncated?\n",cur_file_name);
+    }
   }
 
-  dealloc_cdf_xda(&my_cdf);
+  PROTECT(LocMap);
+  setAttrib(LocMap,R_NamesSymbol,probesets);
+  SET_VECTOR_ELT(CDFInfo,1,LocMap);
+  UNPROTECT(3);
   return CDFInfo;
-
 }
 
 
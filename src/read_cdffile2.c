@@ -29,6 +29,7 @@
  ** Feb 28, 2006 - replace C++ comments with ANSI comments for older compilers
  ** May 31, 2006 - fix some compiler warnings
  ** Jan 15, 2008 - Fix VECTOR_ELT/STRING_ELT issues
+ ** Oct 16, 2026 - add build_cdf_index_text, for compiling a text CDF file into a cdf_index (cdf_index.c)
  **  
  **
  *******************************************************************/
@@ -39,6 +40,8 @@
 #include "stdlib.h"
 #include "stdio.h"
 
+#include "cdf_index.h"
+
 
 #define BUFFER_SIZE 1024
 
@@ -1571,3 +1574,85 @@ SEXP CheckCDFtext(SEXP filename){
   return tmp;
 }
 
+
+
+
+/*************************************************************
+ **
+ ** int build_cdf_index_text(const char *filename, cdf_index *index)
+ **
+ ** const char *filename - a text CDF file
+ ** cdf_index *index - filled with its probesets. Release with 
+ **                    free_cdf_index()
+ **
+ ** RETURNS 0 if filename is not a text CDF file, 1 once the index
+ ** is built. As for binary CDF files only expression units are
+ ** handled and a probeset takes the name and atoms of the (last)
+ ** block of its unit.
+ **
+ *************************************************************/
+
+int build_cdf_index_text(const char *filename, cdf_index *index){
+
+  cdf_text my_cdf;
+  cdf_text_unit_block *block;
+  cdf_text_unit_block_probe *probe;
+  size_t n_atoms = 0, names_size = 0, first;
+  int i, k, cell;
+
+  if (!isTextCDFFile(filename)){
+    return 0;
+  }
+  if (!read_cdf_text(filename, &my_cdf)){
+    error("Problem reading text cdf file %s. Possibly corrupted or truncated?\n",filename);
+  }
+
+  for (i=0; i < my_cdf.header.numberofunits; i++){
+    if (my_cdf.units[i].unit_type == 2){
+      dealloc_cdf_text(&my_cdf);
+      error("makecdfenv does not currently know how to handle cdf files of this type (genotyping).");
+    } else if (my_cdf.units[i].unit_type != 3){
+      dealloc_cdf_text(&my_cdf);
+      error("makecdfenv does not currently know how to handle cdf files of this type (ie not expression or genotyping)");
+    }
+    if (my_cdf.units[i].numberblocks > 0){
+      block = &(my_cdf.units[i].blocks[my_cdf.units[i].numberblocks - 1]);
+      n_atoms += block->num_atoms;
+      names_size += strlen(block->name);
+    }
+    names_size++;
+  }
+
+  alloc_cdf_index(index, my_cdf.header.rows, my_cdf.header.cols, (size_t)my_cdf.header.numberofunits, n_atoms, names_size);
+
+  for (i=0; i < my_cdf.header.numberofunits; i++){
+    index->set_start[i + 1] = index->set_start[i];
+    index->name_start[i + 1] = index->name_start[i] + 1;
+    if (my_cdf.units[i].numberblocks == 0){
+      continue;
+    }
+    block = &(my_cdf.units[i].blocks[my_cdf.units[i].numberblocks - 1]);
+    index->set_start[i + 1] += block->num_atoms;
+    index->name_start[i + 1] += strlen(block->name);
+    strcpy(index->names + index->name_start[i], block->name);
+
+    first = index->set_start[i];
+    for (k=0; k < block->num_cells; k++){
+      probe = &(block->probes[k]);
+      if (probe->atom < 0 || probe->atom >= block->num_atoms){
+	free_cdf_index(index);
+	dealloc_cdf_text(&my_cdf);
+	error("Problem reading text cdf file %s. Possibly corrupted or truncated?\n",filename);
+      }
+      cell = probe->x + probe->y*my_cdf.header.cols + 1;
+      if (isPM(probe->pbase[0], probe->tbase[0])){
+	index->pm[first + probe->atom] = cell;
+      } else {
+	index->mm[first + probe->atom] = cell;
+      }
+    }
+  }
+
+  dealloc_cdf_text(&my_cdf);
+  return 1;
+}
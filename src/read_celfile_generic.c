@@ -25,6 +25,19 @@
  ** May 18, 2009 - Add Ability to extract scan date from CEL file header
  ** Sep 19, 2013 - Improve ability to deal with large 64bit matrices
  ** Sept 4, 2017 - change gzFile * to gzFile
+ ** Oct 16, 2026 - add _stream variants of the header, reading and masking functions
+ **                so that an already open CEL file can be reused
+ ** Oct 16, 2026 - find the cell data through a data set index and seek straight to the
+ **                data set wanted rather than parsing all those before it. 
+ **                Add read_genericcel_file_all(), gzread_genericcel_file_all()
+ ** Oct 16, 2026 - uncompressed files are memory mapped where possible and the cell data
+ **                decoded directly from the mapping into the output
+ ** Oct 16, 2026 - add read_genericcel_file_intensities_blocks(), gzread_genericcel_file_intensities_blocks()
+ **                which pass the intensities to a callback a block at a time
+ ** Oct 16, 2026 - the header readers read only the data header values they use 
+ **                (read_generic_data_header_selected()), skipping the parent headers
+ ** Oct 16, 2026 - a truncated intensity, stddev, npixels, mask or outlier data set is reported
+ **                (as corrupted) rather than leaving the rest of the column unset
  **
  *************************************************************/
 #include <R.h>
@@ -43,8 +56,53 @@
 #include <stdlib.h>
 #include <zlib.h>
 
+#include "fread_functions.h"
 #include "read_generic.h"
 #include "read_celfile_generic.h"
+#include "mmap_functions.h"
+
+
+/*
+   the data header values used by the header readers below. Only these
+   are read from the data header, see read_generic_data_header_selected()
+*/
+
+static const char *header_info_names[] = {"affymetrix-array-type", "affymetrix-cel-cols", "affymetrix-cel-rows"};
+#define N_HEADER_INFO_NAMES 3
+
+static const char *detailed_header_info_names[] = {
+  "affymetrix-array-type",
+  "affymetrix-cel-cols",
+  "affymetrix-cel-rows",
+  "affymetrix-algorithm-param-GridULX",
+  "affymetrix-algorithm-param-GridULY",
+  "affymetrix-algorithm-param-GridURX",
+  "affymetrix-algorithm-param-GridURY",
+  "affymetrix-algorithm-param-GridLLX",
+  "affymetrix-algorithm-param-GridLLY",
+  "affymetrix-algorithm-param-GridLRX",
+  "affymetrix-algorithm-param-GridLRY",
+  "affymetrix-dat-header",
+  "affymetrix-scan-date",
+  "affymetrix-algorithm-name",
+  "affymetrix-algorithm-param-Percentile",
+  "affymetrix-algorithm-param-CellMargin",
+  "affymetrix-algorithm-param-OutlierHigh",
+  "affymetrix-algorithm-param-OutlierLow",
+  "affymetrix-algorithm-param-AlgVersion",
+  "affymetrix-algorithm-param-FixedCellSize",
+  "affymetrix-algorithm-param-FullFeatureWidth",
+  "affymetrix-algorithm-param-FullFeatureHeight",
+  "affymetrix-algorithm-param-IgnoreOutliersInShiftRows",
+  "affymetrix-algorithm-param-FeatureExtraction",
+  "affymetrix-algorithm-param-PoolWidthExtenstion",
+  "affymetrix-algorithm-param-PoolHeightExtension",
+  "affymetrix-algorithm-param-UseSubgrids",
+  "affymetrix-algorithm-param-RandomizePixels",
+  "affymetrix-algorithm-param-ErrorBasis",
+  "affymetrix-algorithm-param-StdMult"
+};
+#define N_DETAILED_HEADER_INFO_NAMES 30
 #include "read_abatch.h"
 
 int isGenericCelFile(const char *filename){
@@ -64,7 +122,7 @@ int isGenericCelFile(const char *filename){
     return 0;
   }
 
-  if (!read_generic_data_header(&data_header,infile)){
+  if (!read_generic_data_header_selected(&data_header,NULL,0,infile)){
     Free_generic_data_header(&data_header);
     fclose(infile);
     return 0;
@@ -86,9 +144,20 @@ int isGenericCelFile(const char *filename){
 
 
 
-char *generic_get_header_info(const char *filename, int *dim1, int *dim2){
+/*************************************************************
+ **
+ ** char *generic_get_header_info_stream(FILE *infile, int *dim1, int *dim2)
+ **
+ ** FILE *infile - a command console CEL file opened at its start
+ **
+ ** reads the file and data headers, returning the cdfName and
+ ** placing cols and rows in dim1 and dim2. On return infile is
+ ** positioned at the first data group.
+ **
+ *************************************************************/
+
+char *generic_get_header_info_stream(FILE *infile, int *dim1, int *dim2){
 
-  FILE *infile;
   generic_file_header file_header;
   generic_data_header data_header;
 
@@ -101,14 +170,8 @@ char *generic_get_header_info(const char *filename, int *dim1, int *dim2){
 
   wchar_t *wchartemp=0;
   
-  if ((infile = fopen(filename, "rb")) == NULL)
-    {
-      error("Unable to open the file %s",filename);
-      return 0;
-    }
-  
   read_generic_file_header(&file_header,infile);
-  read_generic_data_header(&data_header,infile);
+  read_generic_data_header_selected(&data_header,header_info_names,N_HEADER_INFO_NAMES,infile);
 
   /*  affymetrix-array-type  text/plainText/plain String is HG-U133_Plus_2
       Now Trying it again. But using exposed function
@@ -137,13 +200,30 @@ char *generic_get_header_info(const char *filename, int *dim1, int *dim2){
   decode_MIME_value(*triplet,cur_mime_type, dim2, &size);
   
   Free_generic_data_header(&data_header);
-  fclose(infile);
 
   return cdfName;
  
 }
 
 
+char *generic_get_header_info(const char *filename, int *dim1, int *dim2){
+
+  FILE *infile;
+  char *cdfName;
+
+  if ((infile = fopen(filename, "rb")) == NULL)
+    {
+      error("Unable to open the file %s",filename);
+      return 0;
+    }
+
+  cdfName = generic_get_header_info_stream(infile, dim1, dim2);
+  fclose(infile);
+
+  return cdfName;
+}
+
+
 
 
 void generic_get_detailed_header_info(const char *filename, detailed_header_info *header_info){
@@ -167,7 +247,7 @@ void generic_get_detailed_header_info(const char *filename, detailed_header_info
     }
   
   read_generic_file_header(&file_header,infile);
-  read_generic_data_header(&data_header,infile);
+  read_generic_data_header_selected(&data_header,detailed_header_info_names,N_DETAILED_HEADER_INFO_NAMES,infile);
   
   triplet =  find_nvt(&data_header,"affymetrix-array-type");
 
@@ -655,7 +735,7 @@ int check_generic_cel_file(const char *filename, const char *ref_cdfName, int re
     }
 
   read_generic_file_header(&file_header,infile);
-  read_generic_data_header(&data_header,infile);
+  read_generic_data_header_selected(&data_header,header_info_names,N_HEADER_INFO_NAMES,infile);
   
 
    triplet =  find_nvt(&data_header,"affymetrix-array-type");
@@ -704,155 +784,282 @@ int check_generic_cel_file(const char *filename, const char *ref_cdfName, int re
  **
  **************************************************************/
 
-int read_genericcel_file_intensities(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+/*************************************************************
+ **
+ ** The cell data of a command console CEL file is kept in the data sets
+ ** "Intensity", "StdDev", "Pixel", "Outlier" and "Mask" (in that order) 
+ ** of the first data group. These are found through a generic_data_set_index
+ ** so that reading one of them does not require parsing those that come 
+ ** before it. Should a data set not have the expected name it is taken 
+ ** by position instead.
+ **
+ *************************************************************/
 
-  size_t i=0;
-  
-  FILE *infile;
+#define GENERICCEL_INTENSITY 0
+#define GENERICCEL_STDDEV 1
+#define GENERICCEL_NPIXELS 2
+#define GENERICCEL_OUTLIER 3
+#define GENERICCEL_MASK 4
 
-  generic_file_header my_header;
-  generic_data_header my_data_header;
-  generic_data_group my_data_group;
+static const char *genericcel_data_set_names[] = {"Intensity", "StdDev", "Pixel", "Outlier", "Mask"};
 
-  generic_data_set my_data_set;
 
+/* sets the cells listed in x, y to NA */
 
-  if ((infile = fopen(filename, "rb")) == NULL)
-    {
-      error("Unable to open the file %s\n",filename);
-      return 0;
-    }
-  
-
-  
-  read_generic_file_header(&my_header, infile);
-  read_generic_data_header(&my_data_header, infile);
-  read_generic_data_group(&my_data_group,infile);
+static void genericcel_set_NA(double *x, double *y, size_t n, int nrows, double *intensity, size_t chip_num, size_t rows){
 
-  read_generic_data_set(&my_data_set,infile); 
-  read_generic_data_set_rows(&my_data_set,infile); 
+  size_t i;
+  size_t cur_index;
 
-  for (i =0; i < my_data_set.nrows; i++){
-    intensity[chip_num*my_data_set.nrows + i] = (double)(((float *)my_data_set.Data[0])[i]);
+  for (i=0; i < n; i++){
+    cur_index = (int)x[i] + nrows*(int)y[i]; 
+    intensity[chip_num*rows + cur_index] =  R_NaN;
   }
-  
-  fclose(infile);
-  Free_generic_data_set(&my_data_set);
-  Free_generic_data_header(&my_data_header);
-  Free_generic_data_group(&my_data_group);
+}
 
 
+static generic_data_set_index_entry *find_genericcel_data_set(generic_data_set_index *index, int which, FILE *infile){
 
+  generic_data_set_index_entry *entry = find_generic_data_set(index, genericcel_data_set_names[which], infile);
 
-  return(0);
+  if (entry == NULL){
+    entry = get_generic_data_set(index, which, infile);
+  }
+  return entry;
 }
 
 
+static int read_genericcel_data_set(FILE *infile, generic_data_set_index *index, int which, double *intensity, size_t chip_num){
 
+  double **result;
+  int status;
+  generic_data_set_index_entry *entry = find_genericcel_data_set(index, which, infile);
 
+  if (entry == NULL || entry->ncols < 1){
+    return 1;
+  }
+  result = Calloc(entry->ncols, double *);
+  result[0] = &intensity[chip_num*entry->nrows];
+  status = read_generic_data_set_columns(index, entry, result, infile);
+  Free(result);
 
-int read_genericcel_file_stddev(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+  /* a short read leaves the rest of the column unset */
+  return(!status);
+}
+
+
+/*************************************************************
+ **
+ ** static FILE *open_genericcel_file(const char *filename, generic_data_set_index *index, mapped_file *map)
+ **
+ ** opens a command console CEL file, skips its header and starts
+ ** an index of its data sets. Where possible the file is also mapped 
+ ** into memory so that the cell data can be decoded directly from it.
+ ** close_genericcel_file() undoes all of this.
+ **
+ *************************************************************/
+
+static FILE *open_genericcel_file(const char *filename, generic_data_set_index *index, mapped_file *map){
 
-  size_t i=0;
-  
   FILE *infile;
 
   generic_file_header my_header;
   generic_data_header my_data_header;
-  generic_data_group my_data_group;
-
-  generic_data_set my_data_set;
-
 
   if ((infile = fopen(filename, "rb")) == NULL)
     {
       error("Unable to open the file %s\n",filename);
-      return 0;
+      return NULL;
     }
-  
 
-  
   read_generic_file_header(&my_header, infile);
   read_generic_data_header(&my_data_header, infile);
-  read_generic_data_group(&my_data_group,infile);
+  Free_generic_data_header(&my_data_header);
 
-  read_generic_data_set(&my_data_set,infile); 
-  fseek(infile, my_data_set.file_pos_last, SEEK_SET); 
-  Free_generic_data_set(&my_data_set);
- 
-  read_generic_data_set(&my_data_set,infile); 
-  read_generic_data_set_rows(&my_data_set,infile); 
-  for (i =0; i < my_data_set.nrows; i++){
-    intensity[chip_num*my_data_set.nrows + i] = (double)(((float *)my_data_set.Data[0])[i]);
+  init_generic_data_set_index(index, infile);
+  if (map_file(filename, map)){
+    index->mapped = map->data;
+    index->mapped_size = map->size;
   }
-  Free_generic_data_set(&my_data_set);
-  Free_generic_data_header(&my_data_header);
-  Free_generic_data_group(&my_data_group);
 
+  return infile;
+}
+
+
+static void close_genericcel_file(FILE *infile, generic_data_set_index *index, mapped_file *map){
+
+  Free_generic_data_set_index(index);
+  unmap_file(map);
   fclose(infile);
+}
 
 
-  return(0);
+/*************************************************************
+ **
+ ** int read_genericcel_file_intensities_stream(FILE *infile, generic_data_set_index *index, double *intensity, 
+ **                                             size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows)
+ **
+ ** FILE *infile - an open command console CEL file
+ ** generic_data_set_index *index - index of the data sets of infile
+ **
+ ** reads the intensities values into the data matrix. Returns 1 if
+ ** there is no intensity data set or it is truncated, 0 otherwise.
+ **
+ *************************************************************/
 
+int read_genericcel_file_intensities_stream(FILE *infile, generic_data_set_index *index, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
 
+  return read_genericcel_data_set(infile, index, GENERICCEL_INTENSITY, intensity, chip_num);
+}
 
 
+/*************************************************************
+ **
+ ** int read_genericcel_file_intensities_blocks(FILE *infile, generic_data_set_index *index, 
+ **                                             generic_column_sink sink, void *arg)
+ **
+ ** as read_genericcel_file_intensities_stream() but rather than storing
+ ** the intensities for the whole chip they are handed to sink a block of 
+ ** cells at a time. Returns 1 if the intensities could not be read, 0 otherwise.
+ **
+ *************************************************************/
 
+int read_genericcel_file_intensities_blocks(FILE *infile, generic_data_set_index *index, generic_column_sink sink, void *arg){
+
+  generic_data_set_index_entry *entry = find_genericcel_data_set(index, GENERICCEL_INTENSITY, infile);
+
+  if (entry == NULL || entry->ncols < 1){
+    return 1;
+  }
+  return !read_generic_data_set_column_blocks(index, entry, 0, sink, arg, infile);
 }
 
 
+int read_genericcel_file_intensities(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
 
-int read_genericcel_file_npixels(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+  int status;
 
-  size_t i=0;
-  
   FILE *infile;
+  generic_data_set_index index;
+  mapped_file map;
 
-  generic_file_header my_header;
-  generic_data_header my_data_header;
-  generic_data_group my_data_group;
+  infile = open_genericcel_file(filename, &index, &map);
+  status = read_genericcel_file_intensities_stream(infile, &index, intensity, chip_num, rows, cols, chip_dim_rows);
+  
+  close_genericcel_file(infile, &index, &map);
 
-  generic_data_set my_data_set;
+  return status;
+}
 
 
-  if ((infile = fopen(filename, "rb")) == NULL)
-    {
-      error("Unable to open the file %s\n",filename);
-      return 0;
-    }
-  
 
+
+
+/*************************************************************
+ **
+ ** int read_genericcel_file_stddev_stream(FILE *infile, generic_data_set_index *index, double *intensity, 
+ **                                        size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows)
+ **
+ ** FILE *infile - an open command console CEL file
+ ** generic_data_set_index *index - index of the data sets of infile
+ **
+ ** reads the stddev values into the data matrix. Returns 1 if
+ ** there is no stddev data set or it is truncated, 0 otherwise.
+ **
+ *************************************************************/
+
+int read_genericcel_file_stddev_stream(FILE *infile, generic_data_set_index *index, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+
+  return read_genericcel_data_set(infile, index, GENERICCEL_STDDEV, intensity, chip_num);
+}
+
+
+int read_genericcel_file_stddev(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+
+  int status;
+
+  FILE *infile;
+  generic_data_set_index index;
+  mapped_file map;
+
+  infile = open_genericcel_file(filename, &index, &map);
+  status = read_genericcel_file_stddev_stream(infile, &index, intensity, chip_num, rows, cols, chip_dim_rows);
   
-  read_generic_file_header(&my_header, infile);
-  read_generic_data_header(&my_data_header, infile);
-  read_generic_data_group(&my_data_group,infile);
+  close_genericcel_file(infile, &index, &map);
 
-  read_generic_data_set(&my_data_set,infile); 
-  fseek(infile, my_data_set.file_pos_last, SEEK_SET); 
-  Free_generic_data_set(&my_data_set);
- 
-  read_generic_data_set(&my_data_set,infile); 
-  fseek(infile, my_data_set.file_pos_last, SEEK_SET); 
-  Free_generic_data_set(&my_data_set);
+  return status;
+}
+
+
+
+/*************************************************************
+ **
+ ** int read_genericcel_file_npixels_stream(FILE *infile, generic_data_set_index *index, double *intensity, 
+ **                                         size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows)
+ **
+ ** FILE *infile - an open command console CEL file
+ ** generic_data_set_index *index - index of the data sets of infile
+ **
+ ** reads the npixels values into the data matrix. Returns 1 if
+ ** there is no npixels data set or it is truncated, 0 otherwise.
+ **
+ *************************************************************/
+
+int read_genericcel_file_npixels_stream(FILE *infile, generic_data_set_index *index, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+
+  return read_genericcel_data_set(infile, index, GENERICCEL_NPIXELS, intensity, chip_num);
+}
+
+
+int read_genericcel_file_npixels(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+
+  int status;
+
+  FILE *infile;
+  generic_data_set_index index;
+  mapped_file map;
+
+  infile = open_genericcel_file(filename, &index, &map);
+  status = read_genericcel_file_npixels_stream(infile, &index, intensity, chip_num, rows, cols, chip_dim_rows);
   
+  close_genericcel_file(infile, &index, &map);
 
-  read_generic_data_set(&my_data_set,infile); 
-  read_generic_data_set_rows(&my_data_set,infile); 
-  for (i =0; i < my_data_set.nrows; i++){
-    intensity[chip_num*my_data_set.nrows + i] = (double)(((short *)my_data_set.Data[0])[i]);
-  }
-  Free_generic_data_set(&my_data_set);
-  Free_generic_data_header(&my_data_header);
-  Free_generic_data_group(&my_data_group);
+  return status;
+}
 
-  fclose(infile);
 
+/*************************************************************
+ **
+ ** int read_genericcel_file_all(const char *filename, double *intensity, double *stddev, double *npixels)
+ **
+ ** reads intensity, stddev and npixels (any may be NULL) of a single
+ ** command console CEL file, opening it only once. Returns 1 if one of 
+ ** the data sets could not be found or read (completely), 0 otherwise.
+ **
+ *************************************************************/
 
-  return(0);
+int read_genericcel_file_all(const char *filename, double *intensity, double *stddev, double *npixels){
 
+  int status = 0;
 
+  FILE *infile;
+  generic_data_set_index index;
+  mapped_file map;
 
+  infile = open_genericcel_file(filename, &index, &map);
+  if (intensity != NULL){
+    status|= read_genericcel_data_set(infile, &index, GENERICCEL_INTENSITY, intensity, 0);
+  }
+  if (stddev != NULL){
+    status|= read_genericcel_data_set(infile, &index, GENERICCEL_STDDEV, stddev, 0);
+  }
+  if (npixels != NULL){
+    status|= read_genericcel_data_set(infile, &index, GENERICCEL_NPIXELS, npixels, 0);
+  }
+  
+  close_genericcel_file(infile, &index, &map);
 
+  return status;
 }
 
 
@@ -946,14 +1153,60 @@ void generic_get_masks_outliers(const char *filename, int *nmasks, short **masks
 
 
 
-void generic_apply_masks(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
+/*************************************************************
+ **
+ ** int generic_apply_masks_stream(FILE *infile, generic_data_set_index *index, int nrows, double *intensity, size_t chip_num, 
+ **                size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers)
+ **
+ ** FILE *infile - an open command console CEL file
+ ** generic_data_set_index *index - index of the data sets of infile
+ ** int nrows - the number of rows on the chip (affymetrix-cel-rows)
+ **
+ ** sets the masked and outlier probes to NA. Returns 1 if a mask or outlier
+ ** data set could not be read (completely), which is then not applied, 
+ ** 0 otherwise.
+ **
+ *************************************************************/
 
+int generic_apply_masks_stream(FILE *infile, generic_data_set_index *index, int nrows, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
 
-  size_t i=0;
-  size_t cur_index;
-  
-  short cur_x, cur_y;
+  int j;
+  int which[2];
+  int n_which = 0;
+  int status = 0;
+  double **result;
+
+  generic_data_set_index_entry *entry;
 
+  if (rm_outliers){
+    which[n_which++] = GENERICCEL_OUTLIER;
+  }
+  if (rm_mask){
+    which[n_which++] = GENERICCEL_MASK;
+  }
+
+  for (j =0; j < n_which; j++){
+    entry = find_genericcel_data_set(index, which[j], infile);
+    if (entry == NULL || entry->ncols < 2){
+      continue;
+    }
+    result = Calloc(entry->ncols, double *);
+    result[0] = Calloc(entry->nrows, double);
+    result[1] = Calloc(entry->nrows, double);
+    if (read_generic_data_set_columns(index, entry, result, infile)){
+      genericcel_set_NA(result[0], result[1], entry->nrows, nrows, intensity, chip_num, rows);
+    } else {
+      status = 1;
+    }
+    Free(result[0]);
+    Free(result[1]);
+    Free(result);
+  }
+  return status;
+}
+
+
+void generic_apply_masks(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
 
   int nrows;
   int size;
@@ -962,9 +1215,8 @@ void generic_apply_masks(const char *filename, double *intensity, size_t chip_nu
 
   generic_file_header my_header;
   generic_data_header my_data_header;
-  generic_data_group my_data_group;
+  generic_data_set_index index;
 
-  generic_data_set my_data_set;
   nvt_triplet *triplet;
   AffyMIMEtypes cur_mime_type;
 
@@ -973,65 +1225,19 @@ void generic_apply_masks(const char *filename, double *intensity, size_t chip_nu
       error("Unable to open the file %s\n",filename);
       
     }
- 
 
-  
   read_generic_file_header(&my_header, infile);
   read_generic_data_header(&my_data_header, infile);
-  read_generic_data_group(&my_data_group,infile);
 
-    
   triplet =  find_nvt(&my_data_header,"affymetrix-cel-rows");
   cur_mime_type = determine_MIMETYPE(*triplet);
   decode_MIME_value(*triplet,cur_mime_type, &nrows, &size);
-  
 
+  init_generic_data_set_index(&index, infile);
+  generic_apply_masks_stream(infile, &index, nrows, intensity, chip_num, rows, cols, chip_dim_rows, rm_mask, rm_outliers);
 
-  /* passing the intensities */
-  read_generic_data_set(&my_data_set,infile); 
-  fseek(infile, my_data_set.file_pos_last, SEEK_SET); 
-  Free_generic_data_set(&my_data_set);
- 
-  /* passing by the stddev */
-  read_generic_data_set(&my_data_set,infile); 
-  fseek(infile, my_data_set.file_pos_last, SEEK_SET); 
-  Free_generic_data_set(&my_data_set);
-  
-  /* passing by the npixels */
-  read_generic_data_set(&my_data_set,infile); 
-  fseek(infile, my_data_set.file_pos_last, SEEK_SET); 
-  Free_generic_data_set(&my_data_set);
- 
-  /* Now lets go for the "Outlier" */
-  read_generic_data_set(&my_data_set,infile); 
-  
-  if (rm_outliers){
-    read_generic_data_set_rows(&my_data_set,infile); 
-    for (i=0; i < my_data_set.nrows; i++){
-      cur_x = ((short *)my_data_set.Data[0])[i];
-      cur_y = ((short *)my_data_set.Data[1])[i];
-      cur_index = (int)cur_x + nrows*(int)cur_y; 
-      intensity[chip_num*rows + cur_index] =  R_NaN;
-    }
-  }
-  
-  fseek(infile, my_data_set.file_pos_last, SEEK_SET); 
-  Free_generic_data_set(&my_data_set);
-
-  /* Now lets go for the "Mask" */
-  read_generic_data_set(&my_data_set,infile); 
-  if (rm_mask){
-    read_generic_data_set_rows(&my_data_set,infile); 
-    for (i=0; i < my_data_set.nrows; i++){
-      cur_x = ((short *)my_data_set.Data[0])[i];
-      cur_y = ((short *)my_data_set.Data[1])[i];
-      cur_index = (int)cur_x + nrows*(int)cur_y; 
-      intensity[chip_num*rows + cur_index] =  R_NaN;
-    }
-  }
-  Free_generic_data_set(&my_data_set);
+  Free_generic_data_set_index(&index);
   Free_generic_data_header(&my_data_header);
-  Free_generic_data_group(&my_data_group);
 
   fclose(infile);
   
@@ -1063,7 +1269,7 @@ int isgzGenericCelFile(const char *filename){
     return 0;
   }
 
-  if (!gzread_generic_data_header(&data_header,infile)){
+  if (!gzread_generic_data_header_selected(&data_header,NULL,0,infile)){
     Free_generic_data_header(&data_header);
     gzclose(infile);
     return 0;
@@ -1085,9 +1291,20 @@ int isgzGenericCelFile(const char *filename){
 
 
 
-char *gzgeneric_get_header_info(const char *filename, int *dim1, int *dim2){
+/*************************************************************
+ **
+ ** char *gzgeneric_get_header_info_stream(gzFile infile, int *dim1, int *dim2)
+ **
+ ** gzFile infile - a command console CEL file opened at its start
+ **
+ ** reads the file and data headers, returning the cdfName and
+ ** placing cols and rows in dim1 and dim2. On return infile is
+ ** positioned at the first data group.
+ **
+ *************************************************************/
+
+char *gzgeneric_get_header_info_stream(gzFile infile, int *dim1, int *dim2){
 
-  gzFile infile;
   generic_file_header file_header;
   generic_data_header data_header;
 
@@ -1100,14 +1317,8 @@ char *gzgeneric_get_header_info(const char *filename, int *dim1, int *dim2){
 
   wchar_t *wchartemp=0;
   
-  if ((infile = gzopen(filename, "rb")) == NULL)
-    {
-      error("Unable to open the file %s",filename);
-      return 0;
-    }
-  
   gzread_generic_file_header(&file_header,infile);
-  gzread_generic_data_header(&data_header,infile);
+  gzread_generic_data_header_selected(&data_header,header_info_names,N_HEADER_INFO_NAMES,infile);
 
   /*  affymetrix-array-type  text/plainText/plain String is HG-U133_Plus_2
       Now Trying it again. But using exposed function
@@ -1136,13 +1347,30 @@ char *gzgeneric_get_header_info(const char *filename, int *dim1, int *dim2){
   decode_MIME_value(*triplet,cur_mime_type, dim2, &size);
   
   Free_generic_data_header(&data_header);
-  gzclose(infile);
 
   return cdfName;
  
 }
 
 
+char *gzgeneric_get_header_info(const char *filename, int *dim1, int *dim2){
+
+  gzFile infile;
+  char *cdfName;
+
+  if ((infile = gzopen(filename, "rb")) == NULL)
+    {
+      error("Unable to open the file %s",filename);
+      return 0;
+    }
+
+  cdfName = gzgeneric_get_header_info_stream(infile, dim1, dim2);
+  gzclose(infile);
+
+  return cdfName;
+}
+
+
 
 
 void gzgeneric_get_detailed_header_info(const char *filename, detailed_header_info *header_info){
@@ -1166,7 +1394,7 @@ void gzgeneric_get_detailed_header_info(const char *filename, detailed_header_in
     }
   
   gzread_generic_file_header(&file_header,infile);
-  gzread_generic_data_header(&data_header,infile);
+  gzread_generic_data_header_selected(&data_header,detailed_header_info_names,N_DETAILED_HEADER_INFO_NAMES,infile);
   
   triplet =  find_nvt(&data_header,"affymetrix-array-type");
 
@@ -1653,7 +1881,7 @@ int check_gzgeneric_cel_file(const char *filename, const char *ref_cdfName, int
     }
 
   gzread_generic_file_header(&file_header,infile);
-  gzread_generic_data_header(&data_header,infile);
+  gzread_generic_data_header_selected(&data_header,header_info_names,N_HEADER_INFO_NAMES,infile);
   
 
   triplet =  find_nvt(&data_header,"affymetrix-array-type");
@@ -1695,160 +1923,226 @@ int check_gzgeneric_cel_file(const char *filename, const char *ref_cdfName, int
 
 
 
-int gzread_genericcel_file_intensities(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+static generic_data_set_index_entry *gzfind_genericcel_data_set(generic_data_set_index *index, int which, gzFile infile){
+
+  generic_data_set_index_entry *entry = gzfind_generic_data_set(index, genericcel_data_set_names[which], infile);
+
+  if (entry == NULL){
+    entry = gzget_generic_data_set(index, which, infile);
+  }
+  return entry;
+}
+
+
+/* reads column col of a data set as doubles. result must have space for entry->nrows values */
+
+static int gzread_genericcel_data_set(gzFile infile, generic_data_set_index *index, int which, double *intensity, size_t chip_num){
+
+  double **result;
+  int status;
+  generic_data_set_index_entry *entry = gzfind_genericcel_data_set(index, which, infile);
+
+  if (entry == NULL || entry->ncols < 1){
+    return 1;
+  }
+  result = Calloc(entry->ncols, double *);
+  result[0] = &intensity[chip_num*entry->nrows];
+  status = gzread_generic_data_set_columns(index, entry, result, infile);
+  Free(result);
+
+  /* a short read leaves the rest of the column unset */
+  return(!status);
+}
+
+
+/*************************************************************
+ **
+ ** static gzFile open_gzgenericcel_file(const char *filename, generic_data_set_index *index)
+ **
+ ** opens a gzipped command console CEL file, skips its header and starts
+ ** an index of its data sets.
+ **
+ *************************************************************/
+
+static gzFile open_gzgenericcel_file(const char *filename, generic_data_set_index *index){
 
-  size_t i=0;
-  
   gzFile infile;
 
   generic_file_header my_header;
   generic_data_header my_data_header;
-  generic_data_group my_data_group;
 
-  generic_data_set my_data_set;
-
-
-  if ((infile = gzopen(filename, "rb")) == NULL)
+  if ((infile = gzopen_buffered(filename, "rb")) == NULL)
     {
       error("Unable to open the file %s\n",filename);
-      return 0;
+      return NULL;
     }
-  
 
-  
   gzread_generic_file_header(&my_header, infile);
   gzread_generic_data_header(&my_data_header, infile);
-  gzread_generic_data_group(&my_data_group,infile);
+  Free_generic_data_header(&my_data_header);
 
-  gzread_generic_data_set(&my_data_set,infile); 
-  gzread_generic_data_set_rows(&my_data_set,infile); 
+  gzinit_generic_data_set_index(index, infile);
 
-  for (i =0; i < my_data_set.nrows; i++){
-    intensity[chip_num*my_data_set.nrows + i] = (double)(((float *)my_data_set.Data[0])[i]);
-  }
-  
-  gzclose(infile);
-  Free_generic_data_set(&my_data_set);
-  Free_generic_data_header(&my_data_header);
-  Free_generic_data_group(&my_data_group);
+  return infile;
+}
 
 
+/*************************************************************
+ **
+ ** int gzread_genericcel_file_intensities_stream(gzFile infile, generic_data_set_index *index, double *intensity, 
+ **                                             size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows)
+ **
+ ** gzFile infile - an open gzipped command console CEL file
+ ** generic_data_set_index *index - index of the data sets of infile
+ **
+ ** reads the intensities values into the data matrix. Returns 1 if
+ ** there is no intensity data set or it is truncated, 0 otherwise.
+ **
+ *************************************************************/
 
+int gzread_genericcel_file_intensities_stream(gzFile infile, generic_data_set_index *index, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
 
-  return(0);
+  return gzread_genericcel_data_set(infile, index, GENERICCEL_INTENSITY, intensity, chip_num);
 }
 
 
+int gzread_genericcel_file_intensities_blocks(gzFile infile, generic_data_set_index *index, generic_column_sink sink, void *arg){
 
+  generic_data_set_index_entry *entry = gzfind_genericcel_data_set(index, GENERICCEL_INTENSITY, infile);
 
+  if (entry == NULL || entry->ncols < 1){
+    return 1;
+  }
+  return !gzread_generic_data_set_column_blocks(index, entry, 0, sink, arg, infile);
+}
 
 
-int gzread_genericcel_file_stddev(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+int gzread_genericcel_file_intensities(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+
+  int status;
 
-  size_t i=0;
-  
   gzFile infile;
+  generic_data_set_index index;
 
-  generic_file_header my_header;
-  generic_data_header my_data_header;
-  generic_data_group my_data_group;
+  infile = open_gzgenericcel_file(filename, &index);
+  status = gzread_genericcel_file_intensities_stream(infile, &index, intensity, chip_num, rows, cols, chip_dim_rows);
+  
+  Free_generic_data_set_index(&index);
+  gzclose(infile);
 
-  generic_data_set my_data_set;
+  return status;
+}
 
 
-  if ((infile = gzopen(filename, "rb")) == NULL)
-    {
-      error("Unable to open the file %s\n",filename);
-      return 0;
-    }
-  
 
-  
-  gzread_generic_file_header(&my_header, infile);
-  gzread_generic_data_header(&my_data_header, infile);
-  gzread_generic_data_group(&my_data_group,infile);
 
-  gzread_generic_data_set(&my_data_set,infile); 
-  gzseek(infile, my_data_set.file_pos_last, SEEK_SET); 
-  Free_generic_data_set(&my_data_set);
- 
-  gzread_generic_data_set(&my_data_set,infile); 
-  gzread_generic_data_set_rows(&my_data_set,infile); 
-  for (i =0; i < my_data_set.nrows; i++){
-    intensity[chip_num*my_data_set.nrows + i] = (double)(((float *)my_data_set.Data[0])[i]);
-  }
-  Free_generic_data_set(&my_data_set);
-  Free_generic_data_header(&my_data_header);
-  Free_generic_data_group(&my_data_group);
 
-  gzclose(infile);
+/*************************************************************
+ **
+ ** int gzread_genericcel_file_stddev_stream(gzFile infile, generic_data_set_index *index, double *intensity, 
+ **                                        size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows)
+ **
+ ** gzFile infile - an open gzipped command console CEL file
+ ** generic_data_set_index *index - index of the data sets of infile
+ **
+ ** reads the stddev values into the data matrix. Returns 1 if
+ ** there is no stddev data set or it is truncated, 0 otherwise.
+ **
+ *************************************************************/
 
+int gzread_genericcel_file_stddev_stream(gzFile infile, generic_data_set_index *index, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
 
-  return(0);
+  return gzread_genericcel_data_set(infile, index, GENERICCEL_STDDEV, intensity, chip_num);
+}
 
 
+int gzread_genericcel_file_stddev(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
 
+  int status;
 
+  gzFile infile;
+  generic_data_set_index index;
 
+  infile = open_gzgenericcel_file(filename, &index);
+  status = gzread_genericcel_file_stddev_stream(infile, &index, intensity, chip_num, rows, cols, chip_dim_rows);
+  
+  Free_generic_data_set_index(&index);
+  gzclose(infile);
+
+  return status;
 }
 
 
 
-int gzread_genericcel_file_npixels(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
+/*************************************************************
+ **
+ ** int gzread_genericcel_file_npixels_stream(gzFile infile, generic_data_set_index *index, double *intensity, 
+ **                                         size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows)
+ **
+ ** gzFile infile - an open gzipped command console CEL file
+ ** generic_data_set_index *index - index of the data sets of infile
+ **
+ ** reads the npixels values into the data matrix. Returns 1 if
+ ** there is no npixels data set or it is truncated, 0 otherwise.
+ **
+ *************************************************************/
 
-  size_t i=0;
-  
-  gzFile infile;
+int gzread_genericcel_file_npixels_stream(gzFile infile, generic_data_set_index *index, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
 
-  generic_file_header my_header;
-  generic_data_header my_data_header;
-  generic_data_group my_data_group;
+  return gzread_genericcel_data_set(infile, index, GENERICCEL_NPIXELS, intensity, chip_num);
+}
 
-  generic_data_set my_data_set;
 
+int gzread_genericcel_file_npixels(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows){
 
-  if ((infile = gzopen(filename, "rb")) == NULL)
-    {
-      error("Unable to open the file %s\n",filename);
-      return 0;
-    }
-  
+  int status;
 
-  
-  gzread_generic_file_header(&my_header, infile);
-  gzread_generic_data_header(&my_data_header, infile);
-  gzread_generic_data_group(&my_data_group,infile);
+  gzFile infile;
+  generic_data_set_index index;
 
-  gzread_generic_data_set(&my_data_set,infile); 
-  gzseek(infile, my_data_set.file_pos_last, SEEK_SET); 
-  Free_generic_data_set(&my_data_set);
- 
-  gzread_generic_data_set(&my_data_set,infile); 
-  gzseek(infile, my_data_set.file_pos_last, SEEK_SET); 
-  Free_generic_data_set(&my_data_set);
+  infile = open_gzgenericcel_file(filename, &index);
+  status = gzread_genericcel_file_npixels_stream(infile, &index, intensity, chip_num, rows, cols, chip_dim_rows);
   
-
-  gzread_generic_data_set(&my_data_set,infile); 
-  gzread_generic_data_set_rows(&my_data_set,infile); 
-  for (i =0; i < my_data_set.nrows; i++){
-    intensity[chip_num*my_data_set.nrows + i] = (double)(((short *)my_data_set.Data[0])[i]);
-  }
-  Free_generic_data_set(&my_data_set);
-  Free_generic_data_header(&my_data_header);
-  Free_generic_data_group(&my_data_group);
-
+  Free_generic_data_set_index(&index);
   gzclose(infile);
 
-
-  return(0);
+  return status;
+}
 
 
+/*************************************************************
+ **
+ ** int gzread_genericcel_file_all(const char *filename, double *intensity, double *stddev, double *npixels)
+ **
+ ** reads intensity, stddev and npixels (any may be NULL) of a single
+ ** gzipped command console CEL file, opening it only once. Returns 1 if one of 
+ ** the data sets could not be found or read (completely), 0 otherwise.
+ **
+ *************************************************************/
 
+int gzread_genericcel_file_all(const char *filename, double *intensity, double *stddev, double *npixels){
 
-}
+  int status = 0;
 
+  gzFile infile;
+  generic_data_set_index index;
 
+  infile = open_gzgenericcel_file(filename, &index);
+  if (intensity != NULL){
+    status|= gzread_genericcel_data_set(infile, &index, GENERICCEL_INTENSITY, intensity, 0);
+  }
+  if (stddev != NULL){
+    status|= gzread_genericcel_data_set(infile, &index, GENERICCEL_STDDEV, stddev, 0);
+  }
+  if (npixels != NULL){
+    status|= gzread_genericcel_data_set(infile, &index, GENERICCEL_NPIXELS, npixels, 0);
+  }
+  
+  Free_generic_data_set_index(&index);
+  gzclose(infile);
 
+  return status;
+}
 
 
 
@@ -1941,15 +2235,60 @@ void gzgeneric_get_masks_outliers(const char *filename, int *nmasks, short **mas
 
 
 
-void gzgeneric_apply_masks(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
+/*************************************************************
+ **
+ ** int gzgeneric_apply_masks_stream(gzFile infile, generic_data_set_index *index, int nrows, double *intensity, size_t chip_num, 
+ **                size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers)
+ **
+ ** gzFile infile - an open gzipped command console CEL file
+ ** generic_data_set_index *index - index of the data sets of infile
+ ** int nrows - the number of rows on the chip (affymetrix-cel-rows)
+ **
+ ** sets the masked and outlier probes to NA. Returns as 
+ ** generic_apply_masks_stream()
+ **
+ *************************************************************/
 
+int gzgeneric_apply_masks_stream(gzFile infile, generic_data_set_index *index, int nrows, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
 
-  size_t i=0;
-  size_t cur_index;
-  
-  short cur_x, cur_y;
+  int j;
+  int which[2];
+  int n_which = 0;
+  int status = 0;
+  double **result;
+
+  generic_data_set_index_entry *entry;
+
+  if (rm_outliers){
+    which[n_which++] = GENERICCEL_OUTLIER;
+  }
+  if (rm_mask){
+    which[n_which++] = GENERICCEL_MASK;
+  }
+
+  for (j =0; j < n_which; j++){
+    entry = gzfind_genericcel_data_set(index, which[j], infile);
+    if (entry == NULL || entry->ncols < 2){
+      continue;
+    }
+    result = Calloc(entry->ncols, double *);
+    result[0] = Calloc(entry->nrows, double);
+    result[1] = Calloc(entry->nrows, double);
+    if (gzread_generic_data_set_columns(index, entry, result, infile)){
+      genericcel_set_NA(result[0], result[1], entry->nrows, nrows, intensity, chip_num, rows);
+    } else {
+      status = 1;
+    }
+    Free(result[0]);
+    Free(result[1]);
+    Free(result);
+  }
+  return status;
+}
 
 
+void gzgeneric_apply_masks(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers){
+
   int nrows;
   int size;
 
@@ -1957,9 +2296,8 @@ void gzgeneric_apply_masks(const char *filename, double *intensity, size_t chip_
 
   generic_file_header my_header;
   generic_data_header my_data_header;
-  generic_data_group my_data_group;
+  generic_data_set_index index;
 
-  generic_data_set my_data_set;
   nvt_triplet *triplet;
   AffyMIMEtypes cur_mime_type;
 
@@ -1968,69 +2306,20 @@ void gzgeneric_apply_masks(const char *filename, double *intensity, size_t chip_
       error("Unable to open the file %s\n",filename);
       
     }
- 
 
-  
   gzread_generic_file_header(&my_header, infile);
   gzread_generic_data_header(&my_data_header, infile);
-  gzread_generic_data_group(&my_data_group,infile);
 
-    
   triplet =  find_nvt(&my_data_header,"affymetrix-cel-rows");
   cur_mime_type = determine_MIMETYPE(*triplet);
   decode_MIME_value(*triplet,cur_mime_type, &nrows, &size);
-  
-
 
-  /* passing the intensities */
-  gzread_generic_data_set(&my_data_set,infile); 
-  gzseek(infile, my_data_set.file_pos_last, SEEK_SET); 
-  Free_generic_data_set(&my_data_set);
- 
-  /* passing by the stddev */
-  gzread_generic_data_set(&my_data_set,infile); 
-  gzseek(infile, my_data_set.file_pos_last, SEEK_SET); 
-  Free_generic_data_set(&my_data_set);
-  
-  /* passing by the npixels */
-  gzread_generic_data_set(&my_data_set,infile); 
-  gzseek(infile, my_data_set.file_pos_last, SEEK_SET); 
-  Free_generic_data_set(&my_data_set);
- 
-  /* Now lets go for the "Outlier" */
-  gzread_generic_data_set(&my_data_set,infile); 
-  
-  if (rm_outliers){
-    gzread_generic_data_set_rows(&my_data_set,infile); 
-    for (i=0; i < my_data_set.nrows; i++){
-      cur_x = ((short *)my_data_set.Data[0])[i];
-      cur_y = ((short *)my_data_set.Data[1])[i];
-      cur_index = (int)cur_x + nrows*(int)cur_y; 
-      intensity[chip_num*rows + cur_index] =  R_NaN;
-    }
-  }
-  
-  gzseek(infile, my_data_set.file_pos_last, SEEK_SET); 
-  Free_generic_data_set(&my_data_set);
+  gzinit_generic_data_set_index(&index, infile);
+  gzgeneric_apply_masks_stream(infile, &index, nrows, intensity, chip_num, rows, cols, chip_dim_rows, rm_mask, rm_outliers);
 
-  /* Now lets go for the "Mask" */
-  gzread_generic_data_set(&my_data_set,infile); 
-  if (rm_mask){
-    gzread_generic_data_set_rows(&my_data_set,infile); 
-    for (i=0; i < my_data_set.nrows; i++){
-      cur_x = ((short *)my_data_set.Data[0])[i];
-      cur_y = ((short *)my_data_set.Data[1])[i];
-      cur_index = (int)cur_x + nrows*(int)cur_y; 
-      intensity[chip_num*rows + cur_index] =  R_NaN;
-    }
-  }
-  Free_generic_data_set(&my_data_set);
+  Free_generic_data_set_index(&index);
   Free_generic_data_header(&my_data_header);
-  Free_generic_data_group(&my_data_group);
-  
+
   gzclose(infile);
   
 }
-
-
-
@@ -1,7 +1,11 @@
 #ifndef READ_CELFILE_GENERIC_H
 #define READ_CELFILE_GENERIC_H
 
+#include <stdio.h>
+#include <zlib.h>
+
 #include "read_abatch.h"
+#include "read_generic.h"
 
 int isGenericCelFile(const char *filename);
 char *generic_get_header_info(const char *filename, int *dim1, int *dim2);
@@ -10,9 +14,17 @@ int read_genericcel_file_intensities(const char *filename, double *intensity, si
 int check_generic_cel_file(const char *filename, const char *ref_cdfName, int ref_dim_1, int ref_dim_2);
 int read_genericcel_file_stddev(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows);
 int read_genericcel_file_npixels(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows);
+int read_genericcel_file_all(const char *filename, double *intensity, double *stddev, double *npixels);
 void generic_get_masks_outliers(const char *filename, int *nmasks, short **masks_x, short **masks_y, int *noutliers, short **outliers_x, short **outliers_y);
 void generic_apply_masks(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers);
 
+char *generic_get_header_info_stream(FILE *infile, int *dim1, int *dim2);
+int read_genericcel_file_intensities_stream(FILE *infile, generic_data_set_index *index, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows);
+int read_genericcel_file_intensities_blocks(FILE *infile, generic_data_set_index *index, generic_column_sink sink, void *arg);
+int read_genericcel_file_stddev_stream(FILE *infile, generic_data_set_index *index, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows);
+int read_genericcel_file_npixels_stream(FILE *infile, generic_data_set_index *index, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows);
+int generic_apply_masks_stream(FILE *infile, generic_data_set_index *index, int nrows, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers);
+
 
 
 int isgzGenericCelFile(const char *filename);
@@ -22,8 +34,16 @@ int gzread_genericcel_file_intensities(const char *filename, double *intensity,
 int check_gzgeneric_cel_file(const char *filename, const char *ref_cdfName, int ref_dim_1, int ref_dim_2);
 int gzread_genericcel_file_stddev(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows);
 int gzread_genericcel_file_npixels(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows);
+int gzread_genericcel_file_all(const char *filename, double *intensity, double *stddev, double *npixels);
 void gzgeneric_get_masks_outliers(const char *filename, int *nmasks, short **masks_x, short **masks_y, int *noutliers, short **outliers_x, short **outliers_y);
 void gzgeneric_apply_masks(const char *filename, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers);
 
+char *gzgeneric_get_header_info_stream(gzFile infile, int *dim1, int *dim2);
+int gzread_genericcel_file_intensities_stream(gzFile infile, generic_data_set_index *index, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows);
+int gzread_genericcel_file_intensities_blocks(gzFile infile, generic_data_set_index *index, generic_column_sink sink, void *arg);
+int gzread_genericcel_file_stddev_stream(gzFile infile, generic_data_set_index *index, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows);
+int gzread_genericcel_file_npixels_stream(gzFile infile, generic_data_set_index *index, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows);
+int gzgeneric_apply_masks_stream(gzFile infile, generic_data_set_index *index, int nrows, double *intensity, size_t chip_num, size_t rows, size_t cols, size_t chip_dim_rows, int rm_mask, int rm_outliers);
+
 
 #endif
@@ -13,19 +13,31 @@
  ** Dec 31, 2007 - Add function for checking that required headers were found
  ** Jan 2, 2008 - port x,y to probe_id and probe_id to x,y functions from RMAExpress parsers
  ** Mar 18, 2008 - fix error in read_clf_header function
+ ** Oct 16, 2026 - tokenize() splits a line in place rather than copying each token.
+ **                Initialize sequential. Add R_read_clf_file
+ ** Oct 16, 2026 - clf_get_x_y looks probe_ids up in an inverse index rather than
+ **                searching. Add batch lookups and R_clf_probe_locations
+ ** Oct 16, 2026 - read_clf_header and read_clf_data return an error message rather than
+ **                calling error() themselves, so the file and arrays can be released first
  **
  **
  ** 
  ******************************************************************/
 
 #include <R.h>
+#include <Rdefines.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "read_clf.h"
  
 
 #define BUFFERSIZE 1024
 
+#define CLF_TOO_FEW_FIELDS "A line of the CLF file has fewer fields than expected. File corrupted?"
+
 /*******************************************************************
  *******************************************************************
  **
@@ -80,8 +92,13 @@ typedef struct{
   char **other_headers_keys;
   char **other_headers_values;
   int n_other_headers;
+  int order_type;           /* order decoded, one of the CLF_ORDER_ codes */
 } clf_headers;
 
+#define CLF_ORDER_UNKNOWN 0
+#define CLF_ORDER_COL_MAJOR 1
+#define CLF_ORDER_ROW_MAJOR 2
+
 /*******************************************************************
  *******************************************************************
  **
@@ -106,8 +123,28 @@ typedef struct{
  ******************************************************************/
 
 
+/*******************************************************************
+ **
+ ** The inverse, from a probe_id to its index. When the probe_ids
+ ** are (nearly) dense location[probe_id - min_id] is the index,
+ ** otherwise the probe_ids are hashed into a table of size slots
+ ** (a power of 2) with ids[slot] the probe_id in each slot.
+ ** Locations are -1 where there is no probe.
+ **
+ *******************************************************************/
+
+typedef struct{
+  int dense;
+  int min_id;
+  int size;
+  int *ids;
+  int *location;
+} clf_inverse_index;
+
+
 typedef struct{
   int *probe_id;
+  clf_inverse_index *inverse;   /* built when first needed */
 } clf_data;
 
 
@@ -144,10 +181,12 @@ typedef struct{
  ** 
  ** char **tokens  - a array of token strings
  ** int n - number of tokens in this set.
+ ** int size - space allocated for tokens
  **
  ** a structure to hold a set of tokens. Typically a tokenset is
  ** created by breaking a character string based upon a set of 
- ** delimiters.
+ ** delimiters. The tokens point into the string that was broken
+ ** up, and the same tokenset is reused for line after line.
  **
  **
  **************************************************************/
@@ -155,55 +194,50 @@ typedef struct{
 typedef struct{
   char **tokens;
   int n;
+  int size;
 } tokenset;
 
 
+static void initialize_tokens(tokenset *x){
+  x->tokens = NULL;
+  x->n = 0;
+  x->size = 0;
+}
+
 
 /******************************************************************
  **
- ** tokenset *tokenize(char *str, char *delimiters)
+ ** void tokenize(char *str, const char *delimiters, tokenset *x)
  **
  ** char *str - a string to break into tokens
  ** char *delimiters - delimiters to use in breaking up the line
+ ** tokenset *x - where to put the tokens
  **
- **
- ** RETURNS a new tokenset
- **
- ** Given a string, split into tokens based on a set of delimitors
+ ** Given a string, split into tokens based on a set of delimitors.
+ ** As with strtok() the string is broken up in place and runs of
+ ** delimiters are treated as one, but nothing is allocated except
+ ** when a line has more tokens than any line before it.
  **
  *****************************************************************/
 
-static tokenset *tokenize(char *str, char *delimiters){
-
-#if USE_PTHREADS  
-  char *tmp_pointer;
-#endif  
-  int i=0;
+static void tokenize(char *str, const char *delimiters, tokenset *x){
 
-  char *current_token;
-  tokenset *my_tokenset = Calloc(1,tokenset);
-  my_tokenset->n=0;
-  
-  my_tokenset->tokens = NULL;
-#if USE_PTHREADS
-  current_token = strtok_r(str,delimiters,&tmp_pointer);
-#else
-  current_token = strtok(str,delimiters);
-#endif
-  while (current_token != NULL){
-    my_tokenset->n++;
-    my_tokenset->tokens = Realloc(my_tokenset->tokens,my_tokenset->n,char*);
-    my_tokenset->tokens[i] = Calloc(strlen(current_token)+1,char);
-    strcpy(my_tokenset->tokens[i],current_token);
-    my_tokenset->tokens[i][(strlen(current_token))] = '\0';
-    i++;
-#if USE_PTHREADS
-    current_token = strtok_r(NULL,delimiters,&tmp_pointer);
-#else
-    current_token = strtok(NULL,delimiters);
-#endif
-  }
-  return my_tokenset; 
+  x->n = 0;
+  str += strspn(str,delimiters);
+  while (*str != '\0'){
+    if (x->n == x->size){
+      x->size = (x->size == 0) ? 16 : 2*x->size;
+      x->tokens = Realloc(x->tokens,x->size,char*);
+    }
+    x->tokens[x->n] = str;
+    x->n++;
+    str += strcspn(str,delimiters);
+    if (*str != '\0'){
+      *str = '\0';
+      str++;
+      str += strspn(str,delimiters);
+    }
+  }
 }
 
 
@@ -229,7 +263,8 @@ static int tokenset_size(tokenset *x){
  ** tokenset *x - a tokenset
  ** int i - index of the token to return
  ** 
- ** RETURNS pointer to the i'th token
+ ** RETURNS pointer to the i'th token. Check there is one with
+ ** has_token() first.
  **
  ******************************************************************/
 
@@ -237,6 +272,13 @@ static char *get_token(tokenset *x,int i){
   return x->tokens[i];
 }
 
+
+/* RETURNS 1 if the tokenset has an i'th token */
+
+static int has_token(tokenset *x,int i){
+  return (i < x->n);
+}
+
 /******************************************************************
  **
  ** void delete_tokens(tokenset *x)
@@ -249,13 +291,11 @@ static char *get_token(tokenset *x,int i){
 
 static void delete_tokens(tokenset *x){
   
-  int i;
-
-  for (i=0; i < x->n; i++){
-    Free(x->tokens[i]);
+  if (x->tokens != NULL){
+    Free(x->tokens);
   }
-  Free(x->tokens);
-  Free(x);
+  x->n = 0;
+  x->size = 0;
 }
 
 /*******************************************************************
@@ -422,7 +462,7 @@ void initialize_clf_header(clf_headers *header){
 
   header->rows = -1;
   header->cols = -1;
-  header->n_other_headers = -1;
+  header->sequential = -1;
 
 }
 
@@ -437,7 +477,7 @@ void initialize_clf_header(clf_headers *header){
 
 static void determine_order_header0(char *header_str, header_0 *header0){
 
-  tokenset *cur_tokenset;
+  tokenset cur_tokenset;
   int i;
   char *temp_str = Calloc(strlen(header_str) +1, char);
 
@@ -448,18 +488,19 @@ static void determine_order_header0(char *header_str, header_0 *header0){
   header0->x = -1;
   header0->y = -1;
   
-  cur_tokenset = tokenize(temp_str,"\t\r\n");
+  initialize_tokens(&cur_tokenset);
+  tokenize(temp_str,"\t\r\n",&cur_tokenset);
   
-  for (i=0; i < tokenset_size(cur_tokenset); i++){
-    if (strcmp(get_token(cur_tokenset,i),"probe_id")==0){
+  for (i=0; i < tokenset_size(&cur_tokenset); i++){
+    if (strcmp(get_token(&cur_tokenset,i),"probe_id")==0){
       header0->probe_id = i;
-    } else if (strcmp(get_token(cur_tokenset,i),"x")==0){
+    } else if (strcmp(get_token(&cur_tokenset,i),"x")==0){
       header0->x = i;
-    } else if (strcmp(get_token(cur_tokenset,i),"y")==0){
+    } else if (strcmp(get_token(&cur_tokenset,i),"y")==0){
       header0->y = i;
     }
   }
-  delete_tokens(cur_tokenset);
+  delete_tokens(&cur_tokenset);
 
   Free(temp_str);
 
@@ -543,77 +584,87 @@ static FILE *open_clf_file(const char *filename){
 
 /****************************************************************
  **
- ** void read_clf_header(FILE *cur_file, char *buffer, clf_headers *header)
+ ** const char *read_clf_header(FILE *cur_file, char *buffer, clf_headers *header)
  **
  ** read the CLF header section
  **
+ ** RETURNS NULL, or a message saying why the header could not 
+ ** be read
  **
  ***************************************************************/
 
-void read_clf_header(FILE *cur_file, char *buffer, clf_headers *header){
+const char *read_clf_header(FILE *cur_file, char *buffer, clf_headers *header){
 
 
-  tokenset *cur_tokenset;
+  tokenset cur_tokenset;
 
   char *temp_str;
   
   
   initialize_clf_header(header);
+  initialize_tokens(&cur_tokenset);
   do {
-    ReadFileLine(buffer, 1024, cur_file);
+    if (!ReadFileLine(buffer, BUFFERSIZE, cur_file)){
+      buffer[0] = '\0';
+      break;
+    }
     /* Rprintf("%s\n",buffer); */
     if (IsHeaderLine(buffer)){
-      cur_tokenset = tokenize(&buffer[2],"=\r\n");
+      tokenize(&buffer[2],"=\r\n",&cur_tokenset);
       /* hopefully token 0 is Key 
 	 and token 1 is Value */
-      /*   Rprintf("Key is: %s\n",get_token(cur_tokenset,0));
-	   Rprintf("Value is: %s\n",get_token(cur_tokenset,1)); */
+      /*   Rprintf("Key is: %s\n",get_token(&cur_tokenset,0));
+	   Rprintf("Value is: %s\n",get_token(&cur_tokenset,1)); */
+      if (!has_token(&cur_tokenset,1)){
+	delete_tokens(&cur_tokenset);
+	return CLF_TOO_FEW_FIELDS;
+      }
       /* Decode the Key/Value pair */
-      if (strcmp(get_token(cur_tokenset,0),"chip_type") == 0){
+      if (strcmp(get_token(&cur_tokenset,0),"chip_type") == 0){
 	if (header->n_chip_type == 0){
 	  header->chip_type = Calloc(1, char *);
 	} else {
 	  header->chip_type = Realloc(header->chip_type, header->n_chip_type+1, char *);
 	}
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1))+1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1))+1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->chip_type[header->n_chip_type] = temp_str;
 	header->n_chip_type++;
-      } else if (strcmp(get_token(cur_tokenset,0), "lib_set_name") == 0){
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "lib_set_name") == 0){
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->lib_set_name = temp_str;
-      } else if (strcmp(get_token(cur_tokenset,0), "lib_set_version") == 0){
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "lib_set_version") == 0){
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->lib_set_version = temp_str;
-      } else if (strcmp(get_token(cur_tokenset,0), "clf_format_version") == 0) {
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "clf_format_version") == 0) {
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->clf_format_version = temp_str;
-      } else if (strcmp(get_token(cur_tokenset,0), "rows") == 0) {
-	header->rows = atoi(get_token(cur_tokenset,1));
-      } else if (strcmp(get_token(cur_tokenset,0), "cols") == 0) {
-	header->cols = atoi(get_token(cur_tokenset,1));
-      } else if (strcmp(get_token(cur_tokenset,0), "header0") == 0) {
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "rows") == 0) {
+	header->rows = atoi(get_token(&cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "cols") == 0) {
+	header->cols = atoi(get_token(&cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "header0") == 0) {
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->header0_str = temp_str;
 	header->header0 = Calloc(1,header_0);
 	determine_order_header0(header->header0_str,header->header0);
-      } else if (strcmp(get_token(cur_tokenset,0), "create_date") == 0) {
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "create_date") == 0) {
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->create_date = temp_str;
-      } else if (strcmp(get_token(cur_tokenset,0), "order") == 0) {
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "order") == 0) {
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->order = temp_str;
-      } else if (strcmp(get_token(cur_tokenset,0), "sequential") == 0) {
-	header->sequential = atoi(get_token(cur_tokenset,1));
-      } else if (strcmp(get_token(cur_tokenset,0), "guid") == 0) {
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "sequential") == 0) {
+	header->sequential = atoi(get_token(&cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "guid") == 0) {
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->guid = temp_str;
       } else {
 	/* not one of the recognised header types */
@@ -623,63 +674,90 @@ void read_clf_header(FILE *cur_file, char *buffer, clf_headers *header){
 	} else {
 	  header->other_headers_keys = Realloc(header->other_headers_keys,header->n_other_headers+1, char *);
 	  header->other_headers_values = Realloc(header->other_headers_values,header->n_other_headers+1, char *);
-	  header->chip_type = Realloc(header->chip_type, header->n_chip_type+1, char *);
 	}
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->other_headers_values[header->n_other_headers] = temp_str;
-	temp_str = Calloc(strlen(get_token(cur_tokenset,0)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,0));
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,0)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,0));
 	header->other_headers_keys[header->n_other_headers] = temp_str;
 	header->n_other_headers++;
 
       }
-      
-      delete_tokens(cur_tokenset);
     }
   } while (IsHeaderLine(buffer));
- 
+  delete_tokens(&cur_tokenset);
+
+  /* so that order need not be compared for each probe */
+  header->order_type = CLF_ORDER_UNKNOWN;
+  if (header->order != NULL){
+    if (strcmp(header->order,"col_major") == 0){
+      header->order_type = CLF_ORDER_COL_MAJOR;
+    } else if (strcmp(header->order,"row_major") == 0){
+      header->order_type = CLF_ORDER_ROW_MAJOR;
+    }
+  }
+  return NULL;
 }
 
 /****************************************************************
  **
- ** void read_clf_data(FILE *cur_file, char *buffer, clf_data *data, clf_headers *header)
+ ** const char *read_clf_data(FILE *cur_file, char *buffer, clf_data *data, clf_headers *header)
  **
  ** Read in the data part of the file. Specifically, the x,y, probe_id section.
  ** Note to save space only the probe_id are stored.
  **
+ ** RETURNS NULL, or a message saying why the data could not be read
+ ** (data->probe_id is still allocated, to be freed with the rest of 
+ ** the file)
+ **
  ****************************************************************/
 
-void read_clf_data(FILE *cur_file, char *buffer, clf_data *data, clf_headers *header){
-  tokenset *cur_tokenset;
-  int x, y, cur_id;
+const char *read_clf_data(FILE *cur_file, char *buffer, clf_data *data, clf_headers *header){
+  tokenset cur_tokenset;
+  int i, x, y, cur_id;
+  const char *message = NULL;
 
   /* Check to see if the header information includes enough to know that probe_ids are deterministic */
   /* if the are deterministic then don't need to read the rest of the file */
 
 
+  data->inverse = NULL;
   if (header->sequential > -1){
     data->probe_id = NULL;
-    return;
+    return NULL;
   } else {
     data->probe_id = Calloc((header->rows)*(header->cols), int);
-    cur_tokenset = tokenize(buffer,"\t\r\n");
-    cur_id = atoi(get_token(cur_tokenset,header->header0->probe_id));
-    x = atoi(get_token(cur_tokenset,header->header0->x));
-    y = atoi(get_token(cur_tokenset,header->header0->y));
-    data->probe_id[y*header->cols + x] = cur_id;
-
-    delete_tokens(cur_tokenset);
-    while(ReadFileLine(buffer, 1024, cur_file)){
-      cur_tokenset = tokenize(buffer,"\t\r\n");
-      cur_id = atoi(get_token(cur_tokenset,header->header0->probe_id));
-      x = atoi(get_token(cur_tokenset,header->header0->x));
-      y = atoi(get_token(cur_tokenset,header->header0->y));
-      data->probe_id[y*header->cols + x] = cur_id;
-
-      delete_tokens(cur_tokenset);
+    /* -1 for locations with no probe */
+    for (i=0; i < header->rows*header->cols; i++){
+      data->probe_id[i] = -1;
     }
+    
+    initialize_tokens(&cur_tokenset);
+    if (buffer[0] != '\0'){
+      do {
+	if (buffer[strspn(buffer,"\r\n")] == '\0'){
+	  continue;
+	}
+	tokenize(buffer,"\t\r\n",&cur_tokenset);
+	if (!has_token(&cur_tokenset,header->header0->probe_id) || !has_token(&cur_tokenset,header->header0->x) ||
+	    !has_token(&cur_tokenset,header->header0->y)){
+	  message = CLF_TOO_FEW_FIELDS;
+	  break;
+	}
+	cur_id = atoi(get_token(&cur_tokenset,header->header0->probe_id));
+	x = atoi(get_token(&cur_tokenset,header->header0->x));
+	y = atoi(get_token(&cur_tokenset,header->header0->y));
+	if (x < 0 || x >= header->cols || y < 0 || y >= header->rows){
+	  message = "A probe in the CLF file lies outside the chip given by its rows and cols headers. File corrupted?";
+	  break;
+	}
+	data->probe_id[y*header->cols + x] = cur_id;
+      } while(ReadFileLine(buffer, BUFFERSIZE, cur_file));
+    }
+    delete_tokens(&cur_tokenset);
   }
+  return message;
 }
 
 
@@ -687,6 +765,117 @@ void read_clf_data(FILE *cur_file, char *buffer, clf_data *data, clf_headers *he
 
 
 
+/****************************************************************
+ **
+ ** void build_clf_inverse_index(clf_inverse_index *index, const int *probe_id, int n_cells)
+ **
+ ** builds the inverse of probe_id (a probe_id for each of n_cells
+ ** indices, -1 or NA where there is none). Where a probe_id is at
+ ** more than one index the first is kept.
+ **
+ ****************************************************************/
+
+#define CLF_HASH(id,size) ((int)(((unsigned int)(id)*2654435761U) & (unsigned int)((size) - 1)))
+
+static int clf_no_probe(int probe_id){
+  return (probe_id == -1 || probe_id == NA_INTEGER);
+}
+
+
+void build_clf_inverse_index(clf_inverse_index *index, const int *probe_id, int n_cells){
+
+  int i, n_probes = 0, min_id = 0, max_id = 0, slot;
+
+  for (i=0; i < n_cells; i++){
+    if (clf_no_probe(probe_id[i])){
+      continue;
+    }
+    if (n_probes == 0 || probe_id[i] < min_id){
+      min_id = probe_id[i];
+    }
+    if (n_probes == 0 || probe_id[i] > max_id){
+      max_id = probe_id[i];
+    }
+    n_probes++;
+  }
+
+  index->min_id = min_id;
+  index->ids = NULL;
+  
+  if (n_probes == 0 || (double)max_id - (double)min_id + 1.0 <= 2.0*n_probes + 1024.0){
+    index->dense = 1;
+    index->size = (n_probes == 0) ? 0 : max_id - min_id + 1;
+    index->location = Calloc(index->size > 0 ? index->size : 1, int);
+    for (i=0; i < index->size; i++){
+      index->location[i] = -1;
+    }
+    for (i=0; i < n_cells; i++){
+      if (!clf_no_probe(probe_id[i]) && index->location[probe_id[i] - min_id] == -1){
+	index->location[probe_id[i] - min_id] = i;
+      }
+    }
+  } else {
+    /* sparse ids, so hash them (at most half full) */
+    index->dense = 0;
+    index->size = 1;
+    while (index->size < 2*n_probes){
+      index->size *= 2;
+    }
+    index->ids = Calloc(index->size, int);
+    index->location = Calloc(index->size, int);
+    for (i=0; i < index->size; i++){
+      index->location[i] = -1;
+    }
+    for (i=0; i < n_cells; i++){
+      if (clf_no_probe(probe_id[i])){
+	continue;
+      }
+      slot = CLF_HASH(probe_id[i], index->size);
+      while (index->location[slot] != -1 && index->ids[slot] != probe_id[i]){
+	slot = (slot + 1) & (index->size - 1);
+      }
+      if (index->location[slot] == -1){
+	index->ids[slot] = probe_id[i];
+	index->location[slot] = i;
+      }
+    }
+  }
+}
+
+
+/* RETURNS the index of probe_id, -1 if it is not there */
+
+static int clf_inverse_lookup(const clf_inverse_index *index, int probe_id){
+
+  int slot;
+
+  if (index->dense){
+    if (probe_id < index->min_id || (double)probe_id - index->min_id >= index->size){
+      return -1;
+    }
+    return index->location[probe_id - index->min_id];
+  }
+
+  slot = CLF_HASH(probe_id, index->size);
+  while (index->location[slot] != -1){
+    if (index->ids[slot] == probe_id){
+      return index->location[slot];
+    }
+    slot = (slot + 1) & (index->size - 1);
+  }
+  return -1;
+}
+
+
+void free_clf_inverse_index(clf_inverse_index *index){
+  if (index->ids != NULL){
+    Free(index->ids);
+  }
+  Free(index->location);
+}
+
+
+
 /****************************************************************
  ****************************************************************
  **
@@ -749,6 +938,10 @@ void dealloc_clf_data(clf_data *data){
   if (data->probe_id != NULL){
     Free(data->probe_id);
   }
+  if (data->inverse != NULL){
+    free_clf_inverse_index(data->inverse);
+    Free(data->inverse);
+  }
 }
 
 
@@ -778,12 +971,14 @@ void dealloc_clf_file(clf_file* my_clf){
 
 void clf_get_probe_id(clf_file *clf, int *probe_id, int x, int y){
  
-  if (clf->headers->sequential > -1){
+  if (x < 0 || x >= clf->headers->cols || y < 0 || y >= clf->headers->rows){
+    *probe_id = -1;
+  } else if (clf->headers->sequential > -1){
     /* Check if order is "col_major" or "row_major" */
 
-    if (strcmp(clf->headers->order,"col_major") == 0){
+    if (clf->headers->order_type == CLF_ORDER_COL_MAJOR){
       *probe_id = y*clf->headers->cols + x + clf->headers->sequential;
-    } else if (strcmp(clf->headers->order,"row_major") == 0){
+    } else if (clf->headers->order_type == CLF_ORDER_ROW_MAJOR){
       *probe_id = x*clf->headers->rows + y + clf->headers->sequential;
     } else {
       *probe_id = -1;  /* ie missing */
@@ -791,7 +986,7 @@ void clf_get_probe_id(clf_file *clf, int *probe_id, int x, int y){
 
   } else {
 
-    *probe_id = clf->data->probe_id[y*clf->headers->rows + x];
+    *probe_id = clf->data->probe_id[y*clf->headers->cols + x];
   }
 }
 
@@ -799,47 +994,68 @@ void clf_get_probe_id(clf_file *clf, int *probe_id, int x, int y){
  ***
  *** A function for getting the x , y for a given probe_id
  ***
+ *** For a non sequential file this uses an inverse index of the 
+ *** probe_ids, built the first time it is needed.
  ***
  *********************************************************************/
 
 void clf_get_x_y(clf_file *clf, int probe_id, int *x, int *y){
   int ind;
 
+  *x = -1;  /* ie missing */
+  *y = -1;
+
   if (clf->headers->sequential > -1){
     /* Check if order is "col_major" or "row_major" */
 
-    if (strcmp(clf->headers->order,"col_major") == 0){
-      ind = (probe_id - clf->headers->sequential); 
+    ind = probe_id - clf->headers->sequential; 
+    if (probe_id < clf->headers->sequential || ind >= clf->headers->cols*clf->headers->rows){
+      return;
+    }
+    if (clf->headers->order_type == CLF_ORDER_COL_MAJOR){
       *x = ind%clf->headers->cols;
       *y = ind/clf->headers->cols;
-    } else if (strcmp(clf->headers->order,"row_major") == 0){
-      ind = (probe_id - clf->headers->sequential); 
+    } else if (clf->headers->order_type == CLF_ORDER_ROW_MAJOR){
       *x = ind/clf->headers->rows;
       *y = ind%clf->headers->rows;
-    } else {
-      *x = -1;  /* ie missing */
-      *y = -1;
     }
   } else {
-    /* Linear Search (this should be improved for routine use) */
-    ind = 0;
-
-    while (ind < (clf->headers->cols*clf->headers->rows)){
-      if (clf->data->probe_id[ind] == probe_id){
-	break;
-      }
-      ind++;
+    if (clf->data->inverse == NULL){
+      clf->data->inverse = Calloc(1, clf_inverse_index);
+      build_clf_inverse_index(clf->data->inverse, clf->data->probe_id, clf->headers->cols*clf->headers->rows);
     }
-
-    if (ind == (clf->headers->cols*clf->headers->rows)){
-      *x = -1; *y = -1;
-    } else {
-      *x = ind/clf->headers->rows;
-      *y = ind%clf->headers->rows;
+    ind = clf_inverse_lookup(clf->data->inverse, probe_id);
+    if (ind != -1){
+      *x = ind%clf->headers->cols;
+      *y = ind/clf->headers->cols;
     }
   }
 }
 
+
+/**********************************************************************
+ ***
+ *** The same for vectors of n probe_ids or locations
+ ***
+ *********************************************************************/
+
+void clf_get_probe_id_batch(clf_file *clf, int *probe_id, const int *x, const int *y, int n){
+  int i;
+
+  for (i=0; i < n; i++){
+    clf_get_probe_id(clf, &probe_id[i], x[i], y[i]);
+  }
+}
+
+
+void clf_get_x_y_batch(clf_file *clf, const int *probe_id, int *x, int *y, int n){
+  int i;
+
+  for (i=0; i < n; i++){
+    clf_get_x_y(clf, probe_id[i], &x[i], &y[i]);
+  }
+}
+
 /*
  * Note this function is only for testing purposes. It provides no methodology for accessing anything
  * stored in the CLF file in R.
@@ -850,21 +1066,186 @@ void read_clf_file(char **filename){
 
   FILE *cur_file;
   clf_file my_clf;
-  char *buffer = Calloc(1024, char);
+  char *buffer;
+  const char *message;
 
 
   
   cur_file = open_clf_file(filename[0]);
+  buffer = Calloc(1024, char);
   
   my_clf.headers = Calloc(1, clf_headers);
   my_clf.data = Calloc(1, clf_data);
 
-  read_clf_header(cur_file,buffer,my_clf.headers);
-  if (validate_clf_header(my_clf.headers))
-    read_clf_data(cur_file, buffer, my_clf.data, my_clf.headers);
+  message = read_clf_header(cur_file,buffer,my_clf.headers);
+  if (message == NULL && validate_clf_header(my_clf.headers))
+    message = read_clf_data(cur_file, buffer, my_clf.data, my_clf.headers);
 
   Free(buffer);
   dealloc_clf_file(&my_clf);
   fclose(cur_file);
 
+  if (message != NULL){
+    error("%s", message);
+  }
+}
+
+
+
+
+/****************************************************************
+ **
+ ** SEXP R_read_clf_file(SEXP filename)
+ **
+ ** RETURNS the chip type, library set and dimensions (rows, cols)
+ ** from a CLF file along with the probe_id at each location, as
+ ** an integer vector of length rows*cols where x,y is element 
+ ** y*cols + x + 1 (NA where there is no probe). This is worked
+ ** out for a sequential CLF file which does not list its probes.
+ **
+ ***************************************************************/
+
+SEXP R_read_clf_file(SEXP filename){
+
+  static const char *clf_names[] = {"chip_type","lib_set_name","lib_set_version","dimensions","probe_id"};
+
+  SEXP CLF;
+  SEXP Names;
+  SEXP ChipType;
+  SEXP Dimensions;
+  SEXP ProbeId;
+  FILE *cur_file;
+  clf_file my_clf;
+  char *buffer;
+  const char *cur_file_name = CHAR(STRING_ELT(filename,0));
+  const char *message;
+  int i, x, y, n_cells;
+  int *probe_id;
+
+  cur_file = open_clf_file(cur_file_name);
+  buffer = Calloc(BUFFERSIZE, char);
+  my_clf.headers = Calloc(1, clf_headers);
+  my_clf.data = Calloc(1, clf_data);
+
+  message = read_clf_header(cur_file,buffer,my_clf.headers);
+  if (message == NULL && (!validate_clf_header(my_clf.headers) || my_clf.headers->rows < 0 || my_clf.headers->cols < 0 ||
+			  (my_clf.headers->sequential > -1 && my_clf.headers->order == NULL))){
+    Free(buffer);
+    dealloc_clf_file(&my_clf);
+    fclose(cur_file);
+    error("%s is not a CLF file or is missing required headers.",cur_file_name);
+  }
+  if (message == NULL){
+    message = read_clf_data(cur_file, buffer, my_clf.data, my_clf.headers);
+  }
+  Free(buffer);
+  fclose(cur_file);
+  if (message != NULL){
+    dealloc_clf_file(&my_clf);
+    error("%s", message);
+  }
+
+  PROTECT(CLF = allocVector(VECSXP,5));
+  PROTECT(Names = allocVector(STRSXP,5));
+  for (i=0; i < 5; i++){
+    SET_STRING_ELT(Names,i,mkChar(clf_names[i]));
+  }
+  setAttrib(CLF,R_NamesSymbol,Names);
+
+  PROTECT(ChipType = allocVector(STRSXP,my_clf.headers->n_chip_type));
+  for (i=0; i < my_clf.headers->n_chip_type; i++){
+    SET_STRING_ELT(ChipType,i,mkChar(my_clf.headers->chip_type[i]));
+  }
+  SET_VECTOR_ELT(CLF,0,ChipType);
+  SET_VECTOR_ELT(CLF,1,mkString(my_clf.headers->lib_set_name));
+  SET_VECTOR_ELT(CLF,2,mkString(my_clf.headers->lib_set_version));
+
+  PROTECT(Dimensions = allocVector(INTSXP,2));
+  INTEGER(Dimensions)[0] = my_clf.headers->rows;
+  INTEGER(Dimensions)[1] = my_clf.headers->cols;
+  SET_VECTOR_ELT(CLF,3,Dimensions);
+
+  n_cells = my_clf.headers->rows*my_clf.headers->cols;
+  PROTECT(ProbeId = allocVector(INTSXP,n_cells));
+  probe_id = INTEGER(ProbeId);
+  if (my_clf.headers->sequential > -1){
+    for (y=0; y < my_clf.headers->rows; y++){
+      for (x=0; x < my_clf.headers->cols; x++){
+	clf_get_probe_id(&my_clf, &probe_id[y*my_clf.headers->cols + x], x, y);
+      }
+    }
+  } else {
+    memcpy(probe_id, my_clf.data->probe_id, n_cells*sizeof(int));
+  }
+  for (i=0; i < n_cells; i++){
+    if (probe_id[i] == -1){
+      probe_id[i] = NA_INTEGER;
+    }
+  }
+  SET_VECTOR_ELT(CLF,4,ProbeId);
+
+  dealloc_clf_file(&my_clf);
+  UNPROTECT(5);
+  return CLF;
+}
+
+
+
+/****************************************************************
+ **
+ ** SEXP R_clf_probe_locations(SEXP ProbeIdMap, SEXP Dimensions, SEXP ProbeIds)
+ **
+ ** SEXP ProbeIdMap - the probe_id at each location (as from 
+ **                   R_read_clf_file)
+ ** SEXP Dimensions - rows, cols
+ ** SEXP ProbeIds - probe_ids to look up
+ **
+ ** RETURNS a matrix with the x and y of each of ProbeIds (NA 
+ ** for those not on the chip)
+ **
+ ***************************************************************/
+
+SEXP R_clf_probe_locations(SEXP ProbeIdMap, SEXP Dimensions, SEXP ProbeIds){
+
+  SEXP Locations;
+  SEXP dimnames;
+  SEXP ColNames;
+  clf_inverse_index index;
+  const int *probe_ids;
+  int *x, *y;
+  int i, ind, n, rows, cols;
+
+  rows = INTEGER(Dimensions)[0];
+  cols = INTEGER(Dimensions)[1];
+  if (rows < 0 || cols < 0 || (double)rows*cols != (double)length(ProbeIdMap)){
+    error("The probe_id map does not match the dimensions of the chip.");
+  }
+  n = length(ProbeIds);
+  probe_ids = INTEGER(ProbeIds);
+
+  build_clf_inverse_index(&index, INTEGER(ProbeIdMap), rows*cols);
+
+  PROTECT(Locations = allocMatrix(INTSXP,n,2));
+  x = INTEGER(Locations);
+  y = x + n;
+  for (i=0; i < n; i++){
+    ind = (probe_ids[i] == NA_INTEGER) ? -1 : clf_inverse_lookup(&index, probe_ids[i]);
+    if (ind == -1){
+      x[i] = NA_INTEGER;
+      y[i] = NA_INTEGER;
+    } else {
+      x[i] = ind%cols;
+      y[i] = ind/cols;
+    }
+  }
+  free_clf_inverse_index(&index);
+
+  PROTECT(ColNames = allocVector(STRSXP,2));
+  PROTECT(dimnames = allocVector(VECSXP,2));
+  SET_STRING_ELT(ColNames,0,mkChar("x"));
+  SET_STRING_ELT(ColNames,1,mkChar("y"));
+  SET_VECTOR_ELT(dimnames,1,ColNames);
+  setAttrib(Locations,R_DimNamesSymbol,dimnames);
+  UNPROTECT(3);
+  return Locations;
 }
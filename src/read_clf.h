@@ -0,0 +1,7 @@
+#ifndef READ_CLF_H
+#define READ_CLF_H
+
+SEXP R_read_clf_file(SEXP filename);
+SEXP R_clf_probe_locations(SEXP ProbeIdMap, SEXP Dimensions, SEXP ProbeIds);
+
+#endif
@@ -29,6 +29,21 @@
  ** Nov, 2011 - Some additional fixed to deal with fixed width fields for strings in dataset rows
  ** Sept 4, 2017 - change gzFile * to gzFile
  ** August 26, 2021 - Handling fixed width strings of length 0, Better handling for situations where logical ordering and physical ordering of data groups do not agree
+ ** Oct 16, 2026 - read_generic_data_set_rows/gzread_generic_data_set_rows read data sets with only numeric 
+ **                columns a block of rows at a time rather than one value at a time
+ ** Oct 16, 2026 - add a data set index so that a data set can be found by name (or position)
+ **                and a column of it read by seeking straight to it
+ ** Oct 16, 2026 - gzipped data set rows are inflated and decoded in large blocks through 
+ **                gzread_blocks(), with pthreads the inflating runs on its own thread
+ ** Oct 16, 2026 - a single data set column can be read a block of rows at a time, each 
+ **                block handed to a callback rather than stored (read_generic_data_set_column_blocks)
+ ** Oct 16, 2026 - the data set index keeps the names of the data groups it has passed through
+ ** Oct 16, 2026 - find_nvt looks names up in a hash table built on its first call. Add
+ **                read_generic_data_header_selected() which keeps only the named triplets
+ **                of a data header, skipping the others and the parent headers by length
+ ** Oct 16, 2026 - wide strings are read with a single read and widened by decode_UTF16BE().
+ **                Data sets with fixed width string columns are also read a block of rows
+ **                at a time
  **
  *************************************************************/
 
@@ -47,6 +62,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 #include "fread_functions.h"
@@ -75,6 +91,20 @@ static void Free_nvt_triplet(nvt_triplet *triplet){
 }
 
 
+/* hash table of triplet names, see find_nvt() */
+
+struct nvt_name_index{
+  uint32_t mask;               /* number of slots - 1, a power of two - 1 */
+  nvt_triplet **slots;
+};
+
+
+static void Free_nvt_name_index(nvt_name_index *index){
+  Free(index->slots);
+  Free(index);
+}
+
+
 static void Free_nvts_triplet(col_nvts_triplet *triplet){
   Free_AWSTRING(&(triplet->name));
 
@@ -107,6 +137,11 @@ void Free_generic_data_header(generic_data_header *header){
   if (header->parent_headers != 0)
     Free(header->parent_headers);
 
+  if (header->name_index != 0){
+    Free_nvt_name_index(header->name_index);
+    header->name_index = 0;
+  }
+
 
 }
 
@@ -119,6 +154,27 @@ void Free_generic_data_group(generic_data_group *data_group){
 }
 
 
+/* frees everything but the rows, for data sets read by read_generic_data_set_header() */
+
+static void Free_generic_data_set_header(generic_data_set *data_set){
+
+  int j;
+
+  for (j=0; j < data_set->ncols; j++){
+    Free_nvts_triplet(&(data_set->col_name_type_value[j]));
+  }
+  Free(data_set->col_name_type_value);
+
+  for (j =0; j <  data_set->n_name_type_value; j++){
+    Free_nvt_triplet(&(data_set->name_type_value[j]));
+  }
+  Free(data_set->name_type_value);
+
+  Free_AWSTRING(&(data_set->data_set_name));
+  
+}
+
+
 void Free_generic_data_set(generic_data_set *data_set){
 
   int j,i;
@@ -140,20 +196,10 @@ void Free_generic_data_set(generic_data_set *data_set){
   }
   Free(data_set->Data);
 
-  for (j=0; j < data_set->ncols; j++){
-    Free_nvts_triplet(&(data_set->col_name_type_value[j]));
-  }
-  Free(data_set->col_name_type_value);
+  Free_generic_data_set_header(data_set);
+}
 
-  for (j =0; j <  data_set->n_name_type_value; j++){
-    Free_nvt_triplet(&(data_set->name_type_value[j]));
-  }
-  Free(data_set->name_type_value);
 
-  Free_AWSTRING(&(data_set->data_set_name));
-  
-}
-  
 
 static int fread_ASTRING(ASTRING *destination, FILE *instream){
 
@@ -186,20 +232,46 @@ static int fread_ASTRING_fw(ASTRING *destination, FILE *instream, int length){
 }
 
 
-static int fread_AWSTRING(AWSTRING *destination, FILE *instream){
+/*
+   Affy file wchar_t are 16 bit big endian, the platform may have 32 bit
+   wchar_t (notably linux). The characters of a string are read with a
+   single read and then widened, rather than read one at a time.
+*/
 
-  uint16_t temp;   /* Affy file wchar_t are 16 bits, the platform may have  32 bit wchar_t (notatbly linux) */
+#define UTF16_STACK_BUFFER 512
 
+static void decode_UTF16BE(wchar_t *destination, const unsigned char *source, int n){
   int i;
 
+  for (i=0; i < n; i++){
+    destination[i] = (wchar_t)((source[2*i] << 8) | source[2*i+1]);
+  }
+}
+
+
+static void fread_UTF16BE(wchar_t *destination, int len, FILE *instream){
+
+  unsigned char stack_buffer[UTF16_STACK_BUFFER];
+  unsigned char *buffer = stack_buffer;
+  size_t n_read;
+
+  if (2*(size_t)len > sizeof(stack_buffer)){
+    buffer = Calloc(2*(size_t)len, unsigned char);
+  }
+  n_read = fread(buffer, 2, len, instream);
+  decode_UTF16BE(destination, buffer, (int)n_read);
+  if (buffer != stack_buffer){
+    Free(buffer);
+  }
+}
+
+
+static int fread_AWSTRING(AWSTRING *destination, FILE *instream){
+
   fread_be_int32(&(destination->len),1,instream);
   if ((destination->len) > 0){
     destination->value = Calloc(destination->len+1,wchar_t);
-  
-    for (i=0; i < destination->len; i++){
-      fread_be_uint16(&temp,1,instream);
-      destination->value[i] = (wchar_t)temp;
-    }
+    fread_UTF16BE(destination->value, destination->len, instream);
   } else {
     destination->value = 0;
   }
@@ -210,18 +282,10 @@ static int fread_AWSTRING(AWSTRING *destination, FILE *instream){
 
 static int fread_AWSTRING_fw(AWSTRING *destination, FILE *instream, int length){
 
-  uint16_t temp;   /* Affy file wchar_t are 16 bits, the platform may have  32 bit wchar_t (notatbly linux) */
-
-  int i;
-
   fread_be_int32(&(destination->len),1,instream);
   if ((destination->len) > 0){
     destination->value = Calloc(destination->len+1,wchar_t);
-  
-    for (i=0; i < destination->len; i++){
-      fread_be_uint16(&temp,1,instream);
-      destination->value[i] = (wchar_t)temp;
-    }  
+    fread_UTF16BE(destination->value, destination->len, instream);
     if (length > 2*destination->len){
 	fseek(instream, length-2*destination->len, SEEK_CUR);
     }
@@ -637,39 +701,116 @@ char *decode_MIME_value_toASCII(nvt_triplet triplet, AffyMIMEtypes mimetype, voi
 
 
 
-nvt_triplet* find_nvt(generic_data_header *data_header,char *name){
+/*************************************************************
+ **
+ ** nvt_triplet* find_nvt(generic_data_header *data_header,char *name)
+ **
+ ** finds the triplet called name in data_header or, failing that, in
+ ** its parent headers (each searched with its own parents before the
+ ** next). Returns NULL if there is none.
+ **
+ ** The first call builds a hash table of the names of all these
+ ** triplets, keeping the first of any repeated name, so that each
+ ** later search is a single lookup. It is freed along with the header.
+ **
+ *************************************************************/
 
-  nvt_triplet* returnvalue = 0;
+static uint32_t hash_nvt_name(const wchar_t *name){
+  uint32_t hash = 2166136261u;
+
+  while (*name){
+    hash ^= (uint32_t)*name++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
 
-  wchar_t *wname;
-  int i;
-  
-  int len = strlen(name);
-  
 
+static int count_nvt_triplets(generic_data_header *data_header){
+  int i, n = data_header->n_name_type_value;
 
-  wname = Calloc(len+1, wchar_t);
+  for (i =0; i < data_header->n_parent_headers; i++){
+    n += count_nvt_triplets((generic_data_header *)(data_header->parent_headers)[i]);
+  }
+  return n;
+}
 
 
-  mbstowcs(wname, name, len);
+static void index_nvt_names(nvt_name_index *index, generic_data_header *data_header){
+  int i;
+  uint32_t slot;
+  nvt_triplet *triplet;
 
   for (i =0; i < data_header->n_name_type_value; i++){
-    if (wcscmp(wname, data_header->name_type_value[i].name.value) == 0){
-      returnvalue = &(data_header->name_type_value[i]);
-      break;
+    triplet = &(data_header->name_type_value[i]);
+    if (triplet->name.value == 0){
+      continue;
+    }
+    slot = hash_nvt_name(triplet->name.value) & index->mask;
+    while (index->slots[slot] != 0 && wcscmp(index->slots[slot]->name.value, triplet->name.value) != 0){
+      slot = (slot + 1) & index->mask;
     }
+    if (index->slots[slot] == 0){
+      index->slots[slot] = triplet;
+    }
+  }
+  for (i =0; i < data_header->n_parent_headers; i++){
+    index_nvt_names(index, (generic_data_header *)(data_header->parent_headers)[i]);
+  }
+}
+
+
+static nvt_name_index *build_nvt_name_index(generic_data_header *data_header){
+  nvt_name_index *index;
+  uint32_t n_slots = 16;
+  int n = count_nvt_triplets(data_header);
+
+  while (n_slots < 2*(uint32_t)n){
+    n_slots *= 2;
   }
+  index = Calloc(1, nvt_name_index);
+  index->mask = n_slots - 1;
+  index->slots = Calloc(n_slots, nvt_triplet *);
+  index_nvt_names(index, data_header);
+  return index;
+}
+
+
+nvt_triplet* find_nvt(generic_data_header *data_header,char *name){
+
+  nvt_triplet* returnvalue = 0;
+
+  wchar_t wbuffer[64];
+  wchar_t *wname = wbuffer;
+  size_t converted;
+  uint32_t slot;
+  nvt_name_index *index;
   
-  if (returnvalue == 0){
-    for (i =0; i < data_header->n_parent_headers; i++){
-      returnvalue = find_nvt((generic_data_header *)(data_header->parent_headers)[i],name);
-      if (returnvalue !=0){
-	break;
-      }
+  int len = strlen(name);
+  
+  if (data_header->name_index == 0){
+    data_header->name_index = build_nvt_name_index(data_header);
+  }
+  index = data_header->name_index;
+
+  if (len >= 64){
+    wname = Calloc(len+1, wchar_t);
+  }
+  converted = mbstowcs(wname, name, len);
+  wname[converted == (size_t)-1 ? 0 : converted] = 0;
+
+  slot = hash_nvt_name(wname) & index->mask;
+  while (index->slots[slot] != 0){
+    if (wcscmp(wname, index->slots[slot]->name.value) == 0){
+      returnvalue = index->slots[slot];
+      break;
     }
+    slot = (slot + 1) & index->mask;
   }
   
-  Free(wname);
+  if (wname != wbuffer){
+    Free(wname);
+  }
   return returnvalue;
 }
 
@@ -709,6 +850,7 @@ int read_generic_data_header(generic_data_header *data_header, FILE *instream){
   int i;
   generic_data_header *temp_header;
   
+  data_header->name_index = 0;
 
   if (!fread_ASTRING(&(data_header->data_type_id), instream) ||
       !fread_ASTRING(&(data_header->unique_file_id), instream) ||
@@ -764,7 +906,9 @@ int read_generic_data_group(generic_data_group *data_group, FILE *instream){
 
 
 
-int read_generic_data_set(generic_data_set *data_set, FILE *instream){
+/* reads the data set header but does not allocate space for the rows */
+
+static int read_generic_data_set_header(generic_data_set *data_set, FILE *instream){
 
   int i;
 
@@ -800,6 +944,14 @@ int read_generic_data_set(generic_data_set *data_set, FILE *instream){
     return 0;
   }
 
+  return 1;
+}
+
+
+static void allocate_generic_data_set_rows(generic_data_set *data_set){
+
+  int i;
+
   data_set->Data = Calloc(data_set->ncols, void *);
 
   for (i=0; i < data_set->ncols; i++){
@@ -827,13 +979,286 @@ int read_generic_data_set(generic_data_set *data_set, FILE *instream){
     }
     
   }
+}
+
+
+int read_generic_data_set(generic_data_set *data_set, FILE *instream){
+
+  if (!read_generic_data_set_header(data_set, instream)){
+    return 0;
+  }
+  allocate_generic_data_set_rows(data_set);
   return 1;
 }
 
 
+/*****************************************************************
+ **
+ ** Fast path for reading data set rows
+ **
+ ** Each column of a data set takes a fixed number of bytes in every
+ ** row: numeric columns the size of their type, string columns a 4
+ ** byte length followed by a fixed width (the probeset name columns of
+ ** CHP files for instance). Rows are then read a block at a time with
+ ** a single fread and the big endian values and strings decoded from
+ ** the buffer, rather than one fread per value or character.
+ **
+ *****************************************************************/
+
+#define GENERIC_ROW_BLOCK 16384
+
+
+/* size in bytes of a numeric column type, 0 for strings */
+
+static int generic_numeric_type_size(uint8_t type){
+
+  switch(type){
+  case 0: 
+  case 1:
+    return 1;
+  case 2:
+  case 3:
+    return 2;
+  case 4:
+  case 5:
+  case 6:
+    return 4;
+  }
+  return 0;
+}
+
+
+/* the size of a row, or 0 if a column does not have the size expected of its type */
+
+static int generic_fixed_row_size(generic_data_set *data_set){
+
+  int j, size, row_size = 0;
+  uint8_t type;
+
+  for (j=0; j < data_set->ncols; j++){
+    type = data_set->col_name_type_value[j].type;
+    size = data_set->col_name_type_value[j].size;
+    if (type == 7 || type == 8){
+      if (size < 4){
+	return 0;
+      }
+    } else if (type > 8 || size != generic_numeric_type_size(type)){
+      return 0;
+    }
+    row_size+= size;
+  }
+  return row_size;
+}
+
+
+/*****************************************************************
+ **
+ ** static void decode_generic_column(uint8_t type, const unsigned char *cur, int n_rows, 
+ **                                   int row_size, void *values, int first_row)
+ **
+ ** decodes n_rows big endian values of a numeric column, the first of
+ ** which is at cur and each subsequent one row_size bytes further on,
+ ** into values starting at first_row. The decoding does not depend
+ ** on the byte order of the machine.
+ **
+ *****************************************************************/
+
+static void decode_generic_column(uint8_t type, const unsigned char *cur, int n_rows, int row_size, void *values, int first_row){
+
+  int i;
+  uint16_t value16;
+  uint32_t value32;
+
+  switch(type){
+  case 0:
+    for (i=0; i < n_rows; i++, cur+= row_size){
+      ((char *)values)[first_row + i] = (char)cur[0];
+    }
+    break;
+  case 1:
+    for (i=0; i < n_rows; i++, cur+= row_size){
+      ((unsigned char *)values)[first_row + i] = cur[0];
+    }
+    break;
+  case 2:
+    for (i=0; i < n_rows; i++, cur+= row_size){
+      value16 = (uint16_t)((cur[0] << 8) | cur[1]);
+      ((short *)values)[first_row + i] = (short)value16;
+    }
+    break;
+  case 3:
+    for (i=0; i < n_rows; i++, cur+= row_size){
+      value16 = (uint16_t)((cur[0] << 8) | cur[1]);
+      ((unsigned short *)values)[first_row + i] = value16;
+    }
+    break;
+  case 4:
+    for (i=0; i < n_rows; i++, cur+= row_size){
+      value32 = ((uint32_t)cur[0] << 24) | ((uint32_t)cur[1] << 16) | ((uint32_t)cur[2] << 8) | (uint32_t)cur[3];
+      ((int32_t *)values)[first_row + i] = (int32_t)value32;
+    }
+    break;
+  case 5:
+    for (i=0; i < n_rows; i++, cur+= row_size){
+      value32 = ((uint32_t)cur[0] << 24) | ((uint32_t)cur[1] << 16) | ((uint32_t)cur[2] << 8) | (uint32_t)cur[3];
+      ((uint32_t *)values)[first_row + i] = value32;
+    }
+    break;
+  case 6:
+    for (i=0; i < n_rows; i++, cur+= row_size){
+      value32 = ((uint32_t)cur[0] << 24) | ((uint32_t)cur[1] << 16) | ((uint32_t)cur[2] << 8) | (uint32_t)cur[3];
+      memcpy(&((float *)values)[first_row + i], &value32, sizeof(float));
+    }
+    break;
+  }
+}
+
+
+/* 
+   as decode_generic_column() for a string column (type 7 or 8) of the
+   given width. As with fread_ASTRING_fw()/fread_AWSTRING_fw() an empty
+   string has a NULL value. A length longer than the width is cut short.
+*/
+
+static void decode_generic_string_column(uint8_t type, const unsigned char *cur, int n_rows, int row_size, int width, void *values, int first_row){
+
+  int i;
+  int32_t len;
+  ASTRING *astring;
+  AWSTRING *awstring;
+
+  for (i=0; i < n_rows; i++, cur+= row_size){
+    len = (int32_t)(((uint32_t)cur[0] << 24) | ((uint32_t)cur[1] << 16) | ((uint32_t)cur[2] << 8) | (uint32_t)cur[3]);
+    if (type == 7){
+      if (len > width){
+	len = width;
+      }
+      astring = &((ASTRING *)values)[first_row + i];
+      astring->len = len;
+      astring->value = 0;
+      if (len > 0){
+	astring->value = Calloc(len+1, char);
+	memcpy(astring->value, cur + 4, len);
+      }
+    } else {
+      if (len > width/2){
+	len = width/2;
+      }
+      awstring = &((AWSTRING *)values)[first_row + i];
+      awstring->len = len;
+      awstring->value = 0;
+      if (len > 0){
+	awstring->value = Calloc(len+1, wchar_t);
+	decode_UTF16BE(awstring->value, cur + 4, len);
+      }
+    }
+  }
+}
+
+
+/* decodes n_rows packed rows from buffer into data_set->Data starting at first_row */
+
+static void decode_generic_rows(generic_data_set *data_set, const unsigned char *buffer, int first_row, int n_rows, int row_size){
+
+  int j;
+  int offset = 0;
+  uint8_t type;
+
+  for (j=0; j < data_set->ncols; j++){
+    type = data_set->col_name_type_value[j].type;
+    if (type == 7 || type == 8){
+      decode_generic_string_column(type, buffer + offset, n_rows, row_size, data_set->col_name_type_value[j].size - 4, data_set->Data[j], first_row);
+    } else {
+      decode_generic_column(type, buffer + offset, n_rows, row_size, data_set->Data[j], first_row);
+    }
+    offset+= data_set->col_name_type_value[j].size;
+  }
+}
+
+
+/* as decode_generic_column() but storing the values as doubles */
+
+static void decode_generic_column_double(uint8_t type, const unsigned char *cur, int n_rows, int row_size, double *values, int first_row){
+
+  int i;
+  uint32_t value32;
+  float value_float;
+
+  switch(type){
+  case 0:
+    for (i=0; i < n_rows; i++, cur+= row_size){
+      values[first_row + i] = (double)(char)cur[0];
+    }
+    break;
+  case 1:
+    for (i=0; i < n_rows; i++, cur+= row_size){
+      values[first_row + i] = (double)cur[0];
+    }
+    break;
+  case 2:
+    for (i=0; i < n_rows; i++, cur+= row_size){
+      values[first_row + i] = (double)(short)(uint16_t)((cur[0] << 8) | cur[1]);
+    }
+    break;
+  case 3:
+    for (i=0; i < n_rows; i++, cur+= row_size){
+      values[first_row + i] = (double)(uint16_t)((cur[0] << 8) | cur[1]);
+    }
+    break;
+  case 4:
+    for (i=0; i < n_rows; i++, cur+= row_size){
+      value32 = ((uint32_t)cur[0] << 24) | ((uint32_t)cur[1] << 16) | ((uint32_t)cur[2] << 8) | (uint32_t)cur[3];
+      values[first_row + i] = (double)(int32_t)value32;
+    }
+    break;
+  case 5:
+    for (i=0; i < n_rows; i++, cur+= row_size){
+      value32 = ((uint32_t)cur[0] << 24) | ((uint32_t)cur[1] << 16) | ((uint32_t)cur[2] << 8) | (uint32_t)cur[3];
+      values[first_row + i] = (double)value32;
+    }
+    break;
+  case 6:
+    for (i=0; i < n_rows; i++, cur+= row_size){
+      value32 = ((uint32_t)cur[0] << 24) | ((uint32_t)cur[1] << 16) | ((uint32_t)cur[2] << 8) | (uint32_t)cur[3];
+      memcpy(&value_float, &value32, sizeof(float));
+      values[first_row + i] = (double)value_float;
+    }
+    break;
+  }
+}
+
+
+static int read_generic_data_set_rows_fixed(generic_data_set *data_set, FILE *instream, int row_size){
+
+  int i, n_block, n_read;
+  int result = 1;
+  unsigned char *buffer = Calloc((size_t)GENERIC_ROW_BLOCK*row_size, unsigned char);
+
+  for (i=0; i < data_set->nrows; i+= n_block){
+    n_block = data_set->nrows - i;
+    if (n_block > GENERIC_ROW_BLOCK){
+      n_block = GENERIC_ROW_BLOCK;
+    }
+    n_read = fread(buffer, row_size, n_block, instream);
+    decode_generic_rows(data_set, buffer, i, n_read, row_size);
+    if (n_read != n_block){
+      result = 0;
+      break;
+    }
+  }
+  Free(buffer);
+  return result;
+}
+
+
 int read_generic_data_set_rows(generic_data_set *data_set, FILE *instream){
 
   int i,j;
+  int row_size = generic_fixed_row_size(data_set);
+
+  if (row_size > 0){
+    return read_generic_data_set_rows_fixed(data_set, instream, row_size);
+  }
   
   for (i=0; i < data_set->nrows; i++){
     for (j=0; j < data_set->ncols; j++){
@@ -896,84 +1321,485 @@ int read_generic_data_set_rows(generic_data_set *data_set, FILE *instream){
 
 
 
-
-/*****************************************************************************
+/*****************************************************************
  **
+ ** Data set index
  **
- ** Functionality for reading a generic format file which has been gzipped
+ ** Each data set header records where its rows begin and end, so a
+ ** data set can be reached with a seek rather than by parsing every
+ ** data group and data set that comes before it. The index is filled
+ ** in as data sets are looked up, only going as far into the file as
+ ** the data set wanted. This matters for gzipped files where seeking
+ ** forward still means decompressing everything in between.
  **
+ ** init_generic_data_set_index()   - start an index. The stream should be
+ **                                   positioned at the first data group
+ **                                   (ie just after the data header)
+ ** find_generic_data_set()         - look up a data set by name
+ ** get_generic_data_set()          - look up the n'th data set of the file
+ ** read_generic_data_set_columns() - read some or all of the columns of a 
+ **                                   data set with numeric columns, as doubles
+ ** Free_generic_data_set_index()   - free the index
  **
- *****************************************************************************/
+ ** index->data_group_names[entry->data_group] is the name of the data
+ ** group an indexed data set belongs to.
+ **
+ ** The lookup functions return NULL if there is no such data set. 
+ ** Columns wanted from the same data set should be read together, a
+ ** gzipped file has to be decompressed from the start to seek backwards.
+ **
+ ** If the caller has mapped the (uncompressed) file into memory and set
+ ** index->mapped and index->mapped_size the columns are decoded straight
+ ** from the mapping rather than being read through the stream.
+ **
+ *****************************************************************/
+
+static void init_data_set_index(generic_data_set_index *index, uint32_t first_group_pos){
+
+  index->n_data_sets = 0;
+  index->max_data_sets = 0;
+  index->data_sets = NULL;
+  index->cur_data_group = -1;
+  index->data_group_names = NULL;
+  index->n_data_sets_left = 0;
+  index->next_data_set_pos = 0;
+  index->next_data_group_pos = first_group_pos;
+  index->more_data_groups = 1;
+  index->mapped = NULL;
+  index->mapped_size = 0;
+}
 
 
+void init_generic_data_set_index(generic_data_set_index *index, FILE *instream){
+  init_data_set_index(index, (uint32_t)ftell(instream));
+}
 
-static int gzread_ASTRING(ASTRING *destination, gzFile instream){
 
-  gzread_be_int32(&(destination->len),1,instream);
-  if (destination->len > 0){
-    destination->value = Calloc(destination->len+1,char);
-    gzread_be_char(destination->value,destination->len,instream);
-  } else {
-    destination->value = 0;
+void Free_generic_data_set_index(generic_data_set_index *index){
+
+  int i;
+
+  for (i=0; i < index->n_data_sets; i++){
+    Free(index->data_sets[i]->name);
+    Free(index->data_sets[i]->col_type);
+    Free(index->data_sets[i]->col_size);
+    Free(index->data_sets[i]);
   }
-  return 1;
+  if (index->data_sets != NULL){
+    Free(index->data_sets);
+  }
+  for (i=0; i <= index->cur_data_group; i++){
+    Free(index->data_group_names[i]);
+  }
+  if (index->data_group_names != NULL){
+    Free(index->data_group_names);
+  }
+  index->n_data_sets = 0;
+  index->max_data_sets = 0;
+  index->cur_data_group = -1;
 }
 
 
+/* note where the next data group begins, the stream being just past the data group header */
 
-static int gzread_ASTRING_fw(ASTRING *destination, gzFile instream, int length){
+static void index_data_group(generic_data_set_index *index, generic_data_group *data_group, uint32_t cur_pos){
 
-  gzread_be_int32(&(destination->len),1,instream);
-  if (destination->len > 0){
-    destination->value = Calloc(destination->len+1,char);
-    gzread_be_char(destination->value,destination->len,instream);  
-    if (length > destination->len){
-	gzseek(instream, length-destination->len, SEEK_CUR);
-    }
-  } else {
-    destination->value = 0;
-    gzseek(instream, length, SEEK_CUR);
+  char *name = Calloc(data_group->data_group_name.len + 1, char);
+
+  if (data_group->data_group_name.len > 0){
+    wcstombs(name, data_group->data_group_name.value, data_group->data_group_name.len);
   }
-  return 1;
+  index->cur_data_group++;
+  index->data_group_names = Realloc(index->data_group_names, index->cur_data_group + 1, char *);
+  index->data_group_names[index->cur_data_group] = name;
+  index->n_data_sets_left = data_group->n_data_sets;
+  index->next_data_set_pos = cur_pos;
+  index->next_data_group_pos = data_group->file_position_nextgroup;
+  index->more_data_groups = (data_group->file_position_nextgroup > 0);
 }
 
 
-static int gzread_AWSTRING(AWSTRING *destination, gzFile instream){
+static generic_data_set_index_entry *index_data_set(generic_data_set_index *index, generic_data_set *data_set){
 
-  uint16_t temp;   /* Affy file wchar_t are 16 bits, the platform may have  32 bit wchar_t (notatbly linux) */
+  int j;
+  generic_data_set_index_entry *entry = Calloc(1, generic_data_set_index_entry);
 
-  int i;
+  entry->name = Calloc(data_set->data_set_name.len + 1, char);
+  if (data_set->data_set_name.len > 0){
+    wcstombs(entry->name, data_set->data_set_name.value, data_set->data_set_name.len);
+  }
+  entry->data_group = index->cur_data_group;
+  entry->file_pos_first = data_set->file_pos_first;
+  entry->file_pos_last = data_set->file_pos_last;
+  entry->ncols = data_set->ncols;
+  entry->nrows = data_set->nrows;
+  entry->col_type = Calloc(data_set->ncols, uint8_t);
+  entry->col_size = Calloc(data_set->ncols, int32_t);
+  for (j=0; j < data_set->ncols; j++){
+    entry->col_type[j] = data_set->col_name_type_value[j].type;
+    entry->col_size[j] = data_set->col_name_type_value[j].size;
+  }
 
-  gzread_be_int32(&(destination->len),1,instream);
-  if ((destination->len) > 0){
-    destination->value = Calloc(destination->len+1,wchar_t);
-  
-    for (i=0; i < destination->len; i++){
-      gzread_be_uint16(&temp,1,instream);
-      destination->value[i] = (wchar_t)temp;
+  if (index->n_data_sets == index->max_data_sets){
+    if (index->max_data_sets == 0){
+      index->max_data_sets = 8;
+      index->data_sets = Calloc(index->max_data_sets, generic_data_set_index_entry *);
+    } else {
+      index->max_data_sets*= 2;
+      index->data_sets = Realloc(index->data_sets, index->max_data_sets, generic_data_set_index_entry *);
+    }
+  }
+  index->data_sets[index->n_data_sets] = entry;
+  index->n_data_sets++;
+
+  index->n_data_sets_left--;
+  index->next_data_set_pos = data_set->file_pos_last;
+
+  return entry;
+}
+
+
+/* no more data sets if a data group or data set header could not be read */
+
+static void end_data_set_index(generic_data_set_index *index){
+  index->n_data_sets_left = 0;
+  index->more_data_groups = 0;
+}
+
+
+static generic_data_set_index_entry *lookup_data_set_index(generic_data_set_index *index, const char *name){
+
+  int i;
+
+  for (i=0; i < index->n_data_sets; i++){
+    if (strcmp(index->data_sets[i]->name, name) == 0){
+      return index->data_sets[i];
+    }
+  }
+  return NULL;
+}
+
+
+/*****************************************************************
+ **
+ ** static int generic_column_layout(generic_data_set_index_entry *entry, int *offset)
+ **
+ ** returns the size of a row and sets offset[j] to where column j starts
+ ** within it. Returns 0 if the rows of the data set are not all numeric
+ ** (and so have no fixed layout).
+ **
+ *****************************************************************/
+
+static int generic_column_layout(generic_data_set_index_entry *entry, int *offset){
+
+  int j, size, row_size = 0;
+
+  for (j=0; j < entry->ncols; j++){
+    size = generic_numeric_type_size(entry->col_type[j]);
+    if (size == 0 || size != entry->col_size[j]){
+      return 0;
+    }
+    offset[j] = row_size;
+    row_size+= size;
+  }
+  return row_size;
+}
+
+
+static void decode_generic_columns_double(generic_data_set_index_entry *entry, const int *offset, int row_size, const unsigned char *buffer, int n_rows, double **values, int first_row){
+
+  int j;
+
+  for (j=0; j < entry->ncols; j++){
+    if (values[j] != NULL){
+      decode_generic_column_double(entry->col_type[j], buffer + offset[j], n_rows, row_size, values[j], first_row);
+    }
+  }
+}
+
+
+static generic_data_set_index_entry *index_next_data_set(generic_data_set_index *index, FILE *instream){
+
+  generic_data_group data_group;
+  generic_data_set data_set;
+  generic_data_set_index_entry *entry;
+
+  while (index->n_data_sets_left <= 0){
+    if (!index->more_data_groups){
+      return NULL;
+    }
+    fseek(instream, index->next_data_group_pos, SEEK_SET);
+    if (!read_generic_data_group(&data_group, instream)){
+      end_data_set_index(index);
+      return NULL;
+    }
+    index_data_group(index, &data_group, (uint32_t)ftell(instream));
+    Free_generic_data_group(&data_group);
+  }
+
+  fseek(instream, index->next_data_set_pos, SEEK_SET);
+  if (!read_generic_data_set_header(&data_set, instream)){
+    end_data_set_index(index);
+    return NULL;
+  }
+  entry = index_data_set(index, &data_set);
+  Free_generic_data_set_header(&data_set);
+
+  return entry;
+}
+
+
+generic_data_set_index_entry *find_generic_data_set(generic_data_set_index *index, const char *name, FILE *instream){
+
+  generic_data_set_index_entry *entry = lookup_data_set_index(index, name);
+
+  if (entry != NULL){
+    return entry;
+  }
+  while ((entry = index_next_data_set(index, instream)) != NULL){
+    if (strcmp(entry->name, name) == 0){
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+
+generic_data_set_index_entry *get_generic_data_set(generic_data_set_index *index, int n, FILE *instream){
+
+  while (index->n_data_sets <= n){
+    if (index_next_data_set(index, instream) == NULL){
+      return NULL;
+    }
+  }
+  return index->data_sets[n];
+}
+
+
+/*****************************************************************
+ **
+ ** int read_generic_data_set_columns(generic_data_set_index *index, generic_data_set_index_entry *entry, 
+ **                                   double **values, FILE *instream)
+ **
+ ** generic_data_set_index *index - index of the file
+ ** generic_data_set_index_entry *entry - the data set
+ ** double **values - for each column of the data set either space for 
+ **                   entry->nrows values or NULL if the column is not wanted
+ **
+ ** reads the wanted columns of a data set, converted to double, in one
+ ** pass. Only data sets with all numeric columns are supported. Returns 0 
+ ** if the columns could not be read (completely), 1 otherwise.
+ **
+*****************************************************************/
+
+int read_generic_data_set_columns(generic_data_set_index *index, generic_data_set_index_entry *entry, double **values, FILE *instream){
+
+  int i, n_block, n_read;
+  int *offset = Calloc(entry->ncols, int);
+  int row_size = generic_column_layout(entry, offset);
+  int result = 1;
+  unsigned char *buffer;
+
+  if (row_size == 0){
+    Free(offset);
+    return 0;
+  }
+
+  if (index->mapped != NULL){
+    n_read = 0;
+    if (entry->file_pos_first < index->mapped_size){
+      n_read = (index->mapped_size - entry->file_pos_first)/row_size;
+    }
+    if (n_read >= entry->nrows){
+      n_read = entry->nrows;
+    } else {
+      result = 0;
+    }
+    decode_generic_columns_double(entry, offset, row_size, index->mapped + entry->file_pos_first, n_read, values, 0);
+    Free(offset);
+    return result;
+  }
+
+  fseek(instream, entry->file_pos_first, SEEK_SET);
+
+  buffer = Calloc((size_t)GENERIC_ROW_BLOCK*row_size, unsigned char);
+  for (i=0; i < entry->nrows; i+= n_block){
+    n_block = entry->nrows - i;
+    if (n_block > GENERIC_ROW_BLOCK){
+      n_block = GENERIC_ROW_BLOCK;
+    }
+    n_read = fread(buffer, row_size, n_block, instream);
+    decode_generic_columns_double(entry, offset, row_size, buffer, n_read, values, i);
+    if (n_read != n_block){
+      result = 0;
+      break;
+    }
+  }
+  Free(buffer);
+  Free(offset);
+  return result;
+}
+
+
+/*****************************************************************
+ **
+ ** int read_generic_data_set_column_blocks(generic_data_set_index *index, generic_data_set_index_entry *entry, 
+ **                                         int col, generic_column_sink sink, void *arg, FILE *instream)
+ **
+ ** int col - the column wanted
+ ** generic_column_sink sink - called with each block of values (and arg)
+ **
+ ** as read_generic_data_set_columns() but for a single column which 
+ ** rather than being stored is decoded (to double) into a small buffer 
+ ** and passed to sink GENERIC_ROW_BLOCK rows at a time. Returns 0 if the 
+ ** column could not be read (completely), 1 otherwise.
+ **
+*****************************************************************/
+
+int read_generic_data_set_column_blocks(generic_data_set_index *index, generic_data_set_index_entry *entry, int col, generic_column_sink sink, void *arg, FILE *instream){
+
+  int i, n_block, n_read;
+  int n_mapped = 0;
+  int *offset;
+  int row_size;
+  int result = 1;
+  unsigned char *buffer = NULL;
+  const unsigned char *rows;
+  double *values;
+
+  if (col < 0 || col >= (int)entry->ncols){
+    return 0;
+  }
+  offset = Calloc(entry->ncols, int);
+  row_size = generic_column_layout(entry, offset);
+  if (row_size == 0){
+    Free(offset);
+    return 0;
+  }
+
+  if (index->mapped != NULL){
+    if (entry->file_pos_first < index->mapped_size){
+      n_mapped = (index->mapped_size - entry->file_pos_first)/row_size;
     }
+  } else {
+    fseek(instream, entry->file_pos_first, SEEK_SET);
+    buffer = Calloc((size_t)GENERIC_ROW_BLOCK*row_size, unsigned char);
+  }
+
+  values = Calloc(GENERIC_ROW_BLOCK, double);
+  for (i=0; i < (int)entry->nrows; i+= n_block){
+    n_block = entry->nrows - i;
+    if (n_block > GENERIC_ROW_BLOCK){
+      n_block = GENERIC_ROW_BLOCK;
+    }
+    if (index->mapped != NULL){
+      rows = index->mapped + entry->file_pos_first + (size_t)i*row_size;
+      n_read = (n_mapped - i < n_block) ? n_mapped - i : n_block;
+    } else {
+      n_read = fread(buffer, row_size, n_block, instream);
+      rows = buffer;
+    }
+    if (n_read > 0){
+      decode_generic_column_double(entry->col_type[col], rows + offset[col], n_read, row_size, values, 0);
+      sink(values, (size_t)i, (size_t)n_read, arg);
+    }
+    if (n_read != n_block){
+      result = 0;
+      break;
+    }
+  }
+  Free(values);
+  if (buffer != NULL){
+    Free(buffer);
+  }
+  Free(offset);
+  return result;
+}
+
+
+
+
+
+/*****************************************************************************
+ **
+ **
+ ** Functionality for reading a generic format file which has been gzipped
+ **
+ **
+ *****************************************************************************/
+
+
+
+static int gzread_ASTRING(ASTRING *destination, gzFile instream){
+
+  gzread_be_int32(&(destination->len),1,instream);
+  if (destination->len > 0){
+    destination->value = Calloc(destination->len+1,char);
+    gzread_be_char(destination->value,destination->len,instream);
   } else {
     destination->value = 0;
   }
-  
   return 1;
 }
 
 
-static int gzread_AWSTRING_fw(AWSTRING *destination, gzFile instream, int length){
 
-  uint16_t temp;   /* Affy file wchar_t are 16 bits, the platform may have  32 bit wchar_t (notatbly linux) */
+static int gzread_ASTRING_fw(ASTRING *destination, gzFile instream, int length){
 
-  int i;
+  gzread_be_int32(&(destination->len),1,instream);
+  if (destination->len > 0){
+    destination->value = Calloc(destination->len+1,char);
+    gzread_be_char(destination->value,destination->len,instream);  
+    if (length > destination->len){
+	gzseek(instream, length-destination->len, SEEK_CUR);
+    }
+  } else {
+    destination->value = 0;
+    gzseek(instream, length, SEEK_CUR);
+  }
+  return 1;
+}
+
+
+static void gzread_UTF16BE(wchar_t *destination, int len, gzFile instream){
+
+  unsigned char stack_buffer[UTF16_STACK_BUFFER];
+  unsigned char *buffer = stack_buffer;
+  int n_read;
+
+  if (2*(size_t)len > sizeof(stack_buffer)){
+    buffer = Calloc(2*(size_t)len, unsigned char);
+  }
+  n_read = gzread(instream, buffer, 2*len);
+  if (n_read > 0){
+    decode_UTF16BE(destination, buffer, n_read/2);
+  }
+  if (buffer != stack_buffer){
+    Free(buffer);
+  }
+}
+
+
+static int gzread_AWSTRING(AWSTRING *destination, gzFile instream){
 
   gzread_be_int32(&(destination->len),1,instream);
   if ((destination->len) > 0){
     destination->value = Calloc(destination->len+1,wchar_t);
+    gzread_UTF16BE(destination->value, destination->len, instream);
+  } else {
+    destination->value = 0;
+  }
   
-    for (i=0; i < destination->len; i++){
-      gzread_be_uint16(&temp,1,instream);
-      destination->value[i] = (wchar_t)temp;
-    }    
+  return 1;
+}
+
+
+static int gzread_AWSTRING_fw(AWSTRING *destination, gzFile instream, int length){
+
+  gzread_be_int32(&(destination->len),1,instream);
+  if ((destination->len) > 0){
+    destination->value = Calloc(destination->len+1,wchar_t);
+    gzread_UTF16BE(destination->value, destination->len, instream);
     if (length > 2*destination->len){
 	gzseek(instream, length-2*destination->len, SEEK_CUR);
     }
@@ -1042,6 +1868,8 @@ int gzread_generic_data_header(generic_data_header *data_header, gzFile instream
   
   int i;
 
+  data_header->name_index = 0;
+
   if (!gzread_ASTRING(&(data_header->data_type_id), instream) ||
       !gzread_ASTRING(&(data_header->unique_file_id), instream) ||
       !gzread_AWSTRING(&(data_header->Date_time), instream) ||
@@ -1096,7 +1924,7 @@ int gzread_generic_data_group(generic_data_group *data_group, gzFile instream){
 
 
 
-int gzread_generic_data_set(generic_data_set *data_set, gzFile instream){
+static int gzread_generic_data_set_header(generic_data_set *data_set, gzFile instream){
 
   int i;
 
@@ -1132,42 +1960,99 @@ int gzread_generic_data_set(generic_data_set *data_set, gzFile instream){
     return 0;
   }
 
-  data_set->Data = Calloc(data_set->ncols, void *);
+  return 1;
+}
 
-  for (i=0; i < data_set->ncols; i++){
-    switch(data_set->col_name_type_value[i].type){
-    case 0: data_set->Data[i] = Calloc(data_set->nrows,char);
-      break;
-    case 1: data_set->Data[i] = Calloc(data_set->nrows,unsigned char);
-      break;
-    case 2: data_set->Data[i] = Calloc(data_set->nrows,short);
-      break;
-    case 3: data_set->Data[i] = Calloc(data_set->nrows,unsigned short);
-      break;
-    case 4: data_set->Data[i] = Calloc(data_set->nrows,int);
-      break;
-    case 5: data_set->Data[i] = Calloc(data_set->nrows,unsigned int);
-      break;
-    case 6: data_set->Data[i] = Calloc(data_set->nrows,float);
-      break;
-/*    case 7: data_set->Data[i] = Calloc(data_set->nrows,double);
-      break; */
-    case 7: data_set->Data[i] = Calloc(data_set->nrows,ASTRING);
-      break;
-    case 8: data_set->Data[i] = Calloc(data_set->nrows,AWSTRING);
-      break;
-    }
-    
+
+int gzread_generic_data_set(generic_data_set *data_set, gzFile instream){
+
+  if (!gzread_generic_data_set_header(data_set, instream)){
+    return 0;
   }
+  allocate_generic_data_set_rows(data_set);
   return 1;
 }
 
 
 
 
+/* gzread_blocks() callbacks for decoding whole rows and selected columns */
+
+typedef struct{
+  generic_data_set *data_set;
+  generic_data_set_index_entry *entry;
+  const int *offset;
+  int row_size;
+  double **values;
+} generic_rows_destination;
+
+
+static int gzdecode_generic_rows_block(const unsigned char *block, size_t first_row, size_t n_rows, void *arg){
+
+  generic_rows_destination *dest = (generic_rows_destination *)arg;
+
+  decode_generic_rows(dest->data_set, block, (int)first_row, (int)n_rows, dest->row_size);
+  return 0;
+}
+
+
+static int gzdecode_generic_columns_block(const unsigned char *block, size_t first_row, size_t n_rows, void *arg){
+
+  generic_rows_destination *dest = (generic_rows_destination *)arg;
+
+  decode_generic_columns_double(dest->entry, dest->offset, dest->row_size, block, (int)n_rows, dest->values, (int)first_row);
+  return 0;
+}
+
+
+/* for gzread_generic_data_set_column_blocks(), values is GENERIC_ROW_BLOCK long */
+
+typedef struct{
+  uint8_t type;
+  int offset;
+  int row_size;
+  double *values;
+  generic_column_sink sink;
+  void *arg;
+} generic_column_blocks;
+
+
+static int gzdecode_generic_column_block(const unsigned char *block, size_t first_row, size_t n_rows, void *arg){
+
+  generic_column_blocks *dest = (generic_column_blocks *)arg;
+  size_t done, n;
+
+  for (done = 0; done < n_rows; done += n){
+    n = n_rows - done;
+    if (n > GENERIC_ROW_BLOCK){
+      n = GENERIC_ROW_BLOCK;
+    }
+    decode_generic_column_double(dest->type, block + done*dest->row_size + dest->offset, (int)n, dest->row_size, dest->values, 0);
+    dest->sink(dest->values, first_row + done, n, dest->arg);
+  }
+  return 0;
+}
+
+
+static int gzread_generic_data_set_rows_fixed(generic_data_set *data_set, gzFile instream, int row_size){
+
+  generic_rows_destination dest;
+
+  dest.data_set = data_set;
+  dest.row_size = row_size;
+
+  return (gzread_blocks(instream, (size_t)row_size, (size_t)data_set->nrows, gzdecode_generic_rows_block, &dest) == (size_t)data_set->nrows);
+}
+
+
 int gzread_generic_data_set_rows(generic_data_set *data_set, gzFile instream){
 
   int i,j;
+  int row_size = generic_fixed_row_size(data_set);
+
+  if (row_size > 0){
+    return gzread_generic_data_set_rows_fixed(data_set, instream, row_size);
+  }
   
   for (i=0; i < data_set->nrows; i++){
     for (j=0; j < data_set->ncols; j++){
@@ -1230,6 +2115,421 @@ int gzread_generic_data_set_rows(generic_data_set *data_set, gzFile instream){
 
 
 
+/*****************************************************************
+ **
+ ** Data set index for gzipped files. See the non gzipped versions
+ ** above.
+ **
+ *****************************************************************/
+
+void gzinit_generic_data_set_index(generic_data_set_index *index, gzFile instream){
+  init_data_set_index(index, (uint32_t)gztell(instream));
+}
+
+
+static generic_data_set_index_entry *gzindex_next_data_set(generic_data_set_index *index, gzFile instream){
+
+  generic_data_group data_group;
+  generic_data_set data_set;
+  generic_data_set_index_entry *entry;
+
+  while (index->n_data_sets_left <= 0){
+    if (!index->more_data_groups){
+      return NULL;
+    }
+    gzseek(instream, index->next_data_group_pos, SEEK_SET);
+    if (!gzread_generic_data_group(&data_group, instream)){
+      end_data_set_index(index);
+      return NULL;
+    }
+    index_data_group(index, &data_group, (uint32_t)gztell(instream));
+    Free_generic_data_group(&data_group);
+  }
+
+  gzseek(instream, index->next_data_set_pos, SEEK_SET);
+  if (!gzread_generic_data_set_header(&data_set, instream)){
+    end_data_set_index(index);
+    return NULL;
+  }
+  entry = index_data_set(index, &data_set);
+  Free_generic_data_set_header(&data_set);
+
+  return entry;
+}
+
+
+generic_data_set_index_entry *gzfind_generic_data_set(generic_data_set_index *index, const char *name, gzFile instream){
+
+  generic_data_set_index_entry *entry = lookup_data_set_index(index, name);
+
+  if (entry != NULL){
+    return entry;
+  }
+  while ((entry = gzindex_next_data_set(index, instream)) != NULL){
+    if (strcmp(entry->name, name) == 0){
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+
+generic_data_set_index_entry *gzget_generic_data_set(generic_data_set_index *index, int n, gzFile instream){
+
+  while (index->n_data_sets <= n){
+    if (gzindex_next_data_set(index, instream) == NULL){
+      return NULL;
+    }
+  }
+  return index->data_sets[n];
+}
+
+
+int gzread_generic_data_set_columns(generic_data_set_index *index, generic_data_set_index_entry *entry, double **values, gzFile instream){
+
+  int *offset = Calloc(entry->ncols, int);
+  int row_size = generic_column_layout(entry, offset);
+  int result;
+  generic_rows_destination dest;
+
+  if (row_size == 0){
+    Free(offset);
+    return 0;
+  }
+
+  gzseek(instream, entry->file_pos_first, SEEK_SET);
+
+  dest.entry = entry;
+  dest.offset = offset;
+  dest.row_size = row_size;
+  dest.values = values;
+  result = (gzread_blocks(instream, (size_t)row_size, (size_t)entry->nrows, gzdecode_generic_columns_block, &dest) == (size_t)entry->nrows);
+
+  Free(offset);
+  return result;
+}
+
+
+int gzread_generic_data_set_column_blocks(generic_data_set_index *index, generic_data_set_index_entry *entry, int col, generic_column_sink sink, void *arg, gzFile instream){
+
+  int *offset;
+  int row_size;
+  int result;
+  generic_column_blocks dest;
+
+  if (col < 0 || col >= (int)entry->ncols){
+    return 0;
+  }
+  offset = Calloc(entry->ncols, int);
+  row_size = generic_column_layout(entry, offset);
+  if (row_size == 0){
+    Free(offset);
+    return 0;
+  }
+
+  gzseek(instream, entry->file_pos_first, SEEK_SET);
+
+  dest.type = entry->col_type[col];
+  dest.offset = offset[col];
+  dest.row_size = row_size;
+  dest.values = Calloc(GENERIC_ROW_BLOCK, double);
+  dest.sink = sink;
+  dest.arg = arg;
+  result = (gzread_blocks(instream, (size_t)row_size, (size_t)entry->nrows, gzdecode_generic_column_block, &dest) == (size_t)entry->nrows);
+
+  Free(dest.values);
+  Free(offset);
+  return result;
+}
+
+
+
+
+
+
+/*****************************************************************************
+ **
+ ** Reading a data header for a few named values only
+ **
+ ** read_generic_data_header_selected() and gzread_generic_data_header_selected()
+ ** read a data header as read_generic_data_header() does, but keep only
+ ** the triplets named in names, the first of each name in the order
+ ** find_nvt() searches (the header, then each parent header with its
+ ** parents in turn). The triplets are all kept in data_header itself,
+ ** which is left with no parent headers. All other triplets, and the
+ ** parent headers once every name has been found, are skipped over by
+ ** their lengths without being decoded. On return the stream is at the
+ ** end of the data header, as after read_generic_data_header().
+ **
+ ** The names are compared with the UTF-16 names in the file byte by
+ ** byte, so must be ASCII (as all the affymetrix- names are).
+ **
+ *****************************************************************************/
+
+typedef struct{
+  int (*read_int32)(void *stream, int32_t *value);
+  int (*read_bytes)(void *stream, char *buffer, int n);
+  int (*skip)(void *stream, int n);
+} header_stream;
+
+
+typedef struct{
+  const char **names;
+  int *name_len;
+  char *found;
+  int n_names;
+  int n_left;
+  char *buffer;                 /* room for the longest name, as UTF-16 */
+  generic_data_header *data_header;
+} nvt_selection;
+
+
+static int file_read_int32(void *stream, int32_t *value){
+  return fread_be_int32(value, 1, (FILE *)stream) == 1;
+}
+
+static int file_read_bytes(void *stream, char *buffer, int n){
+  return fread(buffer, 1, n, (FILE *)stream) == (size_t)n;
+}
+
+static int file_skip(void *stream, int n){
+  return fseek((FILE *)stream, n, SEEK_CUR) == 0;
+}
+
+/* gzread_be_int32() returns the number of bytes read */
+
+static int gz_read_int32(void *stream, int32_t *value){
+  return gzread_be_int32(value, 1, (gzFile)stream) == sizeof(int32_t);
+}
+
+static int gz_read_bytes(void *stream, char *buffer, int n){
+  return gzread((gzFile)stream, buffer, n) == n;
+}
+
+static int gz_skip(void *stream, int n){
+  return gzseek((gzFile)stream, n, SEEK_CUR) >= 0;
+}
+
+static const header_stream file_header_stream = {file_read_int32, file_read_bytes, file_skip};
+static const header_stream gz_header_stream = {gz_read_int32, gz_read_bytes, gz_skip};
+
+
+/* skips a STRING (char_size 1) or WSTRING (char_size 2) */
+
+static int skip_header_string(const header_stream *hs, void *stream, int char_size){
+  int32_t len;
+
+  if (!hs->read_int32(stream, &len) || len < 0){
+    return 0;
+  }
+  return len == 0 || hs->skip(stream, char_size*len);
+}
+
+
+static int stream_ASTRING(const header_stream *hs, void *stream, ASTRING *destination){
+
+  destination->value = 0;
+  if (!hs->read_int32(stream, &(destination->len)) || destination->len < 0){
+    return 0;
+  }
+  if (destination->len > 0){
+    destination->value = Calloc(destination->len+1, char);
+    return hs->read_bytes(stream, destination->value, destination->len);
+  }
+  return 1;
+}
+
+
+static void decode_AWSTRING_bytes(AWSTRING *destination, const unsigned char *bytes, int len){
+
+  destination->len = len;
+  destination->value = 0;
+  if (len > 0){
+    destination->value = Calloc(len+1, wchar_t);
+    decode_UTF16BE(destination->value, bytes, len);
+  }
+}
+
+
+static int stream_AWSTRING(const header_stream *hs, void *stream, AWSTRING *destination){
+  int32_t len;
+  char *bytes;
+  int ok;
+
+  destination->len = 0;
+  destination->value = 0;
+  if (!hs->read_int32(stream, &len) || len < 0){
+    return 0;
+  }
+  if (len == 0){
+    return 1;
+  }
+  bytes = Calloc(2*len, char);
+  ok = hs->read_bytes(stream, bytes, 2*len);
+  if (ok){
+    decode_AWSTRING_bytes(destination, (unsigned char *)bytes, len);
+  }
+  Free(bytes);
+  return ok;
+}
+
+
+/* which wanted name the UTF-16 name in sel->buffer is, or -1 */
+
+static int selected_nvt_name(const nvt_selection *sel, int len){
+  int k, j;
+  const unsigned char *bytes = (const unsigned char *)sel->buffer;
+
+  for (k = 0; k < sel->n_names; k++){
+    if (sel->found[k] || sel->name_len[k] != len){
+      continue;
+    }
+    for (j = 0; j < len; j++){
+      if (bytes[2*j] != 0 || bytes[2*j+1] != (unsigned char)sel->names[k][j]){
+	break;
+      }
+    }
+    if (j == len){
+      return k;
+    }
+  }
+  return -1;
+}
+
+
+static int name_len_wanted(const nvt_selection *sel, int len){
+  int k;
+
+  for (k = 0; k < sel->n_names; k++){
+    if (!sel->found[k] && sel->name_len[k] == len){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+static int select_nvt_triplets(const header_stream *hs, void *stream, nvt_selection *sel){
+  int32_t n_triplets, len;
+  int i, k;
+  nvt_triplet *triplet;
+  generic_data_header *data_header = sel->data_header;
+
+  if (!hs->read_int32(stream, &n_triplets) || n_triplets < 0){
+    return 0;
+  }
+  for (i = 0; i < n_triplets; i++){
+    if (!hs->read_int32(stream, &len) || len < 0){
+      return 0;
+    }
+    k = -1;
+    if (name_len_wanted(sel, len)){
+      if (!hs->read_bytes(stream, sel->buffer, 2*len)){
+	return 0;
+      }
+      k = selected_nvt_name(sel, len);
+    } else if (len > 0 && !hs->skip(stream, 2*len)){
+      return 0;
+    }
+    if (k < 0){
+      if (!skip_header_string(hs, stream, 1) || !skip_header_string(hs, stream, 2)){
+	return 0;
+      }
+      continue;
+    }
+    triplet = &(data_header->name_type_value[data_header->n_name_type_value]);
+    decode_AWSTRING_bytes(&(triplet->name), (unsigned char *)sel->buffer, len);
+    data_header->n_name_type_value++;
+    if (!stream_ASTRING(hs, stream, &(triplet->value)) ||
+	!stream_AWSTRING(hs, stream, &(triplet->type))){
+      return 0;
+    }
+    sel->found[k] = 1;
+    sel->n_left--;
+  }
+  return 1;
+}
+
+
+/* the top level header keeps its strings, parent headers are only searched for triplets */
+
+static int select_data_header(const header_stream *hs, void *stream, nvt_selection *sel, int top_level){
+  int32_t n_parent_headers;
+  int i;
+  generic_data_header *data_header = sel->data_header;
+
+  if (top_level){
+    if (!stream_ASTRING(hs, stream, &(data_header->data_type_id)) ||
+	!stream_ASTRING(hs, stream, &(data_header->unique_file_id)) ||
+	!stream_AWSTRING(hs, stream, &(data_header->Date_time)) ||
+	!stream_AWSTRING(hs, stream, &(data_header->locale))){
+      return 0;
+    }
+  } else {
+    if (!skip_header_string(hs, stream, 1) ||
+	!skip_header_string(hs, stream, 1) ||
+	!skip_header_string(hs, stream, 2) ||
+	!skip_header_string(hs, stream, 2)){
+      return 0;
+    }
+  }
+
+  if (!select_nvt_triplets(hs, stream, sel)){
+    return 0;
+  }
+
+  if (!hs->read_int32(stream, &n_parent_headers) || n_parent_headers < 0){
+    return 0;
+  }
+  for (i = 0; i < n_parent_headers; i++){
+    if (!select_data_header(hs, stream, sel, 0)){
+      return 0;
+    }
+  }
+  return 1;
+}
+
+
+static int read_data_header_selected(const header_stream *hs, void *stream, generic_data_header *data_header, const char **names, int n_names){
+  nvt_selection sel;
+  int k, max_len = 0, result;
+
+  memset(data_header, 0, sizeof(generic_data_header));
+  data_header->name_type_value = Calloc(n_names > 0 ? n_names : 1, nvt_triplet);
+
+  sel.names = names;
+  sel.n_names = n_names;
+  sel.n_left = n_names;
+  sel.name_len = Calloc(n_names > 0 ? n_names : 1, int);
+  sel.found = Calloc(n_names > 0 ? n_names : 1, char);
+  for (k = 0; k < n_names; k++){
+    sel.name_len[k] = strlen(names[k]);
+    if (sel.name_len[k] > max_len){
+      max_len = sel.name_len[k];
+    }
+  }
+  sel.buffer = Calloc(2*max_len + 1, char);
+  sel.data_header = data_header;
+
+  result = select_data_header(hs, stream, &sel, 1);
+
+  Free(sel.buffer);
+  Free(sel.found);
+  Free(sel.name_len);
+  return result;
+}
+
+
+int read_generic_data_header_selected(generic_data_header *data_header, const char **names, int n_names, FILE *instream){
+  return read_data_header_selected(&file_header_stream, instream, data_header, names, n_names);
+}
+
+
+int gzread_generic_data_header_selected(generic_data_header *data_header, const char **names, int n_names, gzFile instream){
+  return read_data_header_selected(&gz_header_stream, instream, data_header, names, n_names);
+}
+
+
 
 
 
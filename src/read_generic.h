@@ -1,3 +1,5 @@
+#ifndef READ_GENERIC_H
+#define READ_GENERIC_H
 
 #include <zlib.h>
 #include <stdint.h>
@@ -52,6 +54,9 @@ typedef struct{
 
 typedef struct generic_data_header *generic_data_header_pointer;
 
+/* hash table of triplet names, see find_nvt() */
+typedef struct nvt_name_index nvt_name_index;
+
 typedef struct{
   ASTRING data_type_id;         /*Stored in file as INT followed by CHAR array */
   ASTRING unique_file_id;       /*See above */
@@ -61,6 +66,7 @@ typedef struct{
   nvt_triplet *name_type_value;
   int32_t n_parent_headers;
   void **parent_headers;
+  nvt_name_index *name_index;   /* built by find_nvt(), 0 until then */
 } generic_data_header;
 
 
@@ -99,6 +105,41 @@ typedef struct {
 
 
 
+/* Data set index */
+
+typedef struct {
+  char *name;
+  int data_group;            /* which data group the data set is in */
+  uint32_t file_pos_first;   /* where the rows begin */
+  uint32_t file_pos_last;
+  uint32_t ncols;
+  uint8_t *col_type;
+  int32_t *col_size;
+  uint32_t nrows;
+} generic_data_set_index_entry;
+
+
+typedef struct {
+  int n_data_sets;
+  int max_data_sets;
+  generic_data_set_index_entry **data_sets;
+  int cur_data_group;
+  char **data_group_names;       /* of data groups 0 to cur_data_group */
+  int32_t n_data_sets_left;      /* not yet indexed in the current data group */
+  uint32_t next_data_set_pos;
+  uint32_t next_data_group_pos;
+  int more_data_groups;
+  const unsigned char *mapped;   /* the file mapped into memory, or NULL */
+  size_t mapped_size;
+} generic_data_set_index;
+
+
+/* receives the values of rows first_row to first_row + n_rows - 1 of a data set column */
+
+typedef void (*generic_column_sink)(const double *values, size_t first_row, size_t n_rows, void *arg);
+
+
+
 
 typedef enum{
   
@@ -124,10 +165,18 @@ nvt_triplet* find_nvt(generic_data_header *data_header,char *name);
 
 int read_generic_file_header(generic_file_header* file_header, FILE *instream);
 int read_generic_data_header(generic_data_header *data_header, FILE *instream);
+int read_generic_data_header_selected(generic_data_header *data_header, const char **names, int n_names, FILE *instream);
 int read_generic_data_group(generic_data_group *data_group, FILE *instream);
 int read_generic_data_set(generic_data_set *data_set, FILE *instream);
 int read_generic_data_set_rows(generic_data_set *data_set, FILE *instream);
 
+void init_generic_data_set_index(generic_data_set_index *index, FILE *instream);
+generic_data_set_index_entry *find_generic_data_set(generic_data_set_index *index, const char *name, FILE *instream);
+generic_data_set_index_entry *get_generic_data_set(generic_data_set_index *index, int n, FILE *instream);
+int read_generic_data_set_columns(generic_data_set_index *index, generic_data_set_index_entry *entry, double **values, FILE *instream);
+int read_generic_data_set_column_blocks(generic_data_set_index *index, generic_data_set_index_entry *entry, int col, generic_column_sink sink, void *arg, FILE *instream);
+void Free_generic_data_set_index(generic_data_set_index *index);
+
   
 void Free_generic_data_header(generic_data_header *header);
 void Free_generic_data_group(generic_data_group *data_group);
@@ -136,6 +185,15 @@ void Free_generic_data_set(generic_data_set *data_set);
 
 int gzread_generic_file_header(generic_file_header* file_header, gzFile instream);
 int gzread_generic_data_header(generic_data_header *data_header, gzFile instream);
+int gzread_generic_data_header_selected(generic_data_header *data_header, const char **names, int n_names, gzFile instream);
 int gzread_generic_data_group(generic_data_group *data_group,gzFile instream);
 int gzread_generic_data_set(generic_data_set *data_set, gzFile instream);
 int gzread_generic_data_set_rows(generic_data_set *data_set, gzFile instream);
+
+void gzinit_generic_data_set_index(generic_data_set_index *index, gzFile instream);
+generic_data_set_index_entry *gzfind_generic_data_set(generic_data_set_index *index, const char *name, gzFile instream);
+generic_data_set_index_entry *gzget_generic_data_set(generic_data_set_index *index, int n, gzFile instream);
+int gzread_generic_data_set_columns(generic_data_set_index *index, generic_data_set_index_entry *entry, double **values, gzFile instream);
+int gzread_generic_data_set_column_blocks(generic_data_set_index *index, generic_data_set_index_entry *entry, int col, generic_column_sink sink, void *arg, gzFile instream);
+
+#endif
@@ -25,6 +25,14 @@
  ** May 18, 2009 - Add Ability to extract scan date from CEL file header
  ** May 25, 2010 - Multichannel CELfile support adapted from single channel parser
  ** Sep 4, 2017 - change gzFile* to gzFile
+ ** Oct 16, 2026 - add read_genericcel_file_channels(), gzread_genericcel_file_channels() which read
+ **                every channel in a single pass through the file. Masks were being stored
+ **                into the outliers in generic_get_masks_outliers_multichannel()
+ ** Oct 16, 2026 - add read_genericcel_channel_stream(), read_genericcel_channel_blocks() and
+ **                genericcel_channel_apply_masks_stream() (and gz versions) so that the batch
+ **                readers can read each channel through a data set index
+ ** Oct 16, 2026 - isGenericMultiChannelCelFile() and isgzGenericMultiChannelCelFile() read only
+ **                the data type from the data header
  **
  *************************************************************/
 #include <R.h>
@@ -41,10 +49,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <zlib.h>
 
+#include "fread_functions.h"
 #include "read_generic.h"
 #include "read_celfile_generic.h"
+#include "mmap_functions.h"
 #include "read_multichannel_celfile_generic.h"
 #include "read_abatch.h"
 
@@ -65,7 +76,7 @@ int isGenericMultiChannelCelFile(const char *filename){
     return 0;
   }
 
-  if (!read_generic_data_header(&data_header,infile)){
+  if (!read_generic_data_header_selected(&data_header,NULL,0,infile)){
     Free_generic_data_header(&data_header);
     fclose(infile);
     return 0;
@@ -474,8 +485,8 @@ void generic_get_masks_outliers_multichannel(const char *filename, int *nmasks,
   
   read_generic_data_set_rows(&my_data_set,infile); 
   for (i=0; i < my_data_set.nrows; i++){
-    (*outliers_x)[i] = ((short *)my_data_set.Data[0])[i];
-    (*outliers_y)[i] = ((short *)my_data_set.Data[1])[i];
+    (*masks_x)[i] = ((short *)my_data_set.Data[0])[i];
+    (*masks_y)[i] = ((short *)my_data_set.Data[1])[i];
   }
   Free_generic_data_set(&my_data_set);
   Free_generic_data_header(&my_data_header);
@@ -580,6 +591,431 @@ void generic_apply_masks_multichannel(const char *filename, double *intensity, i
   
 }
 
+/*************************************************************
+ **
+ ** Reading every channel in one pass
+ **
+ ** The functions above each reopen the file and skip forward to
+ ** the channel wanted, so reading a whole multichannel file with
+ ** them goes through it many times over. read_genericcel_file_channels()
+ ** instead walks the data groups once, in the order they are in the
+ ** file, and decodes the intensity, stddev, npixels, outliers and masks
+ ** of every channel as it comes to them.
+ **
+ ** A channel is a data group with an "Intensity" data set, its name
+ ** being the name of the data group. Within a data group the data sets
+ ** are recognised by name or failing that by their position, as for
+ ** single channel files.
+ **
+ *************************************************************/
+
+static const char *multichannel_data_set_names[] = {"Intensity", "StdDev", "Pixel", "Outlier", "Mask"};
+
+
+typedef generic_data_set_index_entry *(*channel_get_data_set)(generic_data_set_index *index, int n, void *infile);
+typedef int (*channel_read_columns)(generic_data_set_index *index, generic_data_set_index_entry *entry, double **values, void *infile);
+
+
+static int multichannel_data_set_which(const char *name, int position){
+
+  int which;
+
+  for (which=0; which < 5; which++){
+    if (strcmp(name, multichannel_data_set_names[which]) == 0){
+      return which;
+    }
+  }
+  return (position < 5 ? position : -1);
+}
+
+
+static void add_channel(multichannel_cel *channels, int *max_channels, const char *name, size_t n_cells, int read_intensities_only){
+
+  int c = channels->n_channels;
+
+  if (c == *max_channels){
+    *max_channels = (*max_channels == 0 ? 2 : 2*(*max_channels));
+    channels->channelnames = Realloc(channels->channelnames, *max_channels, char *);
+    channels->intensities = Realloc(channels->intensities, *max_channels, double *);
+    channels->nmasks = Realloc(channels->nmasks, *max_channels, int);
+    channels->masks_x = Realloc(channels->masks_x, *max_channels, short *);
+    channels->masks_y = Realloc(channels->masks_y, *max_channels, short *);
+    channels->noutliers = Realloc(channels->noutliers, *max_channels, int);
+    channels->outliers_x = Realloc(channels->outliers_x, *max_channels, short *);
+    channels->outliers_y = Realloc(channels->outliers_y, *max_channels, short *);
+    if (!read_intensities_only){
+      channels->stddev = Realloc(channels->stddev, *max_channels, double *);
+      channels->npixels = Realloc(channels->npixels, *max_channels, double *);
+    }
+  }
+
+  channels->channelnames[c] = Calloc(strlen(name) + 1, char);
+  strcpy(channels->channelnames[c], name);
+  channels->intensities[c] = Calloc(n_cells, double);
+  if (!read_intensities_only){
+    channels->stddev[c] = Calloc(n_cells, double);
+    channels->npixels[c] = Calloc(n_cells, double);
+  }
+  channels->nmasks[c] = 0;
+  channels->masks_x[c] = NULL;
+  channels->masks_y[c] = NULL;
+  channels->noutliers[c] = 0;
+  channels->outliers_x[c] = NULL;
+  channels->outliers_y[c] = NULL;
+  channels->n_channels++;
+}
+
+
+/* reads the x, y columns of an "Outlier" or "Mask" data set */
+
+static int read_channel_locations(generic_data_set_index *index, generic_data_set_index_entry *entry, channel_read_columns read_columns, void *infile, int *n, short **x, short **y){
+
+  int i, ok;
+  double **values;
+
+  if (*x != NULL || entry->ncols < 2){
+    return 1;
+  }
+
+  values = Calloc(entry->ncols, double *);
+  values[0] = Calloc(entry->nrows, double);
+  values[1] = Calloc(entry->nrows, double);
+  ok = read_columns(index, entry, values, infile);
+
+  *n = entry->nrows;
+  *x = Calloc(entry->nrows, short);
+  *y = Calloc(entry->nrows, short);
+  for (i=0; i < entry->nrows; i++){
+    (*x)[i] = (short)values[0][i];
+    (*y)[i] = (short)values[1][i];
+  }
+
+  Free(values[0]);
+  Free(values[1]);
+  Free(values);
+  return ok;
+}
+
+
+static int read_channel_values(generic_data_set_index *index, generic_data_set_index_entry *entry, channel_read_columns read_columns, void *infile, double *x, size_t n_cells){
+
+  int ok;
+  double **values;
+
+  if (entry->ncols < 1 || entry->nrows > n_cells){
+    return 0;
+  }
+  values = Calloc(entry->ncols, double *);
+  values[0] = x;
+  ok = read_columns(index, entry, values, infile);
+  Free(values);
+  return ok;
+}
+
+
+/*************************************************************
+ **
+ ** static int read_channels(generic_data_set_index *index, void *infile, 
+ **                          channel_get_data_set get_data_set, channel_read_columns read_columns,
+ **                          size_t n_cells, int read_intensities_only, multichannel_cel *channels)
+ **
+ ** the single pass itself, shared by the plain and gzipped readers
+ ** which supply the data set lookup and column reading functions.
+ ** Returns 1 if there were no channels or a data set could not be 
+ ** read, 0 otherwise.
+ **
+ *************************************************************/
+
+static int read_channels(generic_data_set_index *index, void *infile, channel_get_data_set get_data_set, channel_read_columns read_columns, size_t n_cells, int read_intensities_only, multichannel_cel *channels){
+
+  int n, which, c = -1;
+  int group = -1, first = 0, max_channels = 0;
+  int ok = 1;
+  generic_data_set_index_entry *entry;
+
+  memset(channels, 0, sizeof(multichannel_cel));
+
+  for (n=0; (entry = get_data_set(index, n, infile)) != NULL; n++){
+    if (entry->data_group != group){
+      group = entry->data_group;
+      first = n;
+      c = -1;
+    }
+    which = multichannel_data_set_which(entry->name, n - first);
+    if (c < 0){
+      if (strcmp(entry->name, "Intensity") != 0){
+	continue;
+      }
+      add_channel(channels, &max_channels, index->data_group_names[group], n_cells, read_intensities_only);
+      c = channels->n_channels - 1;
+    }
+
+    switch(which){
+    case MULTICHANNEL_INTENSITY:
+      ok&= read_channel_values(index, entry, read_columns, infile, channels->intensities[c], n_cells);
+      break;
+    case MULTICHANNEL_STDDEV:
+      if (!read_intensities_only){
+	ok&= read_channel_values(index, entry, read_columns, infile, channels->stddev[c], n_cells);
+      }
+      break;
+    case MULTICHANNEL_NPIXELS:
+      if (!read_intensities_only){
+	ok&= read_channel_values(index, entry, read_columns, infile, channels->npixels[c], n_cells);
+      }
+      break;
+    case MULTICHANNEL_OUTLIER:
+      ok&= read_channel_locations(index, entry, read_columns, infile, &channels->noutliers[c], &channels->outliers_x[c], &channels->outliers_y[c]);
+      break;
+    case MULTICHANNEL_MASK:
+      ok&= read_channel_locations(index, entry, read_columns, infile, &channels->nmasks[c], &channels->masks_x[c], &channels->masks_y[c]);
+      break;
+    }
+  }
+
+  return (!ok || channels->n_channels == 0);
+}
+
+
+/*************************************************************
+ **
+ ** Reading a single channel through a data set index
+ **
+ ** The batch readers (read_abatch.c) keep an index of the data sets
+ ** of each file, as for single channel files, and read the channels
+ ** one after another through it. Since each channel follows the one 
+ ** before it in the file the file is still only read through once.
+ **
+ ** Channel k is the k'th data group of the file, as for
+ ** multichannel_determine_channel_name(). which is one of the 
+ ** MULTICHANNEL_ values.
+ **
+ *************************************************************/
+
+static generic_data_set_index_entry *find_channel_data_set(generic_data_set_index *index, int channel, int which, void *infile, channel_get_data_set get_data_set){
+
+  int n, first = -1;
+  generic_data_set_index_entry *entry, *by_position = NULL;
+
+  for (n=0; (entry = get_data_set(index, n, infile)) != NULL; n++){
+    if (entry->data_group < channel){
+      continue;
+    }
+    if (entry->data_group > channel){
+      break;
+    }
+    if (first < 0){
+      first = n;
+    }
+    if (strcmp(entry->name, multichannel_data_set_names[which]) == 0){
+      return entry;
+    }
+    if (n - first == which){
+      by_position = entry;
+    }
+  }
+  return by_position;
+}
+
+
+/* sets the cells listed in an "Outlier" or "Mask" data set to NA */
+
+static void channel_set_NA(generic_data_set_index *index, generic_data_set_index_entry *entry, channel_read_columns read_columns, void *infile, int nrows, double *intensity, size_t chip_num, size_t rows){
+
+  int i;
+  size_t cur_index;
+  double **values;
+
+  if (entry == NULL || entry->ncols < 2){
+    return;
+  }
+
+  values = Calloc(entry->ncols, double *);
+  values[0] = Calloc(entry->nrows, double);
+  values[1] = Calloc(entry->nrows, double);
+  read_columns(index, entry, values, infile);
+
+  for (i=0; i < entry->nrows; i++){
+    cur_index = (size_t)values[0][i] + (size_t)nrows*(size_t)values[1][i];
+    if (cur_index < rows){
+      intensity[chip_num*rows + cur_index] = R_NaN;
+    }
+  }
+
+  Free(values[0]);
+  Free(values[1]);
+  Free(values);
+}
+
+
+static generic_data_set_index_entry *channel_get_data_set_file(generic_data_set_index *index, int n, void *infile){
+  return get_generic_data_set(index, n, (FILE *)infile);
+}
+
+
+static int channel_read_columns_file(generic_data_set_index *index, generic_data_set_index_entry *entry, double **values, void *infile){
+  return read_generic_data_set_columns(index, entry, values, (FILE *)infile);
+}
+
+
+/*************************************************************
+ **
+ ** int read_genericcel_file_channels(const char *filename, size_t n_cells, int read_intensities_only, 
+ **                                   multichannel_cel *channels)
+ **
+ ** const char *filename - a command console multichannel CEL file
+ ** size_t n_cells - number of cells on the chip (rows*cols)
+ ** int read_intensities_only - if true stddev and npixels are not read
+ **                             (and channels->stddev, npixels are NULL)
+ ** multichannel_cel *channels - filled in with the channel names and
+ **                              the contents of each channel
+ **
+ ** reads all channels of the file in one pass. Returns 1 if the 
+ ** file could not be read completely, 0 otherwise. The caller owns
+ ** everything allocated in channels, Free_multichannel_cel() frees it.
+ **
+ *************************************************************/
+
+int read_genericcel_file_channels(const char *filename, size_t n_cells, int read_intensities_only, multichannel_cel *channels){
+
+  int status;
+
+  FILE *infile;
+  generic_file_header my_header;
+  generic_data_header my_data_header;
+  generic_data_set_index index;
+  mapped_file map;
+
+  if ((infile = fopen(filename, "rb")) == NULL)
+    {
+      error("Unable to open the file %s\n",filename);
+      return 1;
+    }
+
+  read_generic_file_header(&my_header, infile);
+  read_generic_data_header(&my_data_header, infile);
+  Free_generic_data_header(&my_data_header);
+
+  init_generic_data_set_index(&index, infile);
+  if (map_file(filename, &map)){
+    index.mapped = map.data;
+    index.mapped_size = map.size;
+  }
+
+  status = read_channels(&index, infile, channel_get_data_set_file, channel_read_columns_file, n_cells, read_intensities_only, channels);
+
+  Free_generic_data_set_index(&index);
+  unmap_file(&map);
+  fclose(infile);
+
+  return status;
+}
+
+
+void Free_multichannel_cel(multichannel_cel *channels){
+
+  int c;
+
+  for (c=0; c < channels->n_channels; c++){
+    Free(channels->channelnames[c]);
+    Free(channels->intensities[c]);
+    if (channels->stddev != NULL){
+      Free(channels->stddev[c]);
+      Free(channels->npixels[c]);
+    }
+    Free(channels->masks_x[c]);
+    Free(channels->masks_y[c]);
+    Free(channels->outliers_x[c]);
+    Free(channels->outliers_y[c]);
+  }
+  Free(channels->channelnames);
+  Free(channels->intensities);
+  Free(channels->stddev);
+  Free(channels->npixels);
+  Free(channels->nmasks);
+  Free(channels->masks_x);
+  Free(channels->masks_y);
+  Free(channels->noutliers);
+  Free(channels->outliers_x);
+  Free(channels->outliers_y);
+  channels->n_channels = 0;
+}
+
+
+/*************************************************************
+ **
+ ** int read_genericcel_channel_stream(FILE *infile, generic_data_set_index *index, int channel, 
+ **                                    int which, double *intensity, size_t chip_num)
+ **
+ ** FILE *infile - an open command console multichannel CEL file
+ ** generic_data_set_index *index - index of the data sets of infile
+ ** int channel - which channel (from 0)
+ ** int which - MULTICHANNEL_INTENSITY, MULTICHANNEL_STDDEV or MULTICHANNEL_NPIXELS
+ **
+ ** reads the values of a channel into column chip_num of the data
+ ** matrix. Returns 1 if there is no such channel or it could not be
+ ** read, 0 otherwise.
+ **
+ *************************************************************/
+
+int read_genericcel_channel_stream(FILE *infile, generic_data_set_index *index, int channel, int which, double *intensity, size_t chip_num){
+
+  int ok;
+  double **values;
+  generic_data_set_index_entry *entry = find_channel_data_set(index, channel, which, (void *)infile, channel_get_data_set_file);
+
+  if (entry == NULL || entry->ncols < 1){
+    return 1;
+  }
+  values = Calloc(entry->ncols, double *);
+  values[0] = &intensity[chip_num*entry->nrows];
+  ok = read_generic_data_set_columns(index, entry, values, infile);
+  Free(values);
+
+  return !ok;
+}
+
+
+/* as read_genericcel_channel_stream() but the intensities are handed to sink a block at a time */
+
+int read_genericcel_channel_blocks(FILE *infile, generic_data_set_index *index, int channel, generic_column_sink sink, void *arg){
+
+  generic_data_set_index_entry *entry = find_channel_data_set(index, channel, MULTICHANNEL_INTENSITY, (void *)infile, channel_get_data_set_file);
+
+  if (entry == NULL || entry->ncols < 1){
+    return 1;
+  }
+  return !read_generic_data_set_column_blocks(index, entry, 0, sink, arg, infile);
+}
+
+
+/*************************************************************
+ **
+ ** void genericcel_channel_apply_masks_stream(FILE *infile, generic_data_set_index *index, int channel, int nrows,
+ **                                           double *intensity, size_t chip_num, size_t rows, 
+ **                                           int rm_mask, int rm_outliers)
+ **
+ ** int nrows - rows on the chip
+ ** size_t rows - cells on the chip
+ **
+ ** sets the MASKS and/or OUTLIERS of a channel to NA in column chip_num
+ ** of the data matrix.
+ **
+ *************************************************************/
+
+void genericcel_channel_apply_masks_stream(FILE *infile, generic_data_set_index *index, int channel, int nrows, double *intensity, size_t chip_num, size_t rows, int rm_mask, int rm_outliers){
+
+  if (rm_outliers){
+    channel_set_NA(index, find_channel_data_set(index, channel, MULTICHANNEL_OUTLIER, (void *)infile, channel_get_data_set_file), 
+		   channel_read_columns_file, (void *)infile, nrows, intensity, chip_num, rows);
+  }
+  if (rm_mask){
+    channel_set_NA(index, find_channel_data_set(index, channel, MULTICHANNEL_MASK, (void *)infile, channel_get_data_set_file), 
+		   channel_read_columns_file, (void *)infile, nrows, intensity, chip_num, rows);
+  }
+}
+
+
 /*******************************************************************************************************
  *******************************************************************************************************
  **
@@ -606,7 +1042,7 @@ int isgzGenericMultiChannelCelFile(const char *filename){
     return 0;
   }
 
-  if (!gzread_generic_data_header(&data_header,infile)){
+  if (!gzread_generic_data_header_selected(&data_header,NULL,0,infile)){
     Free_generic_data_header(&data_header);
     gzclose(infile);
     return 0;
@@ -744,7 +1180,7 @@ int gzread_genericcel_file_intensities_multichannel(const char *filename, double
 
   uint32_t next_group =1;  
 
-  if ((infile = gzopen(filename, "rb")) == NULL)
+  if ((infile = gzopen_buffered(filename, "rb")) == NULL)
     {
       error("Unable to open the file %s\n",filename);
       return 0;
@@ -797,7 +1233,7 @@ int gzread_genericcel_file_stddev_multichannel(const char *filename, double *int
 
   uint32_t next_group =1;  
 
-  if ((infile = gzopen(filename, "rb")) == NULL)
+  if ((infile = gzopen_buffered(filename, "rb")) == NULL)
     {
       error("Unable to open the file %s\n",filename);
       return 0;
@@ -856,7 +1292,7 @@ int gzread_genericcel_file_npixels_multichannel(const char *filename, double *in
 
   uint32_t next_group =1;  
 
-  if ((infile = gzopen(filename, "rb")) == NULL)
+  if ((infile = gzopen_buffered(filename, "rb")) == NULL)
     {
       error("Unable to open the file %s\n",filename);
       return 0;
@@ -987,8 +1423,8 @@ void gzgeneric_get_masks_outliers_multichannel(const char *filename, int *nmasks
   
   gzread_generic_data_set_rows(&my_data_set,infile); 
   for (i=0; i < my_data_set.nrows; i++){
-    (*outliers_x)[i] = ((short *)my_data_set.Data[0])[i];
-    (*outliers_y)[i] = ((short *)my_data_set.Data[1])[i];
+    (*masks_x)[i] = ((short *)my_data_set.Data[0])[i];
+    (*masks_y)[i] = ((short *)my_data_set.Data[1])[i];
   }
   Free_generic_data_set(&my_data_set);
   Free_generic_data_header(&my_data_header);
@@ -1092,4 +1528,100 @@ void gzgeneric_apply_masks_multichannel(const char *filename, double *intensity,
 }
 
 
+static generic_data_set_index_entry *channel_get_data_set_gz(generic_data_set_index *index, int n, void *infile){
+  return gzget_generic_data_set(index, n, (gzFile)infile);
+}
+
+
+static int channel_read_columns_gz(generic_data_set_index *index, generic_data_set_index_entry *entry, double **values, void *infile){
+  return gzread_generic_data_set_columns(index, entry, values, (gzFile)infile);
+}
+
+
+/*************************************************************
+ **
+ ** int gzread_genericcel_file_channels(const char *filename, size_t n_cells, int read_intensities_only, 
+ **                                     multichannel_cel *channels)
+ **
+ ** as read_genericcel_file_channels() but for a gzipped file. The
+ ** single pass matters more here as each reopening of the file meant
+ ** decompressing it from the start again.
+ **
+ *************************************************************/
+
+int gzread_genericcel_file_channels(const char *filename, size_t n_cells, int read_intensities_only, multichannel_cel *channels){
+
+  int status;
+
+  gzFile infile;
+  generic_file_header my_header;
+  generic_data_header my_data_header;
+  generic_data_set_index index;
+
+  if ((infile = gzopen_buffered(filename, "rb")) == NULL)
+    {
+      error("Unable to open the file %s\n",filename);
+      return 1;
+    }
+
+  gzread_generic_file_header(&my_header, infile);
+  gzread_generic_data_header(&my_data_header, infile);
+  Free_generic_data_header(&my_data_header);
+
+  gzinit_generic_data_set_index(&index, infile);
+
+  status = read_channels(&index, (void *)infile, channel_get_data_set_gz, channel_read_columns_gz, n_cells, read_intensities_only, channels);
+
+  Free_generic_data_set_index(&index);
+  gzclose(infile);
+
+  return status;
+}
+
+
+/* as read_genericcel_channel_stream() but for a gzipped file */
+
+int gzread_genericcel_channel_stream(gzFile infile, generic_data_set_index *index, int channel, int which, double *intensity, size_t chip_num){
+
+  int ok;
+  double **values;
+  generic_data_set_index_entry *entry = find_channel_data_set(index, channel, which, (void *)infile, channel_get_data_set_gz);
+
+  if (entry == NULL || entry->ncols < 1){
+    return 1;
+  }
+  values = Calloc(entry->ncols, double *);
+  values[0] = &intensity[chip_num*entry->nrows];
+  ok = gzread_generic_data_set_columns(index, entry, values, infile);
+  Free(values);
+
+  return !ok;
+}
+
 
+/* as read_genericcel_channel_blocks() but for a gzipped file */
+
+int gzread_genericcel_channel_blocks(gzFile infile, generic_data_set_index *index, int channel, generic_column_sink sink, void *arg){
+
+  generic_data_set_index_entry *entry = find_channel_data_set(index, channel, MULTICHANNEL_INTENSITY, (void *)infile, channel_get_data_set_gz);
+
+  if (entry == NULL || entry->ncols < 1){
+    return 1;
+  }
+  return !gzread_generic_data_set_column_blocks(index, entry, 0, sink, arg, infile);
+}
+
+
+/* as genericcel_channel_apply_masks_stream() but for a gzipped file */
+
+void gzgenericcel_channel_apply_masks_stream(gzFile infile, generic_data_set_index *index, int channel, int nrows, double *intensity, size_t chip_num, size_t rows, int rm_mask, int rm_outliers){
+
+  if (rm_outliers){
+    channel_set_NA(index, find_channel_data_set(index, channel, MULTICHANNEL_OUTLIER, (void *)infile, channel_get_data_set_gz), 
+		   channel_read_columns_gz, (void *)infile, nrows, intensity, chip_num, rows);
+  }
+  if (rm_mask){
+    channel_set_NA(index, find_channel_data_set(index, channel, MULTICHANNEL_MASK, (void *)infile, channel_get_data_set_gz), 
+		   channel_read_columns_gz, (void *)infile, nrows, intensity, chip_num, rows);
+  }
+}
@@ -1,7 +1,32 @@
 #ifndef READ_MULTICHANNEL_CELFILE_GENERIC_H
 #define READ_MULTICHANNEL_CELFILE_GENERIC_H
 
+#include <stdio.h>
+#include <zlib.h>
+
 #include "read_abatch.h"
+#include "read_generic.h"
+
+/* the data sets of each channel */
+#define MULTICHANNEL_INTENSITY 0
+#define MULTICHANNEL_STDDEV 1
+#define MULTICHANNEL_NPIXELS 2
+#define MULTICHANNEL_OUTLIER 3
+#define MULTICHANNEL_MASK 4
+
+/* the contents of every channel of a multichannel CEL file, see read_genericcel_file_channels() */
+
+typedef struct{
+  int n_channels;
+  char **channelnames;
+  double **intensities;
+  double **stddev;          /* NULL if only the intensities were read */
+  double **npixels;
+  int *nmasks;
+  short **masks_x, **masks_y;
+  int *noutliers;
+  short **outliers_x, **outliers_y;
+} multichannel_cel;
 
 int isGenericMultiChannelCelFile(const char *filename);
 int read_genericcel_file_intensities_multichannel(const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows, int channelindex);
@@ -11,6 +36,11 @@ void generic_get_masks_outliers_multichannel(const char *filename, int *nmasks,
 void generic_apply_masks_multichannel(const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows, int rm_mask, int rm_outliers, int channelindex);
 int multichannel_determine_number_channels(const char *filename);
 char *multichannel_determine_channel_name(const char *filename, int channelindex);
+int read_genericcel_file_channels(const char *filename, size_t n_cells, int read_intensities_only, multichannel_cel *channels);
+void Free_multichannel_cel(multichannel_cel *channels);
+int read_genericcel_channel_stream(FILE *infile, generic_data_set_index *index, int channel, int which, double *intensity, size_t chip_num);
+int read_genericcel_channel_blocks(FILE *infile, generic_data_set_index *index, int channel, generic_column_sink sink, void *arg);
+void genericcel_channel_apply_masks_stream(FILE *infile, generic_data_set_index *index, int channel, int nrows, double *intensity, size_t chip_num, size_t rows, int rm_mask, int rm_outliers);
 
 int isgzGenericMultiChannelCelFile(const char *filename);
 int gzread_genericcel_file_intensities_multichannel(const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows, int channelindex);
@@ -20,6 +50,10 @@ void gzgeneric_get_masks_outliers_multichannel(const char *filename, int *nmasks
 void gzgeneric_apply_masks_multichannel(const char *filename, double *intensity, int chip_num, int rows, int cols,int chip_dim_rows, int rm_mask, int rm_outliers, int channelindex);
 int gzmultichannel_determine_number_channels(const char *filename);
 char *gzmultichannel_determine_channel_name(const char *filename, int channelindex);
+int gzread_genericcel_file_channels(const char *filename, size_t n_cells, int read_intensities_only, multichannel_cel *channels);
+int gzread_genericcel_channel_stream(gzFile infile, generic_data_set_index *index, int channel, int which, double *intensity, size_t chip_num);
+int gzread_genericcel_channel_blocks(gzFile infile, generic_data_set_index *index, int channel, generic_column_sink sink, void *arg);
+void gzgenericcel_channel_apply_masks_stream(gzFile infile, generic_data_set_index *index, int channel, int nrows, double *intensity, size_t chip_num, size_t rows, int rm_mask, int rm_outliers);
 
 
 
@@ -13,19 +13,32 @@
  ** Dec 17. 2007 - add function for counting number of each type of probeset
  ** Dec 31, 2007 - add function which checks that all required fields are present
  ** Mar 18, 2008 - fix error in read_pgf_header function
+ ** Oct 16, 2026 - store probesets, atoms and probes as arrays rather than linked lists
+ **                (appending had to walk each list), with their strings in one pool.
+ **                tokenize() splits a line in place rather than copying each token
+ ** Oct 16, 2026 - add R_read_pgf_file, returning the probesets, atoms and probes as
+ **                column vectors with CSR style offsets
+ ** Oct 16, 2026 - the parsing functions return an error message rather than calling
+ **                error() themselves, so the file and tables can be released first
  **
  **
  ** 
  ******************************************************************/
 
 #include <R.h>
+#include <Rdefines.h>
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "read_pgf.h"
  
 
 #define BUFFERSIZE 1024
 
+#define PGF_TOO_FEW_FIELDS "A line of the PGF file has fewer fields than expected. File corrupted?"
+
 
 /*******************************************************************
  *******************************************************************
@@ -97,89 +110,63 @@ typedef struct{
 /********************************************************************
  *******************************************************************
  **
- ** Structures for dealing with data stored at the probelevel
+ ** Structures for dealing with the body of the file
  **
+ ** The probesets (level 0), atoms (level 1) and probes (level 2)
+ ** are each kept as a table, one array per column, in the order 
+ ** they appear in the file. The atoms of probeset i are 
+ ** atom_start[i] to atom_start[i+1]-1 and the probes of atom j are
+ ** probe_start[j] to probe_start[j+1]-1. Appending a line is then 
+ ** amortized constant time, however long the file.
  **
  *******************************************************************
  *******************************************************************/
 
-typedef struct{
-  
-  int probe_id;
-  char *type;
-  int gc_count;
-  int probe_length;
-  int interrogation_position;
-  char *probe_sequence;
-  struct probe_list_node *next;
-} probe_list_node;
+/* 
+   the strings from the file are stored end to end in one block of
+   memory. A string is referred to by its offset in the block, with
+   0 (an empty string at the start of the block) meaning not present
+*/
 
+#define PGF_NO_STRING 0
 
 typedef struct{
-  int n_probes;
-  probe_list_node *first;
-} probe_list_header;
+  char *data;
+  size_t used;
+  size_t size;
+} pgf_string_pool;
 
 
-
-/********************************************************************
- *******************************************************************
- **
- ** Structures for dealing with data stored at the atom level
- **
- **
- *******************************************************************
- *******************************************************************/
-
 typedef struct{
-  int atom_id;
-  char *type;
-  char *exon_position;
-  probe_list_header *probes;
-  struct atom_list_node *next;
-} atom_list_node;
+  int n_probes;
+  int size;
+  int *probe_id;
+  size_t *type;
+  int *gc_count;
+  int *probe_length;
+  int *interrogation_position;
+  size_t *probe_sequence;
+} pgf_probes;
 
 
 typedef struct{
   int n_atoms;
-  atom_list_node *first;
-} atom_list_header;
-
-
-
-/*******************************************************************
- *******************************************************************
- **
- ** Structures for dealing with data as stored at the probeset level
- **
- **
- **
- *******************************************************************
- *******************************************************************/
-
-typedef struct probeset_list_node *node_pointer;
-
-
-typedef struct{
-  int probeset_id;
-  char *type;
-  char *probeset_name;
-
-  atom_list_header *atoms;
-  
-  struct probeset_list_node *next;
-} probeset_list_node;
-
+  int size;
+  int *atom_id;
+  size_t *type;
+  size_t *exon_position;
+  int *probe_start;        /* size + 1 */
+} pgf_atoms;
 
 
 typedef struct{
-
   int n_probesets;
-
-  probeset_list_node *first;
-  probeset_list_node *current;
-  probeset_list_node *last;
-} probeset_list_header;
+  int size;
+  int *probeset_id;
+  size_t *type;
+  size_t *probeset_name;
+  int *atom_start;         /* size + 1 */
+} pgf_probesets;
 
 
 
@@ -194,7 +181,10 @@ typedef struct{
 
 typedef struct{
   pgf_headers *headers;
-  probeset_list_header *probesets;
+  pgf_probesets probesets;
+  pgf_atoms atoms;
+  pgf_probes probes;
+  pgf_string_pool strings;
 } pgf_file;
 
 
@@ -215,10 +205,12 @@ typedef struct{
  ** 
  ** char **tokens  - a array of token strings
  ** int n - number of tokens in this set.
+ ** int size - space allocated for tokens
  **
  ** a structure to hold a set of tokens. Typically a tokenset is
  ** created by breaking a character string based upon a set of 
- ** delimiters.
+ ** delimiters. The tokens point into the string that was broken
+ ** up, and the same tokenset is reused for line after line.
  **
  **
  **************************************************************/
@@ -226,55 +218,50 @@ typedef struct{
 typedef struct{
   char **tokens;
   int n;
+  int size;
 } tokenset;
 
 
+static void initialize_tokens(tokenset *x){
+  x->tokens = NULL;
+  x->n = 0;
+  x->size = 0;
+}
+
 
 /******************************************************************
  **
- ** tokenset *tokenize(char *str, char *delimiters)
+ ** void tokenize(char *str, const char *delimiters, tokenset *x)
  **
  ** char *str - a string to break into tokens
  ** char *delimiters - delimiters to use in breaking up the line
+ ** tokenset *x - where to put the tokens
  **
- **
- ** RETURNS a new tokenset
- **
- ** Given a string, split into tokens based on a set of delimitors
+ ** Given a string, split into tokens based on a set of delimitors.
+ ** As with strtok() the string is broken up in place and runs of
+ ** delimiters are treated as one, but nothing is allocated except
+ ** when a line has more tokens than any line before it.
  **
  *****************************************************************/
 
-static tokenset *tokenize(char *str, char *delimiters){
-
-#if USE_PTHREADS  
-  char *tmp_pointer;
-#endif  
-  int i=0;
+static void tokenize(char *str, const char *delimiters, tokenset *x){
 
-  char *current_token;
-  tokenset *my_tokenset = Calloc(1,tokenset);
-  my_tokenset->n=0;
-  
-  my_tokenset->tokens = NULL;
-#if USE_PTHREADS
-  current_token = strtok_r(str,delimiters,&tmp_pointer);
-#else
-  current_token = strtok(str,delimiters);
-#endif
-  while (current_token != NULL){
-    my_tokenset->n++;
-    my_tokenset->tokens = Realloc(my_tokenset->tokens,my_tokenset->n,char*);
-    my_tokenset->tokens[i] = Calloc(strlen(current_token)+1,char);
-    strcpy(my_tokenset->tokens[i],current_token);
-    my_tokenset->tokens[i][(strlen(current_token))] = '\0';
-    i++;
-#if USE_PTHREADS
-    current_token = strtok_r(NULL,delimiters,&tmp_pointer);
-#else
-    current_token = strtok(NULL,delimiters);
-#endif
-  }
-  return my_tokenset; 
+  x->n = 0;
+  str += strspn(str,delimiters);
+  while (*str != '\0'){
+    if (x->n == x->size){
+      x->size = (x->size == 0) ? 16 : 2*x->size;
+      x->tokens = Realloc(x->tokens,x->size,char*);
+    }
+    x->tokens[x->n] = str;
+    x->n++;
+    str += strcspn(str,delimiters);
+    if (*str != '\0'){
+      *str = '\0';
+      str++;
+      str += strspn(str,delimiters);
+    }
+  }
 }
 
 
@@ -300,7 +287,8 @@ static int tokenset_size(tokenset *x){
  ** tokenset *x - a tokenset
  ** int i - index of the token to return
  ** 
- ** RETURNS pointer to the i'th token
+ ** RETURNS pointer to the i'th token. Check there is one with
+ ** has_token() first.
  **
  ******************************************************************/
 
@@ -308,6 +296,13 @@ static char *get_token(tokenset *x,int i){
   return x->tokens[i];
 }
 
+
+/* RETURNS 1 if the tokenset has an i'th token, or i is -1 (a field not present in the file) */
+
+static int has_token(tokenset *x,int i){
+  return (i < x->n);
+}
+
 /******************************************************************
  **
  ** void delete_tokens(tokenset *x)
@@ -320,13 +315,11 @@ static char *get_token(tokenset *x,int i){
 
 static void delete_tokens(tokenset *x){
   
-  int i;
-
-  for (i=0; i < x->n; i++){
-    Free(x->tokens[i]);
+  if (x->tokens != NULL){
+    Free(x->tokens);
   }
-  Free(x->tokens);
-  Free(x);
+  x->n = 0;
+  x->size = 0;
 }
 
 /*******************************************************************
@@ -572,87 +565,42 @@ void dealloc_pgf_headers(pgf_headers *header){
 }
 
 
-void dealloc_probes(probe_list_header *probes){
-
-  probe_list_node *temp_node;
-
-  if (probes->first != NULL){
-    temp_node = probes->first;
-    while (temp_node != NULL){
-      probes->first = (probe_list_node *)temp_node->next;
-      if (temp_node->type != NULL){
-	Free(temp_node->type);
-      }
-      if (temp_node->probe_sequence != NULL){
-	Free(temp_node->probe_sequence);
-      }
-      Free(temp_node);
-      temp_node = probes->first;
-    }
-    
-
+void dealloc_pgf_strings(pgf_string_pool *strings){
+  if (strings->data != NULL){
+    Free(strings->data);
   }
 }
 
 
-
-void dealloc_atoms(atom_list_header *atoms){
-
-  atom_list_node *temp_node;
-
-  if (atoms->first != NULL){
-    temp_node = atoms->first;
-    while (temp_node != NULL){
-      atoms->first = (atom_list_node *)temp_node->next;
-      if (temp_node->type != NULL){
-	Free(temp_node->type);
-      }
-      if (temp_node->exon_position != NULL){
-	Free(temp_node->exon_position);
-      }
-      if (temp_node->probes != NULL){
-	dealloc_probes(temp_node->probes);
-	Free(temp_node->probes);
-      }
-
-      Free(temp_node);
-      temp_node = atoms->first;
-    }
-    
-
+void dealloc_probes(pgf_probes *probes){
+  if (probes->size > 0){
+    Free(probes->probe_id);
+    Free(probes->type);
+    Free(probes->gc_count);
+    Free(probes->probe_length);
+    Free(probes->interrogation_position);
+    Free(probes->probe_sequence);
   }
-
-  
-
 }
 
 
-void dealloc_pgf_probesets(probeset_list_header *probesets){
+void dealloc_atoms(pgf_atoms *atoms){
+  if (atoms->size > 0){
+    Free(atoms->atom_id);
+    Free(atoms->type);
+    Free(atoms->exon_position);
+    Free(atoms->probe_start);
+  }
+}
 
-  probeset_list_node *temp_node;
 
-  if (probesets->first != NULL){
-    temp_node = probesets->first;
-    while (temp_node != NULL){
-      probesets->first = (probeset_list_node *)temp_node->next;
-      
-      if (temp_node->type != NULL){
-	Free(temp_node->type);
-      }
-      if (temp_node->probeset_name != NULL){
-	Free(temp_node->probeset_name);
-      }
-      
-      if (temp_node->atoms != NULL){
-	dealloc_atoms(temp_node->atoms);
-	Free(temp_node->atoms);
-      }
-
-      Free(temp_node);
-      temp_node = probesets->first;
-    }
+void dealloc_pgf_probesets(pgf_probesets *probesets){
+  if (probesets->size > 0){
+    Free(probesets->probeset_id);
+    Free(probesets->type);
+    Free(probesets->probeset_name);
+    Free(probesets->atom_start);
   }
-
 }
 
 
@@ -665,13 +613,10 @@ void dealloc_pgf_file(pgf_file* my_pgf){
     Free(my_pgf->headers);
   }
 
-  
-  if (my_pgf->probesets !=NULL){
-    dealloc_pgf_probesets(my_pgf->probesets);
-    Free(my_pgf->probesets);
-  }
-
-
+  dealloc_pgf_probesets(&my_pgf->probesets);
+  dealloc_atoms(&my_pgf->atoms);
+  dealloc_probes(&my_pgf->probes);
+  dealloc_pgf_strings(&my_pgf->strings);
 }
 
 
@@ -707,7 +652,7 @@ void initialize_pgf_header(pgf_headers *header){
 
 static void determine_order_header0(char *header_str, header_0 *header0){
 
-  tokenset *cur_tokenset;
+  tokenset cur_tokenset;
   int i;
   char *temp_str = Calloc(strlen(header_str) +1, char);
 
@@ -718,18 +663,19 @@ static void determine_order_header0(char *header_str, header_0 *header0){
   header0->type = -1;
   header0->probeset_name = -1;
   
-  cur_tokenset = tokenize(temp_str,"\t\r\n");
+  initialize_tokens(&cur_tokenset);
+  tokenize(temp_str,"\t\r\n",&cur_tokenset);
   
-  for (i=0; i < tokenset_size(cur_tokenset); i++){
-    if (strcmp(get_token(cur_tokenset,i),"probeset_id")==0){
+  for (i=0; i < tokenset_size(&cur_tokenset); i++){
+    if (strcmp(get_token(&cur_tokenset,i),"probeset_id")==0){
       header0->probeset_id = i;
-    } else if (strcmp(get_token(cur_tokenset,i),"type")==0){
+    } else if (strcmp(get_token(&cur_tokenset,i),"type")==0){
       header0->type = i;
-    } else if (strcmp(get_token(cur_tokenset,i),"type")==0){
+    } else if (strcmp(get_token(&cur_tokenset,i),"probeset_name")==0){
       header0->probeset_name = i;
     }
   }
-  delete_tokens(cur_tokenset);
+  delete_tokens(&cur_tokenset);
 
   Free(temp_str);
 
@@ -737,7 +683,7 @@ static void determine_order_header0(char *header_str, header_0 *header0){
 
 static void determine_order_header1(char *header_str, header_1 *header1){
 
-  tokenset *cur_tokenset;
+  tokenset cur_tokenset;
   int i;
   char *temp_str = Calloc(strlen(header_str) +1, char);
 
@@ -748,18 +694,19 @@ static void determine_order_header1(char *header_str, header_1 *header1){
   header1->type = -1;
   header1->exon_position = -1;
   
-  cur_tokenset = tokenize(temp_str,"\t\r\n");
+  initialize_tokens(&cur_tokenset);
+  tokenize(temp_str,"\t\r\n",&cur_tokenset);
   
-  for (i=0; i < tokenset_size(cur_tokenset); i++){
-    if (strcmp(get_token(cur_tokenset,i),"atom_id")==0){
+  for (i=0; i < tokenset_size(&cur_tokenset); i++){
+    if (strcmp(get_token(&cur_tokenset,i),"atom_id")==0){
       header1->atom_id = i;
-    } else if (strcmp(get_token(cur_tokenset,i),"type")==0){
+    } else if (strcmp(get_token(&cur_tokenset,i),"type")==0){
       header1->type = i;
-    } else if (strcmp(get_token(cur_tokenset,i),"exon_position")==0){
+    } else if (strcmp(get_token(&cur_tokenset,i),"exon_position")==0){
       header1->exon_position = i;
     }
   }
-  delete_tokens(cur_tokenset);
+  delete_tokens(&cur_tokenset);
 
   Free(temp_str);
 
@@ -767,7 +714,7 @@ static void determine_order_header1(char *header_str, header_1 *header1){
 
 static void determine_order_header2(char *header_str, header_2 *header2){
 
-  tokenset *cur_tokenset;
+  tokenset cur_tokenset;
   int i;
   char *temp_str = Calloc(strlen(header_str) +1, char);
 
@@ -781,25 +728,26 @@ static void determine_order_header2(char *header_str, header_2 *header2){
   header2->interrogation_position = -1;
   header2->probe_sequence = -1;
   
-  cur_tokenset = tokenize(temp_str,"\t\r\n");
+  initialize_tokens(&cur_tokenset);
+  tokenize(temp_str,"\t\r\n",&cur_tokenset);
   
-  for (i=0; i < tokenset_size(cur_tokenset); i++){
-    if (strcmp(get_token(cur_tokenset,i),"probe_id")==0){
+  for (i=0; i < tokenset_size(&cur_tokenset); i++){
+    if (strcmp(get_token(&cur_tokenset,i),"probe_id")==0){
       header2->probe_id = i;
-    } else if (strcmp(get_token(cur_tokenset,i),"type")==0){
+    } else if (strcmp(get_token(&cur_tokenset,i),"type")==0){
       header2->type = i;
-    } else if (strcmp(get_token(cur_tokenset,i),"gc_count")==0){
+    } else if (strcmp(get_token(&cur_tokenset,i),"gc_count")==0){
       header2->gc_count = i;
-    } else if (strcmp(get_token(cur_tokenset,i),"probe_length")==0){
+    } else if (strcmp(get_token(&cur_tokenset,i),"probe_length")==0){
       header2->probe_length = i;
-    } else if (strcmp(get_token(cur_tokenset,i),"interrogation_position")==0){
+    } else if (strcmp(get_token(&cur_tokenset,i),"interrogation_position")==0){
       header2->interrogation_position = i;
-    } else if (strcmp(get_token(cur_tokenset,i),"probe_sequence")==0){
+    } else if (strcmp(get_token(&cur_tokenset,i),"probe_sequence")==0){
       header2->probe_sequence = i;
     }
  
   }
-  delete_tokens(cur_tokenset);
+  delete_tokens(&cur_tokenset);
 
   Free(temp_str);
 
@@ -892,74 +840,85 @@ static FILE *open_pgf_file(const char *filename){
  **
  ** Reading the header
  **
+ ** RETURNS NULL, or a message saying why the header could not 
+ ** be read
+ **
  ***************************************************************/
 
-void read_pgf_header(FILE *cur_file, char *buffer, pgf_headers *header){
+const char *read_pgf_header(FILE *cur_file, char *buffer, pgf_headers *header){
 
 
-  tokenset *cur_tokenset;
+  tokenset cur_tokenset;
 
   char *temp_str;
   
   
   initialize_pgf_header(header);
+  initialize_tokens(&cur_tokenset);
   do {
-    ReadFileLine(buffer, 1024, cur_file);
+    if (!ReadFileLine(buffer, BUFFERSIZE, cur_file)){
+      buffer[0] = '\0';
+      break;
+    }
     /* Rprintf("%s\n",buffer); */
     if (IsHeaderLine(buffer)){
-      cur_tokenset = tokenize(&buffer[2],"=\r\n");
+      tokenize(&buffer[2],"=\r\n",&cur_tokenset);
       /* hopefully token 0 is Key 
 	 and token 1 is Value */
-      /*   Rprintf("Key is: %s\n",get_token(cur_tokenset,0));
-	   Rprintf("Value is: %s\n",get_token(cur_tokenset,1)); */
+      /*   Rprintf("Key is: %s\n",get_token(&cur_tokenset,0));
+	   Rprintf("Value is: %s\n",get_token(&cur_tokenset,1)); */
+      if (!has_token(&cur_tokenset,1)){
+	delete_tokens(&cur_tokenset);
+	return PGF_TOO_FEW_FIELDS;
+      }
       /* Decode the Key/Value pair */
-      if (strcmp(get_token(cur_tokenset,0),"chip_type") == 0){
+      if (strcmp(get_token(&cur_tokenset,0),"chip_type") == 0){
 	if (header->n_chip_type == 0){
 	  header->chip_type = Calloc(1, char *);
 	} else {
 	  header->chip_type = Realloc(header->chip_type, header->n_chip_type+1, char *);
 	}
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1))+1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1))+1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->chip_type[header->n_chip_type] = temp_str;
 	header->n_chip_type++;
-      } else if (strcmp(get_token(cur_tokenset,0), "lib_set_name") == 0){
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "lib_set_name") == 0){
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->lib_set_name = temp_str;
-      } else if (strcmp(get_token(cur_tokenset,0), "lib_set_version") == 0){
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "lib_set_version") == 0){
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->lib_set_version = temp_str;
-      } else if (strcmp(get_token(cur_tokenset,0), "pgf_format_version") == 0) {
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "pgf_format_version") == 0) {
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->pgf_format_version = temp_str;
-      } else if (strcmp(get_token(cur_tokenset,0), "header0") == 0) {
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "header0") == 0) {
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->header0_str = temp_str;
 	header->header0 = Calloc(1,header_0);
 	determine_order_header0(header->header0_str,header->header0);
-      } else if (strcmp(get_token(cur_tokenset,0), "header1") == 0) {
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "header1") == 0) {
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->header1_str = temp_str;
 	header->header1 = Calloc(1,header_1);
 	determine_order_header1(header->header1_str,header->header1);
-      } else if (strcmp(get_token(cur_tokenset,0), "header2") == 0) {
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "header2") == 0) {
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->header2_str = temp_str;
 	header->header2 = Calloc(1,header_2);
 	determine_order_header2(header->header2_str,header->header2);
-      } else if (strcmp(get_token(cur_tokenset,0), "create_date") == 0) {
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "create_date") == 0) {
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->create_date = temp_str;
-      } else if (strcmp(get_token(cur_tokenset,0), "guid") == 0) {
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+      } else if (strcmp(get_token(&cur_tokenset,0), "guid") == 0) {
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->guid = temp_str;
       } else {
 	/* not one of the recognised header types */
@@ -969,22 +928,20 @@ void read_pgf_header(FILE *cur_file, char *buffer, pgf_headers *header){
 	} else {
 	  header->other_headers_keys = Realloc(header->other_headers_keys,header->n_other_headers+1, char *);
 	  header->other_headers_values = Realloc(header->other_headers_values,header->n_other_headers+1, char *);
-	  header->chip_type = Realloc(header->chip_type, header->n_chip_type+1, char *);
 	}
-	temp_str = Calloc(strlen(get_token(cur_tokenset,1)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,1));
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,1)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,1));
 	header->other_headers_values[header->n_other_headers] = temp_str;
-	temp_str = Calloc(strlen(get_token(cur_tokenset,0)) + 1,char);
-	strcpy(temp_str,get_token(cur_tokenset,0));
+	temp_str = Calloc(strlen(get_token(&cur_tokenset,0)) + 1,char);
+	strcpy(temp_str,get_token(&cur_tokenset,0));
 	header->other_headers_keys[header->n_other_headers] = temp_str;
 	header->n_other_headers++;
 
       }
-      
-      delete_tokens(cur_tokenset);
     }
   } while (IsHeaderLine(buffer));
- 
+  delete_tokens(&cur_tokenset);
+  return NULL;
 }
 
 
@@ -994,229 +951,280 @@ void read_pgf_header(FILE *cur_file, char *buffer, pgf_headers *header){
  **
  ***************************************************************/
 
-void initialize_probeset_list(probeset_list_header *probeset_list){
+void initialize_pgf_body(pgf_file *my_pgf){
+
+  memset(&my_pgf->probesets, 0, sizeof(pgf_probesets));
+  memset(&my_pgf->atoms, 0, sizeof(pgf_atoms));
+  memset(&my_pgf->probes, 0, sizeof(pgf_probes));
 
-  probeset_list->n_probesets = 0;
-  probeset_list->first = NULL;
-  probeset_list->current = NULL;
-  probeset_list->last = NULL;
+  my_pgf->strings.size = BUFFERSIZE;
+  my_pgf->strings.data = Calloc(my_pgf->strings.size, char);
+  my_pgf->strings.used = 1;   /* the empty string, PGF_NO_STRING */
 }
 
 
+/****************************************************************
+ **
+ ** static size_t add_pgf_string(pgf_string_pool *strings, const char *str, size_t previous)
+ **
+ ** copies str into the string pool, RETURNING its offset. If str
+ ** is the same as the string at previous (typically the type of
+ ** the line before, as types come in long runs) that is shared
+ ** instead.
+ **
+ ***************************************************************/
+
+static size_t add_pgf_string(pgf_string_pool *strings, const char *str, size_t previous){
 
-void insert_probe(char *buffer, probe_list_header *probe_list, header_2 *header2){
+  size_t length, offset;
 
-  char *temp_str;
-  tokenset *cur_tokenset;
-  probe_list_node *temp_ptr;
+  if (previous != PGF_NO_STRING && strcmp(strings->data + previous, str) == 0){
+    return previous;
+  }
+  
+  length = strlen(str) + 1;
+  if (strings->size - strings->used < length){
+    while (strings->size - strings->used < length){
+      strings->size = 2*strings->size;
+    }
+    strings->data = Realloc(strings->data, strings->size, char);
+  }
+  offset = strings->used;
+  memcpy(strings->data + offset, str, length);
+  strings->used += length;
+  return offset;
+}
 
-  probe_list_node *temp_node = Calloc(1,probe_list_node);
 
-  cur_tokenset = tokenize(buffer,"\t\r\n");
-  temp_node->probe_id = atoi(get_token(cur_tokenset,header2->probe_id));
+/* RETURNS the string at offset, NULL if it was not present */
 
+static const char *get_pgf_string(const pgf_string_pool *strings, size_t offset){
+  return (offset == PGF_NO_STRING) ? NULL : strings->data + offset;
+}
+
+
+static void grow_pgf_probes(pgf_probes *probes){
+  probes->size = (probes->size == 0) ? BUFFERSIZE : 2*probes->size;
+  probes->probe_id = Realloc(probes->probe_id, probes->size, int);
+  probes->type = Realloc(probes->type, probes->size, size_t);
+  probes->gc_count = Realloc(probes->gc_count, probes->size, int);
+  probes->probe_length = Realloc(probes->probe_length, probes->size, int);
+  probes->interrogation_position = Realloc(probes->interrogation_position, probes->size, int);
+  probes->probe_sequence = Realloc(probes->probe_sequence, probes->size, size_t);
+}
+
+
+static void grow_pgf_atoms(pgf_atoms *atoms){
+  atoms->size = (atoms->size == 0) ? BUFFERSIZE : 2*atoms->size;
+  atoms->atom_id = Realloc(atoms->atom_id, atoms->size, int);
+  atoms->type = Realloc(atoms->type, atoms->size, size_t);
+  atoms->exon_position = Realloc(atoms->exon_position, atoms->size, size_t);
+  atoms->probe_start = Realloc(atoms->probe_start, atoms->size + 1, int);
+}
+
+
+static void grow_pgf_probesets(pgf_probesets *probesets){
+  probesets->size = (probesets->size == 0) ? BUFFERSIZE : 2*probesets->size;
+  probesets->probeset_id = Realloc(probesets->probeset_id, probesets->size, int);
+  probesets->type = Realloc(probesets->type, probesets->size, size_t);
+  probesets->probeset_name = Realloc(probesets->probeset_name, probesets->size, size_t);
+  probesets->atom_start = Realloc(probesets->atom_start, probesets->size + 1, int);
+}
+
+
+
+/****************************************************************
+ **
+ ** The insert_ functions each add a line of the body to my_pgf.
+ ** They RETURN NULL, or a message saying what was wrong with 
+ ** the line (and leave my_pgf as it was).
+ **
+ ***************************************************************/
+
+const char *insert_probe(char *buffer, pgf_file *my_pgf, tokenset *cur_tokenset){
+
+  pgf_probes *probes = &my_pgf->probes;
+  header_2 *header2 = my_pgf->headers->header2;
+  int n = probes->n_probes;
+
+  tokenize(buffer,"\t\r\n",cur_tokenset);
+  if (!has_token(cur_tokenset,header2->probe_id) || !has_token(cur_tokenset,header2->type) ||
+      !has_token(cur_tokenset,header2->gc_count) || !has_token(cur_tokenset,header2->probe_length) ||
+      !has_token(cur_tokenset,header2->interrogation_position) || !has_token(cur_tokenset,header2->probe_sequence)){
+    return PGF_TOO_FEW_FIELDS;
+  }
+
+  if (n == probes->size){
+    grow_pgf_probes(probes);
+  }
+
+  probes->probe_id[n] = atoi(get_token(cur_tokenset,header2->probe_id));
+
+  probes->type[n] = PGF_NO_STRING;
   if (header2->type != -1){
-    temp_str = Calloc(strlen(get_token(cur_tokenset,header2->type)) + 1,char);
-    strcpy(temp_str,get_token(cur_tokenset,header2->type));
-    temp_node->type = temp_str;
+    probes->type[n] = add_pgf_string(&my_pgf->strings, get_token(cur_tokenset,header2->type), (n > 0) ? probes->type[n-1] : PGF_NO_STRING);
   }
+  probes->gc_count[n] = 0;
   if (header2->gc_count != -1){
-    temp_node->gc_count = atoi(get_token(cur_tokenset,header2->gc_count));
+    probes->gc_count[n] = atoi(get_token(cur_tokenset,header2->gc_count));
   }
+  probes->probe_length[n] = 0;
   if (header2->probe_length != -1){
-    temp_node->probe_length = atoi(get_token(cur_tokenset,header2->probe_length));
+    probes->probe_length[n] = atoi(get_token(cur_tokenset,header2->probe_length));
   }
+  probes->interrogation_position[n] = 0;
   if (header2->interrogation_position != -1){
-    temp_node->interrogation_position = atoi(get_token(cur_tokenset,header2->interrogation_position));
+    probes->interrogation_position[n] = atoi(get_token(cur_tokenset,header2->interrogation_position));
   }
+  probes->probe_sequence[n] = PGF_NO_STRING;
   if (header2->probe_sequence != -1){
-    temp_str = Calloc(strlen(get_token(cur_tokenset,header2->probe_sequence)) + 1,char);
-    strcpy(temp_str,get_token(cur_tokenset,header2->probe_sequence));
-    temp_node->probe_sequence = temp_str;
+    probes->probe_sequence[n] = add_pgf_string(&my_pgf->strings, get_token(cur_tokenset,header2->probe_sequence), PGF_NO_STRING);
   }
- 
 
-  
-  temp_node->next = NULL;
-  if (probe_list->n_probes == 0){    
-    probe_list->first = temp_node;
-    probe_list->n_probes = 1;
-  } else {
-    /* figure out where the end of the list is. Insert there */
-    temp_ptr = probe_list->first;
-    
-    while (temp_ptr->next != NULL){
-      temp_ptr = (probe_list_node*)temp_ptr->next;
-    }
-    temp_ptr->next = (struct probe_list_node*)temp_node;
-    probe_list->n_probes++;
-  }
-  delete_tokens(cur_tokenset);
+  probes->n_probes++;
+  my_pgf->atoms.probe_start[my_pgf->atoms.n_atoms] = probes->n_probes;
+  return NULL;
 }
 
 
-void insert_level2(char *buffer, probeset_list_header *probeset_list, header_2 *header2){
-
-  atom_list_header *current_level1;
-  atom_list_node *current_atom;
+const char *insert_level2(char *buffer, pgf_file *my_pgf, tokenset *cur_tokenset){
 
-  if (probeset_list->current == NULL){
+  if (my_pgf->probesets.n_probesets == 0){
     /* Oh Boy, this is a problem no header0 level object to insert into. */
-    error("Can not read a level 2 line before seeing a level 0 line. File corrupted?");
+    return "Can not read a level 2 line before seeing a level 0 line. File corrupted?";
   }
   
-  if (probeset_list->current->atoms == NULL){
+  if (my_pgf->probesets.atom_start[my_pgf->probesets.n_probesets - 1] == my_pgf->atoms.n_atoms){
     /* Oh Boy, this is a problem no header1 level object to insert into. */
-    error("Can not read a level 2 line before seeing a level 1 line. File corrupted?");
+    return "Can not read a level 2 line before seeing a level 1 line. File corrupted?";
   }
 
-  current_level1 = probeset_list->current->atoms;
-  
-  current_atom = current_level1->first;
-
-  while (current_atom->next != NULL){
-    current_atom = (atom_list_node *)current_atom->next;
-  }
-
-  if (current_atom->probes == NULL){
-    current_atom->probes = Calloc(1,probe_list_header);
-  }
-  
-  insert_probe(buffer, current_atom->probes, header2);
+  return insert_probe(buffer, my_pgf, cur_tokenset);
 }
 
 
 
 
 
-void insert_atom(char *buffer, atom_list_header *atoms_list, header_1 *header1){
+const char *insert_atom(char *buffer, pgf_file *my_pgf, tokenset *cur_tokenset){
 
-  char *temp_str;
-  tokenset *cur_tokenset;
-  atom_list_node *temp_ptr;
+  pgf_atoms *atoms = &my_pgf->atoms;
+  header_1 *header1 = my_pgf->headers->header1;
+  int n = atoms->n_atoms;
 
-  atom_list_node *temp_node = Calloc(1,atom_list_node);
+  tokenize(buffer,"\t\r\n",cur_tokenset);
+  if (!has_token(cur_tokenset,header1->atom_id) || !has_token(cur_tokenset,header1->type) ||
+      !has_token(cur_tokenset,header1->exon_position)){
+    return PGF_TOO_FEW_FIELDS;
+  }
 
-  cur_tokenset = tokenize(buffer,"\t\r\n");
+  if (n == atoms->size){
+    grow_pgf_atoms(atoms);
+  }
 
-  temp_node->atom_id = atoi(get_token(cur_tokenset,header1->atom_id));
+  atoms->atom_id[n] = atoi(get_token(cur_tokenset,header1->atom_id));
 
+  atoms->type[n] = PGF_NO_STRING;
   if (header1->type != -1){
-    temp_str = Calloc(strlen(get_token(cur_tokenset,header1->type)) + 1,char);
-    strcpy(temp_str,get_token(cur_tokenset,header1->type));
-    temp_node->type = temp_str;
+    atoms->type[n] = add_pgf_string(&my_pgf->strings, get_token(cur_tokenset,header1->type), (n > 0) ? atoms->type[n-1] : PGF_NO_STRING);
   }
+  atoms->exon_position[n] = PGF_NO_STRING;
   if (header1->exon_position != -1){
-    temp_str = Calloc(strlen(get_token(cur_tokenset,header1->exon_position)) + 1,char);
-    strcpy(temp_str,get_token(cur_tokenset,header1->exon_position));
-    temp_node->exon_position = temp_str;
-  }
-  temp_node->probes = NULL;
-  temp_node->next = NULL;
-  
-  if (atoms_list->n_atoms == 0){    
-    atoms_list->first = temp_node;
-    atoms_list->n_atoms = 1;
-  } else {
-    /* figure out where the end of the list is. Insert there */
-    temp_ptr = (atom_list_node*)atoms_list->first;
-    
-    while (temp_ptr->next != NULL){
-      temp_ptr= (atom_list_node*)temp_ptr->next;
-    }
-    temp_ptr->next = (struct atom_list_node*)temp_node;
-    atoms_list->n_atoms++;
+    atoms->exon_position[n] = add_pgf_string(&my_pgf->strings, get_token(cur_tokenset,header1->exon_position), PGF_NO_STRING);
   }
-  delete_tokens(cur_tokenset);
-}
 
+  /* no probes yet */
+  atoms->probe_start[n] = my_pgf->probes.n_probes;
+  atoms->n_atoms++;
+  atoms->probe_start[atoms->n_atoms] = my_pgf->probes.n_probes;
+  my_pgf->probesets.atom_start[my_pgf->probesets.n_probesets] = atoms->n_atoms;
+  return NULL;
+}
 
-void insert_level1(char *buffer, probeset_list_header *probeset_list, header_1 *header1){
-
-  probeset_list_node *current_level0;
 
+const char *insert_level1(char *buffer, pgf_file *my_pgf, tokenset *cur_tokenset){
 
-  if (probeset_list->current == NULL){
+  if (my_pgf->probesets.n_probesets == 0){
     /* Oh Boy, this is a problem no header0 level object to insert into. */
-    error("Can not read a level 1 line before seeing a level 0 line. File corrupted?");
+    return "Can not read a level 1 line before seeing a level 0 line. File corrupted?";
   }
-  
-  current_level0 = probeset_list->current;
-  
-  if (current_level0->atoms == NULL){
-    current_level0->atoms = Calloc(1,atom_list_header);
-  }
-
-  /* Now lets insert the data */
-  
-  insert_atom(buffer, current_level0->atoms, header1);
-
-
-
-
 
+  return insert_atom(buffer, my_pgf, cur_tokenset);
 }
 
 
 
 
-void insert_level0(char *buffer, probeset_list_header *probeset_list, header_0 *header0){
-
-  char *temp_str;
-  tokenset *cur_tokenset;
+const char *insert_level0(char *buffer, pgf_file *my_pgf, tokenset *cur_tokenset){
 
+  pgf_probesets *probesets = &my_pgf->probesets;
+  header_0 *header0 = my_pgf->headers->header0;
+  int n = probesets->n_probesets;
 
-  probeset_list_node *temp_node = Calloc(1,probeset_list_node);
+  tokenize(buffer,"\t\r\n",cur_tokenset);
+  if (!has_token(cur_tokenset,header0->probeset_id) || !has_token(cur_tokenset,header0->type) ||
+      !has_token(cur_tokenset,header0->probeset_name)){
+    return PGF_TOO_FEW_FIELDS;
+  }
 
-  cur_tokenset = tokenize(buffer,"\t\r\n");
+  if (n == probesets->size){
+    grow_pgf_probesets(probesets);
+  }
 
-  temp_node->probeset_id = atoi(get_token(cur_tokenset,header0->probeset_id));
+  probesets->probeset_id[n] = atoi(get_token(cur_tokenset,header0->probeset_id));
 
+  probesets->type[n] = PGF_NO_STRING;
   if (header0->type != -1){
-    temp_str = Calloc(strlen(get_token(cur_tokenset,header0->type)) + 1,char);
-    strcpy(temp_str,get_token(cur_tokenset,header0->type));
-    temp_node->type = temp_str;
+    probesets->type[n] = add_pgf_string(&my_pgf->strings, get_token(cur_tokenset,header0->type), (n > 0) ? probesets->type[n-1] : PGF_NO_STRING);
   }
+  probesets->probeset_name[n] = PGF_NO_STRING;
   if (header0->probeset_name != -1){
-    temp_str = Calloc(strlen(get_token(cur_tokenset,header0->probeset_name)) + 1,char);
-    strcpy(temp_str,get_token(cur_tokenset,header0->probeset_name));
-    temp_node->probeset_name = temp_str;
+    probesets->probeset_name[n] = add_pgf_string(&my_pgf->strings, get_token(cur_tokenset,header0->probeset_name), PGF_NO_STRING);
   }
-  temp_node->atoms = NULL;
-  temp_node->next = NULL;
-  
-  if (probeset_list->first == NULL){
-    probeset_list->first = temp_node;
-    probeset_list->current = temp_node;
-    probeset_list->last = temp_node; 
-    probeset_list->n_probesets = 1;
-  } else {
-    probeset_list->last->next = (struct probeset_list_node *)temp_node;
-    probeset_list->last = temp_node;
-    probeset_list->current = temp_node;
-    probeset_list->n_probesets++;
-  }
-  delete_tokens(cur_tokenset);
+
+  /* no atoms yet */
+  probesets->atom_start[n] = my_pgf->atoms.n_atoms;
+  probesets->n_probesets++;
+  probesets->atom_start[probesets->n_probesets] = my_pgf->atoms.n_atoms;
+  return NULL;
 }
 
 
-void read_pgf_probesets(FILE *cur_file, char *buffer, probeset_list_header *probeset_list, pgf_headers *header){
+/****************************************************************
+ **
+ ** const char *read_pgf_probesets(FILE *cur_file, char *buffer, pgf_file *my_pgf)
+ **
+ ** reads the body of the file. buffer holds the first line after
+ ** the header (empty if there was none).
+ **
+ ** RETURNS NULL, or a message saying why the body could not be 
+ ** read, in which case my_pgf holds the lines before the bad one.
+ **
+ ***************************************************************/
 
-  initialize_probeset_list(probeset_list);
-  
-  insert_level0(buffer, probeset_list, header->header0);
-  
-  while(ReadFileLine(buffer, 1024, cur_file)){
-    if (IsLevel2(buffer)){
-      insert_level2(buffer, probeset_list, header->header2);
-    } else if (IsLevel1(buffer)){
-      insert_level1(buffer, probeset_list, header->header1);
-    } else if (IsCommentLine(buffer)){
-      /*Ignore */
-    } else {
-       insert_level0(buffer, probeset_list, header->header0);
-    }
+const char *read_pgf_probesets(FILE *cur_file, char *buffer, pgf_file *my_pgf){
+
+  tokenset cur_tokenset;
+  const char *message = NULL;
+
+  initialize_tokens(&cur_tokenset);
+
+  if (buffer[0] != '\0'){
+    do {
+      if (IsLevel2(buffer)){
+	message = insert_level2(buffer, my_pgf, &cur_tokenset);
+      } else if (IsLevel1(buffer)){
+	message = insert_level1(buffer, my_pgf, &cur_tokenset);
+      } else if (IsCommentLine(buffer) || buffer[strspn(buffer,"\r\n")] == '\0'){
+	/*Ignore */
+      } else {
+	message = insert_level0(buffer, my_pgf, &cur_tokenset);
+      }
+    } while(message == NULL && ReadFileLine(buffer, BUFFERSIZE, cur_file));
   }
+
+  delete_tokens(&cur_tokenset);
+  return message;
 }
 
 /****************************************************************
@@ -1239,52 +1247,32 @@ probeset_type_list *pgf_count_probeset_types(pgf_file *my_pgf, int *number){
 
   probeset_type_list *my_type_list = Calloc(1,probeset_type_list);
 
-  char *cur_type;
-  int n;
+  const char *cur_type;
+  int i, n;
 
   /* traverse the probesets. each time examining the probeset type */
 
-
-  if (my_pgf->probesets != NULL){
-    
-    if (my_pgf->probesets->first != NULL){
-      
-      my_pgf->probesets->current = my_pgf->probesets->first;
-      
-      if (my_pgf->probesets->current->type == NULL){
-	my_type_list[0].type = Calloc(5,char);
-	strcpy(my_type_list[0].type,"none");
-	
-      } else {
-	my_type_list[0].type = Calloc(strlen(my_pgf->probesets->current->type) + 1,char);
-	strcpy(my_type_list[0].type,my_pgf->probesets->current->type);
-      }
-      my_type_list[0].count = 1;
-      *number = 1; /* number of different types seen */
-      while (my_pgf->probesets->current->next != NULL){
-	my_pgf->probesets->current= (probeset_list_node *)my_pgf->probesets->current->next;
-	if (my_pgf->probesets->current->type == NULL){
-	  cur_type = "none";
-	} else {
-	  cur_type = my_pgf->probesets->current->type;
-	}
-	n = 0;
-	while (n < *number){
-	  if (strcmp(cur_type,my_type_list[n].type) == 0){
-	    break;
-	  }
-	  n++;
-	}
-	if (n == *number){
-	  my_type_list = Realloc(my_type_list,(n+1),probeset_type_list);
-	  my_type_list[n].type = Calloc(strlen(cur_type) + 1,char);
-	  strcpy(my_type_list[n].type,cur_type);
-	  my_type_list[n].count = 1;
-	  *number = *number + 1;
-  	} else {
-	  my_type_list[n].count++;
-	}
+  *number = 0; /* number of different types seen */
+  for (i = 0; i < my_pgf->probesets.n_probesets; i++){
+    cur_type = get_pgf_string(&my_pgf->strings, my_pgf->probesets.type[i]);
+    if (cur_type == NULL){
+      cur_type = "none";
+    }
+    n = 0;
+    while (n < *number){
+      if (strcmp(cur_type,my_type_list[n].type) == 0){
+	break;
       }
+      n++;
+    }
+    if (n == *number){
+      my_type_list = Realloc(my_type_list,(n+1),probeset_type_list);
+      my_type_list[n].type = Calloc(strlen(cur_type) + 1,char);
+      strcpy(my_type_list[n].type,cur_type);
+      my_type_list[n].count = 1;
+      *number = *number + 1;
+    } else {
+      my_type_list[n].count++;
     }
   }
   return  my_type_list;
@@ -1315,23 +1303,275 @@ void read_pgf_file(char **filename){
 
   FILE *cur_file;
   pgf_file my_pgf;
-  char *buffer = Calloc(1024, char);
+  char *buffer;
   probeset_type_list *my_probeset_types;
   int ntypes;
+  const char *message;
   
   cur_file = open_pgf_file(filename[0]);
+  buffer = Calloc(BUFFERSIZE, char);
   
   my_pgf.headers = Calloc(1, pgf_headers);
-  my_pgf.probesets = Calloc(1, probeset_list_header);
-
-  read_pgf_header(cur_file,buffer,my_pgf.headers);
-  if (validate_pgf_header(my_pgf.headers)){
-    read_pgf_probesets(cur_file, buffer, my_pgf.probesets, my_pgf.headers);
-    my_probeset_types = pgf_count_probeset_types(&my_pgf, &ntypes);
-    dealloc_probeset_type_list(my_probeset_types, ntypes);
+  initialize_pgf_body(&my_pgf);
+
+  message = read_pgf_header(cur_file,buffer,my_pgf.headers);
+  if (message == NULL && validate_pgf_header(my_pgf.headers)){
+    message = read_pgf_probesets(cur_file, buffer, &my_pgf);
+    if (message == NULL){
+      my_probeset_types = pgf_count_probeset_types(&my_pgf, &ntypes);
+      dealloc_probeset_type_list(my_probeset_types, ntypes);
+    }
   }
   Free(buffer);
   dealloc_pgf_file(&my_pgf);
   fclose(cur_file);
 
+  if (message != NULL){
+    error("%s", message);
+  }
+}
+
+
+
+/****************************************************************
+ ****************************************************************
+ **
+ ** Returning the contents of a PGF file to R
+ **
+ ** Each level is returned as a list of column vectors, rather 
+ ** than as a list per probeset, so that there is nothing to 
+ ** allocate per probeset or probe beyond the strings. The atoms
+ ** of probeset i (counting from 0) are atom_start[i] to 
+ ** atom_start[i+1]-1 of the atoms table, and likewise for the
+ ** probes of each atom (as in the p slot of a sparse matrix).
+ ** Type columns are factors. Columns that are not in the file are
+ ** NULL.
+ **
+ ****************************************************************
+ ****************************************************************/
+
+static SEXP pgf_int_column(const int *x, int n, int present){
+
+  SEXP Column;
+
+  if (!present){
+    return R_NilValue;
+  }
+  PROTECT(Column = allocVector(INTSXP,n));
+  if (n > 0){
+    memcpy(INTEGER(Column), x, n*sizeof(int));
+  }
+  UNPROTECT(1);
+  return Column;
+}
+
+
+/* the n+1 offsets of a CSR start column (just 0 when the table is empty) */
+
+static SEXP pgf_start_column(const int *start, int n){
+
+  SEXP Column;
+
+  PROTECT(Column = allocVector(INTSXP,n + 1));
+  if (start != NULL){
+    memcpy(INTEGER(Column), start, (n + 1)*sizeof(int));
+  } else {
+    INTEGER(Column)[0] = 0;
+  }
+  UNPROTECT(1);
+  return Column;
+}
+
+
+static SEXP pgf_string_column(const pgf_string_pool *strings, const size_t *x, int n, int present){
+
+  SEXP Column;
+  int i;
+
+  if (!present){
+    return R_NilValue;
+  }
+  PROTECT(Column = allocVector(STRSXP,n));
+  for (i=0; i < n; i++){
+    SET_STRING_ELT(Column,i,(x[i] == PGF_NO_STRING) ? NA_STRING : mkChar(get_pgf_string(strings,x[i])));
+  }
+  UNPROTECT(1);
+  return Column;
+}
+
+
+/* types take only a handful of values, so are coded as a factor */
+
+static SEXP pgf_factor_column(const pgf_string_pool *strings, const size_t *x, int n, int present){
+
+  SEXP Column;
+  SEXP Levels;
+  size_t *levels = NULL;
+  size_t last = PGF_NO_STRING;
+  int *codes;
+  int i, k, n_levels = 0, last_code = NA_INTEGER;
+
+  if (!present){
+    return R_NilValue;
+  }
+  PROTECT(Column = allocVector(INTSXP,n));
+  codes = INTEGER(Column);
+  for (i=0; i < n; i++){
+    if (x[i] == PGF_NO_STRING){
+      codes[i] = NA_INTEGER;
+      continue;
+    }
+    if (x[i] != last){
+      for (k=0; k < n_levels; k++){
+	if (strcmp(strings->data + levels[k], strings->data + x[i]) == 0){
+	  break;
+	}
+      }
+      if (k == n_levels){
+	levels = Realloc(levels, n_levels + 1, size_t);
+	levels[n_levels] = x[i];
+	n_levels++;
+      }
+      last = x[i];
+      last_code = k + 1;
+    }
+    codes[i] = last_code;
+  }
+
+  PROTECT(Levels = allocVector(STRSXP,n_levels));
+  for (k=0; k < n_levels; k++){
+    SET_STRING_ELT(Levels,k,mkChar(strings->data + levels[k]));
+  }
+  if (levels != NULL){
+    Free(levels);
+  }
+  setAttrib(Column,R_LevelsSymbol,Levels);
+  setAttrib(Column,R_ClassSymbol,mkString("factor"));
+  UNPROTECT(2);
+  return Column;
+}
+
+
+static SEXP pgf_table(int n, const char **names){
+
+  SEXP Table;
+  SEXP Names;
+  int i;
+
+  PROTECT(Table = allocVector(VECSXP,n));
+  PROTECT(Names = allocVector(STRSXP,n));
+  for (i=0; i < n; i++){
+    SET_STRING_ELT(Names,i,mkChar(names[i]));
+  }
+  setAttrib(Table,R_NamesSymbol,Names);
+  UNPROTECT(2);
+  return Table;
+}
+
+
+static SEXP pgf_file_to_list(const pgf_file *my_pgf){
+
+  static const char *pgf_names[] = {"chip_type","lib_set_name","lib_set_version","probesets","atoms","probes"};
+  static const char *probeset_names[] = {"probeset_id","type","probeset_name","atom_start"};
+  static const char *atom_names[] = {"atom_id","type","exon_position","probe_start"};
+  static const char *probe_names[] = {"probe_id","type","gc_count","probe_length","interrogation_position","probe_sequence"};
+
+  const pgf_headers *headers = my_pgf->headers;
+  const pgf_probesets *probesets = &my_pgf->probesets;
+  const pgf_atoms *atoms = &my_pgf->atoms;
+  const pgf_probes *probes = &my_pgf->probes;
+  const pgf_string_pool *strings = &my_pgf->strings;
+
+  SEXP PGF;
+  SEXP ChipType;
+  SEXP Table;
+  int i;
+
+  PROTECT(PGF = pgf_table(6,pgf_names));
+
+  PROTECT(ChipType = allocVector(STRSXP,headers->n_chip_type));
+  for (i=0; i < headers->n_chip_type; i++){
+    SET_STRING_ELT(ChipType,i,mkChar(headers->chip_type[i]));
+  }
+  SET_VECTOR_ELT(PGF,0,ChipType);
+  SET_VECTOR_ELT(PGF,1,mkString(headers->lib_set_name));
+  SET_VECTOR_ELT(PGF,2,mkString(headers->lib_set_version));
+  UNPROTECT(1);
+
+  PROTECT(Table = pgf_table(4,probeset_names));
+  SET_VECTOR_ELT(PGF,3,Table);
+  SET_VECTOR_ELT(Table,0,pgf_int_column(probesets->probeset_id,probesets->n_probesets,1));
+  SET_VECTOR_ELT(Table,1,pgf_factor_column(strings,probesets->type,probesets->n_probesets,headers->header0->type != -1));
+  SET_VECTOR_ELT(Table,2,pgf_string_column(strings,probesets->probeset_name,probesets->n_probesets,headers->header0->probeset_name != -1));
+  SET_VECTOR_ELT(Table,3,pgf_start_column(probesets->atom_start,probesets->n_probesets));
+  UNPROTECT(1);
+
+  PROTECT(Table = pgf_table(4,atom_names));
+  SET_VECTOR_ELT(PGF,4,Table);
+  SET_VECTOR_ELT(Table,0,pgf_int_column(atoms->atom_id,atoms->n_atoms,1));
+  SET_VECTOR_ELT(Table,1,pgf_factor_column(strings,atoms->type,atoms->n_atoms,headers->header1->type != -1));
+  SET_VECTOR_ELT(Table,2,pgf_string_column(strings,atoms->exon_position,atoms->n_atoms,headers->header1->exon_position != -1));
+  SET_VECTOR_ELT(Table,3,pgf_start_column(atoms->probe_start,atoms->n_atoms));
+  UNPROTECT(1);
+
+  PROTECT(Table = pgf_table(6,probe_names));
+  SET_VECTOR_ELT(PGF,5,Table);
+  SET_VECTOR_ELT(Table,0,pgf_int_column(probes->probe_id,probes->n_probes,1));
+  SET_VECTOR_ELT(Table,1,pgf_factor_column(strings,probes->type,probes->n_probes,headers->header2->type != -1));
+  SET_VECTOR_ELT(Table,2,pgf_int_column(probes->gc_count,probes->n_probes,headers->header2->gc_count != -1));
+  SET_VECTOR_ELT(Table,3,pgf_int_column(probes->probe_length,probes->n_probes,headers->header2->probe_length != -1));
+  SET_VECTOR_ELT(Table,4,pgf_int_column(probes->interrogation_position,probes->n_probes,headers->header2->interrogation_position != -1));
+  SET_VECTOR_ELT(Table,5,pgf_string_column(strings,probes->probe_sequence,probes->n_probes,headers->header2->probe_sequence != -1));
+  UNPROTECT(1);
+
+  UNPROTECT(1);
+  return PGF;
+}
+
+
+/****************************************************************
+ **
+ ** SEXP R_read_pgf_file(SEXP filename)
+ **
+ ** RETURNS the chip type and library set of a PGF file and its
+ ** probeset, atom and probe tables, as described above
+ **
+ ***************************************************************/
+
+SEXP R_read_pgf_file(SEXP filename){
+
+  SEXP PGF;
+  FILE *cur_file;
+  pgf_file my_pgf;
+  char *buffer;
+  const char *message;
+  const char *cur_file_name = CHAR(STRING_ELT(filename,0));
+
+  cur_file = open_pgf_file(cur_file_name);
+  buffer = Calloc(BUFFERSIZE, char);
+
+  my_pgf.headers = Calloc(1, pgf_headers);
+  initialize_pgf_body(&my_pgf);
+
+  message = read_pgf_header(cur_file,buffer,my_pgf.headers);
+  if (message == NULL && !validate_pgf_header(my_pgf.headers)){
+    Free(buffer);
+    dealloc_pgf_file(&my_pgf);
+    fclose(cur_file);
+    error("%s is not a PGF file or is missing required headers.",cur_file_name);
+  }
+  if (message == NULL){
+    message = read_pgf_probesets(cur_file, buffer, &my_pgf);
+  }
+  Free(buffer);
+  fclose(cur_file);
+  if (message != NULL){
+    dealloc_pgf_file(&my_pgf);
+    error("%s", message);
+  }
+
+  PROTECT(PGF = pgf_file_to_list(&my_pgf));
+  dealloc_pgf_file(&my_pgf);
+  UNPROTECT(1);
+  return PGF;
 }
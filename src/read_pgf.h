@@ -0,0 +1,6 @@
+#ifndef READ_PGF_H
+#define READ_PGF_H
+
+SEXP R_read_pgf_file(SEXP filename);
+
+#endif